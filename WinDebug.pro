@@ -4,12 +4,100 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += \
-        fontdump.cpp \
+        chunkstore.cpp \
+        dumpbudget.cpp \
+        dumpcompression.cpp \
+        dumpdiff.cpp \
+        dumpoutput.cpp \
+        dumppolicy.cpp \
+        dumpprofiler.cpp \
+        dumprecorder.cpp \
+        dumptrigger.cpp \
+        dumpservice.cpp \
+        dumpreader.cpp \
+        dumprebuild.cpp \
+        fontbench.cpp \
+        fontcache.cpp \
+        fontcoverage.cpp \
+        fontnameindex.cpp \
+        fontnames.cpp \
+        fontscanner.cpp \
+        fonttext.cpp \
         main.cpp \
-        minidumpper.cpp
+        mappedfile.cpp \
+        multidumpper.cpp \
+        processindex.cpp \
+        processwatcher.cpp \
+        progresssink.cpp \
+        stackprofile.cpp \
+        threadpool.cpp
 
 HEADERS += \
+    chunkstore.h \
+    contenthash.h \
+    dumpbudget.h \
+    dumpcompression.h \
+    dumpdiff.h \
+    dumpoutput.h \
+    dumppolicy.h \
+    dumpprofiler.h \
+    dumprecorder.h \
+    dumptrigger.h \
+    dumpservice.h \
+    dumpreader.h \
+    dumprebuild.h \
+    fontbench.h \
+    fontcache.h \
+    fontcoverage.h \
     fontdump.h \
-    minidumpper.h
+    fontnameindex.h \
+    fontnames.h \
+    fontscanner.h \
+    fonttext.h \
+    mappedfile.h \
+    memoryreader.h \
+    minidumpformat.h \
+    minidumpper.h \
+    multidumpper.h \
+    processindex.h \
+    processwatcher.h \
+    progresssink.h \
+    stackprofile.h \
+    threadpool.h
+
+# Optional codecs for compressed dumps, e.g. qmake CONFIG+=zstd CONFIG+=lz4
+zstd {
+    DEFINES += DUMP_WITH_ZSTD
+    LIBS += -lzstd
+}
+
+lz4 {
+    DEFINES += DUMP_WITH_LZ4
+    LIBS += -llz4
+}
+
+# libFuzzer target for the font name parsers, needs clang:
+# qmake CONFIG+=fuzz QMAKE_CXX=clang++ QMAKE_LINK=clang++
+fuzz {
+    TARGET = fontnamefuzz
+    SOURCES -= main.cpp
+    SOURCES += fontnamefuzz.cpp
+    QMAKE_CXXFLAGS += -fsanitize=fuzzer,address,undefined
+    QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
+}
+
+win32 {
+    SOURCES += \
+        fontdump.cpp \
+        minidumpper.cpp
+
+    LIBS += -lAdvapi32 -lUser32 -lShell32 -lGdi32 -lPsapi -lDbghelp
+}
+
+linux {
+    SOURCES += \
+        memoryreader.cpp \
+        minidumpper_linux.cpp
 
-LIBS += -lAdvapi32 -lUser32 -lShell32 -lGdi32
+    LIBS += -lpthread
+}
@@ -0,0 +1,541 @@
+#include "chunkstore.h"
+#include "contenthash.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+namespace {
+
+const uint32_t kManifestMagic = 0x4d43444d; // "MDCM"
+const uint32_t kManifestVersion = 1;
+const uint64_t kSecondSeed = 0x6a09e667f3bcc909ULL;
+
+struct ManifestHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint64_t chunks;
+};
+
+struct ManifestEntry
+{
+    uint64_t hi;
+    uint64_t lo;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct IndexRecord
+{
+    uint64_t hi;
+    uint64_t lo;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t length;
+    uint32_t codec;
+    uint32_t reserved;
+};
+
+// FastCDC with normalized chunking: a harder condition before the average
+// size and an easier one after it keep chunk sizes close to the average.
+// The gear hash shifts left, so its high bits depend on the last 64 bytes
+// and the masks test those.
+const uint64_t kMaskHard = ~uint64_t(0) << (64 - 16);
+const uint64_t kMaskEasy = ~uint64_t(0) << (64 - 12);
+
+struct GearTable
+{
+    uint64_t values[256];
+
+    GearTable()
+    {
+        // splitmix64, chunk boundaries have to stay the same forever
+        uint64_t state = 0x3243f6a8885a308dULL;
+        for (int i = 0; i < 256; ++i) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable & Gear()
+{
+    static const GearTable table;
+    return table;
+}
+
+#ifdef _WIN32
+const wchar_t kSeparator[] = L"\\";
+
+bool MakeDirectory(std::wstring const & path)
+{
+    return CreateDirectoryW(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// Names in directory ending in suffix, without it
+bool ListFiles(std::wstring const & directory, std::wstring const & suffix, std::vector<std::wstring> & stems)
+{
+    WIN32_FIND_DATAW data;
+    HANDLE hFind = FindFirstFileW((directory + L"\\*" + suffix).c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    do {
+        std::wstring name = data.cFileName;
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            stems.push_back(name.substr(0, name.size() - suffix.size()));
+    } while (FindNextFileW(hFind, &data));
+    FindClose(hFind);
+    return true;
+}
+
+unsigned long CurrentProcessId()
+{
+    return GetCurrentProcessId();
+}
+#else
+const wchar_t kSeparator[] = L"/";
+
+bool MakeDirectory(std::wstring const & path)
+{
+    return mkdir(NarrowPath(path).c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+bool ListFiles(std::wstring const & directory, std::wstring const & suffix, std::vector<std::wstring> & stems)
+{
+    DIR * dir = opendir(NarrowPath(directory).c_str());
+    if (dir == nullptr)
+        return false;
+    while (dirent * entry = readdir(dir)) {
+        std::string narrow = entry->d_name;
+        std::wstring name(narrow.size(), L'\0');
+        name.resize(mbstowcs(&name[0], narrow.c_str(), name.size()));
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            stems.push_back(name.substr(0, name.size() - suffix.size()));
+    }
+    closedir(dir);
+    return true;
+}
+
+unsigned long CurrentProcessId()
+{
+    return getpid();
+}
+#endif
+
+bool EndsWith(std::wstring const & text, std::wstring const & suffix)
+{
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool ReadManifest(std::wstring const & path, ManifestHeader & header, std::vector<ManifestEntry> & entries)
+{
+    FILE * file = OpenDumpFile(path, L"rb");
+    if (file == nullptr)
+        return false;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == kManifestMagic
+            && header.version == kManifestVersion && header.chunks <= header.size;
+    if (ok) {
+        entries.resize(size_t(header.chunks));
+        ok = entries.empty() || fread(&entries[0], sizeof(ManifestEntry), entries.size(), file) == entries.size();
+    }
+    fclose(file);
+    return ok;
+}
+
+} // namespace
+
+// std::min takes them by reference, which needs a definition
+const size_t ChunkStoreDumpOutput::kMinChunk;
+const size_t ChunkStoreDumpOutput::kAverageChunk;
+const size_t ChunkStoreDumpOutput::kMaxChunk;
+
+ChunkId HashChunk(void const * data, size_t size)
+{
+    ChunkId id;
+    id.hi = ContentHash::Hash64(data, size, kSecondSeed);
+    id.lo = ContentHash::Hash64(data, size);
+    return id;
+}
+
+ChunkStore::ChunkStore()
+    : m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_pack(nullptr)
+    , m_index(nullptr)
+    , m_nPack(0)
+    , m_nPackSize(0)
+    , m_nBytes(0)
+    , m_nStoredBytes(0)
+{
+}
+
+ChunkStore::~ChunkStore()
+{
+    if (m_pack)
+        fclose(m_pack);
+    if (m_index)
+        fclose(m_index);
+    for (size_t i = 0; i < m_readers.size(); ++i) {
+        if (m_readers[i])
+            fclose(m_readers[i]);
+    }
+}
+
+bool ChunkStore::Open(std::wstring const & root, bool bCreate)
+{
+    m_root = root;
+    std::wstring packs = root + kSeparator + L"packs";
+    if (bCreate && !(MakeDirectory(root) && MakeDirectory(packs) && MakeDirectory(root + kSeparator + L"dumps")))
+        return false;
+    std::vector<std::wstring> stems;
+    if (!ListFiles(packs, L".idx", stems))
+        return false;
+    std::sort(stems.begin(), stems.end());
+    for (size_t i = 0; i < stems.size(); ++i) {
+        if (!LoadIndex(stems[i]))
+            wprintf(L"Couldn't read the index of pack %ls\n", stems[i].c_str());
+    }
+    return true;
+}
+
+void ChunkStore::SetCompression(DumpCodec codec, int level)
+{
+    m_codec = codec;
+    m_nCodecLevel = level;
+}
+
+bool ChunkStore::LoadIndex(std::wstring const & stem)
+{
+    FILE * file = OpenDumpFile(m_root + kSeparator + L"packs" + kSeparator + stem + L".idx", L"rb");
+    if (file == nullptr)
+        return false;
+    uint32_t pack = uint32_t(m_packs.size());
+    m_packs.push_back(stem);
+    m_readers.push_back(nullptr);
+    // A record is only written after its chunk, a torn last record of a
+    // writer that died is left out
+    IndexRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        ChunkId id = { record.hi, record.lo };
+        Location location = { pack, record.size, record.offset, record.length, record.codec };
+        if (m_chunks.insert(std::make_pair(id, location)).second) {
+            m_nBytes += record.length;
+            m_nStoredBytes += record.size;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+bool ChunkStore::OpenPack()
+{
+    std::wstring packs = m_root + kSeparator + L"packs" + kSeparator;
+    wchar_t stem[64];
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        swprintf(stem, sizeof(stem) / sizeof(wchar_t), L"%lu-%llu-%d", CurrentProcessId(),
+                 static_cast<unsigned long long>(time(nullptr)), attempt);
+        // Packs are never shared, don't take over one that exists
+        FILE * existing = OpenDumpFile(packs + stem + L".pack", L"rb");
+        if (existing) {
+            fclose(existing);
+            continue;
+        }
+        m_pack = OpenDumpFile(packs + stem + L".pack", L"wb");
+        m_index = OpenDumpFile(packs + stem + L".idx", L"wb");
+        if (m_pack == nullptr || m_index == nullptr)
+            break;
+        m_nPack = uint32_t(m_packs.size());
+        m_nPackSize = 0;
+        m_packs.push_back(stem);
+        m_readers.push_back(nullptr);
+        return true;
+    }
+    if (m_pack)
+        fclose(m_pack);
+    if (m_index)
+        fclose(m_index);
+    m_pack = m_index = nullptr;
+    return false;
+}
+
+bool ChunkStore::Put(void const * data, size_t size, ChunkId & id, bool & bNew)
+{
+    id = HashChunk(data, size);
+    bNew = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_chunks.find(id) != m_chunks.end())
+            return true;
+    }
+
+    // Compressed outside the lock, kept as is when that doesn't pay
+    std::vector<char> compressed;
+    DumpCodec codec = NoCodec;
+    if (m_codec != NoCodec) {
+        std::vector<char> in(static_cast<char const *>(data), static_cast<char const *>(data) + size);
+        if (CompressBlock(m_codec, m_nCodecLevel, in, compressed) && compressed.size() < size)
+            codec = m_codec;
+    }
+    void const * stored = codec == NoCodec ? data : compressed.data();
+    uint32_t storedSize = uint32_t(codec == NoCodec ? size : compressed.size());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_chunks.find(id) != m_chunks.end())
+        return true;
+    if (m_pack == nullptr && !OpenPack())
+        return false;
+    IndexRecord record = { id.hi, id.lo, m_nPackSize, storedSize, uint32_t(size), uint32_t(codec), 0 };
+    if (fwrite(stored, 1, storedSize, m_pack) != storedSize || fwrite(&record, sizeof(record), 1, m_index) != 1)
+        return false;
+    Location location = { m_nPack, storedSize, m_nPackSize, uint32_t(size), uint32_t(codec) };
+    m_chunks.insert(std::make_pair(id, location));
+    m_nPackSize += storedSize;
+    m_nBytes += size;
+    m_nStoredBytes += storedSize;
+    bNew = true;
+    return true;
+}
+
+bool ChunkStore::Sync()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // Chunks before the records pointing at them
+    return m_pack == nullptr || (fflush(m_pack) == 0 && fflush(m_index) == 0);
+}
+
+FILE * ChunkStore::PackFile(uint32_t pack)
+{
+    if (m_readers[pack] == nullptr)
+        m_readers[pack] = OpenDumpFile(m_root + kSeparator + L"packs" + kSeparator + m_packs[pack] + L".pack", L"rb");
+    return m_readers[pack];
+}
+
+bool ChunkStore::Get(ChunkId const & id, std::vector<char> & data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unordered_map<ChunkId, Location, ChunkIdHash>::const_iterator it = m_chunks.find(id);
+    if (it == m_chunks.end())
+        return false;
+    Location const & location = it->second;
+    if (location.pack == m_nPack && m_pack)
+        fflush(m_pack);
+    FILE * file = PackFile(location.pack);
+    if (file == nullptr || !SeekDumpFile(file, location.offset))
+        return false;
+    data.resize(location.length);
+    if (location.codec == NoCodec)
+        return data.empty() || fread(&data[0], 1, data.size(), file) == data.size();
+    std::vector<char> compressed(location.size);
+    return fread(&compressed[0], 1, compressed.size(), file) == compressed.size()
+            && DecompressBlock(DumpCodec(location.codec), compressed, data);
+}
+
+std::wstring ChunkStore::ManifestPath(std::wstring const & name) const
+{
+    return m_root + kSeparator + L"dumps" + kSeparator + name + L".manifest";
+}
+
+std::wstring ChunkStore::Root() const
+{
+    return m_root;
+}
+
+void ChunkStore::Totals(uint64_t & chunks, uint64_t & bytes, uint64_t & storedBytes) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    chunks = m_chunks.size();
+    bytes = m_nBytes;
+    storedBytes = m_nStoredBytes;
+}
+
+ChunkStoreDumpOutput::ChunkStoreDumpOutput(ChunkStore & store, std::wstring const & name)
+    : m_store(store)
+    , m_name(name)
+    , m_nSize(0)
+    , m_nNewBytes(0)
+    , m_bError(false)
+{
+}
+
+size_t ChunkStoreDumpOutput::CutPoint(unsigned char const * data, size_t size)
+{
+    if (size <= kMinChunk)
+        return size;
+    uint64_t const * gear = Gear().values;
+    size_t limit = std::min(size, kMaxChunk);
+    size_t normal = std::min(limit, kAverageChunk);
+    uint64_t fingerprint = 0;
+    size_t i = kMinChunk;
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if ((fingerprint & kMaskHard) == 0)
+            return i + 1;
+    }
+    for (; i < limit; ++i) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if ((fingerprint & kMaskEasy) == 0)
+            return i + 1;
+    }
+    return limit;
+}
+
+bool ChunkStoreDumpOutput::StoreChunks(bool bFinal)
+{
+    // Without bFinal a chunk is only cut where more data can't move its end
+    size_t done = 0;
+    while (!m_bError && (bFinal ? done < m_pending.size() : m_pending.size() - done >= kMaxChunk)) {
+        size_t n = CutPoint(&m_pending[done], m_pending.size() - done);
+        ChunkId id;
+        bool bNew = false;
+        if (!m_store.Put(&m_pending[done], n, id, bNew)) {
+            m_bError = true;
+            break;
+        }
+        m_manifest.push_back(std::make_pair(id, uint32_t(n)));
+        if (bNew)
+            m_nNewBytes += n;
+        done += n;
+    }
+    m_pending.erase(m_pending.begin(), m_pending.begin() + done);
+    return !m_bError;
+}
+
+bool ChunkStoreDumpOutput::Write(void const * data, size_t size)
+{
+    unsigned char const * bytes = static_cast<unsigned char const *>(data);
+    m_pending.insert(m_pending.end(), bytes, bytes + size);
+    m_nSize += size;
+    // Cutting in batches keeps the moves of the leftover rare
+    if (m_pending.size() >= 16 * kMaxChunk)
+        return StoreChunks(false);
+    return !m_bError;
+}
+
+bool ChunkStoreDumpOutput::Finish()
+{
+    if (!StoreChunks(true) || !m_store.Sync())
+        return false;
+
+    FILE * file = OpenDumpFile(m_store.ManifestPath(m_name), L"wb");
+    if (file == nullptr)
+        return false;
+    ManifestHeader header = { kManifestMagic, kManifestVersion, m_nSize, m_manifest.size() };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; i < m_manifest.size() && ok; ++i) {
+        ManifestEntry entry = { m_manifest[i].first.hi, m_manifest[i].first.lo, m_manifest[i].second, 0 };
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        wprintf(L"Stored %ls: %d chunks, %llu of %llu bytes new\n", m_name.c_str(), int(m_manifest.size()),
+                static_cast<unsigned long long>(m_nNewBytes), static_cast<unsigned long long>(m_nSize));
+    return ok;
+}
+
+uint64_t ChunkStoreDumpOutput::Size() const
+{
+    return m_nSize;
+}
+
+bool StoreDumpFile(ChunkStore & store, std::wstring const & path, std::wstring const & name)
+{
+    FILE * in = OpenDumpFile(path, L"rb");
+    if (in == nullptr)
+        return false;
+    ChunkStoreDumpOutput out(store, name);
+    std::vector<char> buffer(1024 * 1024);
+    bool ok = true;
+    size_t n;
+    while (ok && (n = fread(&buffer[0], 1, buffer.size(), in)) > 0)
+        ok = out.Write(&buffer[0], n);
+    ok = ok && !ferror(in) && out.Finish();
+    fclose(in);
+    return ok;
+}
+
+bool RestoreDump(std::wstring const & root, std::wstring const & name, std::wstring const & output)
+{
+    ChunkStore store;
+    if (!store.Open(root, false)) {
+        wprintf(L"%ls is not a chunk store\n", root.c_str());
+        return false;
+    }
+    std::wstring path = EndsWith(name, L".manifest") ? name : store.ManifestPath(name);
+    ManifestHeader header;
+    std::vector<ManifestEntry> entries;
+    if (!ReadManifest(path, header, entries)) {
+        wprintf(L"Couldn't read %ls\n", path.c_str());
+        return false;
+    }
+
+    FileDumpOutput out;
+    if (!out.Open(output)) {
+        wprintf(L"Couldn't create %ls\n", output.c_str());
+        return false;
+    }
+    std::vector<char> chunk;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ChunkId id = { entries[i].hi, entries[i].lo };
+        if (!store.Get(id, chunk) || chunk.size() != entries[i].length) {
+            wprintf(L"Chunk %016llx%016llx of %ls is missing\n", static_cast<unsigned long long>(id.hi),
+                    static_cast<unsigned long long>(id.lo), path.c_str());
+            return false;
+        }
+        if (!out.Write(chunk.data(), chunk.size())) {
+            wprintf(L"Error writing %ls\n", output.c_str());
+            return false;
+        }
+    }
+    if (!out.Finish() || out.Size() != header.size) {
+        wprintf(L"Error writing %ls\n", output.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PrintChunkStore(std::wstring const & root)
+{
+    ChunkStore store;
+    std::vector<std::wstring> names;
+    if (!store.Open(root, false) || !ListFiles(root + kSeparator + L"dumps", L".manifest", names)) {
+        wprintf(L"%ls is not a chunk store\n", root.c_str());
+        return false;
+    }
+    std::sort(names.begin(), names.end());
+    uint64_t total = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        ManifestHeader header;
+        std::vector<ManifestEntry> entries;
+        if (!ReadManifest(store.ManifestPath(names[i]), header, entries)) {
+            wprintf(L"  %ls: unreadable manifest\n", names[i].c_str());
+            continue;
+        }
+        wprintf(L"  %ls: %llu bytes, %llu chunks\n", names[i].c_str(),
+                static_cast<unsigned long long>(header.size), static_cast<unsigned long long>(header.chunks));
+        total += header.size;
+    }
+    uint64_t chunks, bytes, storedBytes;
+    store.Totals(chunks, bytes, storedBytes);
+    wprintf(L"%d dumps, %llu bytes in %llu distinct chunks of %llu bytes, %llu bytes stored",
+            int(names.size()), static_cast<unsigned long long>(total), static_cast<unsigned long long>(chunks),
+            static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(storedBytes));
+    if (storedBytes)
+        wprintf(L", %.1fx smaller", double(total) / storedBytes);
+    wprintf(L"\n");
+    return true;
+}
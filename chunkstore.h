@@ -0,0 +1,159 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include "dumpcompression.h"
+#include "dumpoutput.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+// Names a chunk by its contents: XXH64 of the chunk with two different
+// seeds, which makes a collision between distinct chunks practically
+// impossible
+struct ChunkId
+{
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(ChunkId const & other) const
+    {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+struct ChunkIdHash
+{
+    size_t operator()(ChunkId const & id) const
+    {
+        return size_t(id.lo);
+    }
+};
+
+ChunkId HashChunk(void const * data, size_t size);
+
+// A repository of dump contents where every distinct chunk is kept once.
+//
+//     <root>/packs/<writer>.pack  chunk data, appended by one writer
+//     <root>/packs/<writer>.idx   where each chunk of the pack is
+//     <root>/dumps/<dump>.manifest  the dump as a list of chunks
+//
+// Every process writing to the repository appends to packs of its own, so
+// several dumppers may share one repository without locking. Two of them
+// storing the same new chunk at once keep it twice, which costs space but
+// nothing else. Thread safe.
+class ChunkStore
+{
+public:
+    ChunkStore();
+
+    ~ChunkStore();
+
+public:
+    // Loads the indexes of all packs, creates the repository if bCreate
+    bool Open(std::wstring const & root, bool bCreate);
+
+    // Chunks are compressed one by one when stored
+    void SetCompression(DumpCodec codec, int level);
+
+    // Stores a chunk unless the repository has it already. bNew tells
+    // whether it was stored.
+    bool Put(void const * data, size_t size, ChunkId & id, bool & bNew);
+
+    bool Get(ChunkId const & id, std::vector<char> & data);
+
+    // Makes the chunks stored so far visible to readers
+    bool Sync();
+
+    // Where the manifest of a dump goes
+    std::wstring ManifestPath(std::wstring const & name) const;
+
+    std::wstring Root() const;
+
+    // Distinct chunks and their bytes before and after compression
+    void Totals(uint64_t & chunks, uint64_t & bytes, uint64_t & storedBytes) const;
+
+private:
+    // Index record, the pack holds size bytes at offset
+    struct Location
+    {
+        uint32_t pack;
+        uint32_t size;   // as stored
+        uint64_t offset;
+        uint32_t length; // uncompressed
+        uint32_t codec;
+    };
+
+    bool LoadIndex(std::wstring const & stem);
+
+    // Starts the pack of this writer on the first new chunk
+    bool OpenPack();
+
+    FILE * PackFile(uint32_t pack);
+
+private:
+    std::wstring m_root;
+    DumpCodec m_codec;
+    int m_nCodecLevel;
+    std::unordered_map<ChunkId, Location, ChunkIdHash> m_chunks;
+    std::vector<std::wstring> m_packs; // stems
+    std::vector<FILE *> m_readers;     // by pack, opened on demand
+    FILE * m_pack;                     // written by us
+    FILE * m_index;
+    uint32_t m_nPack;
+    uint64_t m_nPackSize;
+    uint64_t m_nBytes;
+    uint64_t m_nStoredBytes;
+    mutable std::mutex m_mutex;
+};
+
+// Stores a dump in a ChunkStore. The bytes are cut into chunks where their
+// contents say so (FastCDC), so data moving to another offset between
+// dumps still splits into the same chunks. Chunks are 4 to 64 KB, 16 KB on
+// average. Finish writes the manifest.
+class ChunkStoreDumpOutput : public DumpOutput
+{
+public:
+    static const size_t kMinChunk = 4 * 1024;
+    static const size_t kAverageChunk = 16 * 1024;
+    static const size_t kMaxChunk = 64 * 1024;
+
+    ChunkStoreDumpOutput(ChunkStore & store, std::wstring const & name);
+
+public:
+    virtual bool Write(void const * data, size_t size);
+
+    virtual bool Finish();
+
+    virtual uint64_t Size() const;
+
+    // Where the next chunk ends in data, at most size
+    static size_t CutPoint(unsigned char const * data, size_t size);
+
+private:
+    bool StoreChunks(bool bFinal);
+
+private:
+    ChunkStore & m_store;
+    std::wstring m_name;
+    std::vector<unsigned char> m_pending;
+    std::vector<std::pair<ChunkId, uint32_t> > m_manifest;
+    uint64_t m_nSize;
+    uint64_t m_nNewBytes;
+    bool m_bError;
+};
+
+// Moves a dump file into the store, for dumps that can't be streamed
+bool StoreDumpFile(ChunkStore & store, std::wstring const & path, std::wstring const & name);
+
+// Writes a stored dump out as an MDMP file. name is the dump's name or the
+// path of its manifest.
+bool RestoreDump(std::wstring const & root, std::wstring const & name, std::wstring const & output);
+
+// Lists the stored dumps and how much the repository saves
+bool PrintChunkStore(std::wstring const & root);
+
+#endif // CHUNKSTORE_H
@@ -0,0 +1,106 @@
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+// 64 bit content hash for dump pages, this is the XXH64 algorithm.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace ContentHash {
+
+const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t Rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t Read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t Read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input)
+{
+    acc += input * Prime2;
+    acc = Rotl(acc, 31);
+    return acc * Prime1;
+}
+
+inline uint64_t Merge(uint64_t acc, uint64_t val)
+{
+    acc ^= Round(0, val);
+    return acc * Prime1 + Prime4;
+}
+
+inline uint64_t Hash64(const void *data, size_t length, uint64_t seed = 0)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + Prime1 + Prime2;
+        uint64_t v2 = seed + Prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - Prime1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+        h = Merge(h, v1);
+        h = Merge(h, v2);
+        h = Merge(h, v3);
+        h = Merge(h, v4);
+    } else {
+        h = seed + Prime5;
+    }
+
+    h += uint64_t(length);
+
+    while (p + 8 <= end) {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * Prime1 + Prime4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= uint64_t(Read32(p)) * Prime1;
+        h = Rotl(h, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * Prime5;
+        h = Rotl(h, 11) * Prime1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+} // namespace ContentHash
+
+#endif // CONTENTHASH_H
@@ -0,0 +1,114 @@
+#include "dumpbudget.h"
+#include "minidumpformat.h"
+
+#include <chrono>
+#include <string.h>
+
+namespace {
+
+// Share of a time limit kept for writing the directory and closing the
+// file once bulk memory stops
+const long long kReserveShare = 10;
+
+} // namespace
+
+DumpBudget::DumpBudget()
+    : m_nStart(0)
+    , m_nPauseStart(0)
+    , m_nPauseTime(0)
+    , m_nReasons(0)
+{
+    memset(&m_limits, 0, sizeof(m_limits));
+}
+
+void DumpBudget::SetLimits(DumpLimits const & limits)
+{
+    m_limits = limits;
+}
+
+DumpLimits const & DumpBudget::Limits() const
+{
+    return m_limits;
+}
+
+bool DumpBudget::IsLimited() const
+{
+    return m_limits.maxWallTime || m_limits.maxBytes || m_limits.maxPauseTime;
+}
+
+void DumpBudget::Start()
+{
+    m_nStart = Now();
+    m_nPauseStart = 0;
+    m_nPauseTime = 0;
+    m_nReasons = 0;
+}
+
+void DumpBudget::PauseStarted()
+{
+    if (m_nPauseStart == 0)
+        m_nPauseStart = Now();
+}
+
+void DumpBudget::PauseEnded()
+{
+    if (m_nPauseStart)
+        m_nPauseTime += Now() - m_nPauseStart;
+    m_nPauseStart = 0;
+}
+
+uint64_t DumpBudget::BulkAllowance(uint64_t written, uint64_t size, uint64_t pageSize)
+{
+    if (IsLow(Now() - m_nStart, m_limits.maxWallTime)) {
+        m_nReasons |= MD_OMITTED_WALL_TIME;
+        return 0;
+    }
+    // Only memory copied while the target is stopped counts against the pause
+    if (m_nPauseStart && IsLow(PauseTime(), m_limits.maxPauseTime)) {
+        m_nReasons |= MD_OMITTED_PAUSE_TIME;
+        return 0;
+    }
+    if (m_limits.maxBytes && written + size > m_limits.maxBytes) {
+        m_nReasons |= MD_OMITTED_BYTES;
+        uint64_t room = written < m_limits.maxBytes ? m_limits.maxBytes - written : 0;
+        return room / pageSize * pageSize;
+    }
+    return size;
+}
+
+bool DumpBudget::AllowsPause() const
+{
+    return !IsLow(Now() - m_nStart, m_limits.maxWallTime) && !IsLow(PauseTime(), m_limits.maxPauseTime);
+}
+
+bool DumpBudget::IsExhausted() const
+{
+    return (m_limits.maxWallTime && Now() - m_nStart >= m_limits.maxWallTime)
+            || (m_limits.maxPauseTime && PauseTime() >= m_limits.maxPauseTime);
+}
+
+uint32_t DumpBudget::Reasons() const
+{
+    return m_nReasons;
+}
+
+void DumpBudget::AddReasons(uint32_t reasons)
+{
+    m_nReasons |= reasons;
+}
+
+long long DumpBudget::Now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long long DumpBudget::PauseTime() const
+{
+    return m_nPauseTime + (m_nPauseStart ? Now() - m_nPauseStart : 0);
+}
+
+bool DumpBudget::IsLow(long long used, long long limit)
+{
+    return limit && used >= limit - limit / kReserveShare;
+}
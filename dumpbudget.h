@@ -0,0 +1,70 @@
+#ifndef DUMPBUDGET_H
+#define DUMPBUDGET_H
+
+#include <stdint.h>
+
+// Limits of a single dump, 0 for none
+struct DumpLimits
+{
+    long long maxWallTime;       // microseconds
+    unsigned long long maxBytes; // dump size before compression
+    long long maxPauseTime;      // microseconds the target may stay stopped
+};
+
+// Keeps a dump within its limits.
+//
+// Thread contexts, stacks and modules are always written. Bulk memory is
+// only copied while every limit has some reserve left, what doesn't fit is
+// left out and listed in the dump. The dump is cancelled only when a time
+// limit is used up entirely.
+class DumpBudget
+{
+public:
+    DumpBudget();
+
+public:
+    void SetLimits(DumpLimits const & limits);
+
+    DumpLimits const & Limits() const;
+
+    bool IsLimited() const;
+
+    // Starts measuring a dump
+    void Start();
+
+    void PauseStarted();
+
+    void PauseEnded();
+
+    // How many of size more bytes of bulk memory may follow the written
+    // ones, in whole pages. Less than size once a limit runs low.
+    uint64_t BulkAllowance(uint64_t written, uint64_t size, uint64_t pageSize);
+
+    // Whether the target may be stopped again for a while
+    bool AllowsPause() const;
+
+    // True once a time limit is used up
+    bool IsExhausted() const;
+
+    // MD_OMITTED_* flags of the limits that cut the dump short
+    uint32_t Reasons() const;
+
+    void AddReasons(uint32_t reasons);
+
+private:
+    long long Now() const;
+
+    long long PauseTime() const;
+
+    // True when less than the reserve is left of limit
+    static bool IsLow(long long used, long long limit);
+
+private:
+    DumpLimits m_limits;
+    long long m_nStart;
+    long long m_nPauseStart; // 0 while the target runs
+    long long m_nPauseTime;
+    uint32_t m_nReasons;
+};
+
+#endif // DUMPBUDGET_H
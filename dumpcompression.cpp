@@ -0,0 +1,514 @@
+#include "dumpcompression.h"
+
+#ifdef DUMP_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef DUMP_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <algorithm>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+// Seek table layout from zstd's contrib/seekable_format
+const uint32_t kSkippableFrameMagic = 0x184D2A5E;
+const uint32_t kSeekableMagic = 0x8F92EAB1;
+const size_t kSeekTableFooterSize = 9;
+
+const uint32_t kZstdFrameMagic = 0xFD2FB528;
+const uint32_t kLz4FrameMagic = 0x184D2204;
+
+void Put32(std::vector<char> & out, uint32_t value)
+{
+    char bytes[4] = { char(value), char(value >> 8), char(value >> 16), char(value >> 24) };
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+uint32_t Get32(const char * p)
+{
+    const unsigned char * u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) | (uint32_t(u[1]) << 8) | (uint32_t(u[2]) << 16) | (uint32_t(u[3]) << 24);
+}
+
+#ifdef DUMP_WITH_ZSTD
+// One compression context per pool thread, they are expensive to set up
+struct ZstdContext
+{
+    ZSTD_CCtx * cctx;
+    ZstdContext() : cctx(ZSTD_createCCtx()) {}
+    ~ZstdContext() { ZSTD_freeCCtx(cctx); }
+};
+#endif
+
+unsigned int DefaultThreads()
+{
+    unsigned int threads = std::thread::hardware_concurrency() / 2;
+    if (threads > CompressedDumpOutput::kMaxThreads)
+        threads = CompressedDumpOutput::kMaxThreads;
+    return threads ? threads : 1;
+}
+
+} // namespace
+
+bool CompressBlock(DumpCodec codec, int level, std::vector<char> const & in, std::vector<char> & out)
+{
+    switch (codec) {
+#ifdef DUMP_WITH_ZSTD
+    case ZstdCodec:
+        {
+            static thread_local ZstdContext context;
+            out.resize(ZSTD_compressBound(in.size()));
+            size_t n = ZSTD_compressCCtx(context.cctx, &out[0], out.size(), in.data(), in.size(), level);
+            if (ZSTD_isError(n))
+                return false;
+            out.resize(n);
+            return true;
+        }
+#endif
+#ifdef DUMP_WITH_LZ4
+    case Lz4Codec:
+        {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = level;
+            prefs.frameInfo.contentSize = in.size();
+            out.resize(LZ4F_compressFrameBound(in.size(), &prefs));
+            size_t n = LZ4F_compressFrame(&out[0], out.size(), in.data(), in.size(), &prefs);
+            if (LZ4F_isError(n))
+                return false;
+            out.resize(n);
+            return true;
+        }
+#endif
+    default:
+        (void) level;
+        (void) in;
+        (void) out;
+        return false;
+    }
+}
+
+bool DecompressBlock(DumpCodec codec, std::vector<char> const & in, std::vector<char> & out)
+{
+    switch (codec) {
+#ifdef DUMP_WITH_ZSTD
+    case ZstdCodec:
+        {
+            size_t n = ZSTD_decompress(&out[0], out.size(), in.data(), in.size());
+            return !ZSTD_isError(n) && n == out.size();
+        }
+#endif
+#ifdef DUMP_WITH_LZ4
+    case Lz4Codec:
+        {
+            LZ4F_dctx * dctx = nullptr;
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+                return false;
+            size_t inPos = 0;
+            size_t outPos = 0;
+            size_t r = 1;
+            while (r != 0 && inPos < in.size() && outPos < out.size()) {
+                size_t inSize = in.size() - inPos;
+                size_t outSize = out.size() - outPos;
+                r = LZ4F_decompress(dctx, &out[outPos], &outSize, &in[inPos], &inSize, nullptr);
+                if (LZ4F_isError(r))
+                    break;
+                inPos += inSize;
+                outPos += outSize;
+            }
+            LZ4F_freeDecompressionContext(dctx);
+            return r == 0 && outPos == out.size();
+        }
+#endif
+    default:
+        (void) in;
+        (void) out;
+        return false;
+    }
+}
+
+bool ParseDumpCodec(std::wstring const & spec, DumpCodec & codec, int & level)
+{
+    std::wstring name = spec.substr(0, spec.find(L':'));
+    if (name == L"zstd") {
+        codec = ZstdCodec;
+        level = 3;
+    } else if (name == L"lz4") {
+        codec = Lz4Codec;
+        level = 0;
+    } else if (name == L"none") {
+        codec = NoCodec;
+        level = 0;
+        return true;
+    } else {
+        return false;
+    }
+    if (name.size() < spec.size())
+        level = wcstol(spec.c_str() + name.size() + 1, nullptr, 10);
+#ifndef DUMP_WITH_ZSTD
+    if (codec == ZstdCodec)
+        return false;
+#endif
+#ifndef DUMP_WITH_LZ4
+    if (codec == Lz4Codec)
+        return false;
+#endif
+    return true;
+}
+
+std::wstring DumpCodecExtension(DumpCodec codec)
+{
+    switch (codec) {
+    case ZstdCodec:
+        return L".zst";
+    case Lz4Codec:
+        return L".lz4";
+    default:
+        return std::wstring();
+    }
+}
+
+CompressedDumpOutput::CompressedDumpOutput(DumpCodec codec, int level, size_t blockSize)
+    : m_codec(codec)
+    , m_nLevel(level)
+    , m_nBlockSize(blockSize)
+    , m_file(nullptr)
+    , m_nSize(0)
+    , m_nPending(0)
+    , m_bError(false)
+{
+    // Enough blocks in flight to keep every worker busy while one is written
+    m_nMaxInFlight = Pool().Size() * 2;
+    m_current.reserve(m_nBlockSize);
+}
+
+CompressedDumpOutput::~CompressedDumpOutput()
+{
+    WaitForBlocks();
+    if (m_file)
+        fclose(m_file);
+}
+
+ThreadPool & CompressedDumpOutput::Pool()
+{
+    static ThreadPool pool(DefaultThreads());
+    return pool;
+}
+
+void CompressedDumpOutput::WaitForBlocks()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_nPending)
+        m_blockWritten.wait(lock);
+}
+
+bool CompressedDumpOutput::Open(std::wstring const & path)
+{
+    m_file = OpenDumpFile(path, L"wb");
+    return m_file != nullptr;
+}
+
+bool CompressedDumpOutput::Write(void const * data, size_t size)
+{
+    const char * p = static_cast<const char *>(data);
+    m_nSize += size;
+    while (size) {
+        size_t n = std::min(size, m_nBlockSize - m_current.size());
+        m_current.insert(m_current.end(), p, p + n);
+        p += n;
+        size -= n;
+        if (m_current.size() == m_nBlockSize)
+            SubmitBlock();
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_bError;
+}
+
+bool CompressedDumpOutput::Finish()
+{
+    if (!m_current.empty())
+        SubmitBlock();
+    WaitForBlocks();
+    WriteCompleted();
+
+    std::vector<char> table;
+    Put32(table, kSkippableFrameMagic);
+    Put32(table, uint32_t(m_seekTable.size() * 8 + kSeekTableFooterSize));
+    for (size_t i = 0; i < m_seekTable.size(); ++i) {
+        Put32(table, m_seekTable[i].first);
+        Put32(table, m_seekTable[i].second);
+    }
+    Put32(table, uint32_t(m_seekTable.size()));
+    table.push_back(0); // no checksums
+    Put32(table, kSeekableMagic);
+
+    bool ok = !m_bError && m_blocks.empty()
+            && fwrite(&table[0], 1, table.size(), m_file) == table.size();
+    ok = fclose(m_file) == 0 && ok;
+    m_file = nullptr;
+    return ok;
+}
+
+uint64_t CompressedDumpOutput::Size() const
+{
+    return m_nSize;
+}
+
+void CompressedDumpOutput::SubmitBlock()
+{
+    std::shared_ptr<Block> block = std::make_shared<Block>();
+    block->data.swap(m_current);
+    block->done = false;
+    block->ok = false;
+    m_current.reserve(m_nBlockSize);
+    {
+        // Bound memory use when the disk can't keep up with the compressors
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_blocks.size() >= m_nMaxInFlight && !m_bError)
+            m_blockWritten.wait(lock);
+        m_blocks.push_back(block);
+        ++m_nPending;
+    }
+    Pool().Submit(std::bind(&CompressedDumpOutput::Compress, this, block));
+}
+
+void CompressedDumpOutput::Compress(std::shared_ptr<Block> block)
+{
+    bool ok = CompressBlock(m_codec, m_nLevel, block->data, block->compressed);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        block->ok = ok;
+        block->done = true;
+    }
+    WriteCompleted();
+
+    // Last, the output may go away as soon as it sees no pending blocks
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --m_nPending;
+    m_blockWritten.notify_all();
+}
+
+void CompressedDumpOutput::WriteCompleted()
+{
+    // Whoever holds the write lock drains the finished head of the queue,
+    // other threads just leave their blocks behind for it.
+    std::unique_lock<std::mutex> writeLock(m_writeMutex, std::try_to_lock);
+    if (!writeLock.owns_lock())
+        return;
+    for (;;) {
+        std::shared_ptr<Block> block;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_blocks.empty() || !m_blocks.front()->done)
+                break;
+            block = m_blocks.front();
+        }
+        bool ok = block->ok && !m_bError
+                && fwrite(block->compressed.data(), 1, block->compressed.size(), m_file) == block->compressed.size();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_blocks.pop_front();
+            if (ok)
+                m_seekTable.push_back(std::make_pair(uint32_t(block->compressed.size()), uint32_t(block->data.size())));
+            else
+                m_bError = true;
+        }
+        m_blockWritten.notify_all();
+    }
+    writeLock.unlock();
+
+    // A block may have finished after we looked at the queue but before
+    // we let go of the write lock, make sure it doesn't get stuck.
+    bool pending;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending = !m_blocks.empty() && m_blocks.front()->done;
+    }
+    if (pending)
+        WriteCompleted();
+}
+
+CompressedDumpReader::CompressedDumpReader()
+    : m_file(nullptr)
+    , m_codec(NoCodec)
+    , m_nCached(size_t(-1))
+{
+}
+
+CompressedDumpReader::~CompressedDumpReader()
+{
+    if (m_file)
+        fclose(m_file);
+}
+
+bool CompressedDumpReader::Open(std::wstring const & path)
+{
+    m_file = OpenDumpFile(path, L"rb");
+    if (m_file == nullptr)
+        return false;
+
+    char head[4];
+    if (fread(head, 1, sizeof(head), m_file) != sizeof(head))
+        return false;
+    if (Get32(head) == kZstdFrameMagic)
+        m_codec = ZstdCodec;
+    else if (Get32(head) == kLz4FrameMagic)
+        m_codec = Lz4Codec;
+    else
+        return false;
+
+    char footer[kSeekTableFooterSize];
+#ifdef _WIN32
+    if (_fseeki64(m_file, -int(sizeof(footer)), SEEK_END) != 0)
+#else
+    if (fseeko(m_file, -off_t(sizeof(footer)), SEEK_END) != 0)
+#endif
+        return false;
+    if (fread(footer, 1, sizeof(footer), m_file) != sizeof(footer)
+            || Get32(footer + 5) != kSeekableMagic || (footer[4] & 0x80) != 0)
+        return false;
+#ifdef _WIN32
+    uint64_t fileSize = uint64_t(_ftelli64(m_file));
+#else
+    uint64_t fileSize = uint64_t(ftello(m_file));
+#endif
+
+    uint32_t count = Get32(footer);
+    uint64_t tableSize = uint64_t(count) * 8 + kSeekTableFooterSize;
+    if (tableSize + 8 > fileSize)
+        return false;
+    std::vector<char> table(size_t(tableSize + 8));
+    if (!SeekDumpFile(m_file, fileSize - table.size())
+            || fread(&table[0], 1, table.size(), m_file) != table.size()
+            || Get32(&table[0]) != kSkippableFrameMagic)
+        return false;
+
+    uint64_t compressedOffset = 0;
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        Frame f;
+        f.compressedOffset = compressedOffset;
+        f.compressedSize = Get32(&table[8 + i * 8]);
+        f.offset = offset;
+        f.size = Get32(&table[8 + i * 8 + 4]);
+        m_frames.push_back(f);
+        compressedOffset += f.compressedSize;
+        offset += f.size;
+    }
+    return compressedOffset + table.size() == fileSize;
+}
+
+bool CompressedDumpReader::Read(uint64_t offset, void * data, size_t size)
+{
+    char * out = static_cast<char *>(data);
+    while (size) {
+        // Binary search for the frame holding offset
+        size_t lo = 0;
+        size_t hi = m_frames.size();
+        while (lo + 1 < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (m_frames[mid].offset <= offset)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        if (lo >= m_frames.size() || !LoadBlock(lo))
+            return false;
+        Frame const & f = m_frames[lo];
+        if (offset < f.offset || offset >= f.offset + f.size)
+            return false;
+        size_t n = std::min<uint64_t>(size, f.offset + f.size - offset);
+        memcpy(out, &m_cache[size_t(offset - f.offset)], n);
+        out += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+uint64_t CompressedDumpReader::Size() const
+{
+    return m_frames.empty() ? 0 : m_frames.back().offset + m_frames.back().size;
+}
+
+DumpCodec CompressedDumpReader::Codec() const
+{
+    return m_codec;
+}
+
+bool CompressedDumpReader::LoadBlock(size_t index)
+{
+    if (index == m_nCached)
+        return true;
+    Frame const & f = m_frames[index];
+    m_compressed.resize(f.compressedSize);
+    m_cache.resize(f.size);
+    if (!SeekDumpFile(m_file, f.compressedOffset)
+            || fread(&m_compressed[0], 1, m_compressed.size(), m_file) != m_compressed.size()
+            || !DecompressBlock(m_codec, m_compressed, m_cache)) {
+        m_nCached = size_t(-1);
+        return false;
+    }
+    m_nCached = index;
+    return true;
+}
+
+DumpOutput * OpenDumpOutput(std::wstring const & path, DumpCodec codec, int level)
+{
+    if (codec == NoCodec) {
+        FileDumpOutput * out = new FileDumpOutput;
+        if (out->Open(path))
+            return out;
+        delete out;
+        return nullptr;
+    }
+    CompressedDumpOutput * out = new CompressedDumpOutput(codec, level);
+    if (out->Open(path))
+        return out;
+    delete out;
+    return nullptr;
+}
+
+bool CompressDump(std::wstring const & input, std::wstring const & output, DumpCodec codec, int level)
+{
+    FILE * in = OpenDumpFile(input, L"rb");
+    if (in == nullptr)
+        return false;
+    std::unique_ptr<DumpOutput> out(OpenDumpOutput(output, codec, level));
+    bool ok = out.get() != nullptr;
+    std::vector<char> buffer(CompressedDumpOutput::kDefaultBlockSize);
+    size_t n;
+    while (ok && (n = fread(&buffer[0], 1, buffer.size(), in)) > 0)
+        ok = out->Write(&buffer[0], n);
+    ok = ok && !ferror(in) && out->Finish();
+    fclose(in);
+    return ok;
+}
+
+bool DecompressDump(std::wstring const & input, std::wstring const & output)
+{
+    CompressedDumpReader reader;
+    if (!reader.Open(input)) {
+        wprintf(L"%ls is not a compressed dump\n", input.c_str());
+        return false;
+    }
+    FileDumpOutput out;
+    if (!out.Open(output)) {
+        wprintf(L"Couldn't create %ls\n", output.c_str());
+        return false;
+    }
+    std::vector<char> buffer(CompressedDumpOutput::kDefaultBlockSize);
+    uint64_t size = reader.Size();
+    for (uint64_t offset = 0; offset < size; ) {
+        size_t n = size_t(std::min<uint64_t>(buffer.size(), size - offset));
+        if (!reader.Read(offset, &buffer[0], n) || !out.Write(&buffer[0], n)) {
+            wprintf(L"Error inflating %ls\n", input.c_str());
+            return false;
+        }
+        offset += n;
+    }
+    return out.Finish();
+}
@@ -0,0 +1,147 @@
+#ifndef DUMPCOMPRESSION_H
+#define DUMPCOMPRESSION_H
+
+#include "dumpoutput.h"
+#include "threadpool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum DumpCodec {
+    NoCodec,
+    ZstdCodec,
+    Lz4Codec
+};
+
+// Parses "zstd", "zstd:19", "lz4" or "lz4:9"
+bool ParseDumpCodec(std::wstring const & spec, DumpCodec & codec, int & level);
+
+// File name extension added for the codec, e.g. ".zst"
+std::wstring DumpCodecExtension(DumpCodec codec);
+
+// Compresses the dump in independent blocks on a pool of threads shared by
+// all outputs of this process, so concurrent dumps don't multiply the
+// threads competing with their targets.
+//
+// Each block becomes a standalone zstd or LZ4 frame, so the stock zstd and
+// lz4 tools can inflate the whole file. A seek table in the skippable frame
+// format of zstd's seekable format goes at the end, which lets
+// CompressedDumpReader inflate only the blocks holding a given range.
+class CompressedDumpOutput : public DumpOutput
+{
+public:
+    static const size_t kDefaultBlockSize = 4 * 1024 * 1024;
+
+    // Threads of the shared pool: half the hardware threads, at most this
+    static const unsigned int kMaxThreads = 4;
+
+    CompressedDumpOutput(DumpCodec codec, int level, size_t blockSize = kDefaultBlockSize);
+
+    virtual ~CompressedDumpOutput();
+
+public:
+    bool Open(std::wstring const & path);
+
+    virtual bool Write(void const * data, size_t size);
+
+    virtual bool Finish();
+
+    virtual uint64_t Size() const;
+
+private:
+    struct Block
+    {
+        std::vector<char> data;
+        std::vector<char> compressed;
+        bool done;
+        bool ok;
+    };
+
+    void SubmitBlock();
+
+    void Compress(std::shared_ptr<Block> block);
+
+    // Writes finished blocks in submission order
+    void WriteCompleted();
+
+    // Waits until no block of this output is left on the pool
+    void WaitForBlocks();
+
+    static ThreadPool & Pool();
+
+private:
+    DumpCodec m_codec;
+    int m_nLevel;
+    size_t m_nBlockSize;
+    size_t m_nMaxInFlight;
+    FILE * m_file;
+    uint64_t m_nSize;
+    std::vector<char> m_current;
+    std::deque<std::shared_ptr<Block> > m_blocks;
+    std::vector<std::pair<uint32_t, uint32_t> > m_seekTable;
+    std::mutex m_mutex;
+    std::mutex m_writeMutex;
+    std::condition_variable m_blockWritten;
+    size_t m_nPending; // blocks submitted to the pool and not done yet
+    bool m_bError;
+};
+
+// Random access to a dump written by CompressedDumpOutput
+class CompressedDumpReader
+{
+public:
+    CompressedDumpReader();
+
+    ~CompressedDumpReader();
+
+public:
+    bool Open(std::wstring const & path);
+
+    // Reads uncompressed bytes, inflating only the blocks they live in
+    bool Read(uint64_t offset, void * data, size_t size);
+
+    uint64_t Size() const;
+
+    DumpCodec Codec() const;
+
+private:
+    bool LoadBlock(size_t index);
+
+private:
+    struct Frame
+    {
+        uint64_t compressedOffset;
+        uint32_t compressedSize;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    FILE * m_file;
+    DumpCodec m_codec;
+    std::vector<Frame> m_frames;
+    size_t m_nCached;
+    std::vector<char> m_cache;
+    std::vector<char> m_compressed;
+};
+
+// Opens a plain or compressed output for a dump, returns nullptr on failure
+DumpOutput * OpenDumpOutput(std::wstring const & path, DumpCodec codec, int level);
+
+// Compresses in into one standalone zstd or LZ4 frame
+bool CompressBlock(DumpCodec codec, int level, std::vector<char> const & in, std::vector<char> & out);
+
+// Inflates a frame of CompressBlock, out has to be sized to the original
+// length
+bool DecompressBlock(DumpCodec codec, std::vector<char> const & in, std::vector<char> & out);
+
+// Compresses an existing dump file
+bool CompressDump(std::wstring const & input, std::wstring const & output, DumpCodec codec, int level);
+
+// Inflates a compressed dump into a plain MDMP file
+bool DecompressDump(std::wstring const & input, std::wstring const & output);
+
+#endif // DUMPCOMPRESSION_H
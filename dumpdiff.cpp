@@ -0,0 +1,297 @@
+#include "dumpdiff.h"
+#include "dumpoutput.h"
+#include "dumpreader.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const uint64_t kComparePageSize = 4096;
+
+// Pages compared by one task
+const uint64_t kCompareChunkSize = 16 * 1024 * 1024;
+
+// Label of the addresses from start to end
+struct LabeledRange
+{
+    uint64_t start;
+    uint64_t end;
+    size_t label;
+
+    bool operator<(LabeledRange const & o) const
+    {
+        return start < o.start;
+    }
+};
+
+struct LabelStats
+{
+    uint64_t before;
+    uint64_t after;
+    uint64_t changed;
+};
+
+class Labels
+{
+public:
+    size_t Add(std::wstring const & name)
+    {
+        std::map<std::wstring, size_t>::const_iterator it = m_index.find(name);
+        if (it != m_index.end())
+            return it->second;
+        m_index[name] = m_names.size();
+        m_names.push_back(name);
+        return m_names.size() - 1;
+    }
+
+    std::wstring const & Name(size_t label) const
+    {
+        return m_names[label];
+    }
+
+    size_t Count() const
+    {
+        return m_names.size();
+    }
+
+private:
+    std::vector<std::wstring> m_names;
+    std::map<std::wstring, size_t> m_index;
+};
+
+// Labels memory by mapping name from the Linux maps stream, or by module
+// for dumps that don't have it
+void LabelMemory(DumpReader const & reader, Labels & labels, std::vector<LabeledRange> & ranges)
+{
+    MDRawDirectory const * maps = reader.FindStream(MD_LINUX_MAPS);
+    char const * text = reader.StreamData(maps);
+    if (text) {
+        std::string lines(text, maps->location.data_size);
+        size_t pos = 0;
+        while (pos < lines.size()) {
+            size_t eol = lines.find('\n', pos);
+            if (eol == std::string::npos)
+                eol = lines.size();
+            std::string line = lines.substr(pos, eol - pos);
+            pos = eol + 1;
+            unsigned long long start = 0;
+            unsigned long long end = 0;
+            int nameOffset = 0;
+            if (sscanf(line.c_str(), "%llx-%llx %*s %*s %*s %*s %n", &start, &end, &nameOffset) < 2)
+                continue;
+            std::string name = nameOffset > 0 ? line.substr(nameOffset) : std::string();
+            if (name.empty())
+                name = "[anon]";
+            LabeledRange r = { start, end, labels.Add(WidenPath(name)) };
+            ranges.push_back(r);
+        }
+    } else {
+        for (uint32_t i = 0; i < reader.ModuleCount(); ++i) {
+            MDRawModule const * module = reader.Module(i);
+            LabeledRange r = { module->base_of_image, module->base_of_image + module->size_of_image,
+                               labels.Add(reader.ModuleName(i)) };
+            ranges.push_back(r);
+        }
+    }
+    std::sort(ranges.begin(), ranges.end());
+}
+
+// Splits [start, end) at label boundaries and calls visit(start, end, label)
+template <typename Visitor>
+void VisitLabeled(std::vector<LabeledRange> const & ranges, size_t unknown, uint64_t start, uint64_t end, Visitor visit)
+{
+    LabeledRange key = { start, 0, 0 };
+    std::vector<LabeledRange>::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), key);
+    if (it != ranges.begin() && (it - 1)->end > start)
+        --it;
+    while (start < end) {
+        if (it == ranges.end() || it->start >= end) {
+            visit(start, end, unknown);
+            return;
+        }
+        if (it->start > start) {
+            visit(start, it->start, unknown);
+            start = it->start;
+        }
+        uint64_t stop = std::min(end, it->end);
+        if (stop > start) {
+            visit(start, stop, it->label);
+            start = stop;
+        }
+        ++it;
+    }
+}
+
+// Number of bytes in pages that differ. memcmp is vectorized by the C
+// runtimes, and pages are read straight from the mappings.
+uint64_t CompareMemory(char const * a, char const * b, uint64_t size)
+{
+    uint64_t changed = 0;
+    for (uint64_t off = 0; off < size; off += kComparePageSize) {
+        size_t n = size_t(std::min(kComparePageSize, size - off));
+        if (memcmp(a + off, b + off, n) != 0)
+            changed += n;
+    }
+    return changed;
+}
+
+struct CompareTask
+{
+    size_t label;
+    char const * a;
+    char const * b;
+    uint64_t size;
+    uint64_t changed;
+};
+
+bool LargerChange(std::pair<size_t, LabelStats> const & a, std::pair<size_t, LabelStats> const & b)
+{
+    long long da = llabs(static_cast<long long>(a.second.after - a.second.before));
+    long long db = llabs(static_cast<long long>(b.second.after - b.second.before));
+    if (da != db)
+        return da > db;
+    return a.second.changed > b.second.changed;
+}
+
+bool DiffPair(DumpReader const & before, DumpReader const & after, ThreadPool & pool)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    // Labels come from the later dump, mappings gone since the earlier one
+    // are labeled from the earlier dump.
+    Labels labels;
+    std::vector<LabeledRange> afterLabels;
+    std::vector<LabeledRange> beforeLabels;
+    LabelMemory(after, labels, afterLabels);
+    LabelMemory(before, labels, beforeLabels);
+    size_t unknown = labels.Add(L"[unknown]");
+
+    std::vector<LabelStats> stats(labels.Count());
+    memset(&stats[0], 0, stats.size() * sizeof(LabelStats));
+    std::vector<CompareTask> tasks;
+
+    // Walk both sorted range lists at once, every piece of memory is in
+    // the earlier dump only, the later dump only, or both
+    std::vector<DumpMemoryRange> const & a = before.MemoryRanges();
+    std::vector<DumpMemoryRange> const & b = after.MemoryRanges();
+    size_t i = 0;
+    size_t j = 0;
+    uint64_t address = 0;
+    while (i < a.size() || j < b.size()) {
+        bool inA = i < a.size() && a[i].address <= address && address < a[i].address + a[i].size;
+        bool inB = j < b.size() && b[j].address <= address && address < b[j].address + b[j].size;
+        if (!inA && !inB) {
+            uint64_t next = ~uint64_t(0);
+            if (i < a.size())
+                next = std::min(next, std::max(address, a[i].address));
+            if (j < b.size())
+                next = std::min(next, std::max(address, b[j].address));
+            address = next;
+            continue;
+        }
+        // Stop at the next point where either list starts or ends a range
+        uint64_t end = ~uint64_t(0);
+        if (i < a.size())
+            end = std::min(end, inA ? a[i].address + a[i].size : a[i].address);
+        if (j < b.size())
+            end = std::min(end, inB ? b[j].address + b[j].size : b[j].address);
+
+        if (inA && inB) {
+            char const * pa = before.Data(a[i].offset + (address - a[i].address), end - address);
+            char const * pb = after.Data(b[j].offset + (address - b[j].address), end - address);
+            VisitLabeled(afterLabels, unknown, address, end, [&](uint64_t from, uint64_t to, size_t label) {
+                stats[label].before += to - from;
+                stats[label].after += to - from;
+                for (uint64_t chunk = from; chunk < to; chunk += kCompareChunkSize) {
+                    CompareTask task = { label, pa + (chunk - address), pb + (chunk - address),
+                                         std::min(kCompareChunkSize, to - chunk), 0 };
+                    tasks.push_back(task);
+                }
+            });
+        } else if (inA) {
+            VisitLabeled(beforeLabels, unknown, address, end, [&](uint64_t from, uint64_t to, size_t label) {
+                stats[label].before += to - from;
+            });
+        } else {
+            VisitLabeled(afterLabels, unknown, address, end, [&](uint64_t from, uint64_t to, size_t label) {
+                stats[label].after += to - from;
+            });
+        }
+
+        address = end;
+        if (i < a.size() && address >= a[i].address + a[i].size)
+            ++i;
+        if (j < b.size() && address >= b[j].address + b[j].size)
+            ++j;
+    }
+
+    uint64_t compared = 0;
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        CompareTask * task = &tasks[t];
+        compared += task->size;
+        pool.Submit([task]() { task->changed = CompareMemory(task->a, task->b, task->size); });
+    }
+    pool.Wait();
+    for (size_t t = 0; t < tasks.size(); ++t)
+        stats[tasks[t].label].changed += tasks[t].changed;
+
+    std::vector<std::pair<size_t, LabelStats> > rows;
+    LabelStats total = { 0, 0, 0 };
+    for (size_t l = 0; l < stats.size(); ++l) {
+        total.before += stats[l].before;
+        total.after += stats[l].after;
+        total.changed += stats[l].changed;
+        if (stats[l].before != stats[l].after || stats[l].changed)
+            rows.push_back(std::make_pair(l, stats[l]));
+    }
+    std::sort(rows.begin(), rows.end(), LargerChange);
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    wprintf(L"%14ls %14ls %14ls %14ls  %ls\n", L"before", L"after", L"delta", L"changed", L"mapping");
+    for (size_t r = 0; r < rows.size(); ++r) {
+        LabelStats const & s = rows[r].second;
+        wprintf(L"%14llu %14llu %+14lld %14llu  %ls\n", static_cast<unsigned long long>(s.before),
+                static_cast<unsigned long long>(s.after), static_cast<long long>(s.after - s.before),
+                static_cast<unsigned long long>(s.changed), labels.Name(rows[r].first).c_str());
+    }
+    wprintf(L"%14llu %14llu %+14lld %14llu  total\n", static_cast<unsigned long long>(total.before),
+            static_cast<unsigned long long>(total.after), static_cast<long long>(total.after - total.before),
+            static_cast<unsigned long long>(total.changed));
+    wprintf(L"Compared %llu bytes in %.3f s, %.2f GB/s\n", static_cast<unsigned long long>(compared),
+            seconds, seconds > 0 ? compared / seconds / 1e9 : 0.0);
+    return true;
+}
+
+} // namespace
+
+bool DiffDumps(std::vector<std::wstring> const & paths, unsigned int threads)
+{
+    if (paths.size() < 2)
+        return false;
+
+    std::vector<std::unique_ptr<DumpReader> > readers;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        readers.push_back(std::unique_ptr<DumpReader>(new DumpReader()));
+        if (!readers.back()->Open(paths[i])) {
+            wprintf(L"%ls is not a minidump\n", paths[i].c_str());
+            return false;
+        }
+    }
+
+    ThreadPool pool(threads);
+    for (size_t i = 1; i < readers.size(); ++i) {
+        wprintf(L"%ls -> %ls\n", paths[i - 1].c_str(), paths[i].c_str());
+        if (!DiffPair(*readers[i - 1], *readers[i], pool))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef DUMPDIFF_H
+#define DUMPDIFF_H
+
+#include <string>
+#include <vector>
+
+// Compares the memory of consecutive dumps of a process and prints which
+// mappings and modules grew, shrank or changed.
+//
+// Memory is labeled with the mapping names of the dump's Linux maps
+// stream, or with the module list for dumps without one. Pages held by
+// both dumps are compared in place through the mappings, split in chunks
+// across threads (0 uses one per hardware thread).
+bool DiffDumps(std::vector<std::wstring> const & paths, unsigned int threads);
+
+#endif // DUMPDIFF_H
@@ -0,0 +1,119 @@
+#include "dumpoutput.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#include <stdlib.h>
+#include <wchar.h>
+
+#ifndef _WIN32
+std::string NarrowPath(std::wstring const & path)
+{
+    size_t n = wcstombs(nullptr, path.c_str(), 0);
+    if (n == size_t(-1))
+        return std::string(path.begin(), path.end());
+    std::string narrow(n, '\0');
+    wcstombs(&narrow[0], path.c_str(), narrow.size());
+    return narrow;
+}
+#endif
+
+std::wstring WidenPath(std::string const & path)
+{
+#ifdef _WIN32
+    int n = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path.c_str(), int(path.size()), nullptr, 0);
+    if (n <= 0)
+        return std::wstring(path.begin(), path.end());
+    std::wstring wide(n, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), int(path.size()), &wide[0], n);
+    return wide;
+#else
+    size_t n = mbstowcs(nullptr, path.c_str(), 0);
+    if (n == size_t(-1))
+        return std::wstring(path.begin(), path.end());
+    std::wstring wide(n, L'\0');
+    mbstowcs(&wide[0], path.c_str(), n);
+    return wide;
+#endif
+}
+
+FILE * OpenDumpFile(std::wstring const & path, const wchar_t * mode)
+{
+#ifdef _WIN32
+    return _wfopen(path.c_str(), mode);
+#else
+    std::string narrowMode(mode, mode + wcslen(mode));
+    return fopen(NarrowPath(path).c_str(), narrowMode.c_str());
+#endif
+}
+
+bool SeekDumpFile(FILE * file, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+bool DumpOutput::Skip(uint64_t size)
+{
+    static const char zeros[65536] = {0};
+    while (size) {
+        size_t n = size < sizeof(zeros) ? size_t(size) : sizeof(zeros);
+        if (!Write(zeros, n))
+            return false;
+        size -= n;
+    }
+    return true;
+}
+
+FileDumpOutput::FileDumpOutput()
+    : m_file(nullptr)
+    , m_nSize(0)
+{
+}
+
+FileDumpOutput::~FileDumpOutput()
+{
+    if (m_file)
+        fclose(m_file);
+}
+
+bool FileDumpOutput::Open(std::wstring const & path)
+{
+    m_file = OpenDumpFile(path, L"wb");
+    if (m_file == nullptr)
+        return false;
+    setvbuf(m_file, nullptr, _IOFBF, 1024 * 1024);
+    return true;
+}
+
+bool FileDumpOutput::Write(void const * data, size_t size)
+{
+    if (fwrite(data, 1, size, m_file) != size)
+        return false;
+    m_nSize += size;
+    return true;
+}
+
+bool FileDumpOutput::Skip(uint64_t size)
+{
+    if (fflush(m_file) != 0 || !SeekDumpFile(m_file, m_nSize + size))
+        return false;
+    m_nSize += size;
+    return true;
+}
+
+bool FileDumpOutput::Finish()
+{
+    bool ok = fclose(m_file) == 0;
+    m_file = nullptr;
+    return ok;
+}
+
+uint64_t FileDumpOutput::Size() const
+{
+    return m_nSize;
+}
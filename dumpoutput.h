@@ -0,0 +1,69 @@
+#ifndef DUMPOUTPUT_H
+#define DUMPOUTPUT_H
+
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
+
+// Opens a file with a wide path on all platforms
+FILE * OpenDumpFile(std::wstring const & path, const wchar_t * mode);
+
+// Seeks with 64 bit offsets on all platforms
+bool SeekDumpFile(FILE * file, uint64_t offset);
+
+#ifndef _WIN32
+// Converts a wide path to the multibyte encoding of the current locale
+std::string NarrowPath(std::wstring const & path);
+#endif
+
+// Converts a path, or any text taken from the system, from the multibyte
+// encoding of the current locale, or from UTF-8 on Windows. Bytes that
+// don't decode are widened one by one.
+std::wstring WidenPath(std::string const & path);
+
+// Sequential sink for the bytes of a dump
+class DumpOutput
+{
+public:
+    virtual ~DumpOutput() {}
+
+public:
+    virtual bool Write(void const * data, size_t size) = 0;
+
+    // Writes size zero bytes, for space reserved for data that never came
+    virtual bool Skip(uint64_t size);
+
+    // Flushes everything and closes the output, returns false on any error
+    virtual bool Finish() = 0;
+
+    // Bytes written so far, before any compression
+    virtual uint64_t Size() const = 0;
+};
+
+// Writes the dump as is
+class FileDumpOutput : public DumpOutput
+{
+public:
+    FileDumpOutput();
+
+    virtual ~FileDumpOutput();
+
+public:
+    bool Open(std::wstring const & path);
+
+    virtual bool Write(void const * data, size_t size);
+
+    // Seeks over the zeros, which leaves a hole in the file where the file
+    // system supports it
+    virtual bool Skip(uint64_t size);
+
+    virtual bool Finish();
+
+    virtual uint64_t Size() const;
+
+private:
+    FILE * m_file;
+    uint64_t m_nSize;
+};
+
+#endif // DUMPOUTPUT_H
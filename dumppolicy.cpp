@@ -0,0 +1,243 @@
+#include "dumppolicy.h"
+#include "dumpoutput.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+namespace {
+
+const struct { const wchar_t * name; unsigned int kinds; } kKindNames[] = {
+    { L"image", RegionImage },
+    { L"file", RegionFile },
+    { L"anon", RegionAnonymous },
+    { L"heap", RegionHeap },
+    { L"stack", RegionStack },
+    { L"shared", RegionShared },
+    { L"all", 0 },
+};
+
+bool ParseSize(std::wstring const & text, uint64_t & size)
+{
+    wchar_t * end = nullptr;
+    size = wcstoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+        return false;
+    switch (*end) {
+    case L'G': case L'g': size <<= 10; // fall through
+    case L'M': case L'm': size <<= 10; // fall through
+    case L'K': case L'k': size <<= 10; ++end;
+    }
+    return *end == 0;
+}
+
+// Splits at blanks
+std::vector<std::wstring> SplitWords(std::wstring const & line)
+{
+    std::vector<std::wstring> words;
+    size_t pos = 0;
+    for (;;) {
+        pos = line.find_first_not_of(L" \t\r", pos);
+        if (pos == std::wstring::npos)
+            break;
+        size_t end = line.find_first_of(L" \t\r", pos);
+        if (end == std::wstring::npos)
+            end = line.size();
+        words.push_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+    return words;
+}
+
+bool MatchesAt(const wchar_t * pattern, const wchar_t * text)
+{
+    // Backtracks to the last * only, which is enough for glob matching
+    const wchar_t * star = nullptr;
+    const wchar_t * resume = nullptr;
+    while (*text) {
+        if (*pattern == L'*') {
+            star = pattern++;
+            resume = text;
+        } else if (*pattern == L'?' || *pattern == *text) {
+            ++pattern;
+            ++text;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == L'*')
+        ++pattern;
+    return *pattern == 0;
+}
+
+} // namespace
+
+DumpPolicy::DumpPolicy()
+    : m_nRegisterWindow(0)
+{
+}
+
+bool DumpPolicy::Parse(std::wstring const & text, std::wstring & error)
+{
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t end = text.find_first_of(L";\n", pos);
+        if (end == std::wstring::npos)
+            end = text.size();
+        std::wstring line = text.substr(pos, end - pos);
+        pos = end + 1;
+        size_t comment = line.find(L'#');
+        if (comment != std::wstring::npos)
+            line.resize(comment);
+        if (!ParseRule(line, error))
+            return false;
+    }
+    return true;
+}
+
+bool DumpPolicy::Load(std::wstring const & path, std::wstring & error)
+{
+    FILE * file = OpenDumpFile(path, L"rb");
+    if (file == nullptr) {
+        error = L"Couldn't open " + path;
+        return false;
+    }
+    std::string bytes;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.append(buffer, n);
+    fclose(file);
+
+    std::wstring text(bytes.size() + 1, 0);
+    size_t length = mbstowcs(&text[0], bytes.c_str(), text.size());
+    if (length == size_t(-1)) {
+        error = L"Couldn't decode " + path;
+        return false;
+    }
+    text.resize(length);
+    return Parse(text, error);
+}
+
+bool DumpPolicy::ParseRule(std::wstring const & line, std::wstring & error)
+{
+    std::vector<std::wstring> words = SplitWords(line);
+    if (words.empty())
+        return true;
+    error = L"Bad memory rule: " + line;
+    if (words[0] != L"include" && words[0] != L"exclude")
+        return false;
+
+    if (words.size() > 1 && words[1] == L"registers") {
+        if (words[0] != L"include" || words.size() != 3 || !ParseSize(words[2], m_nRegisterWindow))
+            return false;
+        error.clear();
+        return true;
+    }
+
+    Rule rule;
+    rule.include = words[0] == L"include";
+    rule.kinds = 0;
+    rule.prot[0] = rule.prot[1] = rule.prot[2] = '?';
+    rule.minSize = 0;
+    rule.maxSize = 0;
+    for (size_t i = 1; i < words.size(); ++i) {
+        std::wstring const & word = words[i];
+        size_t equals = word.find(L'=');
+        std::wstring key = word.substr(0, equals);
+        std::wstring value = equals == std::wstring::npos ? std::wstring() : word.substr(equals + 1);
+        if (equals == std::wstring::npos) {
+            size_t k = 0;
+            while (k < sizeof(kKindNames) / sizeof(kKindNames[0]) && word != kKindNames[k].name)
+                ++k;
+            if (k == sizeof(kKindNames) / sizeof(kKindNames[0]))
+                return false;
+            rule.kinds |= kKindNames[k].kinds;
+        } else if (key == L"prot") {
+            const wchar_t letters[] = L"rwx";
+            if (value.size() != 3)
+                return false;
+            for (int p = 0; p < 3; ++p) {
+                if (value[p] != letters[p] && value[p] != L'-' && value[p] != L'?')
+                    return false;
+                rule.prot[p] = char(value[p]);
+            }
+        } else if (key == L"file") {
+            rule.file = value;
+        } else if (key == L"module") {
+            rule.module = value;
+        } else if (key == L"min") {
+            if (!ParseSize(value, rule.minSize))
+                return false;
+        } else if (key == L"max") {
+            if (!ParseSize(value, rule.maxSize))
+                return false;
+        } else {
+            return false;
+        }
+    }
+    m_rules.push_back(rule);
+    error.clear();
+    return true;
+}
+
+bool DumpPolicy::IsEmpty() const
+{
+    return m_rules.empty() && m_nRegisterWindow == 0;
+}
+
+PolicyDecision DumpPolicy::Decide(DumpRegion const & region) const
+{
+    for (size_t i = 0; i < m_rules.size(); ++i) {
+        if (Matches(m_rules[i], region))
+            return m_rules[i].include ? PolicyInclude : PolicyExclude;
+    }
+    return PolicyNoMatch;
+}
+
+uint64_t DumpPolicy::RegisterWindow() const
+{
+    return m_nRegisterWindow;
+}
+
+void DumpPolicy::WindowAround(uint64_t value, uint64_t start, uint64_t end, uint64_t pageSize,
+                              uint64_t & windowStart, uint64_t & windowSize) const
+{
+    uint64_t half = m_nRegisterWindow / 2;
+    uint64_t from = value - start > half ? value - half : start;
+    uint64_t to = end - value > half ? value + half : end;
+    // start and end are page aligned, so rounding stays within them
+    from &= ~(pageSize - 1);
+    to = (to + pageSize - 1) & ~(pageSize - 1);
+    windowStart = from;
+    windowSize = to > from ? to - from : 0;
+}
+
+bool DumpPolicy::MatchesGlob(std::wstring const & pattern, std::wstring const & path)
+{
+    if (MatchesAt(pattern.c_str(), path.c_str()))
+        return true;
+    size_t slash = path.find_last_of(L"/\\");
+    return slash != std::wstring::npos && MatchesAt(pattern.c_str(), path.c_str() + slash + 1);
+}
+
+bool DumpPolicy::Matches(Rule const & rule, DumpRegion const & region)
+{
+    if (rule.kinds && (rule.kinds & region.kinds) == 0)
+        return false;
+    const bool prot[3] = { region.readable, region.writable, region.executable };
+    for (int p = 0; p < 3; ++p) {
+        if ((rule.prot[p] == '-' && prot[p]) || (rule.prot[p] != '-' && rule.prot[p] != '?' && !prot[p]))
+            return false;
+    }
+    if (region.size < rule.minSize || (rule.maxSize && region.size > rule.maxSize))
+        return false;
+    if (!rule.file.empty() && (region.path.empty() || !MatchesGlob(rule.file, region.path)))
+        return false;
+    if (!rule.module.empty() && (region.module.empty() || !MatchesGlob(rule.module, region.module)))
+        return false;
+    return true;
+}
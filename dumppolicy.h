@@ -0,0 +1,112 @@
+#ifndef DUMPPOLICY_H
+#define DUMPPOLICY_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// What a region of target memory holds, several may apply
+enum RegionKind
+{
+    RegionImage = 1,      // mapped executable or library
+    RegionFile = 2,       // backed by a file, images included
+    RegionAnonymous = 4,  // not backed by a file
+    RegionHeap = 8,       // process heap
+    RegionStack = 16,     // the used part of a thread's stack, see DumpPolicy
+    RegionShared = 32     // shared with other processes
+};
+
+// A region of target memory as both backends describe it
+struct DumpRegion
+{
+    uint64_t base;
+    uint64_t size;
+    unsigned int kinds; // RegionKind flags
+    bool readable;
+    bool writable;
+    bool executable;
+    std::wstring path;   // backing file, empty for anonymous memory
+    std::wstring module; // image the region belongs to, see Parse
+};
+
+enum PolicyDecision
+{
+    PolicyNoMatch, // no rule applies, the backend's default decides
+    PolicyInclude,
+    PolicyExclude
+};
+
+// Decides which memory goes into a dump.
+//
+// Rules are read one per line or separated by ';', the first rule matching
+// a region decides, regions no rule matches are left to the backend:
+//
+//     include|exclude [kind...] [prot=rwx] [file=glob] [module=glob]
+//                     [min=size] [max=size]
+//     include registers <size>
+//
+// kind is image, file, anon, heap, stack, shared or all, a region needs one
+// of them. stack matches only the used part of a thread's stack, from
+// just below its stack pointer to the top of the mapping, the rest of the
+// mapping is an ordinary region. prot gives r, w, x, - (must not) or ?
+// (either) per permission. Globs match the full path or the file name,
+// with * and ?. A module owns its image mappings and the anonymous memory
+// mapped right behind them, where its uninitialized data lives. Sizes take
+// K, M or G. The registers rule adds size bytes centered on every register
+// value that points into readable memory. # starts a comment.
+//
+//     include stack
+//     include registers 64K
+//     exclude file prot=r-?
+//     include heap anon module=libfoo*
+//     exclude all
+class DumpPolicy
+{
+public:
+    DumpPolicy();
+
+public:
+    // Adds the rules in text, returns false and describes the first bad
+    // rule in error
+    bool Parse(std::wstring const & text, std::wstring & error);
+
+    // Parses the rules of a file
+    bool Load(std::wstring const & path, std::wstring & error);
+
+    bool IsEmpty() const;
+
+    PolicyDecision Decide(DumpRegion const & region) const;
+
+    // Bytes to include around register values, 0 for none
+    uint64_t RegisterWindow() const;
+
+    // Pieces of the window around value, clipped to [start, end) and
+    // aligned to pageSize. size is 0 if there is none.
+    void WindowAround(uint64_t value, uint64_t start, uint64_t end, uint64_t pageSize,
+                      uint64_t & windowStart, uint64_t & windowSize) const;
+
+    // Whether the file name or full path matches a * and ? pattern
+    static bool MatchesGlob(std::wstring const & pattern, std::wstring const & path);
+
+private:
+    struct Rule
+    {
+        bool include;
+        unsigned int kinds; // 0 for any
+        char prot[3];       // 'r' / 'w' / 'x' required, '-' forbidden, '?' either
+        std::wstring file;
+        std::wstring module;
+        uint64_t minSize;
+        uint64_t maxSize;   // 0 for no limit
+    };
+
+    bool ParseRule(std::wstring const & line, std::wstring & error);
+
+    static bool Matches(Rule const & rule, DumpRegion const & region);
+
+private:
+    std::vector<Rule> m_rules;
+    uint64_t m_nRegisterWindow;
+};
+
+#endif // DUMPPOLICY_H
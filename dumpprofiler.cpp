@@ -0,0 +1,323 @@
+#include "dumpprofiler.h"
+#include "dumpoutput.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const char * const kPhaseNames[PhaseCount] = {
+    "dump",
+    "load dbghelp",
+    "privileges",
+    "create file",
+    "open process",
+    "snapshot",
+    "thread",
+    "module",
+    "changed pages",
+    "write",
+    "memory",
+    "fixups",
+    "flush",
+};
+
+std::atomic<unsigned int> s_nextThread(1);
+
+// Small stable number of the calling thread, for the trace's tid
+unsigned int CurrentThread()
+{
+    static thread_local unsigned int thread = 0;
+    if (thread == 0)
+        thread = s_nextThread++;
+    return thread;
+}
+
+template <typename Char>
+const Char * LastComponent(const Char * name)
+{
+    const Char * last = name;
+    for (const Char * p = name; *p; ++p) {
+        if ((*p == '/' || *p == '\\') && p[1])
+            last = p + 1;
+    }
+    return last;
+}
+
+// Copies a UTF-8 name, cutting it at a character boundary
+void CopyName(char * out, size_t size, const char * name)
+{
+    size_t length = strlen(name);
+    if (length >= size) {
+        length = size - 1;
+        while (length && (static_cast<unsigned char>(name[length]) & 0xc0) == 0x80)
+            --length;
+    }
+    memcpy(out, name, length);
+    out[length] = 0;
+}
+
+void CopyName(char * out, size_t size, const wchar_t * name)
+{
+    size_t pos = 0;
+    for (; *name; ++name) {
+        unsigned long c = static_cast<unsigned long>(*name);
+        if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00 && name[1] >= 0xdc00 && name[1] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (static_cast<unsigned long>(name[1]) - 0xdc00);
+            ++name;
+        } else if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+            c = 0xfffd;
+        }
+        char utf8[4];
+        size_t n;
+        if (c < 0x80) {
+            utf8[0] = char(c);
+            n = 1;
+        } else if (c < 0x800) {
+            utf8[0] = char(0xc0 | (c >> 6));
+            utf8[1] = char(0x80 | (c & 0x3f));
+            n = 2;
+        } else if (c < 0x10000) {
+            utf8[0] = char(0xe0 | (c >> 12));
+            utf8[1] = char(0x80 | ((c >> 6) & 0x3f));
+            utf8[2] = char(0x80 | (c & 0x3f));
+            n = 3;
+        } else {
+            utf8[0] = char(0xf0 | (c >> 18));
+            utf8[1] = char(0x80 | ((c >> 12) & 0x3f));
+            utf8[2] = char(0x80 | ((c >> 6) & 0x3f));
+            utf8[3] = char(0x80 | (c & 0x3f));
+            n = 4;
+        }
+        if (pos + n >= size)
+            break;
+        memcpy(out + pos, utf8, n);
+        pos += n;
+    }
+    out[pos] = 0;
+}
+
+void WriteJsonString(FILE * file, const char * text)
+{
+    fputc('"', file);
+    for (; *text; ++text) {
+        unsigned char c = static_cast<unsigned char>(*text);
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+double Milliseconds(long long nanoseconds)
+{
+    return nanoseconds / 1e6;
+}
+
+double MegabytesPerSecond(unsigned long long bytes, long long nanoseconds)
+{
+    return nanoseconds > 0 ? bytes * 1e3 / nanoseconds : 0.0;
+}
+
+} // namespace
+
+const char * DumpPhaseName(DumpPhase phase)
+{
+    return phase < PhaseCount ? kPhaseNames[phase] : "unknown";
+}
+
+DumpProfiler::DumpProfiler(size_t capacity)
+    : m_spans(capacity)
+    , m_nCount(0)
+    , m_nDropped(0)
+    , m_nOrigin(Now())
+{
+}
+
+long long DumpProfiler::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+DumpProfiler::Span * DumpProfiler::Claim()
+{
+    size_t index = m_nCount.fetch_add(1, std::memory_order_relaxed);
+    if (index >= m_spans.size()) {
+        m_nDropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &m_spans[index];
+}
+
+void DumpProfiler::Record(DumpPhase phase, int pid, long long start, long long end,
+                          unsigned long long bytes, const char * name)
+{
+    Span * span = Claim();
+    if (span == nullptr)
+        return;
+    span->start = start;
+    span->end = end;
+    span->bytes = bytes;
+    span->pid = pid;
+    span->thread = CurrentThread();
+    span->phase = static_cast<unsigned char>(phase);
+    span->name[0] = 0;
+    if (name)
+        CopyName(span->name, sizeof(span->name), LastComponent(name));
+}
+
+void DumpProfiler::Record(DumpPhase phase, int pid, long long start, long long end,
+                          unsigned long long bytes, const wchar_t * name)
+{
+    Span * span = Claim();
+    if (span == nullptr)
+        return;
+    span->start = start;
+    span->end = end;
+    span->bytes = bytes;
+    span->pid = pid;
+    span->thread = CurrentThread();
+    span->phase = static_cast<unsigned char>(phase);
+    span->name[0] = 0;
+    if (name)
+        CopyName(span->name, sizeof(span->name), LastComponent(name));
+}
+
+bool DumpProfiler::WriteTrace(std::wstring const & path) const
+{
+    FILE * file = OpenDumpFile(path, L"wb");
+    if (file == nullptr)
+        return false;
+
+    size_t count = Count();
+    std::vector<int> pids;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < count; ++i) {
+        Span const & span = m_spans[i];
+        const char * phase = DumpPhaseName(DumpPhase(span.phase));
+        fprintf(file, "{\"name\":");
+        WriteJsonString(file, span.name[0] ? span.name : phase);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"bytes\":%llu}},\n",
+                phase, (span.start - m_nOrigin) / 1e3, (span.end - span.start) / 1e3,
+                span.pid, span.thread, span.bytes);
+        pids.push_back(span.pid);
+    }
+    std::sort(pids.begin(), pids.end());
+    pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+    for (size_t i = 0; i < pids.size(); ++i)
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"target %d\"}},\n",
+                pids[i], pids[i]);
+    fprintf(file, "{\"name\":\"dropped_spans\",\"ph\":\"M\",\"pid\":0,\"args\":{\"count\":%llu}}\n]}\n",
+            static_cast<unsigned long long>(Dropped()));
+
+    bool ok = ferror(file) == 0;
+    if (fclose(file) != 0)
+        ok = false;
+    return ok;
+}
+
+void DumpProfiler::PrintSummary() const
+{
+    struct Total
+    {
+        size_t count;
+        long long time;
+        unsigned long long bytes;
+    };
+
+    size_t count = Count();
+    Total phases[PhaseCount];
+    memset(phases, 0, sizeof(phases));
+    std::vector<Span const *> modules;
+    std::vector<Span const *> dumps;
+    std::map<int, std::vector<long long> > targetPhases;
+    for (size_t i = 0; i < count; ++i) {
+        Span const & span = m_spans[i];
+        if (span.phase >= PhaseCount)
+            continue;
+        Total & total = phases[span.phase];
+        ++total.count;
+        total.time += span.end - span.start;
+        total.bytes += span.bytes;
+        if (span.phase == PhaseModule)
+            modules.push_back(&span);
+        else if (span.phase == PhaseDump)
+            dumps.push_back(&span);
+        std::vector<long long> & perPhase = targetPhases[span.pid];
+        perPhase.resize(PhaseCount);
+        perPhase[span.phase] += span.end - span.start;
+    }
+
+    long long dumpTime = phases[PhaseDump].time;
+    wprintf(L"%-14ls %8ls %10ls %6ls %14ls %10ls\n", L"phase", L"count", L"total ms", L"%", L"bytes", L"MB/s");
+    for (int i = 0; i < PhaseCount; ++i) {
+        Total const & total = phases[i];
+        if (total.count == 0)
+            continue;
+        wprintf(L"%-14hs %8zu %10.2f %6.1f %14llu %10.1f\n", DumpPhaseName(DumpPhase(i)), total.count,
+                Milliseconds(total.time), dumpTime ? total.time * 100.0 / dumpTime : 0.0, total.bytes,
+                MegabytesPerSecond(total.bytes, total.time));
+    }
+
+    // The slowest dumps with the phase they spent most of their time in
+    const size_t kTop = 10;
+    struct Slower
+    {
+        bool operator()(Span const * a, Span const * b) const
+        {
+            return a->end - a->start > b->end - b->start;
+        }
+    };
+    std::sort(dumps.begin(), dumps.end(), Slower());
+    if (!dumps.empty())
+        wprintf(L"\n%8ls %10ls %14ls %10ls  %ls\n", L"pid", L"ms", L"bytes", L"MB/s", L"slowest phase");
+    for (size_t i = 0; i < dumps.size() && i < kTop; ++i) {
+        Span const & span = *dumps[i];
+        std::vector<long long> const & perPhase = targetPhases[span.pid];
+        int slowest = PhaseDump + 1;
+        for (int j = slowest + 1; j < PhaseCount; ++j) {
+            if (perPhase[j] > perPhase[slowest])
+                slowest = j;
+        }
+        wprintf(L"%8d %10.2f %14llu %10.1f  %hs %.2f ms%ls\n", span.pid, Milliseconds(span.end - span.start),
+                span.bytes, MegabytesPerSecond(span.bytes, span.end - span.start),
+                DumpPhaseName(DumpPhase(slowest)), Milliseconds(perPhase[slowest]),
+                span.name[0] ? L" (failed)" : L"");
+    }
+
+    std::sort(modules.begin(), modules.end(), Slower());
+    if (!modules.empty())
+        wprintf(L"\n%8ls %10ls  %ls\n", L"pid", L"ms", L"slowest modules");
+    for (size_t i = 0; i < modules.size() && i < kTop; ++i) {
+        Span const & span = *modules[i];
+        wprintf(L"%8d %10.3f  %hs\n", span.pid, Milliseconds(span.end - span.start), span.name);
+    }
+
+    if (Dropped())
+        wprintf(L"\nDropped %zu spans, the profile buffer holds %zu\n", Dropped(), m_spans.size());
+}
+
+void DumpProfiler::Clear()
+{
+    m_nCount = 0;
+    m_nDropped = 0;
+}
+
+size_t DumpProfiler::Count() const
+{
+    return std::min(m_nCount.load(), m_spans.size());
+}
+
+size_t DumpProfiler::Dropped() const
+{
+    return m_nDropped;
+}
@@ -0,0 +1,87 @@
+#ifndef DUMPPROFILER_H
+#define DUMPPROFILER_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+enum DumpPhase
+{
+    PhaseDump,         // a whole CreateMiniDump call
+    PhaseLoadDbgHelp,
+    PhasePrivileges,
+    PhaseCreateFile,
+    PhaseOpenProcess,  // OpenProcess on Windows, stopping the threads on Linux
+    PhaseSnapshot,     // PssCaptureSnapshot on Windows, reading the memory map on Linux
+    PhaseThread,
+    PhaseModule,
+    PhaseChangedPages, // finding the pages of a delta dump
+    PhaseWrite,        // MiniDumpWriteDump on Windows, the metadata on Linux
+    PhaseMemory,
+    PhaseFixups,
+    PhaseFlush,        // closing and compressing the file
+    PhaseCount
+};
+
+const char * DumpPhaseName(DumpPhase phase);
+
+// Records where the time of dumps goes.
+//
+// Spans go into a buffer allocated up front, a slot is claimed with a
+// single atomic increment, so dump threads record without allocating or
+// locking. Spans past the capacity are counted and dropped. The trace and
+// summary are meant to be written while no dump is running.
+class DumpProfiler
+{
+public:
+    explicit DumpProfiler(size_t capacity = 65536);
+
+public:
+    // Steady clock nanoseconds
+    static long long Now();
+
+    // Records [start, end) of a phase of the dump of pid. Names are cut to
+    // their last path component.
+    void Record(DumpPhase phase, int pid, long long start, long long end,
+                unsigned long long bytes = 0, const char * name = nullptr);
+
+    void Record(DumpPhase phase, int pid, long long start, long long end,
+                unsigned long long bytes, const wchar_t * name);
+
+    // Writes all spans as Chrome trace events, for chrome://tracing or
+    // Perfetto
+    bool WriteTrace(std::wstring const & path) const;
+
+    // Prints time and throughput per phase, the slowest targets and the
+    // slowest modules
+    void PrintSummary() const;
+
+    void Clear();
+
+    size_t Count() const;
+
+    size_t Dropped() const;
+
+private:
+    struct Span
+    {
+        long long start;
+        long long end;
+        unsigned long long bytes;
+        int pid;
+        unsigned int thread;
+        unsigned char phase;
+        char name[39];
+    };
+
+    Span * Claim();
+
+private:
+    std::vector<Span> m_spans;
+    std::atomic<size_t> m_nCount;
+    std::atomic<size_t> m_nDropped;
+    long long m_nOrigin;
+};
+
+#endif // DUMPPROFILER_H
@@ -0,0 +1,384 @@
+#include "dumpreader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+bool AddressLess(DumpMemoryRange const & a, DumpMemoryRange const & b)
+{
+    return a.address < b.address;
+}
+
+void AppendPart(std::vector<DumpMemoryRange> & ranges, DumpMemoryRange const & from, uint64_t address, uint64_t end)
+{
+    DumpMemoryRange r = { address, end - address, from.offset + (address - from.address) };
+    ranges.push_back(r);
+}
+
+// Sorts ranges by address and trims overlaps, the range starting first wins
+void SortRanges(std::vector<DumpMemoryRange> & ranges)
+{
+    std::sort(ranges.begin(), ranges.end(), AddressLess);
+    std::vector<DumpMemoryRange> sorted;
+    sorted.reserve(ranges.size());
+    uint64_t covered = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        uint64_t address = std::max(ranges[i].address, covered);
+        uint64_t end = ranges[i].address + ranges[i].size;
+        if (address >= end)
+            continue;
+        AppendPart(sorted, ranges[i], address, end);
+        covered = end;
+    }
+    ranges.swap(sorted);
+}
+
+// Replaces the parts of base covered by top, both sorted without overlaps
+void OverlayRanges(std::vector<DumpMemoryRange> & base, std::vector<DumpMemoryRange> const & top)
+{
+    std::vector<DumpMemoryRange> merged;
+    merged.reserve(base.size() + top.size() * 2);
+    size_t t = 0;
+    for (size_t i = 0; i < base.size(); ++i) {
+        uint64_t address = base[i].address;
+        uint64_t end = base[i].address + base[i].size;
+        while (address < end) {
+            while (t < top.size() && top[t].address + top[t].size <= address)
+                ++t;
+            if (t == top.size() || top[t].address >= end) {
+                AppendPart(merged, base[i], address, end);
+                break;
+            }
+            if (top[t].address > address)
+                AppendPart(merged, base[i], address, top[t].address);
+            address = std::min(end, top[t].address + top[t].size);
+        }
+    }
+    merged.insert(merged.end(), top.begin(), top.end());
+    std::sort(merged.begin(), merged.end(), AddressLess);
+    base.swap(merged);
+}
+
+} // namespace
+
+DumpReader::DumpReader()
+    : m_header(nullptr)
+    , m_directory(nullptr)
+    , m_threadList(nullptr)
+    , m_moduleList(nullptr)
+{
+}
+
+bool DumpReader::Open(std::wstring const & path)
+{
+    m_header = nullptr;
+    m_directory = nullptr;
+    m_threadList = nullptr;
+    m_moduleList = nullptr;
+    m_memory.clear();
+    if (!m_file.Open(path))
+        return false;
+
+    m_header = At<MDRawHeader>(0);
+    if (m_header == nullptr || m_header->signature != MD_HEADER_SIGNATURE) {
+        m_header = nullptr;
+        return false;
+    }
+    m_directory = At<MDRawDirectory>(m_header->stream_directory_rva, m_header->stream_count);
+    if (m_directory == nullptr) {
+        m_header = nullptr;
+        return false;
+    }
+    m_threadList = FindStream(MD_THREAD_LIST_STREAM);
+    m_moduleList = FindStream(MD_MODULE_LIST_STREAM);
+    return IndexMemory();
+}
+
+bool DumpReader::IndexMemory()
+{
+    std::vector<DumpMemoryRange> fixups;
+    for (uint32_t i = 0; i < StreamCount(); ++i) {
+        MDRawDirectory const & dir = m_directory[i];
+        uint64_t rva = dir.location.rva;
+        switch (dir.stream_type) {
+        case MD_MEMORY_LIST_STREAM:
+            {
+                uint32_t const * count = At<uint32_t>(rva);
+                MDMemoryDescriptor const * ranges = count ? At<MDMemoryDescriptor>(rva + sizeof(*count), *count) : nullptr;
+                if (ranges == nullptr)
+                    return false;
+                for (uint32_t j = 0; j < *count; ++j) {
+                    DumpMemoryRange r = { ranges[j].start_of_memory_range, ranges[j].memory.data_size, ranges[j].memory.rva };
+                    if (Data(r.offset, r.size))
+                        m_memory.push_back(r);
+                }
+            }
+            break;
+        case MD_MEMORY_64_LIST_STREAM:
+        case MD_DUMPPER_PAGE_FIXUPS:
+            {
+                uint64_t const * head = At<uint64_t>(rva, 2);
+                MDMemoryDescriptor64 const * ranges = head ? At<MDMemoryDescriptor64>(rva + sizeof(uint64_t) * 2, head[0]) : nullptr;
+                if (ranges == nullptr)
+                    return false;
+                std::vector<DumpMemoryRange> & target = dir.stream_type == MD_DUMPPER_PAGE_FIXUPS ? fixups : m_memory;
+                uint64_t offset = head[1];
+                for (uint64_t j = 0; j < head[0]; ++j) {
+                    DumpMemoryRange r = { ranges[j].start_of_memory_range, ranges[j].data_size, offset };
+                    if (Data(r.offset, r.size))
+                        target.push_back(r);
+                    offset += ranges[j].data_size;
+                }
+            }
+            break;
+        }
+    }
+    SortRanges(m_memory);
+    if (!fixups.empty()) {
+        SortRanges(fixups);
+        OverlayRanges(m_memory, fixups);
+    }
+    return true;
+}
+
+MDRawHeader const * DumpReader::Header() const
+{
+    return m_header;
+}
+
+uint32_t DumpReader::StreamCount() const
+{
+    return m_header ? m_header->stream_count : 0;
+}
+
+MDRawDirectory const * DumpReader::Stream(uint32_t index) const
+{
+    return index < StreamCount() ? &m_directory[index] : nullptr;
+}
+
+MDRawDirectory const * DumpReader::FindStream(uint32_t type) const
+{
+    for (uint32_t i = 0; i < StreamCount(); ++i) {
+        if (m_directory[i].stream_type == type)
+            return &m_directory[i];
+    }
+    return nullptr;
+}
+
+char const * DumpReader::StreamData(MDRawDirectory const * stream) const
+{
+    return stream ? Data(stream->location.rva, stream->location.data_size) : nullptr;
+}
+
+uint32_t DumpReader::ThreadCount() const
+{
+    uint32_t const * count = m_threadList ? At<uint32_t>(m_threadList->location.rva) : nullptr;
+    if (count == nullptr || At<MDRawThread>(m_threadList->location.rva + sizeof(*count), *count) == nullptr)
+        return 0;
+    return *count;
+}
+
+MDRawThread const * DumpReader::Thread(uint32_t index) const
+{
+    if (index >= ThreadCount())
+        return nullptr;
+    return At<MDRawThread>(m_threadList->location.rva + sizeof(uint32_t)) + index;
+}
+
+char const * DumpReader::ThreadContext(uint32_t index, uint32_t & size) const
+{
+    MDRawThread const * thread = Thread(index);
+    size = thread ? thread->thread_context.data_size : 0;
+    return thread ? Data(thread->thread_context.rva, size) : nullptr;
+}
+
+char const * DumpReader::ThreadStack(uint32_t index, uint64_t & address, uint64_t & size) const
+{
+    MDRawThread const * thread = Thread(index);
+    address = 0;
+    size = 0;
+    if (thread == nullptr || thread->stack.memory.data_size == 0)
+        return nullptr;
+    address = thread->stack.start_of_memory_range;
+    size = thread->stack.memory.data_size;
+    return Data(thread->stack.memory.rva, size);
+}
+
+uint32_t DumpReader::ModuleCount() const
+{
+    uint32_t const * count = m_moduleList ? At<uint32_t>(m_moduleList->location.rva) : nullptr;
+    if (count == nullptr || At<MDRawModule>(m_moduleList->location.rva + sizeof(*count), *count) == nullptr)
+        return 0;
+    return *count;
+}
+
+MDRawModule const * DumpReader::Module(uint32_t index) const
+{
+    if (index >= ModuleCount())
+        return nullptr;
+    return At<MDRawModule>(m_moduleList->location.rva + sizeof(uint32_t)) + index;
+}
+
+std::wstring DumpReader::ModuleName(uint32_t index) const
+{
+    MDRawModule const * module = Module(index);
+    return module ? ReadString(module->module_name_rva) : std::wstring();
+}
+
+std::wstring DumpReader::ReadString(uint32_t rva) const
+{
+    uint32_t const * length = At<uint32_t>(rva);
+    uint16_t const * units = length ? At<uint16_t>(rva + sizeof(*length), *length / 2) : nullptr;
+    if (units == nullptr)
+        return std::wstring();
+    std::wstring str;
+    str.reserve(*length / 2);
+    for (uint32_t i = 0; i < *length / 2; ++i) {
+        uint32_t c = units[i];
+#ifndef _WIN32
+        // wchar_t holds whole code points outside of Windows
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < *length / 2
+                && units[i + 1] >= 0xdc00 && units[i + 1] < 0xe000)
+            c = 0x10000 + ((c - 0xd800) << 10) + (units[++i] - 0xdc00);
+#endif
+        str.push_back(wchar_t(c));
+    }
+    return str;
+}
+
+std::vector<DumpMemoryRange> const & DumpReader::MemoryRanges() const
+{
+    return m_memory;
+}
+
+DumpMemoryRange const * DumpReader::FindMemory(uint64_t address) const
+{
+    DumpMemoryRange key = { address, 0, 0 };
+    std::vector<DumpMemoryRange>::const_iterator it = std::upper_bound(m_memory.begin(), m_memory.end(), key, AddressLess);
+    if (it == m_memory.begin())
+        return nullptr;
+    --it;
+    return address - it->address < it->size ? &*it : nullptr;
+}
+
+uint64_t DumpReader::TranslateAddress(uint64_t address, uint64_t * available) const
+{
+    DumpMemoryRange const * range = FindMemory(address);
+    if (available)
+        *available = range ? range->size - (address - range->address) : 0;
+    return range ? range->offset + (address - range->address) : 0;
+}
+
+size_t DumpReader::ReadMemory(uint64_t address, void * buffer, size_t size) const
+{
+    char * out = static_cast<char *>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        uint64_t available = 0;
+        uint64_t offset = TranslateAddress(address + done, &available);
+        if (offset == 0)
+            break;
+        size_t n = size_t(std::min<uint64_t>(available, size - done));
+        memcpy(out + done, m_file.Data() + offset, n);
+        done += n;
+    }
+    return done;
+}
+
+char const * DumpReader::Data(uint64_t offset, uint64_t size) const
+{
+    if (m_file.Data() == nullptr || offset > m_file.Size() || size > m_file.Size() - offset)
+        return nullptr;
+    return m_file.Data() + offset;
+}
+
+uint64_t DumpReader::Size() const
+{
+    return m_file.Size();
+}
+
+bool InspectDump(std::wstring const & path, uint64_t address, size_t size)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    DumpReader reader;
+    if (!reader.Open(path)) {
+        wprintf(L"%ls is not a minidump\n", path.c_str());
+        return false;
+    }
+    Clock::time_point opened = Clock::now();
+
+    wprintf(L"%ls: %llu bytes, %u streams, opened in %.3f ms\n", path.c_str(),
+            static_cast<unsigned long long>(reader.Size()), reader.StreamCount(),
+            std::chrono::duration<double, std::milli>(opened - start).count());
+    for (uint32_t i = 0; i < reader.StreamCount(); ++i) {
+        MDRawDirectory const * stream = reader.Stream(i);
+        wprintf(L"  stream 0x%08x %10u bytes at %u\n", stream->stream_type,
+                stream->location.data_size, stream->location.rva);
+    }
+
+    wprintf(L"%u threads\n", reader.ThreadCount());
+    for (uint32_t i = 0; i < reader.ThreadCount(); ++i) {
+        uint64_t stackAddress = 0;
+        uint64_t stackSize = 0;
+        reader.ThreadStack(i, stackAddress, stackSize);
+        uint32_t contextSize = 0;
+        char const * context = reader.ThreadContext(i, contextSize);
+        unsigned long long ip = 0;
+        if (context && contextSize == sizeof(MDRawContextAMD64))
+            ip = reinterpret_cast<MDRawContextAMD64 const *>(context)->rip;
+        wprintf(L"  %8u  rip %016llx  stack %016llx %8llu bytes\n", reader.Thread(i)->thread_id, ip,
+                static_cast<unsigned long long>(stackAddress), static_cast<unsigned long long>(stackSize));
+    }
+
+    wprintf(L"%u modules\n", reader.ModuleCount());
+    for (uint32_t i = 0; i < reader.ModuleCount(); ++i) {
+        MDRawModule const * module = reader.Module(i);
+        wprintf(L"  %016llx %10u %ls\n", static_cast<unsigned long long>(module->base_of_image),
+                module->size_of_image, reader.ModuleName(i).c_str());
+    }
+
+    uint64_t total = 0;
+    std::vector<DumpMemoryRange> const & ranges = reader.MemoryRanges();
+    for (size_t i = 0; i < ranges.size(); ++i)
+        total += ranges[i].size;
+    wprintf(L"%d memory ranges, %llu bytes\n", int(ranges.size()), static_cast<unsigned long long>(total));
+
+    // Memory a dump budget left out
+    MDRawDirectory const * omittedStream = reader.FindStream(MD_DUMPPER_OMITTED_MEMORY);
+    char const * omittedData = omittedStream ? reader.StreamData(omittedStream) : nullptr;
+    if (omittedData && omittedStream->location.data_size >= sizeof(MDRawOmittedMemory)) {
+        MDRawOmittedMemory const * omitted = reinterpret_cast<MDRawOmittedMemory const *>(omittedData);
+        uint64_t count = std::min<uint64_t>(omitted->range_count,
+                (omittedStream->location.data_size - sizeof(MDRawOmittedMemory)) / sizeof(MDMemoryDescriptor64));
+        MDMemoryDescriptor64 const * descriptors = reinterpret_cast<MDMemoryDescriptor64 const *>(omitted + 1);
+        uint64_t omittedTotal = 0;
+        for (uint64_t i = 0; i < count; ++i)
+            omittedTotal += descriptors[i].data_size;
+        if (count || omitted->reasons)
+            wprintf(L"%llu memory ranges left out, %llu bytes:%ls%ls%ls%ls\n", static_cast<unsigned long long>(count),
+                    static_cast<unsigned long long>(omittedTotal),
+                    omitted->reasons & MD_OMITTED_WALL_TIME ? L" wall time" : L"",
+                    omitted->reasons & MD_OMITTED_BYTES ? L" size" : L"",
+                    omitted->reasons & MD_OMITTED_PAUSE_TIME ? L" pause time" : L"",
+                    omitted->reasons & MD_OMITTED_RVA_LIMIT ? L" 4 GB limit" : L"");
+    }
+
+    if (size) {
+        std::vector<unsigned char> bytes(size);
+        size_t n = reader.ReadMemory(address, &bytes[0], size);
+        for (size_t line = 0; line < n; line += 16) {
+            wprintf(L"%016llx ", static_cast<unsigned long long>(address + line));
+            for (size_t i = line; i < line + 16 && i < n; ++i)
+                wprintf(L" %02x", bytes[i]);
+            wprintf(L"\n");
+        }
+        if (n < size)
+            wprintf(L"%016llx not in dump\n", static_cast<unsigned long long>(address + n));
+    }
+    return true;
+}
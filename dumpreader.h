@@ -0,0 +1,111 @@
+#ifndef DUMPREADER_H
+#define DUMPREADER_H
+
+#include "mappedfile.h"
+#include "minidumpformat.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// A piece of target memory stored in the dump
+struct DumpMemoryRange
+{
+    uint64_t address;
+    uint64_t size;
+    uint64_t offset; // file offset of the first byte
+};
+
+// Reads MDMP files in place through a memory mapping.
+//
+// Open only validates the header, finds the well known streams in the
+// directory and sorts the memory descriptors, nothing else is read. Thread,
+// module and memory accessors return pointers into the mapping, so reading
+// one stack of a dump of many gigabytes touches just the pages holding it.
+//
+// Everything read from the file is bounds checked, accessors return
+// nullptr or an empty result for data that lies outside of it.
+class DumpReader
+{
+public:
+    DumpReader();
+
+public:
+    bool Open(std::wstring const & path);
+
+    MDRawHeader const * Header() const;
+
+    uint32_t StreamCount() const;
+
+    MDRawDirectory const * Stream(uint32_t index) const;
+
+    // First stream of the given type, nullptr if there is none
+    MDRawDirectory const * FindStream(uint32_t type) const;
+
+    // Contents of a stream, nullptr if it doesn't fit in the file
+    char const * StreamData(MDRawDirectory const * stream) const;
+
+    uint32_t ThreadCount() const;
+
+    MDRawThread const * Thread(uint32_t index) const;
+
+    // Register context of a thread, size receives its length
+    char const * ThreadContext(uint32_t index, uint32_t & size) const;
+
+    // Stack memory of a thread, nullptr if the dump has none
+    char const * ThreadStack(uint32_t index, uint64_t & address, uint64_t & size) const;
+
+    uint32_t ModuleCount() const;
+
+    MDRawModule const * Module(uint32_t index) const;
+
+    std::wstring ModuleName(uint32_t index) const;
+
+    // Decodes the MINIDUMP_STRING at rva
+    std::wstring ReadString(uint32_t rva) const;
+
+    // All memory in the dump sorted by address, without overlaps. Pages
+    // re-read by a low pause dump replace their copy in the memory64 list.
+    std::vector<DumpMemoryRange> const & MemoryRanges() const;
+
+    // Range holding address, nullptr if the dump doesn't have it
+    DumpMemoryRange const * FindMemory(uint64_t address) const;
+
+    // File offset of the byte at address, 0 if the dump doesn't have it.
+    // available receives how many bytes follow it in the same range.
+    uint64_t TranslateAddress(uint64_t address, uint64_t * available = nullptr) const;
+
+    // Copies target memory, stops at the first byte missing from the dump
+    // and returns the number of bytes copied
+    size_t ReadMemory(uint64_t address, void * buffer, size_t size) const;
+
+    // View of size bytes at offset, nullptr if they don't fit in the file
+    char const * Data(uint64_t offset, uint64_t size) const;
+
+    uint64_t Size() const;
+
+private:
+    bool IndexMemory();
+
+    template <typename T>
+    T const * At(uint64_t offset, uint64_t count = 1) const
+    {
+        if (count > ~uint64_t(0) / sizeof(T))
+            return nullptr;
+        return reinterpret_cast<T const *>(Data(offset, count * sizeof(T)));
+    }
+
+private:
+    MappedFile m_file;
+    MDRawHeader const * m_header;
+    MDRawDirectory const * m_directory;
+    MDRawDirectory const * m_threadList;
+    MDRawDirectory const * m_moduleList;
+    std::vector<DumpMemoryRange> m_memory;
+};
+
+// Prints the streams, threads, modules and memory of a dump, followed by a
+// hex dump of size bytes at address when size isn't 0
+bool InspectDump(std::wstring const & path, uint64_t address, size_t size);
+
+#endif // DUMPREADER_H
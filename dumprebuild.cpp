@@ -0,0 +1,386 @@
+#include "dumprebuild.h"
+#include "dumpoutput.h"
+#include "minidumpformat.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+bool ReadAt(FILE * file, uint64_t offset, void * data, size_t size)
+{
+    return SeekDumpFile(file, offset) && fread(data, 1, size, file) == size;
+}
+
+// A piece of memory stored in one of the input dumps
+struct Piece
+{
+    uint64_t address;
+    uint64_t size;
+    uint64_t offset;
+
+    bool operator<(Piece const & o) const
+    {
+        return address < o.address;
+    }
+};
+
+struct InputDump
+{
+    std::wstring path;
+    FILE * file;
+    MDRawHeader header;
+    std::vector<MDRawDirectory> directory;
+    MDRawDeltaInfo info;
+    std::vector<MDMemoryDescriptor64> layout;
+    std::vector<Piece> pieces;
+    std::vector<Piece> fixups;
+    uint32_t memory64Index;
+    uint64_t memory64Base;
+    bool hasFixups;
+    uint32_t fixupsIndex;
+    std::vector<char> omitted; // MD_DUMPPER_OMITTED_MEMORY stream, empty if none
+    uint32_t omittedIndex;
+
+    InputDump()
+        : file(nullptr)
+        , memory64Index(0)
+        , memory64Base(0)
+        , hasFixups(false)
+        , fixupsIndex(0)
+        , omittedIndex(0)
+    {
+    }
+};
+
+// Page size assumed for dumps without delta info, only sets how far apart
+// the rebuild looks for newer copies of memory.
+const uint32_t kDefaultPageSize = 4096;
+
+// Reads a memory64 style list: range count, data offset, ranges
+bool ReadMemory64List(InputDump & dump, MDLocationDescriptor const & loc, uint64_t & base,
+                      std::vector<MDMemoryDescriptor64> & ranges, std::vector<Piece> & pieces)
+{
+    uint64_t head[2];
+    if (!ReadAt(dump.file, loc.rva, head, sizeof(head))
+            || loc.data_size < sizeof(head) + head[0] * sizeof(MDMemoryDescriptor64))
+        return false;
+    ranges.resize(static_cast<size_t>(head[0]));
+    if (!ranges.empty() && !ReadAt(dump.file, loc.rva + sizeof(head), &ranges[0],
+                                   ranges.size() * sizeof(MDMemoryDescriptor64)))
+        return false;
+    base = head[1];
+    uint64_t offset = head[1];
+    for (size_t j = 0; j < ranges.size(); ++j) {
+        Piece p = { ranges[j].start_of_memory_range, ranges[j].data_size, offset };
+        pieces.push_back(p);
+        offset += ranges[j].data_size;
+    }
+    return true;
+}
+
+bool LoadDump(InputDump & dump)
+{
+    dump.file = OpenDumpFile(dump.path, L"rb");
+    if (dump.file == nullptr) {
+        wprintf(L"Couldn't open %ls\n", dump.path.c_str());
+        return false;
+    }
+    if (!ReadAt(dump.file, 0, &dump.header, sizeof(dump.header))
+            || dump.header.signature != MD_HEADER_SIGNATURE
+            || dump.header.stream_count == 0 || dump.header.stream_count > 4096) {
+        wprintf(L"%ls is not a minidump\n", dump.path.c_str());
+        return false;
+    }
+    dump.directory.resize(dump.header.stream_count);
+    if (!ReadAt(dump.file, dump.header.stream_directory_rva, &dump.directory[0],
+                dump.directory.size() * sizeof(MDRawDirectory)))
+        return false;
+
+    bool hasInfo = false;
+    bool hasMemory64 = false;
+    std::vector<MDMemoryDescriptor64> memory64;
+    for (uint32_t i = 0; i < dump.directory.size(); ++i) {
+        MDLocationDescriptor const & loc = dump.directory[i].location;
+        switch (dump.directory[i].stream_type) {
+        case MD_DUMPPER_DELTA_INFO:
+            if (!ReadAt(dump.file, loc.rva, &dump.info, sizeof(dump.info))
+                    || loc.data_size != sizeof(dump.info) + dump.info.range_count * sizeof(MDMemoryDescriptor64))
+                return false;
+            dump.layout.resize(size_t(dump.info.range_count));
+            if (!dump.layout.empty() && !ReadAt(dump.file, loc.rva + sizeof(dump.info), &dump.layout[0],
+                                                dump.layout.size() * sizeof(MDMemoryDescriptor64)))
+                return false;
+            hasInfo = true;
+            break;
+        case MD_MEMORY_LIST_STREAM:
+            {
+                uint32_t count = 0;
+                if (!ReadAt(dump.file, loc.rva, &count, sizeof(count))
+                        || loc.data_size < sizeof(count) + uint64_t(count) * sizeof(MDMemoryDescriptor))
+                    return false;
+                std::vector<MDMemoryDescriptor> ranges(count);
+                if (count && !ReadAt(dump.file, loc.rva + sizeof(count), &ranges[0], count * sizeof(MDMemoryDescriptor)))
+                    return false;
+                for (uint32_t j = 0; j < count; ++j) {
+                    Piece p = { ranges[j].start_of_memory_range, ranges[j].memory.data_size, ranges[j].memory.rva };
+                    dump.pieces.push_back(p);
+                }
+            }
+            break;
+        case MD_MEMORY_64_LIST_STREAM:
+            if (!ReadMemory64List(dump, loc, dump.memory64Base, memory64, dump.pieces))
+                return false;
+            dump.memory64Index = i;
+            hasMemory64 = true;
+            break;
+        case MD_DUMPPER_PAGE_FIXUPS:
+            {
+                uint64_t base = 0;
+                std::vector<MDMemoryDescriptor64> ranges;
+                if (!ReadMemory64List(dump, loc, base, ranges, dump.fixups))
+                    return false;
+                dump.fixupsIndex = i;
+                dump.hasFixups = true;
+            }
+            break;
+        case MD_DUMPPER_OMITTED_MEMORY:
+            {
+                MDRawOmittedMemory head;
+                if (!ReadAt(dump.file, loc.rva, &head, sizeof(head))
+                        || loc.data_size != sizeof(head) + head.range_count * sizeof(MDMemoryDescriptor64))
+                    return false;
+                dump.omitted.resize(loc.data_size);
+                if (!ReadAt(dump.file, loc.rva, &dump.omitted[0], dump.omitted.size()))
+                    return false;
+                dump.omittedIndex = i;
+            }
+            break;
+        }
+    }
+    if (!hasMemory64) {
+        wprintf(L"%ls has no memory64 list\n", dump.path.c_str());
+        return false;
+    }
+    // A dump not written in incremental mode stands for itself
+    if (!hasInfo) {
+        memset(&dump.info, 0, sizeof(dump.info));
+        dump.info.page_size = kDefaultPageSize;
+        dump.info.base_time_date_stamp = dump.header.time_date_stamp;
+        dump.info.range_count = memory64.size();
+        dump.layout = memory64;
+    }
+    std::sort(dump.pieces.begin(), dump.pieces.end());
+    std::sort(dump.fixups.begin(), dump.fixups.end());
+    return true;
+}
+
+// Removes the ranges a dump budget left out from layout, both are sorted
+// and every omitted range lies within one layout range
+void RemoveOmitted(std::vector<MDMemoryDescriptor64> & layout, std::vector<char> const & omitted)
+{
+    if (omitted.empty())
+        return;
+    MDRawOmittedMemory const * head = reinterpret_cast<MDRawOmittedMemory const *>(&omitted[0]);
+    MDMemoryDescriptor64 const * gaps = reinterpret_cast<MDMemoryDescriptor64 const *>(head + 1);
+    std::vector<MDMemoryDescriptor64> kept;
+    size_t g = 0;
+    for (size_t i = 0; i < layout.size(); ++i) {
+        uint64_t address = layout[i].start_of_memory_range;
+        uint64_t end = address + layout[i].data_size;
+        for (; g < head->range_count && gaps[g].start_of_memory_range < end; ++g) {
+            if (gaps[g].start_of_memory_range > address) {
+                MDMemoryDescriptor64 d = { address, gaps[g].start_of_memory_range - address };
+                kept.push_back(d);
+            }
+            address = std::max(address, gaps[g].start_of_memory_range + gaps[g].data_size);
+        }
+        if (address < end) {
+            MDMemoryDescriptor64 d = { address, end - address };
+            kept.push_back(d);
+        }
+    }
+    layout.swap(kept);
+}
+
+// Finds the piece holding address, or returns nullptr
+Piece const * FindPiece(std::vector<Piece> const & pieces, uint64_t address)
+{
+    Piece key = { address, 0, 0 };
+    std::vector<Piece>::const_iterator it = std::upper_bound(pieces.begin(), pieces.end(), key);
+    if (it == pieces.begin())
+        return nullptr;
+    --it;
+    return address < it->address + it->size ? &*it : nullptr;
+}
+
+// Finds the newest copy of the page at address, fixups of a dump win over
+// its memory64 list. Returns nullptr if no dump holds it.
+Piece const * FindNewest(std::vector<InputDump> const & dumps, uint64_t address, size_t & source)
+{
+    for (size_t j = dumps.size(); j-- > 0; ) {
+        Piece const * piece = FindPiece(dumps[j].fixups, address);
+        if (piece == nullptr)
+            piece = FindPiece(dumps[j].pieces, address);
+        if (piece) {
+            source = j;
+            return piece;
+        }
+    }
+    return nullptr;
+}
+
+bool CopyData(FILE * from, uint64_t offset, FILE * to, uint64_t size, std::vector<char> & buffer)
+{
+    if (!SeekDumpFile(from, offset))
+        return false;
+    while (size) {
+        size_t n = size < buffer.size() ? size_t(size) : buffer.size();
+        if (fread(&buffer[0], 1, n, from) != n || fwrite(&buffer[0], 1, n, to) != n)
+            return false;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteZeros(FILE * to, uint64_t size)
+{
+    static const char zeros[4096] = {0};
+    while (size) {
+        size_t n = size < sizeof(zeros) ? size_t(size) : sizeof(zeros);
+        if (fwrite(zeros, 1, n, to) != n)
+            return false;
+        size -= n;
+    }
+    return true;
+}
+
+} // namespace
+
+bool RebuildDump(std::wstring const & output, std::vector<std::wstring> const & inputs)
+{
+    bool bStatus = false;
+    FILE * out = nullptr;
+    std::vector<InputDump> dumps(inputs.size());
+    std::vector<char> buffer(4 * 1024 * 1024);
+
+    if (inputs.empty())
+        return false;
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        dumps[i].path = inputs[i];
+        if (!LoadDump(dumps[i]))
+            goto cleanup;
+        if (dumps[i].info.sequence != i
+                || dumps[i].info.base_time_date_stamp != dumps[0].info.base_time_date_stamp
+                || dumps[i].info.page_size != dumps[0].info.page_size) {
+            wprintf(L"%ls doesn't follow the previous dump\n", inputs[i].c_str());
+            goto cleanup;
+        }
+    }
+
+    out = OpenDumpFile(output, L"wb");
+    if (out == nullptr) {
+        wprintf(L"Couldn't create %ls\n", output.c_str());
+        goto cleanup;
+    }
+
+    {
+        InputDump & last = dumps.back();
+        uint64_t pageSize = last.info.page_size;
+        // Memory the last dump left out is left out of the result too, older
+        // copies of it would mix points in time
+        RemoveOmitted(last.layout, last.omitted);
+
+        // Everything in front of the memory data is copied from the last dump,
+        // the new memory64 list is appended to it.
+        std::vector<char> prefix(size_t(last.memory64Base));
+        if (!ReadAt(last.file, 0, &prefix[0], prefix.size()))
+            goto cleanup;
+        uint32_t listRva = uint32_t((prefix.size() + 7) & ~size_t(7));
+        uint64_t count = last.layout.size();
+        uint32_t listSize = uint32_t(sizeof(uint64_t) * 2 + count * sizeof(MDMemoryDescriptor64));
+        std::vector<MDRawDirectory> directory(last.directory);
+        directory[last.memory64Index].location.rva = listRva;
+        directory[last.memory64Index].location.data_size = listSize;
+        if (last.hasFixups) {
+            // merged into the memory64 list data below
+            directory[last.fixupsIndex].stream_type = MD_UNUSED_STREAM;
+            directory[last.fixupsIndex].location.rva = 0;
+            directory[last.fixupsIndex].location.data_size = 0;
+        }
+        prefix.resize(listRva + listSize);
+        if (!last.omitted.empty()) {
+            // kept behind the memory data like the directory, moves along
+            directory[last.omittedIndex].location.rva = uint32_t(prefix.size());
+            prefix.insert(prefix.end(), last.omitted.begin(), last.omitted.end());
+        }
+
+        // Low pause dumps keep the directory behind the memory data, it
+        // moves in front of the new memory data.
+        uint32_t dirRva = last.header.stream_directory_rva;
+        size_t dirSize = directory.size() * sizeof(MDRawDirectory);
+        if (dirRva + dirSize > last.memory64Base) {
+            dirRva = uint32_t(prefix.size());
+            prefix.resize(prefix.size() + dirSize);
+            reinterpret_cast<MDRawHeader *>(&prefix[0])->stream_directory_rva = dirRva;
+        }
+        memcpy(&prefix[dirRva], &directory[0], dirSize);
+
+        uint64_t * list = reinterpret_cast<uint64_t *>(&prefix[listRva]);
+        list[0] = count;
+        list[1] = prefix.size();
+        if (count)
+            memcpy(&list[2], &last.layout[0], count * sizeof(MDMemoryDescriptor64));
+        if (fwrite(&prefix[0], 1, prefix.size(), out) != prefix.size())
+            goto cleanup;
+
+        // Take each page from the newest dump that has it, copying runs of
+        // pages that sit next to each other in the same file at once.
+        for (size_t i = 0; i < last.layout.size(); ++i) {
+            uint64_t address = last.layout[i].start_of_memory_range;
+            uint64_t end = address + last.layout[i].data_size;
+            while (address < end) {
+                size_t source = 0;
+                Piece const * piece = FindNewest(dumps, address, source);
+                uint64_t size = pageSize - address % pageSize;
+                if (piece) {
+                    uint64_t pieceEnd = std::min(piece->address + piece->size, end);
+                    size = std::min(size, pieceEnd - address);
+                    // extend the run while the next page comes from the same piece
+                    while (address + size < pieceEnd) {
+                        size_t next = 0;
+                        if (FindNewest(dumps, address + size, next) != piece)
+                            break;
+                        size = std::min(size + pageSize, pieceEnd - address);
+                    }
+                    if (!CopyData(dumps[source].file, piece->offset + (address - piece->address), out, size, buffer))
+                        goto cleanup;
+                } else {
+                    size = std::min(size, end - address);
+                    if (!WriteZeros(out, size))
+                        goto cleanup;
+                }
+                address += size;
+            }
+        }
+    }
+
+    bStatus = fflush(out) == 0;
+    if (bStatus)
+        wprintf(L"Rebuilt %ls from %d dumps\n", output.c_str(), int(dumps.size()));
+
+cleanup:
+    if (out)
+        fclose(out);
+    for (size_t i = 0; i < dumps.size(); ++i) {
+        if (dumps[i].file)
+            fclose(dumps[i].file);
+    }
+    return bStatus;
+}
@@ -0,0 +1,15 @@
+#ifndef DUMPREBUILD_H
+#define DUMPREBUILD_H
+
+#include <string>
+#include <vector>
+
+// Rebuilds a full dump from a base dump and the delta dumps written after
+// it in incremental mode. Thread, module and other streams are taken from
+// the last dump, memory from the newest dump that holds each page.
+//
+// Pages re-read by low pause dumps are merged into the memory64 list, so
+// rebuilding a single low pause dump gives a dump any reader sees whole.
+bool RebuildDump(std::wstring const & output, std::vector<std::wstring> const & inputs);
+
+#endif // DUMPREBUILD_H
@@ -0,0 +1,300 @@
+#include "dumprecorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+long long SteadyMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool ParseCount(std::wstring const & text, unsigned long long & value, bool bSuffix)
+{
+    wchar_t * end = nullptr;
+    value = wcstoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+        return false;
+    if (bSuffix) {
+        switch (*end) {
+        case L'G': case L'g': value <<= 10; // fall through
+        case L'M': case L'm': value <<= 10; // fall through
+        case L'K': case L'k': value <<= 10; ++end;
+        }
+    }
+    return *end == 0;
+}
+
+} // namespace
+
+bool ParseRecorderLimits(std::wstring const & text, RecorderLimits & limits)
+{
+    memset(&limits, 0, sizeof(limits));
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(L',', pos);
+        if (comma == std::wstring::npos)
+            comma = text.size();
+        std::wstring item = text.substr(pos, comma - pos);
+        size_t equals = item.find(L'=');
+        unsigned long long value = 0;
+        if (pos == 0) {
+            // The memory limit comes first and is required
+            if (!ParseCount(item, limits.maxBytes, true) || limits.maxBytes == 0)
+                return false;
+        } else if (equals == std::wstring::npos || !ParseCount(item.substr(equals + 1), value, false)) {
+            return false;
+        } else if (item.compare(0, equals, L"dumps") == 0) {
+            limits.maxDumps = unsigned(value);
+        } else if (item.compare(0, equals, L"for") == 0) {
+            limits.maxSeconds = unsigned(value);
+        } else {
+            return false;
+        }
+        pos = comma + 1;
+    }
+    return true;
+}
+
+// std::min takes it by reference, which needs a definition
+const size_t DumpRecorder::kChunkSize;
+
+RecordedDumpOutput::RecordedDumpOutput(DumpRecorder & recorder, RecordedDump * dump)
+    : m_recorder(recorder)
+    , m_pDump(dump)
+    , m_nPosition(0)
+    , m_nSize(0)
+    , m_nReserved(0)
+{
+}
+
+RecordedDumpOutput::~RecordedDumpOutput()
+{
+    // Never finished, give the memory back
+    if (m_pDump)
+        m_recorder.Release(m_nReserved);
+}
+
+bool RecordedDumpOutput::Write(void const * data, size_t size)
+{
+    if (!WriteAt(m_nPosition, data, size))
+        return false;
+    m_nPosition += size;
+    return true;
+}
+
+bool RecordedDumpOutput::WriteAt(uint64_t offset, void const * data, size_t size)
+{
+    const size_t kChunkSize = DumpRecorder::kChunkSize;
+    if (!m_pDump)
+        return false;
+    std::vector<std::vector<char> > & chunks = m_pDump->chunks;
+    char const * in = static_cast<char const *>(data);
+    while (size > 0) {
+        size_t index = size_t(offset / kChunkSize);
+        size_t within = size_t(offset % kChunkSize);
+        size_t n = std::min(size, kChunkSize - within);
+        if (index >= chunks.size())
+            chunks.resize(index + 1);
+        if (chunks[index].empty()) {
+            if (!m_recorder.Reserve(kChunkSize, m_pDump->chain))
+                return false;
+            m_nReserved += kChunkSize;
+            chunks[index].resize(kChunkSize);
+        }
+        memcpy(&chunks[index][within], in, n);
+        in += n;
+        offset += n;
+        size -= n;
+        m_pDump->size = m_nSize = std::max(m_nSize, offset);
+    }
+    return true;
+}
+
+bool RecordedDumpOutput::Skip(uint64_t size)
+{
+    if (!m_pDump)
+        return false;
+    m_nPosition += size;
+    m_pDump->size = m_nSize = std::max(m_nSize, m_nPosition);
+    return true;
+}
+
+bool RecordedDumpOutput::Finish()
+{
+    if (!m_pDump)
+        return false;
+    // The last chunk only needs to hold the end of the dump
+    std::vector<std::vector<char> > & chunks = m_pDump->chunks;
+    chunks.resize(size_t((m_pDump->size + DumpRecorder::kChunkSize - 1) / DumpRecorder::kChunkSize));
+    size_t tail = size_t(m_pDump->size % DumpRecorder::kChunkSize);
+    if (tail && !chunks.back().empty()) {
+        chunks.back().resize(tail);
+        chunks.back().shrink_to_fit();
+        m_recorder.Release(DumpRecorder::kChunkSize - tail);
+        m_nReserved -= DumpRecorder::kChunkSize - tail;
+    }
+    m_recorder.Commit(std::move(m_pDump));
+    m_nReserved = 0;
+    return true;
+}
+
+uint64_t RecordedDumpOutput::Size() const
+{
+    return m_nSize;
+}
+
+DumpRecorder::DumpRecorder(RecorderLimits const & limits)
+    : m_limits(limits)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_nBytes(0)
+    , m_nChain(0)
+    , m_bNeedsBase(true)
+{
+}
+
+void DumpRecorder::SetCompression(DumpCodec codec, int level)
+{
+    m_codec = codec;
+    m_nCodecLevel = level;
+}
+
+RecordedDumpOutput * DumpRecorder::Open(std::wstring const & name, bool bBase)
+{
+    RecordedDump * dump = new RecordedDump;
+    dump->name = name;
+    if (bBase || m_dumps.empty())
+        ++m_nChain;
+    dump->chain = m_nChain;
+    dump->time = SteadyMicroseconds();
+    dump->size = 0;
+    return new RecordedDumpOutput(*this, dump);
+}
+
+bool DumpRecorder::NeedsBase() const
+{
+    return m_bNeedsBase;
+}
+
+bool DumpRecorder::Flush()
+{
+    bool ok = true;
+    size_t count = 0;
+    uint64_t written = 0;
+    for (size_t i = 0; i < m_dumps.size(); ++i) {
+        RecordedDump const & dump = *m_dumps[i];
+        std::wstring path = dump.name + DumpCodecExtension(m_codec);
+        std::unique_ptr<DumpOutput> out(OpenDumpOutput(path, m_codec, m_nCodecLevel));
+        bool bWritten = out.get() != nullptr;
+        for (size_t c = 0; c < dump.chunks.size() && bWritten; ++c) {
+            size_t n = size_t(std::min<uint64_t>(kChunkSize, dump.size - uint64_t(c) * kChunkSize));
+            bWritten = dump.chunks[c].empty() ? out->Skip(n) : out->Write(dump.chunks[c].data(), n);
+        }
+        bWritten = bWritten && out->Finish();
+        if (!bWritten) {
+            wprintf(L"Couldn't write %ls\n", path.c_str());
+            ok = false;
+            continue;
+        }
+        ++count;
+        written += dump.size;
+    }
+    wprintf(L"Wrote %d recorded dumps, %llu bytes\n", int(count), static_cast<unsigned long long>(written));
+
+    while (!m_dumps.empty())
+        DropOldestChain();
+    // Deltas on top of dumps already written out would be useless alone
+    m_bNeedsBase = true;
+    return ok;
+}
+
+size_t DumpRecorder::Count() const
+{
+    return m_dumps.size();
+}
+
+uint64_t DumpRecorder::Bytes() const
+{
+    return m_nBytes;
+}
+
+bool DumpRecorder::Reserve(uint64_t bytes, unsigned int chain)
+{
+    while (m_limits.maxBytes && m_nBytes + bytes > m_limits.maxBytes) {
+        if (m_dumps.empty() || m_dumps.front()->chain == chain) {
+            // The chain being recorded doesn't fit by itself
+            m_bNeedsBase = true;
+            return false;
+        }
+        DropOldestChain();
+    }
+    m_nBytes += bytes;
+    return true;
+}
+
+void DumpRecorder::Release(uint64_t bytes)
+{
+    m_nBytes -= bytes;
+}
+
+void DumpRecorder::Commit(std::unique_ptr<RecordedDump> dump)
+{
+    // Its memory was reserved while writing
+    m_dumps.push_back(std::move(dump));
+    Trim();
+}
+
+void DumpRecorder::DropOldestChain()
+{
+    unsigned int chain = m_dumps.front()->chain;
+    while (!m_dumps.empty() && m_dumps.front()->chain == chain) {
+        m_nBytes -= DumpBytes(*m_dumps.front());
+        m_dumps.pop_front();
+    }
+}
+
+void DumpRecorder::Trim()
+{
+    long long now = SteadyMicroseconds();
+    long long window = m_limits.maxSeconds * 1000000LL;
+    for (;;) {
+        unsigned int oldest = m_dumps.front()->chain;
+        size_t next = 0;
+        while (next < m_dumps.size() && m_dumps[next]->chain == oldest)
+            ++next;
+        if (next == m_dumps.size())
+            break;
+        // Older chains go once the newer ones hold enough by themselves
+        bool bTooMany = m_limits.maxDumps && m_dumps.size() > m_limits.maxDumps;
+        bool bTooOld = window && now - m_dumps[next]->time >= window;
+        if (!bTooMany && !bTooOld)
+            break;
+        DropOldestChain();
+    }
+
+    size_t first = m_dumps.size() - 1;
+    while (first > 0 && m_dumps[first - 1]->chain == m_dumps.back()->chain)
+        --first;
+    uint64_t chainBytes = 0;
+    for (size_t i = first; i < m_dumps.size(); ++i)
+        chainBytes += DumpBytes(*m_dumps[i]);
+    size_t chainDumps = m_dumps.size() - first;
+    m_bNeedsBase = (m_limits.maxDumps && chainDumps * 2 >= m_limits.maxDumps)
+            || (window && (now - m_dumps[first]->time) * 2 >= window)
+            || (m_limits.maxBytes && chainBytes * 2 >= m_limits.maxBytes);
+}
+
+uint64_t DumpRecorder::DumpBytes(RecordedDump const & dump)
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < dump.chunks.size(); ++i)
+        bytes += dump.chunks[i].size();
+    return bytes;
+}
@@ -0,0 +1,132 @@
+#ifndef DUMPRECORDER_H
+#define DUMPRECORDER_H
+
+#include "dumpcompression.h"
+#include "dumpoutput.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// How much the flight recorder keeps, 0 for no limit. Parsed from
+// "size[,dumps=N][,for=seconds]", e.g. "512M,dumps=20,for=600".
+struct RecorderLimits
+{
+    unsigned long long maxBytes; // memory held by recorded dumps
+    unsigned int maxDumps;
+    unsigned int maxSeconds;     // how far back the recorded dumps reach
+};
+
+bool ParseRecorderLimits(std::wstring const & text, RecorderLimits & limits);
+
+// A dump held in memory. Chunks that were only skipped stay empty and
+// read as zeros.
+struct RecordedDump
+{
+    std::wstring name;
+    unsigned int chain;
+    long long time; // steady clock microseconds
+    uint64_t size;
+    std::vector<std::vector<char> > chunks;
+};
+
+class DumpRecorder;
+
+// Writes a dump into the recorder, sequentially or, for DbgHelp, at any
+// offset. The dump is only kept once Finish succeeds.
+class RecordedDumpOutput : public DumpOutput
+{
+public:
+    virtual ~RecordedDumpOutput();
+
+public:
+    virtual bool Write(void const * data, size_t size);
+
+    bool WriteAt(uint64_t offset, void const * data, size_t size);
+
+    // Leaves the chunks unallocated
+    virtual bool Skip(uint64_t size);
+
+    virtual bool Finish();
+
+    virtual uint64_t Size() const;
+
+private:
+    friend class DumpRecorder;
+
+    RecordedDumpOutput(DumpRecorder & recorder, RecordedDump * dump);
+
+private:
+    DumpRecorder & m_recorder;
+    std::unique_ptr<RecordedDump> m_pDump;
+    uint64_t m_nPosition;
+    uint64_t m_nSize;     // end of the furthest write
+    uint64_t m_nReserved; // bytes of chunks allocated
+};
+
+// Keeps the most recent dumps in memory and writes them to disk only on
+// demand, e.g. when a trigger fires or the target goes away.
+//
+// Incremental dumps only make sense together with their base dump and the
+// deltas before them, so the recorder drops whole chains, oldest first. A
+// new chain is asked for once the current one holds half of what may be
+// kept, which lets the recorder drop the old one later and still cover
+// the limits. The memory limit is never exceeded: a dump that doesn't fit
+// after dropping every older chain fails.
+//
+// Not thread safe, meant for one dumpper.
+class DumpRecorder
+{
+public:
+    static const size_t kChunkSize = 1024 * 1024;
+
+    explicit DumpRecorder(RecorderLimits const & limits);
+
+public:
+    // Dumps are held uncompressed and compressed when written out
+    void SetCompression(DumpCodec codec, int level);
+
+    // Starts recording a dump, bBase starts a new chain
+    RecordedDumpOutput * Open(std::wstring const & name, bool bBase);
+
+    // True while the next dump has to be a base dump
+    bool NeedsBase() const;
+
+    // Writes the recorded dumps to the current directory, oldest first,
+    // under the names they were opened with and empties the recorder
+    bool Flush();
+
+    size_t Count() const;
+
+    uint64_t Bytes() const;
+
+private:
+    friend class RecordedDumpOutput;
+
+    // Makes room for bytes more of the dump being recorded in chain
+    bool Reserve(uint64_t bytes, unsigned int chain);
+
+    void Release(uint64_t bytes);
+
+    void Commit(std::unique_ptr<RecordedDump> dump);
+
+    void DropOldestChain();
+
+    // Drops chains no longer needed to cover the limits
+    void Trim();
+
+    static uint64_t DumpBytes(RecordedDump const & dump);
+
+private:
+    RecorderLimits m_limits;
+    DumpCodec m_codec;
+    int m_nCodecLevel;
+    std::deque<std::unique_ptr<RecordedDump> > m_dumps;
+    uint64_t m_nBytes; // of recorded dumps and the one being recorded
+    unsigned int m_nChain;
+    bool m_bNeedsBase;
+};
+
+#endif // DUMPRECORDER_H
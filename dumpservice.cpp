@@ -0,0 +1,625 @@
+#include "dumpservice.h"
+#include "dumpoutput.h"
+#include "dumptrigger.h"
+#include "fonttext.h"
+#include "processindex.h"
+#include "stackprofile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+// Longest request line, a client sending more is dropped
+const size_t kMaxRequest = 4096;
+
+// How often the listener and the connections look at the stop flag
+const unsigned int kPollMilliseconds = 200;
+
+// Set by SIGINT and SIGTERM (Ctrl+C) while serving
+volatile sig_atomic_t s_bStopService = 0;
+
+std::string Format(const char * format, ...)
+{
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    return text;
+}
+
+std::vector<std::string> SplitWords(std::string const & line)
+{
+    std::vector<std::string> words;
+    size_t pos = 0;
+    for (;;) {
+        pos = line.find_first_not_of(" \t", pos);
+        if (pos == std::string::npos)
+            break;
+        size_t end = line.find_first_of(" \t", pos);
+        if (end == std::string::npos)
+            end = line.size();
+        words.push_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+    return words;
+}
+
+#ifdef _WIN32
+
+typedef HANDLE Channel;
+
+BOOL WINAPI StopService(DWORD)
+{
+    s_bStopService = 1;
+    return TRUE;
+}
+
+// Named pipe instances. Connecting is overlapped, so waiting for a client
+// can time out and let Run look at the stop flag.
+class Listener
+{
+public:
+    Listener()
+        : m_hPipe(INVALID_HANDLE_VALUE)
+        , m_hEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+        , m_bPending(false)
+    {
+        memset(&m_overlapped, 0, sizeof(m_overlapped));
+    }
+
+    ~Listener()
+    {
+        if (m_hPipe != INVALID_HANDLE_VALUE) {
+            CancelIoEx(m_hPipe, &m_overlapped);
+            CloseHandle(m_hPipe);
+        }
+        CloseHandle(m_hEvent);
+    }
+
+    bool Open(std::wstring const & endpoint)
+    {
+        const std::wstring prefix = L"\\\\.\\pipe\\";
+        m_name = endpoint.compare(0, prefix.size(), prefix) == 0 ? endpoint : prefix + endpoint;
+        // The first instance fails when another service owns the name
+        return CreateInstance(FILE_FLAG_FIRST_PIPE_INSTANCE);
+    }
+
+    // Waits up to milliseconds for a client
+    bool Accept(unsigned int milliseconds, Channel & client)
+    {
+        if (!m_bPending) {
+            memset(&m_overlapped, 0, sizeof(m_overlapped));
+            m_overlapped.hEvent = m_hEvent;
+            ResetEvent(m_hEvent);
+            ConnectNamedPipe(m_hPipe, &m_overlapped);
+            DWORD dwError = GetLastError();
+            if (dwError == ERROR_PIPE_CONNECTED)
+                return Take(client);
+            if (dwError != ERROR_IO_PENDING) {
+                wprintf(L"Couldn't wait for clients: %lu\n", dwError);
+                Sleep(milliseconds);
+                return false;
+            }
+            m_bPending = true;
+        }
+        if (WaitForSingleObject(m_hEvent, milliseconds) != WAIT_OBJECT_0)
+            return false;
+        m_bPending = false;
+        DWORD dwBytes = 0;
+        if (!GetOverlappedResult(m_hPipe, &m_overlapped, &dwBytes, FALSE)) {
+            DisconnectNamedPipe(m_hPipe);
+            return false;
+        }
+        return Take(client);
+    }
+
+private:
+    bool CreateInstance(DWORD dwFlags)
+    {
+        m_hPipe = CreateNamedPipeW(
+            m_name.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | dwFlags,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES,
+            kMaxRequest,
+            kMaxRequest,
+            0,
+            nullptr);
+        return m_hPipe != INVALID_HANDLE_VALUE;
+    }
+
+    // Hands the connected instance to the client, the next one waits
+    bool Take(Channel & client)
+    {
+        client = m_hPipe;
+        if (!CreateInstance(0))
+            wprintf(L"Couldn't create pipe instance: %lu\n", GetLastError());
+        return true;
+    }
+
+private:
+    std::wstring m_name;
+    HANDLE m_hPipe;
+    HANDLE m_hEvent;
+    OVERLAPPED m_overlapped;
+    bool m_bPending;
+};
+
+#else
+
+typedef int Channel;
+
+void StopService(int)
+{
+    s_bStopService = 1;
+}
+
+// A Unix domain socket only our user may connect to
+class Listener
+{
+public:
+    Listener()
+        : m_fd(-1)
+        , m_bBound(false)
+    {
+    }
+
+    ~Listener()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+        if (m_bBound)
+            unlink(m_path.c_str());
+    }
+
+    bool Open(std::wstring const & endpoint)
+    {
+        m_path = NarrowPath(endpoint);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (m_path.empty() || m_path.size() >= sizeof(address.sun_path))
+            return false;
+        memcpy(address.sun_path, m_path.c_str(), m_path.size());
+
+        // A socket left behind by a service that died is replaced, one
+        // that still answers or anything else in the way is not
+        struct stat st;
+        if (lstat(m_path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode))
+                return false;
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool bLive = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+            if (probe >= 0)
+                close(probe);
+            if (bLive)
+                return false;
+            unlink(m_path.c_str());
+        }
+
+        m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_fd < 0 || bind(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+            return false;
+        m_bBound = true;
+        // Requests dump whatever this process may attach to. Nobody can
+        // connect before listen, so restricting the socket here is in time.
+        if (chmod(m_path.c_str(), 0600) != 0 || listen(m_fd, 16) != 0)
+            return false;
+        return true;
+    }
+
+    // Waits up to milliseconds for a client
+    bool Accept(unsigned int milliseconds, Channel & client)
+    {
+        pollfd p = { m_fd, POLLIN, 0 };
+        if (poll(&p, 1, int(milliseconds)) <= 0)
+            return false;
+        client = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                wprintf(L"Couldn't accept client: %hs\n", strerror(errno));
+                usleep(milliseconds * 1000);
+            }
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string m_path;
+    int m_fd;
+    bool m_bBound;
+};
+
+#endif
+
+} // namespace
+
+// One client. The reader thread and the workers answering its requests
+// share it, the last one to let go closes it.
+class DumpService::Connection
+{
+public:
+    explicit Connection(Channel channel)
+        : m_channel(channel)
+        , m_bFinished(false)
+    {
+#ifdef _WIN32
+        m_hReadEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        m_hWriteEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+#endif
+    }
+
+    ~Connection()
+    {
+#ifdef _WIN32
+        FlushFileBuffers(m_channel);
+        DisconnectNamedPipe(m_channel);
+        CloseHandle(m_channel);
+        CloseHandle(m_hReadEvent);
+        CloseHandle(m_hWriteEvent);
+#else
+        close(m_channel);
+#endif
+    }
+
+public:
+    // Waits up to milliseconds for more of the requests and appends it to
+    // buffer. Returns false once the client hung up.
+    bool Read(std::string & buffer, unsigned int milliseconds)
+    {
+        char data[kMaxRequest];
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = m_hReadEvent;
+        ResetEvent(m_hReadEvent);
+        DWORD dwRead = 0;
+        if (!ReadFile(m_channel, data, sizeof(data), nullptr, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+            return false;
+        if (WaitForSingleObject(m_hReadEvent, milliseconds) != WAIT_OBJECT_0)
+            CancelIoEx(m_channel, &overlapped);
+        // A read cancelled too late still has its data
+        if (!GetOverlappedResult(m_channel, &overlapped, &dwRead, TRUE))
+            return GetLastError() == ERROR_OPERATION_ABORTED;
+        if (dwRead == 0)
+            return false;
+        buffer.append(data, dwRead);
+#else
+        pollfd p = { m_channel, POLLIN, 0 };
+        int result = poll(&p, 1, int(milliseconds));
+        if (result <= 0)
+            return result == 0 || errno == EINTR;
+        ssize_t n = recv(m_channel, data, sizeof(data), 0);
+        if (n <= 0)
+            return n < 0 && errno == EINTR;
+        buffer.append(data, size_t(n));
+#endif
+        return true;
+    }
+
+    // Sends one reply line, thread safe
+    bool Write(std::string const & reply)
+    {
+        std::string line = reply + "\n";
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = m_hWriteEvent;
+        ResetEvent(m_hWriteEvent);
+        DWORD dwWritten = 0;
+        if (!WriteFile(m_channel, line.data(), DWORD(line.size()), nullptr, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+            return false;
+        return GetOverlappedResult(m_channel, &overlapped, &dwWritten, TRUE) && dwWritten == line.size();
+#else
+        size_t sent = 0;
+        while (sent < line.size()) {
+            // A client that hung up must not kill the service with SIGPIPE
+            ssize_t n = send(m_channel, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += size_t(n);
+        }
+        return true;
+#endif
+    }
+
+    // The reader thread is done and may be joined
+    void Finish()
+    {
+        m_bFinished = true;
+    }
+
+    bool Finished() const
+    {
+        return m_bFinished;
+    }
+
+private:
+    Channel m_channel;
+#ifdef _WIN32
+    HANDLE m_hReadEvent;
+    HANDLE m_hWriteEvent;
+#endif
+    std::mutex m_writeMutex;
+    std::atomic<bool> m_bFinished;
+};
+
+DumpService::DumpService(std::wstring const & endpoint, unsigned int workers, DumpperSetup setup)
+    : m_endpoint(endpoint)
+    , m_setup(setup)
+    , m_pool(workers)
+    , m_nQueued(0)
+    , m_nServed(0)
+    , m_bStop(false)
+{
+}
+
+DumpService::~DumpService()
+{
+    m_pool.Wait();
+}
+
+bool DumpService::Run()
+{
+    Listener listener;
+    if (!listener.Open(m_endpoint)) {
+        wprintf(L"Couldn't listen on %ls\n", m_endpoint.c_str());
+        return false;
+    }
+
+    s_bStopService = 0;
+#ifdef _WIN32
+    SetConsoleCtrlHandler(StopService, TRUE);
+#else
+    struct sigaction action, oldInt, oldTerm;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopService;
+    sigaction(SIGINT, &action, &oldInt);
+    sigaction(SIGTERM, &action, &oldTerm);
+#endif
+    wprintf(L"Serving dumps on %ls with %u workers\n", m_endpoint.c_str(), m_pool.Size());
+
+    // Only the reader and the workers own a connection, it is closed as
+    // soon as the client hung up and the last reply went out, not when the
+    // reader is joined here
+    struct Client
+    {
+        std::thread thread;
+        std::weak_ptr<Connection> connection;
+    };
+    std::vector<Client> clients;
+    while (!m_bStop && !s_bStopService) {
+        Channel channel;
+        if (listener.Accept(kPollMilliseconds, channel)) {
+            std::shared_ptr<Connection> connection = std::make_shared<Connection>(channel);
+            Client client;
+            client.connection = connection;
+            client.thread = std::thread(&DumpService::Serve, this, std::move(connection));
+            clients.push_back(std::move(client));
+        }
+        for (size_t i = 0; i < clients.size(); ) {
+            std::shared_ptr<Connection> connection = clients[i].connection.lock();
+            if (!connection || connection->Finished()) {
+                clients[i].thread.join();
+                clients.erase(clients.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // Readers notice the stop within a poll, replies to requests already
+    // queued still reach their clients
+    wprintf(L"Stopping, %u requests queued\n", m_nQueued.load());
+    m_bStop = true;
+    for (size_t i = 0; i < clients.size(); ++i)
+        clients[i].thread.join();
+    m_pool.Wait();
+
+#ifdef _WIN32
+    SetConsoleCtrlHandler(StopService, FALSE);
+#else
+    sigaction(SIGINT, &oldInt, nullptr);
+    sigaction(SIGTERM, &oldTerm, nullptr);
+#endif
+    wprintf(L"Served %llu requests\n", m_nServed.load());
+    return true;
+}
+
+void DumpService::Serve(std::shared_ptr<Connection> connection)
+{
+    std::string buffer;
+    unsigned long long number = 0;
+    while (!m_bStop && !s_bStopService && connection->Read(buffer, kPollMilliseconds)) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) != std::string::npos) {
+            std::string request = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!request.empty() && request[request.size() - 1] == '\r')
+                request.erase(request.size() - 1);
+            if (!SplitWords(request).empty())
+                Dispatch(connection, ++number, request);
+        }
+        if (buffer.size() > kMaxRequest) {
+            connection->Write(Format("%llu error request too long", number + 1));
+            break;
+        }
+    }
+    connection->Finish();
+}
+
+void DumpService::Dispatch(std::shared_ptr<Connection> connection, unsigned long long number,
+                           std::string const & request)
+{
+    std::vector<std::string> words = SplitWords(request);
+    std::string prefix = Format("%llu ", number);
+
+    // Status and shutdown are answered right away, even with every
+    // worker busy
+    if (words[0] == "status" && words.size() == 1) {
+        ++m_nServed;
+        connection->Write(prefix + Status());
+        return;
+    }
+    if (words[0] == "shutdown" && words.size() == 1) {
+        ++m_nServed;
+        m_bStop = true;
+        connection->Write(prefix + "ok stopping");
+        return;
+    }
+
+    std::function<std::string()> task;
+    if (words[0] == "dump" && words.size() == 2) {
+        std::string target = words[1];
+        task = [this, target]() { return Dump(target); };
+    } else if (words[0] == "sample" && words.size() >= 2 && words.size() <= 5) {
+        std::string target = words[1];
+        unsigned int hz = words.size() > 2 ? unsigned(strtoul(words[2].c_str(), nullptr, 10)) : 100;
+        unsigned int seconds = words.size() > 3 ? unsigned(strtoul(words[3].c_str(), nullptr, 10)) : 5;
+        std::string path = words.size() > 4 ? words[4] : std::string();
+        // Without a time limit the sample would hold its worker forever
+        if (hz == 0 || seconds == 0) {
+            connection->Write(prefix + "error hz and seconds must be positive");
+            return;
+        }
+        task = [this, target, hz, seconds, path]() { return Sample(target, hz, seconds, path); };
+    } else {
+        connection->Write(prefix + "error unknown request");
+        return;
+    }
+
+    ++m_nQueued;
+    m_pool.Submit([this, connection, prefix, task]() {
+        std::string reply = task();
+        --m_nQueued;
+        ++m_nServed;
+        connection->Write(prefix + reply);
+    });
+}
+
+std::string DumpService::Dump(std::string const & target)
+{
+    std::string error;
+    std::shared_ptr<Session> session = OpenSession(target, error);
+    if (!session)
+        return "error " + error;
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    if (!session->dumpper->CreateMiniDump()) {
+        ++session->failures;
+        return Format("error dump of %d failed", session->pid);
+    }
+    ++session->dumps;
+    DumpStats const & stats = session->dumpper->LastDumpStats();
+    // Replies are UTF-8 like the requests
+    std::string file;
+    FontText::WideToUtf8(session->dumpper->LastDumpName(), file);
+    return Format("ok pid=%d file=%s bytes=%llu pause_ms=%.2f wall_ms=%.1f", session->pid, file.c_str(), stats.bytesWritten,
+                  stats.pauseTime / 1000.0, stats.wallTime / 1000.0);
+}
+
+std::string DumpService::Sample(std::string const & target, unsigned int hz, unsigned int seconds,
+                                std::string const & path)
+{
+    std::string error;
+    std::shared_ptr<Session> session = OpenSession(target, error);
+    if (!session)
+        return "error " + error;
+
+    std::string file = path.empty() ? Format("stacks-%d.folded", session->pid) : path;
+    std::lock_guard<std::mutex> lock(session->mutex);
+    if (!ProfileStacks(*session->dumpper, hz, seconds, WidenPath(file), false)) {
+        ++session->failures;
+        return Format("error sampling %d failed", session->pid);
+    }
+    ++session->samples;
+    return Format("ok pid=%d file=%s", session->pid, file.c_str());
+}
+
+std::string DumpService::Status()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string reply = Format("ok sessions=%d queued=%u served=%llu", int(m_sessions.size()),
+                               m_nQueued.load(), m_nServed.load());
+    for (std::map<int, std::shared_ptr<Session> >::const_iterator it = m_sessions.begin();
+         it != m_sessions.end(); ++it) {
+        Session const & session = *it->second;
+        reply += Format(" %d:dumps=%u,samples=%u,failures=%u", session.pid, session.dumps.load(),
+                        session.samples.load(), session.failures.load());
+    }
+    return reply;
+}
+
+std::shared_ptr<DumpService::Session> DumpService::OpenSession(std::string const & target, std::string & error)
+{
+    int pid = 0;
+    char * end = nullptr;
+    long value = strtol(target.c_str(), &end, 10);
+    if (value > 0 && *end == 0) {
+        pid = int(value);
+    } else {
+        std::vector<ProcessInfo> matches = ProcessIndex::Instance().Find(WidenPath(target));
+        if (matches.empty()) {
+            error = "no process named " + target;
+            return nullptr;
+        }
+        pid = matches[0].pid;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // Sessions of processes that exited go, their pid may come back as a
+    // different process. Requests still running keep theirs alive.
+    bool bInterrupted = false;
+    for (std::map<int, std::shared_ptr<Session> >::iterator it = m_sessions.begin(); it != m_sessions.end(); ) {
+        if (it->second->sampler->WaitExit(0, bInterrupted)) {
+            wprintf(L"Closed session of %d\n", it->first);
+            it = m_sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::shared_ptr<Session> & session = m_sessions[pid];
+    if (!session) {
+        std::unique_ptr<ProcessSampler> sampler(new ProcessSampler(pid));
+        if (sampler->WaitExit(0, bInterrupted)) {
+            m_sessions.erase(pid);
+            error = Format("no process %d", pid);
+            return nullptr;
+        }
+        session = std::make_shared<Session>();
+        session->pid = pid;
+        session->dumpper.reset(new MiniDumpper(pid));
+        session->sampler.swap(sampler);
+        session->dumps = 0;
+        session->samples = 0;
+        session->failures = 0;
+        m_setup(*session->dumpper);
+        wprintf(L"Opened session of %d\n", pid);
+    }
+    return session;
+}
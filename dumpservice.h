@@ -0,0 +1,95 @@
+#ifndef DUMPSERVICE_H
+#define DUMPSERVICE_H
+
+#include "minidumpper.h"
+#include "threadpool.h"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class ProcessSampler;
+
+// Applies the command line settings to the dumpper of a new session
+typedef std::function<void(MiniDumpper &)> DumpperSetup;
+
+// Takes dump requests over a local socket, for tools that want a dump in
+// milliseconds instead of starting a dumpper each time.
+//
+// Clients connect to a Unix domain socket, or \\.\pipe\<name> on Windows,
+// and send one request per line:
+//
+//     dump <target>
+//     sample <target> [hz [seconds [file]]]   100 Hz for 5 s by default
+//     status
+//     shutdown
+//
+// Targets are pids or image names, a name picks the newest process. Every
+// request is answered by one line, "<n> ok ..." or "<n> error ...", where
+// n counts the requests of the connection from 1. Dumps and samples run on
+// the worker pool, so their replies may come out of order.
+//
+// Each target gets a session the first time it is asked for, which keeps
+// its MiniDumpper, and with it dbghelp.dll, the open process and the
+// incremental dump state, until the target exits. Requests for the same
+// target take turns, different targets are dumped in parallel.
+class DumpService
+{
+public:
+    // workers == 0 uses one worker per hardware thread
+    DumpService(std::wstring const & endpoint, unsigned int workers, DumpperSetup setup);
+
+    ~DumpService();
+
+public:
+    // Serves until a shutdown request, SIGINT or SIGTERM (Ctrl+C), then
+    // finishes the queued requests
+    bool Run();
+
+private:
+    struct Session
+    {
+        int pid;
+        std::unique_ptr<MiniDumpper> dumpper;
+        std::unique_ptr<ProcessSampler> sampler; // notices the exit
+        std::mutex mutex;                         // one request at a time
+        std::atomic<unsigned int> dumps;
+        std::atomic<unsigned int> samples;
+        std::atomic<unsigned int> failures;
+    };
+
+    class Connection;
+
+    // Reads requests until the client hangs up or the service stops
+    void Serve(std::shared_ptr<Connection> connection);
+
+    // Answers a request, queueing dumps and samples on the pool
+    void Dispatch(std::shared_ptr<Connection> connection, unsigned long long number,
+                  std::string const & request);
+
+    std::string Dump(std::string const & target);
+
+    std::string Sample(std::string const & target, unsigned int hz, unsigned int seconds,
+                       std::string const & path);
+
+    std::string Status();
+
+    // The session of target, created on first use. Sessions of processes
+    // that exited are dropped on the way.
+    std::shared_ptr<Session> OpenSession(std::string const & target, std::string & error);
+
+private:
+    std::wstring m_endpoint;
+    DumpperSetup m_setup;
+    ThreadPool m_pool;
+    std::map<int, std::shared_ptr<Session> > m_sessions;
+    std::mutex m_mutex; // guards m_sessions
+    std::atomic<unsigned int> m_nQueued;
+    std::atomic<unsigned long long> m_nServed;
+    std::atomic<bool> m_bStop;
+};
+
+#endif // DUMPSERVICE_H
@@ -0,0 +1,450 @@
+#include "dumptrigger.h"
+#include "dumprecorder.h"
+#include "minidumpper.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#include <TlHelp32.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const struct { const wchar_t * name; TriggerKind kind; } kTriggerNames[] = {
+    { L"cpu", TriggerCpu },
+    { L"rss", TriggerRss },
+    { L"commit", TriggerCommit },
+    { L"handles", TriggerHandles },
+    { L"threads", TriggerThreads },
+};
+
+volatile sig_atomic_t s_bFlushRequested = 0;
+
+#ifdef _WIN32
+BOOL WINAPI RequestFlush(DWORD dwCtrlType)
+{
+    if (dwCtrlType != CTRL_BREAK_EVENT)
+        return FALSE;
+    s_bFlushRequested = 1;
+    return TRUE;
+}
+#else
+void RequestFlush(int)
+{
+    s_bFlushRequested = 1;
+}
+#endif
+
+long long SteadyMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const wchar_t * TriggerName(TriggerKind kind)
+{
+    for (size_t i = 0; i < sizeof(kTriggerNames) / sizeof(kTriggerNames[0]); ++i) {
+        if (kTriggerNames[i].kind == kind)
+            return kTriggerNames[i].name;
+    }
+    return L"?";
+}
+
+// Reads a number with an optional K, M or G suffix
+bool ParseNumber(std::wstring const & text, double & value)
+{
+    wchar_t * end = nullptr;
+    value = wcstod(text.c_str(), &end);
+    if (end == text.c_str())
+        return false;
+    switch (*end) {
+    case L'G': case L'g': value *= 1024; // fall through
+    case L'M': case L'm': value *= 1024; // fall through
+    case L'K': case L'k': value *= 1024; ++end;
+    }
+    return *end == 0;
+}
+
+} // namespace
+
+bool ParseTrigger(std::wstring const & text, TriggerSpec & spec)
+{
+    memset(&spec, 0, sizeof(spec));
+    bool bKind = false;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(L',', pos);
+        if (comma == std::wstring::npos)
+            comma = text.size();
+        std::wstring item = text.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t equals = item.find(L'=');
+        if (equals == std::wstring::npos)
+            return false;
+        std::wstring key = item.substr(0, equals);
+        double value = 0;
+        if (!ParseNumber(item.substr(equals + 1), value) || value < 0)
+            return false;
+        if (key == L"for") {
+            spec.seconds = int(value);
+        } else if (key == L"cooldown") {
+            spec.cooldown = int(value);
+        } else if (key == L"max") {
+            spec.maxDumps = int(value);
+        } else if (key == L"escalate") {
+            spec.escalate = int(value);
+        } else if (!bKind) {
+            size_t k = 0;
+            while (k < sizeof(kTriggerNames) / sizeof(kTriggerNames[0]) && key != kTriggerNames[k].name)
+                ++k;
+            if (k == sizeof(kTriggerNames) / sizeof(kTriggerNames[0]))
+                return false;
+            spec.kind = kTriggerNames[k].kind;
+            spec.threshold = value;
+            bKind = true;
+        } else {
+            return false;
+        }
+    }
+    return bKind;
+}
+
+#ifdef _WIN32
+
+ProcessSampler::ProcessSampler(int pid)
+    : m_pid(pid)
+{
+    memset(&m_last, 0, sizeof(m_last));
+    m_hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_VM_READ | SYNCHRONIZE, FALSE, pid);
+}
+
+ProcessSampler::~ProcessSampler()
+{
+    if (m_hProcess)
+        CloseHandle(m_hProcess);
+}
+
+bool ProcessSampler::Sample(ProcessSample & sample, bool bCountHandles, bool bCountThreads)
+{
+    memset(&sample, 0, sizeof(sample));
+    sample.time = SteadyMicroseconds();
+    FILETIME creation, exit, kernel, user;
+    if (m_hProcess == nullptr || !GetProcessTimes(m_hProcess, &creation, &exit, &kernel, &user))
+        return false;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    sample.cpuTime = (k.QuadPart + u.QuadPart) / 10;
+
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    if (GetProcessMemoryInfo(m_hProcess, reinterpret_cast<PROCESS_MEMORY_COUNTERS *>(&counters), sizeof(counters))) {
+        sample.rss = counters.WorkingSetSize;
+        sample.commit = counters.PrivateUsage;
+    }
+    if (bCountHandles) {
+        DWORD count = 0;
+        if (GetProcessHandleCount(m_hProcess, &count))
+            sample.handles = count;
+    }
+    if (bCountThreads) {
+        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if (hSnapshot != INVALID_HANDLE_VALUE) {
+            THREADENTRY32 te;
+            te.dwSize = sizeof(te);
+            for (BOOL bMore = Thread32First(hSnapshot, &te); bMore; bMore = Thread32Next(hSnapshot, &te)) {
+                if (te.th32OwnerProcessID == DWORD(m_pid))
+                    ++sample.threads;
+            }
+            CloseHandle(hSnapshot);
+        }
+    }
+
+    if (m_last.time)
+        sample.cpuPercent = 100.0 * (sample.cpuTime - m_last.cpuTime) / (sample.time - m_last.time);
+    m_last = sample;
+    return true;
+}
+
+bool ProcessSampler::WaitExit(unsigned int milliseconds, bool & bInterrupted)
+{
+    bInterrupted = false;
+    if (m_hProcess == nullptr)
+        return true;
+    DWORD result = WaitForSingleObjectEx(m_hProcess, milliseconds, TRUE);
+    bInterrupted = result == WAIT_IO_COMPLETION;
+    return result == WAIT_OBJECT_0;
+}
+
+bool ProcessSampler::MayHaveCrashed()
+{
+    // Unhandled exceptions end the process with their NTSTATUS code
+    DWORD dwExitCode = 0;
+    if (m_hProcess == nullptr || !GetExitCodeProcess(m_hProcess, &dwExitCode))
+        return true;
+    return dwExitCode >= 0xC0000000;
+}
+
+#else
+
+ProcessSampler::ProcessSampler(int pid)
+    : m_pid(pid)
+    , m_pidfd(-1)
+    , m_nTicksPerSecond(sysconf(_SC_CLK_TCK))
+    , m_nPageSize(sysconf(_SC_PAGESIZE))
+{
+    memset(&m_last, 0, sizeof(m_last));
+#ifdef SYS_pidfd_open
+    m_pidfd = int(syscall(SYS_pidfd_open, pid, 0));
+#endif
+}
+
+ProcessSampler::~ProcessSampler()
+{
+    if (m_pidfd >= 0)
+        close(m_pidfd);
+}
+
+bool ProcessSampler::Sample(ProcessSample & sample, bool bCountHandles, bool bCountThreads)
+{
+    memset(&sample, 0, sizeof(sample));
+    sample.time = SteadyMicroseconds();
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", m_pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char text[1024];
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    text[n] = 0;
+
+    // The command name may hold anything, the fields start after its ')'
+    char * fields = strrchr(text, ')');
+    if (fields == nullptr)
+        return false;
+    unsigned long utime = 0, stime = 0;
+    long threads = 0, rss = 0;
+    unsigned long long vsize = 0;
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld %*d %*u %llu %ld",
+               &utime, &stime, &threads, &vsize, &rss) != 5)
+        return false;
+    sample.cpuTime = (unsigned long long)(utime + stime) * 1000000 / m_nTicksPerSecond;
+    sample.rss = (unsigned long long)rss * m_nPageSize;
+    sample.commit = vsize;
+    if (bCountThreads)
+        sample.threads = unsigned(threads);
+
+    if (bCountHandles) {
+        snprintf(path, sizeof(path), "/proc/%d/fd", m_pid);
+        if (DIR * dir = opendir(path)) {
+            while (dirent * entry = readdir(dir)) {
+                if (entry->d_name[0] != '.')
+                    ++sample.handles;
+            }
+            closedir(dir);
+        }
+    }
+
+    if (m_last.time)
+        sample.cpuPercent = 100.0 * (sample.cpuTime - m_last.cpuTime) / (sample.time - m_last.time);
+    m_last = sample;
+    return true;
+}
+
+bool ProcessSampler::WaitExit(unsigned int milliseconds, bool & bInterrupted)
+{
+    bInterrupted = false;
+    if (m_pidfd >= 0) {
+        pollfd p = { m_pidfd, POLLIN, 0 };
+        int result = poll(&p, 1, int(milliseconds));
+        bInterrupted = result < 0 && errno == EINTR;
+        return result > 0;
+    }
+    // Without pidfd an exit is only noticed once the tick is over
+    bInterrupted = usleep(milliseconds * 1000) != 0 && errno == EINTR;
+    return kill(m_pid, 0) != 0 && errno == ESRCH;
+}
+
+bool ProcessSampler::MayHaveCrashed()
+{
+    return true;
+}
+
+#endif
+
+TriggerEngine::TriggerEngine(MiniDumpper & full, MiniDumpper & light, std::vector<TriggerSpec> const & triggers)
+    : m_full(full)
+    , m_light(light)
+    , m_pRecorder(nullptr)
+    , m_nInterval(0)
+    , m_bFired(false)
+{
+    for (size_t i = 0; i < triggers.size(); ++i) {
+        TriggerState state;
+        memset(&state, 0, sizeof(state));
+        state.spec = triggers[i];
+        m_triggers.push_back(state);
+    }
+}
+
+double TriggerEngine::Value(TriggerKind kind, ProcessSample const & sample) const
+{
+    switch (kind) {
+    case TriggerCpu: return sample.cpuPercent;
+    case TriggerRss: return double(sample.rss);
+    case TriggerCommit: return double(sample.commit);
+    case TriggerHandles: return sample.handles;
+    case TriggerThreads: return sample.threads;
+    }
+    return 0;
+}
+
+bool TriggerEngine::Check(TriggerState & trigger, ProcessSample const & sample)
+{
+    TriggerSpec const & spec = trigger.spec;
+    if (spec.maxDumps && trigger.dumps >= spec.maxDumps)
+        return false;
+    double value = Value(spec.kind, sample);
+    if (value < spec.threshold) {
+        trigger.since = 0;
+        trigger.lightDump = 0;
+        return true;
+    }
+    long long now = sample.time;
+    if (trigger.since == 0)
+        trigger.since = now;
+    if (now - trigger.since < spec.seconds * 1000000LL)
+        return true;
+
+    if (trigger.lightDump) {
+        // Still holding after a stack-only dump, escalate to a full dump
+        if (now - trigger.lightDump < spec.escalate * 1000000LL)
+            return true;
+    } else {
+        if (trigger.lastDump && now - trigger.lastDump < spec.cooldown * 1000000LL)
+            return true;
+        if (spec.escalate) {
+            wprintf(L"Trigger %ls at %.0f, stack-only dump\n", TriggerName(spec.kind), value);
+            m_light.CreateMiniDump();
+            m_bFired = true;
+            trigger.lightDump = trigger.lastDump = SteadyMicroseconds();
+            return true;
+        }
+    }
+
+    wprintf(L"Trigger %ls at %.0f, full dump %d\n", TriggerName(spec.kind), value, trigger.dumps + 1);
+    m_full.CreateMiniDump();
+    m_bFired = true;
+    trigger.lastDump = SteadyMicroseconds();
+    trigger.lightDump = 0;
+    ++trigger.dumps;
+    return !spec.maxDumps || trigger.dumps < spec.maxDumps;
+}
+
+void TriggerEngine::SetRecorder(DumpRecorder * recorder, unsigned int intervalSeconds)
+{
+    m_pRecorder = recorder;
+    m_nInterval = intervalSeconds;
+}
+
+void TriggerEngine::FlushRecorder(const wchar_t * reason)
+{
+    if (m_pRecorder == nullptr || m_pRecorder->Count() == 0)
+        return;
+    wprintf(L"%ls, writing out %d recorded dumps\n", reason, int(m_pRecorder->Count()));
+    m_pRecorder->Flush();
+}
+
+void TriggerEngine::Run(unsigned int tickMilliseconds)
+{
+    bool bCountHandles = false;
+    bool bCountThreads = false;
+    for (size_t i = 0; i < m_triggers.size(); ++i) {
+        bCountHandles = bCountHandles || m_triggers[i].spec.kind == TriggerHandles;
+        bCountThreads = bCountThreads || m_triggers[i].spec.kind == TriggerThreads;
+    }
+
+    ProcessSampler sampler(m_full.ProcessId());
+    ProcessSample sample;
+    // The first sample only sets the base for cpu percent
+    if (!sampler.Sample(sample, bCountHandles, bCountThreads)) {
+        wprintf(L"Couldn't sample process %d\n", m_full.ProcessId());
+        return;
+    }
+
+    s_bFlushRequested = 0;
+#ifdef _WIN32
+    if (m_pRecorder)
+        SetConsoleCtrlHandler(RequestFlush, TRUE);
+#else
+    // poll returns early on the signal, SA_RESTART keeps it away from the
+    // system calls of a dump
+    struct sigaction action, oldAction;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = RequestFlush;
+    action.sa_flags = SA_RESTART;
+    if (m_pRecorder)
+        sigaction(SIGUSR1, &action, &oldAction);
+#endif
+
+    long long nextRecord = SteadyMicroseconds();
+    for (;;) {
+        if (m_pRecorder && SteadyMicroseconds() >= nextRecord) {
+            m_full.CreateMiniDump();
+            // Dumps running over the interval delay the next one
+            nextRecord = std::max(nextRecord + m_nInterval * 1000000LL, SteadyMicroseconds());
+        }
+        bool bInterrupted = false;
+        if (sampler.WaitExit(tickMilliseconds, bInterrupted)) {
+            wprintf(L"Process %d exited\n", m_full.ProcessId());
+            if (sampler.MayHaveCrashed())
+                FlushRecorder(L"Process may have crashed");
+            break;
+        }
+        if (s_bFlushRequested) {
+            s_bFlushRequested = 0;
+            FlushRecorder(L"Flush requested");
+            continue;
+        }
+        if (bInterrupted || !sampler.Sample(sample, bCountHandles, bCountThreads))
+            break;
+        bool bArmed = false;
+        m_bFired = false;
+        for (size_t i = 0; i < m_triggers.size(); ++i)
+            bArmed = Check(m_triggers[i], sample) || bArmed;
+        if (m_bFired)
+            FlushRecorder(L"Trigger fired");
+        // The recorder keeps going after the triggers are done
+        if (!bArmed && !m_pRecorder) {
+            wprintf(L"Every trigger took its dumps\n");
+            break;
+        }
+    }
+
+#ifdef _WIN32
+    if (m_pRecorder)
+        SetConsoleCtrlHandler(RequestFlush, FALSE);
+#else
+    if (m_pRecorder)
+        sigaction(SIGUSR1, &oldAction, nullptr);
+#endif
+}
@@ -0,0 +1,134 @@
+#ifndef DUMPTRIGGER_H
+#define DUMPTRIGGER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class DumpRecorder;
+class MiniDumpper;
+
+enum TriggerKind
+{
+    TriggerCpu,     // percent of one core, above 100 on several
+    TriggerRss,     // resident bytes
+    TriggerCommit,  // Windows private bytes, Linux virtual size
+    TriggerHandles, // open handles or file descriptors
+    TriggerThreads
+};
+
+// When to dump. Parsed from "kind=threshold[,option=value...]":
+//
+//     cpu=80,for=5,cooldown=60,max=3,escalate=10
+//     rss=2G  commit=4G  handles=5000  threads=300
+//
+// for is how many seconds the condition has to hold, cooldown how many
+// seconds pass after a dump before the trigger may fire again, max how
+// many dumps it takes at most (0 for no limit). With escalate a firing
+// trigger takes a stack-only dump first and a full dump only when the
+// condition still holds escalate seconds later.
+struct TriggerSpec
+{
+    TriggerKind kind;
+    double threshold;
+    int seconds;
+    int cooldown;
+    int maxDumps;
+    int escalate;
+};
+
+bool ParseTrigger(std::wstring const & text, TriggerSpec & spec);
+
+// One look at the target
+struct ProcessSample
+{
+    long long time;        // steady clock microseconds
+    unsigned long long cpuTime; // user and kernel time in microseconds
+    double cpuPercent;     // since the previous sample
+    unsigned long long rss;
+    unsigned long long commit;
+    unsigned int handles;
+    unsigned int threads;
+};
+
+// Samples a process cheaply: one read of /proc/<pid>/stat on Linux, a few
+// queries on an open handle on Windows. Handles and threads cost a
+// directory listing or a Toolhelp snapshot on the respective platform and
+// are only counted when asked for.
+class ProcessSampler
+{
+public:
+    explicit ProcessSampler(int pid);
+
+    ~ProcessSampler();
+
+public:
+    bool Sample(ProcessSample & sample, bool bCountHandles, bool bCountThreads);
+
+    // Waits up to milliseconds for the process to exit. Returns true once
+    // it did, bInterrupted is set when a signal cut the wait short.
+    bool WaitExit(unsigned int milliseconds, bool & bInterrupted);
+
+    // After an exit, false only when the exit is known to be a clean one.
+    // Linux can't tell without being the parent, so it is always true.
+    bool MayHaveCrashed();
+
+private:
+    int m_pid;
+#ifdef _WIN32
+    void * m_hProcess;
+#else
+    int m_pidfd; // -1 where pidfd_open is missing
+    long m_nTicksPerSecond;
+    long m_nPageSize;
+#endif
+    ProcessSample m_last;
+};
+
+// Samples the target every tick and dumps when a trigger fires, in place
+// of dumping every interval. Stops when the target exits, every trigger
+// has taken its maximum of dumps or a signal arrives. An exit is reported
+// but not dumped, that would take staying attached as a debugger.
+//
+// With a recorder the full dumpper also dumps every interval into it, and
+// the recorded dumps are written out when a trigger fires, the target may
+// have crashed or SIGUSR1 (Ctrl+Break on Windows) arrives.
+class TriggerEngine
+{
+public:
+    // light takes the stack-only dumps of escalating triggers
+    TriggerEngine(MiniDumpper & full, MiniDumpper & light, std::vector<TriggerSpec> const & triggers);
+
+public:
+    // The full dumpper has to keep its dumps in recorder
+    void SetRecorder(DumpRecorder * recorder, unsigned int intervalSeconds);
+
+    void Run(unsigned int tickMilliseconds);
+
+private:
+    struct TriggerState
+    {
+        TriggerSpec spec;
+        long long since;    // when the condition started to hold, 0 while it doesn't
+        long long lastDump; // 0 before the first
+        long long lightDump; // stack-only dump awaiting escalation, 0 for none
+        int dumps;
+    };
+
+    double Value(TriggerKind kind, ProcessSample const & sample) const;
+
+    // Dumps if the trigger is due, returns true while it may fire again
+    bool Check(TriggerState & trigger, ProcessSample const & sample);
+
+    void FlushRecorder(const wchar_t * reason);
+
+private:
+    MiniDumpper & m_full;
+    MiniDumpper & m_light;
+    std::vector<TriggerState> m_triggers;
+    DumpRecorder * m_pRecorder;
+    unsigned int m_nInterval;
+    bool m_bFired; // a trigger dumped during the current tick
+};
+
+#endif // DUMPTRIGGER_H
@@ -0,0 +1,545 @@
+#include "fontbench.h"
+#include "fontnames.h"
+#include "fontscanner.h"
+#include "fonttext.h"
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const uint32_t kTagName = 0x6e616d65; // 'name'
+
+// Each group is parsed for at least this long
+const double kBenchSeconds = 0.2;
+
+struct NameEntry
+{
+    uint16_t platformId;
+    uint16_t encodingId;
+    uint16_t languageId;
+    uint16_t nameId;
+    std::vector<unsigned char> bytes;
+};
+
+struct CorpusGroup
+{
+    std::wstring name;
+    std::vector<std::vector<unsigned char> > tables;
+};
+
+void PutUShort(std::vector<unsigned char> &out, uint16_t value)
+{
+    out.push_back(uint8_t(value >> 8));
+    out.push_back(uint8_t(value));
+}
+
+void SetUShort(std::vector<unsigned char> &out, size_t offset, uint16_t value)
+{
+    out[offset] = uint8_t(value >> 8);
+    out[offset + 1] = uint8_t(value);
+}
+
+std::vector<unsigned char> Utf16Be(const wchar_t *text)
+{
+    std::vector<unsigned char> out;
+    for (; *text; ++text) {
+        uint32_t c = uint32_t(*text);
+        if (c > 0xffff) {
+            c -= 0x10000;
+            PutUShort(out, uint16_t(0xd800 + (c >> 10)));
+            PutUShort(out, uint16_t(0xdc00 + (c & 0x3ff)));
+        } else {
+            PutUShort(out, uint16_t(c));
+        }
+    }
+    return out;
+}
+
+std::vector<unsigned char> Bytes(const char *text, size_t length)
+{
+    return std::vector<unsigned char>(text, text + length);
+}
+
+NameEntry Entry(uint16_t platformId, uint16_t encodingId, uint16_t languageId, uint16_t nameId,
+                std::vector<unsigned char> const & bytes)
+{
+    NameEntry entry = { platformId, encodingId, languageId, nameId, bytes };
+    return entry;
+}
+
+// Version 0 table with the strings laid out after the records
+std::vector<unsigned char> BuildTable(std::vector<NameEntry> const & entries)
+{
+    std::vector<unsigned char> table;
+    PutUShort(table, 0);
+    PutUShort(table, uint16_t(entries.size()));
+    PutUShort(table, uint16_t(6 + entries.size() * 12));
+    std::vector<unsigned char> strings;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        PutUShort(table, entries[i].platformId);
+        PutUShort(table, entries[i].encodingId);
+        PutUShort(table, entries[i].languageId);
+        PutUShort(table, entries[i].nameId);
+        PutUShort(table, uint16_t(entries[i].bytes.size()));
+        PutUShort(table, uint16_t(strings.size()));
+        strings.insert(strings.end(), entries[i].bytes.begin(), entries[i].bytes.end());
+    }
+    table.insert(table.end(), strings.begin(), strings.end());
+    return table;
+}
+
+std::vector<NameEntry> EnglishEntries()
+{
+    std::vector<NameEntry> entries;
+    const wchar_t *names[] = { L"Bench Sans", L"Bold Italic", L"Bench Sans Bold Italic", L"Bench Sans",
+                               L"Bold Italic" };
+    const uint16_t ids[] = { FamilyId, StyleId, 4, PreferredFamilyId, PreferredStyleId };
+    for (int i = 0; i < 5; ++i) {
+        std::vector<unsigned char> roman;
+        for (const wchar_t *c = names[i]; *c; ++c)
+            roman.push_back(uint8_t(*c));
+        entries.push_back(Entry(PlatformId_Apple, 0, 0, ids[i], roman));
+        entries.push_back(Entry(PlatformId_Microsoft, 1, 0x409, ids[i], Utf16Be(names[i])));
+    }
+    return entries;
+}
+
+std::vector<CorpusGroup> SyntheticCorpus()
+{
+    std::vector<CorpusGroup> groups;
+
+    CorpusGroup english;
+    english.name = L"english";
+    english.tables.push_back(BuildTable(EnglishEntries()));
+    groups.push_back(english);
+
+    // The same family in many languages, some outside the BMP
+    CorpusGroup localized;
+    localized.name = L"localized";
+    {
+        const wchar_t *families[] = {
+            L"Bench Sans", L"Bench Schrift", L"Police Bench", L"\u30d9\u30f3\u30c1 \u30b4\u30b7\u30c3\u30af",
+            L"\u672c\u5947\u9ed1\u4f53", L"\ubca4\uce58 \uace0\ub515", L"\u0411\u0435\u043d\u0447",
+            L"\u0393\u03c1\u03b1\u03bc\u03bc\u03b1", L"\u05d2\u05d5\u05e4\u05df", L"\u062e\u0637 \u0628\u0646\u0634",
+            L"\U0002000b\U00020089 Sans", L"\U0001f600 Emoji"
+        };
+        std::vector<NameEntry> entries = EnglishEntries();
+        for (uint16_t language = 0; language < 48; ++language) {
+            const wchar_t *family = families[language % 12];
+            entries.push_back(Entry(PlatformId_Microsoft, 1, uint16_t(0x401 + language), FamilyId, Utf16Be(family)));
+            entries.push_back(Entry(PlatformId_Microsoft, 1, uint16_t(0x401 + language), StyleId,
+                                    Utf16Be(L"\u0424\u0435\u0442\u0442 Bold")));
+            entries.push_back(Entry(PlatformId_Microsoft, 10, uint16_t(0x401 + language), PreferredFamilyId,
+                                    Utf16Be(family)));
+        }
+        localized.tables.push_back(BuildTable(entries));
+    }
+    groups.push_back(localized);
+
+    // Every record the 16 bit string offset leaves room for, all sharing
+    // one string
+    CorpusGroup largest;
+    largest.name = L"max records";
+    {
+        const uint16_t count = (0xffff - 6) / 12;
+        std::vector<unsigned char> table;
+        PutUShort(table, 0);
+        PutUShort(table, count);
+        PutUShort(table, uint16_t(6 + count * 12));
+        std::vector<unsigned char> name = Utf16Be(L"Bench Sans");
+        for (uint16_t i = 0; i < count; ++i) {
+            PutUShort(table, PlatformId_Microsoft);
+            PutUShort(table, 1);
+            PutUShort(table, uint16_t(0x400 + (i & 0x3ff)));
+            PutUShort(table, uint16_t(i % 26));
+            PutUShort(table, uint16_t(name.size()));
+            PutUShort(table, 0);
+        }
+        table.insert(table.end(), name.begin(), name.end());
+        largest.tables.push_back(table);
+    }
+    groups.push_back(largest);
+
+    CorpusGroup malformed;
+    malformed.name = L"malformed";
+    {
+        std::vector<unsigned char> base = BuildTable(EnglishEntries());
+
+        // More records than the table holds
+        std::vector<unsigned char> table = base;
+        SetUShort(table, 2, 0xffff);
+        malformed.tables.push_back(table);
+
+        // String offset inside the records
+        table = base;
+        SetUShort(table, 4, 8);
+        malformed.tables.push_back(table);
+
+        // String offset past the end
+        table = base;
+        SetUShort(table, 4, 0xfff0);
+        malformed.tables.push_back(table);
+
+        // Strings overlapping each other at odd offsets, and one running
+        // past the end
+        table = base;
+        uint16_t count = qt_getUShort(&table[2]);
+        uint16_t strings = uint16_t(table.size() - qt_getUShort(&table[4]));
+        for (uint16_t i = 0; i < count; ++i) {
+            SetUShort(table, 6 + i * 12 + 8, uint16_t(strings - i));
+            SetUShort(table, 6 + i * 12 + 10, uint16_t(i));
+        }
+        SetUShort(table, 6 + 8, 0xffff);
+        malformed.tables.push_back(table);
+
+        // Header only, and less than a header
+        malformed.tables.push_back(std::vector<unsigned char>(base.begin(), base.begin() + 6));
+        malformed.tables.push_back(std::vector<unsigned char>(base.begin(), base.begin() + 3));
+
+        // Unknown version
+        table = base;
+        SetUShort(table, 0, 7);
+        malformed.tables.push_back(table);
+    }
+    groups.push_back(malformed);
+
+    // Every platform encoding, the legacy ones aren't decoded
+    CorpusGroup encodings;
+    encodings.name = L"encodings";
+    {
+        std::vector<NameEntry> entries;
+        std::vector<unsigned char> roman = Bytes("Caf\x8e \xa5 \xf0 \xff", 10);
+        entries.push_back(Entry(PlatformId_Apple, 0, 0, FamilyId, roman));
+        entries.push_back(Entry(PlatformId_Apple, 1, 11, FamilyId, Bytes("\x83\x74\x83\x48", 4)));
+        for (uint16_t encoding = 0; encoding < 7; ++encoding)
+            entries.push_back(Entry(PlatformId_Unicode, encoding, 0, FamilyId, Utf16Be(L"Bench \U0001d400")));
+        for (uint16_t encoding = 0; encoding < 11; ++encoding)
+            entries.push_back(Entry(PlatformId_Microsoft, encoding, 0x409, StyleId, Utf16Be(L"Regular")));
+        // Unpaired surrogates, a pair split by another unit and an odd
+        // byte count
+        std::vector<unsigned char> broken = Utf16Be(L"A");
+        PutUShort(broken, 0xd800);
+        PutUShort(broken, 0x0042);
+        PutUShort(broken, 0xdc00);
+        PutUShort(broken, 0xd83d);
+        broken.push_back(0xde);
+        entries.push_back(Entry(PlatformId_Microsoft, 1, 0x409, FamilyId, broken));
+        entries.push_back(Entry(PlatformId_Microsoft, 1, 0x409, PreferredFamilyId, std::vector<unsigned char>()));
+        entries.push_back(Entry(7, 0, 0, FamilyId, Utf16Be(L"Unknown platform")));
+        encodings.tables.push_back(BuildTable(entries));
+    }
+    groups.push_back(encodings);
+
+    return groups;
+}
+
+CorpusGroup FileCorpus(std::vector<std::wstring> const & paths)
+{
+    CorpusGroup group;
+    group.name = L"font files";
+    std::vector<std::wstring> files = paths;
+    if (files.empty()) {
+        FontScanner scanner;
+        scanner.AddDefaultDirectories();
+        std::vector<FontFile> listed = scanner.ListFiles();
+        for (size_t i = 0; i < listed.size(); ++i)
+            files.push_back(listed[i].path);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        MappedFile file;
+        if (!file.Open(files[i]))
+            continue;
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(file.Data());
+        uint32_t count = FontFaceCount(data, file.Size());
+        for (uint32_t face = 0; face < count; ++face) {
+            const unsigned char *table = nullptr;
+            uint32_t length = 0;
+            if (FindFontTable(data, file.Size(), face, kTagName, table, length))
+                group.tables.push_back(std::vector<unsigned char>(table, table + length));
+        }
+    }
+    return group;
+}
+
+// Buffer whose contents end right before an inaccessible page
+class GuardedBuffer
+{
+public:
+    GuardedBuffer()
+        : m_base(nullptr)
+        , m_nCapacity(0)
+        , m_nPageSize(0)
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        m_nPageSize = info.dwPageSize;
+#else
+        m_nPageSize = size_t(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    ~GuardedBuffer()
+    {
+        Free();
+    }
+
+    const unsigned char * Assign(const unsigned char *data, size_t size)
+    {
+        if ((size > m_nCapacity || m_base == nullptr) && !Allocate(size))
+            return nullptr;
+        unsigned char *at = m_base + m_nCapacity - size;
+        if (size)
+            memcpy(at, data, size);
+        return at;
+    }
+
+private:
+    bool Allocate(size_t size)
+    {
+        Free();
+        size_t capacity = (std::max(size, size_t(1)) + m_nPageSize - 1) / m_nPageSize * m_nPageSize;
+#ifdef _WIN32
+        unsigned char *base = static_cast<unsigned char *>(VirtualAlloc(nullptr, capacity + m_nPageSize,
+                                                                        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+        DWORD old;
+        if (base == nullptr)
+            return false;
+        if (!VirtualProtect(base + capacity, m_nPageSize, PAGE_NOACCESS, &old)) {
+            VirtualFree(base, 0, MEM_RELEASE);
+            return false;
+        }
+#else
+        void *mapped = mmap(nullptr, capacity + m_nPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        unsigned char *base = static_cast<unsigned char *>(mapped);
+        if (mprotect(base + capacity, m_nPageSize, PROT_NONE) != 0) {
+            munmap(base, capacity + m_nPageSize);
+            return false;
+        }
+#endif
+        m_base = base;
+        m_nCapacity = capacity;
+        return true;
+    }
+
+    void Free()
+    {
+        if (m_base == nullptr)
+            return;
+#ifdef _WIN32
+        VirtualFree(m_base, 0, MEM_RELEASE);
+#else
+        munmap(m_base, m_nCapacity + m_nPageSize);
+#endif
+        m_base = nullptr;
+        m_nCapacity = 0;
+    }
+
+private:
+    GuardedBuffer(GuardedBuffer const &);
+    GuardedBuffer & operator=(GuardedBuffer const &);
+
+private:
+    unsigned char *m_base;
+    size_t m_nCapacity;
+    size_t m_nPageSize;
+};
+
+// xorshift64*, the mutations are the same on every run
+class Random
+{
+public:
+    explicit Random(uint64_t seed)
+        : m_state(seed | 1)
+    {
+    }
+
+    uint64_t Next()
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return m_state * 0x2545f4914f6cdd1dULL;
+    }
+
+    size_t Below(size_t n)
+    {
+        return n ? size_t(Next() % n) : 0;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+void Mutate(std::vector<unsigned char> &table, Random &random)
+{
+    if (table.empty()) {
+        table.push_back(uint8_t(random.Next()));
+        return;
+    }
+    // Mostly hit the header and the records, where the offsets are
+    size_t records = std::min(table.size(), size_t(6 + 12 * 64));
+    switch (random.Below(5)) {
+    case 0:
+        table[random.Below(table.size())] ^= uint8_t(1 << random.Below(8));
+        break;
+    case 1:
+        if (records >= 2) {
+            size_t at = random.Below(records - 1) & ~size_t(1);
+            static const uint16_t values[] = { 0, 1, 0x7fff, 0x8000, 0xfffe, 0xffff };
+            SetUShort(table, at, values[random.Below(6)]);
+        }
+        break;
+    case 2:
+        table.resize(random.Below(table.size()));
+        break;
+    case 3:
+        if (table.size() >= 6 + 12) {
+            size_t record = 6 + 12 * random.Below((table.size() - 6) / 12);
+            if (record + 12 <= table.size())
+                SetUShort(table, record + 8 + 2 * random.Below(2), uint16_t(random.Next()));
+        }
+        break;
+    default: {
+        size_t from = random.Below(table.size());
+        size_t to = random.Below(table.size());
+        size_t length = std::min(random.Below(64), table.size() - std::max(from, to));
+        memmove(&table[to], &table[from], length);
+        break;
+    }
+    }
+}
+
+volatile size_t g_sink;
+
+} // namespace
+
+int CheckFontNameTable(const unsigned char *data, size_t size)
+{
+    uint32_t bytes = uint32_t(std::min(size, size_t(0xffffffff)));
+    FontNames names = qt_getCanonicalFontNames(data, bytes);
+    size_t total = names.name.size() + names.style.size() + names.preferredName.size() + names.preferredStyle.size();
+
+    FontNameTable table;
+    if (table.Open(data, bytes)) {
+        std::wstring wide;
+        std::string utf8;
+        for (uint16_t i = 0; i < table.Count(); ++i) {
+            FontNameRecord record;
+            if (!table.Record(i, record))
+                continue;
+            if (DecodeFontName(record, wide))
+                total += wide.size();
+            if (DecodeFontNameUtf8(record, utf8))
+                total += utf8.size();
+        }
+    }
+    g_sink = total;
+    return 0;
+}
+
+void BenchmarkFontNames(std::vector<std::wstring> const & files, unsigned int mutations)
+{
+    typedef std::chrono::steady_clock Clock;
+    std::vector<CorpusGroup> groups = SyntheticCorpus();
+    groups.push_back(FileCorpus(files));
+
+    wprintf(L"UTF-16 kernels: %hs\n", FontText::KernelName());
+    wprintf(L"%-12ls %7ls %10ls %14ls %12ls %14ls %12ls\n", L"group", L"tables", L"bytes", L"canonical/s",
+            L"MB/s", L"names/s", L"MB/s");
+    for (size_t g = 0; g < groups.size(); ++g) {
+        CorpusGroup const & group = groups[g];
+        size_t bytes = 0;
+        for (size_t t = 0; t < group.tables.size(); ++t)
+            bytes += group.tables[t].size();
+        if (bytes == 0) {
+            wprintf(L"%-12ls %7d %10d\n", group.name.c_str(), int(group.tables.size()), 0);
+            continue;
+        }
+
+        // Canonical names only, as the font scanner reads them
+        size_t runs = 0;
+        Clock::time_point start = Clock::now();
+        double seconds = 0;
+        while (seconds < kBenchSeconds) {
+            for (size_t t = 0; t < group.tables.size(); ++t) {
+                FontNames names = qt_getCanonicalFontNames(group.tables[t].data(), uint32_t(group.tables[t].size()));
+                g_sink = names.name.size();
+            }
+            ++runs;
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        double canonicalTables = double(runs) * group.tables.size() / seconds;
+        double canonicalBytes = double(runs) * bytes / seconds;
+
+        // Every record decoded to UTF-8, as the name index reads them
+        size_t names = 0;
+        size_t nameBytes = 0;
+        runs = 0;
+        start = Clock::now();
+        seconds = 0;
+        std::string utf8;
+        while (seconds < kBenchSeconds) {
+            for (size_t t = 0; t < group.tables.size(); ++t) {
+                FontNameTable table;
+                if (!table.Open(group.tables[t].data(), uint32_t(group.tables[t].size())))
+                    continue;
+                for (uint16_t i = 0; i < table.Count(); ++i) {
+                    FontNameRecord record;
+                    if (table.Record(i, record) && DecodeFontNameUtf8(record, utf8)) {
+                        ++names;
+                        nameBytes += record.length;
+                    }
+                }
+            }
+            ++runs;
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        wprintf(L"%-12ls %7d %10llu %14.0f %12.1f %14.0f %12.1f\n", group.name.c_str(), int(group.tables.size()),
+                static_cast<unsigned long long>(bytes), canonicalTables, canonicalBytes / 1e6, names / seconds,
+                nameBytes / seconds / 1e6);
+    }
+
+    // Mutated copies of every table, parsed from guarded buffers
+    GuardedBuffer buffer;
+    Random random(0x6e616d65);
+    size_t checked = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t g = 0; g < groups.size(); ++g) {
+        for (size_t t = 0; t < groups[g].tables.size(); ++t) {
+            std::vector<unsigned char> table = groups[g].tables[t];
+            for (unsigned int m = 0; m <= mutations; ++m) {
+                const unsigned char *data = buffer.Assign(table.data(), table.size());
+                if (data == nullptr) {
+                    wprintf(L"Couldn't allocate a guarded buffer\n");
+                    return;
+                }
+                CheckFontNameTable(data, table.size());
+                ++checked;
+                // Start over from the original now and then, so mutations
+                // don't drift into noise
+                if (random.Below(8) == 0)
+                    table = groups[g].tables[t];
+                Mutate(table, random);
+            }
+        }
+    }
+    wprintf(L"Parsed %llu mutated tables in %.1f s without reading out of bounds\n",
+            static_cast<unsigned long long>(checked), std::chrono::duration<double>(Clock::now() - start).count());
+}
@@ -0,0 +1,27 @@
+#ifndef FONTBENCH_H
+#define FONTBENCH_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+// Runs every name table parser over one input: qt_getCanonicalFontNames,
+// FontNameTable and both decoders. The entry point of fontnamefuzz.cpp,
+// always returns 0.
+int CheckFontNameTable(const unsigned char *data, size_t size);
+
+// Measures the name table parsers and checks them against malformed
+// tables.
+//
+// The corpus holds synthetic tables built in memory (typical English
+// names, many languages, the largest valid record count, counts that
+// overflow the table, overlapping and truncated strings, every platform
+// encoding) and the name tables of files, or of the installed fonts when
+// files is empty. Each group reports names and bytes per second.
+//
+// Then every table is mutated the given number of times and parsed again.
+// Each input is copied to the end of a page followed by an inaccessible
+// one, so reading past a table crashes right away.
+void BenchmarkFontNames(std::vector<std::wstring> const & files, unsigned int mutations);
+
+#endif // FONTBENCH_H
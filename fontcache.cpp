@@ -0,0 +1,312 @@
+#include "fontcache.h"
+#include "dumpoutput.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const uint32_t kCacheMagic = 0x31434e46; // "FNC1"
+const uint32_t kCacheVersion = 1;
+
+// Names stored per face, in the order of FontNames
+const int kNameCount = 4;
+
+std::wstring const & FaceName(FontNames const & names, int i)
+{
+    switch (i) {
+    case 0: return names.name;
+    case 1: return names.style;
+    case 2: return names.preferredName;
+    default: return names.preferredStyle;
+    }
+}
+
+int ComparePath(wchar_t const * a, size_t aLength, wchar_t const * b, size_t bLength)
+{
+    int c = wmemcmp(a, b, std::min(aLength, bLength));
+    if (c != 0)
+        return c;
+    return aLength < bLength ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+bool PathLess(FontFile const * a, FontFile const * b)
+{
+    return ComparePath(a->path.data(), a->path.size(), b->path.data(), b->path.size()) < 0;
+}
+
+} // namespace
+
+struct FontNameCache::Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t charSize;
+    uint32_t fileCount;
+    uint32_t faceCount;
+    uint32_t charCount;
+};
+
+struct FontNameCache::FileRecord
+{
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t path;
+    uint32_t pathLength;
+    uint32_t firstFace;
+    uint32_t faceCount;
+};
+
+struct FontNameCache::FaceRecord
+{
+    uint32_t faceIndex;
+    uint32_t names[kNameCount][2]; // offset and length
+};
+
+FontNameCache::FontNameCache()
+    : m_header(nullptr)
+    , m_files(nullptr)
+    , m_faces(nullptr)
+    , m_strings(nullptr)
+{
+}
+
+bool FontNameCache::Load(std::wstring const & path)
+{
+    static_assert(sizeof(Header) == 24, "cache header must be 24 bytes");
+    static_assert(sizeof(FileRecord) == 32, "cache file record must be 32 bytes");
+    static_assert(sizeof(FaceRecord) == 36, "cache face record must be 36 bytes");
+
+    Close();
+    if (!m_file.Open(path))
+        return false;
+
+    char const * data = m_file.Data();
+    uint64_t size = m_file.Size();
+    if (size < sizeof(Header))
+        goto invalid;
+    {
+        Header const * header = reinterpret_cast<Header const *>(data);
+        if (header->magic != kCacheMagic || header->version != kCacheVersion || header->charSize != sizeof(wchar_t))
+            goto invalid;
+        uint64_t facesOffset = sizeof(Header) + uint64_t(header->fileCount) * sizeof(FileRecord);
+        // Strings start aligned for wchar_t
+        uint64_t stringsOffset = facesOffset + uint64_t(header->faceCount) * sizeof(FaceRecord);
+        stringsOffset = (stringsOffset + sizeof(wchar_t) - 1) & ~uint64_t(sizeof(wchar_t) - 1);
+        if (stringsOffset + uint64_t(header->charCount) * sizeof(wchar_t) != size)
+            goto invalid;
+
+        m_header = header;
+        m_files = reinterpret_cast<FileRecord const *>(data + sizeof(Header));
+        m_faces = reinterpret_cast<FaceRecord const *>(data + facesOffset);
+        m_strings = reinterpret_cast<wchar_t const *>(data + stringsOffset);
+    }
+    return true;
+
+invalid:
+    Close();
+    return false;
+}
+
+void FontNameCache::Close()
+{
+    m_file.Close();
+    m_header = nullptr;
+    m_files = nullptr;
+    m_faces = nullptr;
+    m_strings = nullptr;
+}
+
+uint32_t FontNameCache::FileCount() const
+{
+    return m_header ? m_header->fileCount : 0;
+}
+
+std::wstring FontNameCache::String(uint32_t offset, uint32_t length) const
+{
+    if (uint64_t(offset) + length > m_header->charCount)
+        return std::wstring();
+    return std::wstring(m_strings + offset, length);
+}
+
+bool FontNameCache::Find(FontFile const & file, std::vector<FontFace> & faces) const
+{
+    if (m_header == nullptr)
+        return false;
+
+    // Binary search of the sorted file records
+    uint32_t lo = 0;
+    uint32_t hi = m_header->fileCount;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        FileRecord const & record = m_files[mid];
+        int c = -1;
+        if (uint64_t(record.path) + record.pathLength <= m_header->charCount)
+            c = ComparePath(m_strings + record.path, record.pathLength, file.path.data(), file.path.size());
+        if (c == 0) {
+            if (record.size != file.size || record.mtime != file.mtime)
+                return false;
+            if (uint64_t(record.firstFace) + record.faceCount > m_header->faceCount)
+                return false;
+            for (uint32_t i = 0; i < record.faceCount; ++i) {
+                FaceRecord const & faceRecord = m_faces[record.firstFace + i];
+                FontFace face;
+                face.path = file.path;
+                face.faceIndex = faceRecord.faceIndex;
+                face.names.name = String(faceRecord.names[0][0], faceRecord.names[0][1]);
+                face.names.style = String(faceRecord.names[1][0], faceRecord.names[1][1]);
+                face.names.preferredName = String(faceRecord.names[2][0], faceRecord.names[2][1]);
+                face.names.preferredStyle = String(faceRecord.names[3][0], faceRecord.names[3][1]);
+                faces.push_back(face);
+            }
+            return true;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+bool FontNameCache::Save(std::wstring const & path, std::vector<FontFile> const & files,
+                         std::vector<FontFace> const & faces)
+{
+    // Faces of each file, faces follow the order of files
+    std::vector<std::pair<size_t, size_t> > fileFaces(files.size(), std::make_pair(size_t(0), size_t(0)));
+    size_t f = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        fileFaces[i].first = f;
+        while (f < faces.size() && faces[f].path == files[i].path)
+            ++f;
+        fileFaces[i].second = f - fileFaces[i].first;
+    }
+    if (f != faces.size())
+        return false;
+
+    std::vector<FontFile const *> sorted(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+        sorted[i] = &files[i];
+    std::sort(sorted.begin(), sorted.end(), PathLess);
+    // The same file listed twice is cached once
+    sorted.erase(std::unique(sorted.begin(), sorted.end(), [](FontFile const * a, FontFile const * b) {
+        return a->path == b->path;
+    }), sorted.end());
+
+    std::vector<FileRecord> fileRecords;
+    std::vector<FaceRecord> faceRecords;
+    std::wstring strings;
+    fileRecords.reserve(sorted.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        size_t index = sorted[i] - &files[0];
+        FileRecord record;
+        record.size = sorted[i]->size;
+        record.mtime = sorted[i]->mtime;
+        record.path = uint32_t(strings.size());
+        record.pathLength = uint32_t(sorted[i]->path.size());
+        record.firstFace = uint32_t(faceRecords.size());
+        record.faceCount = uint32_t(fileFaces[index].second);
+        strings += sorted[i]->path;
+        for (size_t j = 0; j < fileFaces[index].second; ++j) {
+            FontFace const & face = faces[fileFaces[index].first + j];
+            FaceRecord faceRecord;
+            faceRecord.faceIndex = face.faceIndex;
+            for (int n = 0; n < kNameCount; ++n) {
+                std::wstring const & name = FaceName(face.names, n);
+                faceRecord.names[n][0] = uint32_t(strings.size());
+                faceRecord.names[n][1] = uint32_t(name.size());
+                strings += name;
+            }
+            faceRecords.push_back(faceRecord);
+        }
+        fileRecords.push_back(record);
+    }
+
+    Header header;
+    header.magic = kCacheMagic;
+    header.version = kCacheVersion;
+    header.charSize = sizeof(wchar_t);
+    header.fileCount = uint32_t(fileRecords.size());
+    header.faceCount = uint32_t(faceRecords.size());
+    header.charCount = uint32_t(strings.size());
+
+    uint64_t end = sizeof(Header) + fileRecords.size() * sizeof(FileRecord) + faceRecords.size() * sizeof(FaceRecord);
+    size_t padding = size_t(((end + sizeof(wchar_t) - 1) & ~uint64_t(sizeof(wchar_t) - 1)) - end);
+    static const char zeros[sizeof(wchar_t)] = { 0 };
+
+    // The mapping is dropped before the file is replaced, Windows doesn't
+    // replace mapped files
+    Close();
+
+    // Written next to the cache and renamed over it, so readers see the
+    // old or the new cache and never a partial one
+    std::wstring temporary = path + L".tmp";
+    FileDumpOutput output;
+    if (!output.Open(temporary))
+        return false;
+    bool ok = output.Write(&header, sizeof(header));
+    if (ok && !fileRecords.empty())
+        ok = output.Write(&fileRecords[0], fileRecords.size() * sizeof(FileRecord));
+    if (ok && !faceRecords.empty())
+        ok = output.Write(&faceRecords[0], faceRecords.size() * sizeof(FaceRecord));
+    if (ok && padding)
+        ok = output.Write(zeros, padding);
+    if (ok && !strings.empty())
+        ok = output.Write(strings.data(), strings.size() * sizeof(wchar_t));
+    ok = output.Finish() && ok;
+
+#ifdef _WIN32
+    if (ok)
+        ok = MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+    if (!ok)
+        DeleteFileW(temporary.c_str());
+#else
+    if (ok)
+        ok = rename(NarrowPath(temporary).c_str(), NarrowPath(path).c_str()) == 0;
+    if (!ok)
+        unlink(NarrowPath(temporary).c_str());
+#endif
+    return ok;
+}
+
+std::wstring FontNameCache::DefaultPath()
+{
+#ifdef _WIN32
+    wchar_t local[MAX_PATH];
+    DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", local, MAX_PATH);
+    if (n == 0 || n >= MAX_PATH)
+        return std::wstring();
+    return std::wstring(local) + L"\\WinDebugFontNames.cache";
+#else
+    std::string directory;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        directory = xdg;
+    } else {
+        const char *home = getenv("HOME");
+        if (home == nullptr || *home == '\0')
+            return std::wstring();
+        directory = std::string(home) + "/.cache";
+    }
+    if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+        return std::wstring();
+    std::string path = directory + "/windebug-fontnames.cache";
+    size_t n = mbstowcs(nullptr, path.c_str(), 0);
+    if (n == size_t(-1))
+        return std::wstring();
+    std::wstring wide(n, L'\0');
+    mbstowcs(&wide[0], path.c_str(), n);
+    return wide;
+#endif
+}
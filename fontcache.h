@@ -0,0 +1,62 @@
+#ifndef FONTCACHE_H
+#define FONTCACHE_H
+
+#include "fontscanner.h"
+#include "mappedfile.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Binary cache of the names read from font files, keyed by path, size,
+// modification time and face index.
+//
+// The cache file is mapped and searched in place: a header, the file
+// records sorted by path, the face records and one pool of wide
+// characters all strings point into. Loading costs one mapping whatever
+// the number of fonts, so a warm start only lists the font directories.
+//
+// Strings are stored as wchar_t, a cache written with a different
+// wchar_t size is ignored like any other invalid cache.
+class FontNameCache
+{
+public:
+    FontNameCache();
+
+public:
+    bool Load(std::wstring const & path);
+
+    void Close();
+
+    // Appends the cached faces of file, false if the file isn't cached or
+    // changed since
+    bool Find(FontFile const & file, std::vector<FontFace> & faces) const;
+
+    // Number of files in the loaded cache
+    uint32_t FileCount() const;
+
+    // Replaces the cache at path with the faces of files, faces being in
+    // file order as returned by FontScanner::Scan. Files without faces are
+    // recorded too so they aren't parsed again.
+    bool Save(std::wstring const & path, std::vector<FontFile> const & files,
+              std::vector<FontFace> const & faces);
+
+    // Per user cache location, empty if there is none
+    static std::wstring DefaultPath();
+
+private:
+    struct Header;
+    struct FileRecord;
+    struct FaceRecord;
+
+    std::wstring String(uint32_t offset, uint32_t length) const;
+
+private:
+    MappedFile m_file;
+    Header const * m_header;
+    FileRecord const * m_files;
+    FaceRecord const * m_faces;
+    wchar_t const * m_strings;
+};
+
+#endif // FONTCACHE_H
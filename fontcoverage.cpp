@@ -0,0 +1,580 @@
+#include "fontcoverage.h"
+#include "dumpoutput.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const uint32_t kTagCmap = 0x636d6170; // 'cmap'
+const uint32_t kTagOs2 = 0x4f532f32;  // 'OS/2'
+const uint32_t kTagName = 0x6e616d65; // 'name'
+
+const uint32_t kMaxCodepoint = 0x10ffff;
+const uint32_t kBlockShift = 8;
+const uint32_t kBlockCount = (kMaxCodepoint >> kBlockShift) + 1;
+
+// Files parsed by one task
+const size_t kFilesPerTask = 8;
+
+const uint32_t kIndexMagic = 0x31564346; // "FCV1"
+const uint32_t kIndexVersion = 1;
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t charSize;
+    uint32_t faceCount;
+    uint32_t rangeCount;
+    uint32_t charCount;
+};
+
+struct IndexFace
+{
+    uint32_t path;
+    uint32_t pathLength;
+    uint32_t family;
+    uint32_t familyLength;
+    uint32_t style;
+    uint32_t styleLength;
+    uint32_t faceIndex;
+    uint32_t rangeCount;
+    uint32_t codepoints;
+    uint16_t weight;
+    uint16_t width;
+    uint32_t italic;
+};
+
+struct ParsedFace
+{
+    FontCoverageFace face;
+    std::vector<CodepointRange> ranges;
+};
+
+// Codepoints of one face in one block
+struct BlockMask
+{
+    uint32_t block;
+    uint32_t face;
+    uint64_t bits[4];
+
+    // Block, then identical masks together, then face order
+    bool operator<(BlockMask const & o) const
+    {
+        if (block != o.block)
+            return block < o.block;
+        int c = memcmp(bits, o.bits, sizeof(bits));
+        if (c != 0)
+            return c < 0;
+        return face < o.face;
+    }
+};
+
+inline bool SameBits(BlockMask const & a, BlockMask const & b)
+{
+    return memcmp(a.bits, b.bits, sizeof(a.bits)) == 0;
+}
+
+inline int CountTrailingZeros(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return int(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+bool RangeBefore(CodepointRange const & a, CodepointRange const & b)
+{
+    return a.first < b.first;
+}
+
+void MergeRanges(std::vector<CodepointRange> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end(), RangeBefore);
+    size_t w = 0;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        if (w > 0 && ranges[r].first <= ranges[w - 1].last + 1)
+            ranges[w - 1].last = std::max(ranges[w - 1].last, ranges[r].last);
+        else
+            ranges[w++] = ranges[r];
+    }
+    ranges.resize(w);
+}
+
+void AddCodepoint(std::vector<CodepointRange> &ranges, uint32_t codepoint)
+{
+    if (!ranges.empty() && ranges.back().last + 1 == codepoint) {
+        ranges.back().last = codepoint;
+    } else {
+        CodepointRange range = { codepoint, codepoint };
+        ranges.push_back(range);
+    }
+}
+
+// Segments of a format 4 subtable, glyph 0 means not covered
+bool ReadFormat4(const unsigned char *sub, uint32_t bytes, std::vector<CodepointRange> &ranges)
+{
+    if (bytes < 14)
+        return false;
+    uint32_t segCount = qt_getUShort(sub + 6) / 2;
+    if (16 + uint64_t(segCount) * 8 > bytes)
+        return false;
+    const unsigned char *endCodes = sub + 14;
+    const unsigned char *startCodes = endCodes + 2 + segCount * 2;
+    const unsigned char *deltas = startCodes + segCount * 2;
+    const unsigned char *rangeOffsets = deltas + segCount * 2;
+    for (uint32_t i = 0; i < segCount; ++i) {
+        uint32_t start = qt_getUShort(startCodes + i * 2);
+        uint32_t end = qt_getUShort(endCodes + i * 2);
+        uint16_t delta = qt_getUShort(deltas + i * 2);
+        uint16_t rangeOffset = qt_getUShort(rangeOffsets + i * 2);
+        for (uint32_t c = start; c <= end; ++c) {
+            uint16_t glyph;
+            if (rangeOffset == 0) {
+                glyph = uint16_t(c + delta);
+            } else {
+                uint64_t at = uint64_t(rangeOffsets + i * 2 - sub) + rangeOffset + (c - start) * 2;
+                if (at + 2 > bytes)
+                    break;
+                glyph = qt_getUShort(sub + at);
+                if (glyph != 0)
+                    glyph = uint16_t(glyph + delta);
+            }
+            if (glyph != 0)
+                AddCodepoint(ranges, c);
+        }
+    }
+    return true;
+}
+
+bool ReadFormat12(const unsigned char *sub, uint32_t bytes, std::vector<CodepointRange> &ranges)
+{
+    if (bytes < 16)
+        return false;
+    uint32_t count = qt_getULong(sub + 12);
+    if (16 + uint64_t(count) * 12 > bytes)
+        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *group = sub + 16 + i * 12;
+        CodepointRange range = { qt_getULong(group), qt_getULong(group + 4) };
+        // The first codepoint is on .notdef
+        if (qt_getULong(group + 8) == 0)
+            ++range.first;
+        range.last = std::min(range.last, kMaxCodepoint);
+        if (range.first <= range.last)
+            ranges.push_back(range);
+    }
+    return true;
+}
+
+// Preference of a subtable, 0 for subtables that don't map Unicode
+int SubtableScore(uint16_t platformId, uint16_t encodingId, uint16_t format)
+{
+    if (format == 12) {
+        if (platformId == PlatformId_Microsoft && encodingId == 10)
+            return 5;
+        if (platformId == PlatformId_Unicode)
+            return 4;
+    } else if (format == 4) {
+        if (platformId == PlatformId_Microsoft && encodingId == 1)
+            return 3;
+        if (platformId == PlatformId_Unicode)
+            return 2;
+        // Symbol fonts, codepoints in the private use area
+        if (platformId == PlatformId_Microsoft && encodingId == 0)
+            return 1;
+    }
+    return 0;
+}
+
+void ParseFile(FontFile const & file, std::vector<ParsedFace> &faces)
+{
+    MappedFile mapped;
+    if (!mapped.Open(file.path))
+        return;
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(mapped.Data());
+    uint64_t size = mapped.Size();
+    uint32_t count = FontFaceCount(data, size);
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *table = nullptr;
+        uint32_t length = 0;
+        ParsedFace parsed;
+        if (!FindFontTable(data, size, i, kTagCmap, table, length)
+            || !ReadCmapCoverage(table, length, parsed.ranges) || parsed.ranges.empty())
+            continue;
+
+        FontCoverageFace & face = parsed.face;
+        face.path = file.path;
+        face.faceIndex = i;
+        face.weight = 400;
+        face.width = 5;
+        face.italic = false;
+        if (FindFontTable(data, size, i, kTagOs2, table, length) && length >= 64) {
+            face.weight = qt_getUShort(table + 4);
+            face.width = qt_getUShort(table + 6);
+            // Italic or oblique
+            face.italic = (qt_getUShort(table + 62) & 0x201) != 0;
+        }
+        if (FindFontTable(data, size, i, kTagName, table, length)) {
+            FontNames names = qt_getCanonicalFontNames(table, length);
+            bool preferred = !names.preferredName.empty();
+            face.family = preferred ? names.preferredName : names.name;
+            face.style = preferred && !names.preferredStyle.empty() ? names.preferredStyle : names.style;
+        }
+        face.codepoints = 0;
+        for (size_t r = 0; r < parsed.ranges.size(); ++r)
+            face.codepoints += parsed.ranges[r].last - parsed.ranges[r].first + 1;
+        faces.push_back(parsed);
+    }
+}
+
+// Lower is a better fallback
+uint32_t FallbackRank(FontCoverageFace const & face)
+{
+    uint32_t weight = uint32_t(abs(int(face.weight) - 400));
+    uint32_t width = uint32_t(abs(int(face.width) - 5));
+    return (face.italic ? 1u << 24 : 0) + weight * 16 + width;
+}
+
+} // namespace
+
+bool ReadCmapCoverage(const unsigned char *table, uint32_t bytes, std::vector<CodepointRange> &ranges)
+{
+    if (bytes < 4)
+        return false;
+    uint16_t count = qt_getUShort(table + 2);
+    if (4 + uint32_t(count) * 8 > bytes)
+        return false;
+
+    int bestScore = 0;
+    uint32_t bestOffset = 0;
+    uint16_t bestFormat = 0;
+    for (uint16_t i = 0; i < count; ++i) {
+        const unsigned char *record = table + 4 + i * 8;
+        uint32_t offset = qt_getULong(record + 4);
+        if (uint64_t(offset) + 2 > bytes)
+            continue;
+        uint16_t format = qt_getUShort(table + offset);
+        int score = SubtableScore(qt_getUShort(record), qt_getUShort(record + 2), format);
+        if (score > bestScore) {
+            bestScore = score;
+            bestOffset = offset;
+            bestFormat = format;
+        }
+    }
+    if (bestScore == 0)
+        return false;
+
+    ranges.clear();
+    bool ok = bestFormat == 12 ? ReadFormat12(table + bestOffset, bytes - bestOffset, ranges)
+                               : ReadFormat4(table + bestOffset, bytes - bestOffset, ranges);
+    MergeRanges(ranges);
+    return ok;
+}
+
+FontCoverage::FontCoverage()
+    : m_nWords(0)
+{
+    m_rangeOffsets.push_back(0);
+}
+
+void FontCoverage::Build(std::vector<FontFile> const & files, unsigned int threads)
+{
+    std::vector<std::vector<ParsedFace> > results(files.size());
+    {
+        ThreadPool pool(threads);
+        for (size_t t = 0; t < files.size(); t += kFilesPerTask) {
+            FontFile const * first = &files[t];
+            std::vector<ParsedFace> * out = &results[t];
+            size_t count = std::min(kFilesPerTask, files.size() - t);
+            pool.Submit([first, out, count]() {
+                for (size_t i = 0; i < count; ++i)
+                    ParseFile(first[i], out[i]);
+            });
+        }
+        pool.Wait();
+    }
+
+    std::vector<ParsedFace const *> parsed;
+    for (size_t i = 0; i < results.size(); ++i) {
+        for (size_t j = 0; j < results[i].size(); ++j)
+            parsed.push_back(&results[i][j]);
+    }
+    // Fallback order, file order among equals
+    std::stable_sort(parsed.begin(), parsed.end(), [](ParsedFace const * a, ParsedFace const * b) {
+        return FallbackRank(a->face) < FallbackRank(b->face);
+    });
+
+    m_faces.clear();
+    m_ranges.clear();
+    m_rangeOffsets.assign(1, 0);
+    for (size_t i = 0; i < parsed.size(); ++i) {
+        m_faces.push_back(parsed[i]->face);
+        m_ranges.insert(m_ranges.end(), parsed[i]->ranges.begin(), parsed[i]->ranges.end());
+        m_rangeOffsets.push_back(uint32_t(m_ranges.size()));
+    }
+    Index();
+}
+
+void FontCoverage::Index()
+{
+    // Mask of every block each face touches
+    std::vector<BlockMask> masks;
+    for (uint32_t f = 0; f < m_faces.size(); ++f) {
+        for (uint32_t r = m_rangeOffsets[f]; r < m_rangeOffsets[f + 1]; ++r) {
+            CodepointRange const & range = m_ranges[r];
+            for (uint32_t b = range.first >> kBlockShift; b <= range.last >> kBlockShift; ++b) {
+                if (masks.empty() || masks.back().face != f || masks.back().block != b) {
+                    BlockMask mask = { b, f, { 0, 0, 0, 0 } };
+                    masks.push_back(mask);
+                }
+                uint32_t first = std::max(range.first, b << kBlockShift) & 0xff;
+                uint32_t last = std::min(range.last, ((b + 1) << kBlockShift) - 1) & 0xff;
+                for (uint32_t c = first; c <= last; ++c)
+                    masks.back().bits[c / 64] |= uint64_t(1) << (c % 64);
+            }
+        }
+    }
+    // Bucketed by block first, the sorts within a block are small
+    std::vector<uint32_t> blockStart(kBlockCount + 1, 0);
+    for (size_t i = 0; i < masks.size(); ++i)
+        ++blockStart[masks[i].block + 1];
+    for (uint32_t b = 0; b < kBlockCount; ++b)
+        blockStart[b + 1] += blockStart[b];
+    std::vector<BlockMask> sorted(masks.size());
+    std::vector<uint32_t> next(blockStart.begin(), blockStart.end() - 1);
+    for (size_t i = 0; i < masks.size(); ++i)
+        sorted[next[masks[i].block]++] = masks[i];
+    for (uint32_t b = 0; b < kBlockCount; ++b) {
+        if (blockStart[b + 1] - blockStart[b] > 1)
+            std::sort(sorted.begin() + blockStart[b], sorted.begin() + blockStart[b + 1]);
+    }
+    masks.swap(sorted);
+
+    m_nWords = uint32_t((m_faces.size() + 63) / 64);
+    m_blockClasses.assign(kBlockCount + 1, 0);
+    m_classMasks.clear();
+    m_classFaces.clear();
+    uint32_t classes = 0;
+    size_t i = 0;
+    for (uint32_t b = 0; b < kBlockCount; ++b) {
+        m_blockClasses[b] = classes;
+        for (; i < masks.size() && masks[i].block == b; ++i) {
+            if (i == 0 || masks[i - 1].block != b || !SameBits(masks[i - 1], masks[i])) {
+                m_classMasks.insert(m_classMasks.end(), masks[i].bits, masks[i].bits + 4);
+                m_classFaces.resize(m_classFaces.size() + m_nWords, 0);
+                ++classes;
+            }
+            m_classFaces[size_t(classes - 1) * m_nWords + masks[i].face / 64] |= uint64_t(1) << (masks[i].face % 64);
+        }
+    }
+    m_blockClasses[kBlockCount] = classes;
+}
+
+std::vector<uint32_t> FontCoverage::Lookup(uint32_t codepoint, size_t maxFaces) const
+{
+    std::vector<uint32_t> faces;
+    if (codepoint > kMaxCodepoint || m_blockClasses.empty())
+        return faces;
+    uint32_t block = codepoint >> kBlockShift;
+    uint32_t first = m_blockClasses[block];
+    uint32_t last = m_blockClasses[block + 1];
+    uint32_t bit = codepoint & 0xff;
+
+    // Union of the classes covering the codepoint, most blocks have one or
+    // two of them
+    std::vector<uint64_t> covering;
+    for (uint32_t c = first; c < last; ++c) {
+        if (!((m_classMasks[size_t(c) * 4 + bit / 64] >> (bit % 64)) & 1))
+            continue;
+        uint64_t const * words = &m_classFaces[size_t(c) * m_nWords];
+        if (covering.empty())
+            covering.assign(words, words + m_nWords);
+        else
+            for (uint32_t w = 0; w < m_nWords; ++w)
+                covering[w] |= words[w];
+    }
+
+    for (uint32_t w = 0; w < covering.size(); ++w) {
+        uint64_t bits = covering[w];
+        while (bits) {
+            faces.push_back(w * 64 + CountTrailingZeros(bits));
+            if (faces.size() == maxFaces)
+                return faces;
+            bits &= bits - 1;
+        }
+    }
+    return faces;
+}
+
+bool FontCoverage::Covers(uint32_t face, uint32_t codepoint) const
+{
+    std::vector<CodepointRange>::const_iterator begin = m_ranges.begin() + m_rangeOffsets[face];
+    std::vector<CodepointRange>::const_iterator end = m_ranges.begin() + m_rangeOffsets[face + 1];
+    CodepointRange key = { codepoint, codepoint };
+    std::vector<CodepointRange>::const_iterator it = std::upper_bound(begin, end, key, RangeBefore);
+    return it != begin && (it - 1)->last >= codepoint;
+}
+
+uint32_t FontCoverage::FaceCount() const
+{
+    return uint32_t(m_faces.size());
+}
+
+FontCoverageFace const & FontCoverage::Face(uint32_t face) const
+{
+    return m_faces[face];
+}
+
+bool FontCoverage::Save(std::wstring const & path) const
+{
+    std::wstring strings;
+    std::vector<IndexFace> records(m_faces.size());
+    for (size_t i = 0; i < m_faces.size(); ++i) {
+        FontCoverageFace const & face = m_faces[i];
+        IndexFace & record = records[i];
+        record.path = uint32_t(strings.size());
+        record.pathLength = uint32_t(face.path.size());
+        strings += face.path;
+        record.family = uint32_t(strings.size());
+        record.familyLength = uint32_t(face.family.size());
+        strings += face.family;
+        record.style = uint32_t(strings.size());
+        record.styleLength = uint32_t(face.style.size());
+        strings += face.style;
+        record.faceIndex = face.faceIndex;
+        record.rangeCount = m_rangeOffsets[i + 1] - m_rangeOffsets[i];
+        record.codepoints = face.codepoints;
+        record.weight = face.weight;
+        record.width = face.width;
+        record.italic = face.italic;
+    }
+
+    IndexHeader header;
+    header.magic = kIndexMagic;
+    header.version = kIndexVersion;
+    header.charSize = sizeof(wchar_t);
+    header.faceCount = uint32_t(records.size());
+    header.rangeCount = uint32_t(m_ranges.size());
+    header.charCount = uint32_t(strings.size());
+
+    FileDumpOutput output;
+    if (!output.Open(path))
+        return false;
+    bool ok = output.Write(&header, sizeof(header));
+    if (ok && !records.empty())
+        ok = output.Write(&records[0], records.size() * sizeof(IndexFace));
+    if (ok && !m_ranges.empty())
+        ok = output.Write(&m_ranges[0], m_ranges.size() * sizeof(CodepointRange));
+    if (ok && !strings.empty())
+        ok = output.Write(strings.data(), strings.size() * sizeof(wchar_t));
+    return output.Finish() && ok;
+}
+
+bool FontCoverage::Load(std::wstring const & path)
+{
+    MappedFile file;
+    if (!file.Open(path) || file.Size() < sizeof(IndexHeader))
+        return false;
+    IndexHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    if (header.magic != kIndexMagic || header.version != kIndexVersion || header.charSize != sizeof(wchar_t))
+        return false;
+    uint64_t rangesOffset = sizeof(IndexHeader) + uint64_t(header.faceCount) * sizeof(IndexFace);
+    uint64_t stringsOffset = rangesOffset + uint64_t(header.rangeCount) * sizeof(CodepointRange);
+    if (stringsOffset + uint64_t(header.charCount) * sizeof(wchar_t) != file.Size())
+        return false;
+
+    std::vector<IndexFace> records(header.faceCount);
+    std::vector<CodepointRange> ranges(header.rangeCount);
+    std::wstring strings(header.charCount, L'\0');
+    if (!records.empty())
+        memcpy(&records[0], file.Data() + sizeof(IndexHeader), records.size() * sizeof(IndexFace));
+    if (!ranges.empty())
+        memcpy(&ranges[0], file.Data() + rangesOffset, ranges.size() * sizeof(CodepointRange));
+    if (!strings.empty())
+        memcpy(&strings[0], file.Data() + stringsOffset, strings.size() * sizeof(wchar_t));
+
+    std::vector<FontCoverageFace> faces(records.size());
+    std::vector<uint32_t> rangeOffsets(1, 0);
+    for (size_t i = 0; i < records.size(); ++i) {
+        IndexFace const & record = records[i];
+        if (uint64_t(record.path) + record.pathLength > strings.size()
+            || uint64_t(record.family) + record.familyLength > strings.size()
+            || uint64_t(record.style) + record.styleLength > strings.size()
+            || uint64_t(rangeOffsets.back()) + record.rangeCount > ranges.size())
+            return false;
+        FontCoverageFace & face = faces[i];
+        face.path = strings.substr(record.path, record.pathLength);
+        face.family = strings.substr(record.family, record.familyLength);
+        face.style = strings.substr(record.style, record.styleLength);
+        face.faceIndex = record.faceIndex;
+        face.codepoints = record.codepoints;
+        face.weight = record.weight;
+        face.width = record.width;
+        face.italic = record.italic != 0;
+        rangeOffsets.push_back(rangeOffsets.back() + record.rangeCount);
+    }
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        if (ranges[r].first > ranges[r].last || ranges[r].last > kMaxCodepoint)
+            return false;
+    }
+
+    m_faces.swap(faces);
+    m_ranges.swap(ranges);
+    m_rangeOffsets.swap(rangeOffsets);
+    Index();
+    return true;
+}
+
+void PrintFontCoverage(std::vector<uint32_t> const & codepoints, unsigned int threads,
+                       std::wstring const & indexPath)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    FontCoverage coverage;
+    bool loaded = !indexPath.empty() && coverage.Load(indexPath);
+    if (!loaded) {
+        FontScanner scanner(threads);
+        scanner.AddDefaultDirectories();
+        coverage.Build(scanner.ListFiles(), threads);
+        if (!indexPath.empty() && !coverage.Save(indexPath))
+            wprintf(L"Couldn't write coverage index %ls\n", indexPath.c_str());
+    }
+    double buildMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    const size_t kShownFaces = 10;
+    for (size_t i = 0; i < codepoints.size(); ++i) {
+        std::vector<uint32_t> faces = coverage.Lookup(codepoints[i]);
+        wprintf(L"U+%04X: %d faces\n", codepoints[i], int(faces.size()));
+        for (size_t j = 0; j < faces.size() && j < kShownFaces; ++j) {
+            FontCoverageFace const & face = coverage.Face(faces[j]);
+            wprintf(L"  %ls, %ls (%ls #%u)\n", face.family.c_str(), face.style.c_str(), face.path.c_str(),
+                    face.faceIndex);
+        }
+    }
+
+    // Time the best match of every BMP codepoint
+    Clock::time_point lookups = Clock::now();
+    size_t found = 0;
+    for (uint32_t c = 0; c < 0x10000; ++c)
+        found += coverage.Lookup(c, 1).size();
+    double lookupNs = std::chrono::duration<double, std::nano>(Clock::now() - lookups).count() / 0x10000;
+
+    wprintf(L"%ls %d faces in %.1f ms, best match in %.0f ns per codepoint, %d BMP codepoints covered\n",
+            loaded ? L"Loaded" : L"Indexed", int(coverage.FaceCount()), buildMs, lookupNs, int(found));
+}
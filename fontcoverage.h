@@ -0,0 +1,85 @@
+#ifndef FONTCOVERAGE_H
+#define FONTCOVERAGE_H
+
+#include "fontscanner.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Codepoints from first to last included
+struct CodepointRange
+{
+    uint32_t first;
+    uint32_t last;
+};
+
+struct FontCoverageFace
+{
+    std::wstring path;
+    uint32_t faceIndex;
+    std::wstring family;
+    std::wstring style;
+    uint16_t weight;   // OS/2 usWeightClass, 400 is regular
+    uint16_t width;    // OS/2 usWidthClass, 5 is normal
+    bool italic;
+    uint32_t codepoints;
+};
+
+// Codepoints mapped to a glyph by the best Unicode subtable of a 'cmap'
+// table, format 12 preferred over format 4. Ranges are sorted and merged.
+bool ReadCmapCoverage(const unsigned char *table, uint32_t bytes, std::vector<CodepointRange> &ranges);
+
+// Which installed faces cover a codepoint, for font fallback.
+//
+// Faces are kept in fallback order: upright before italic, then closest to
+// regular weight and normal width, then in file order. Each face has its
+// sorted codepoint ranges, and the codepoints are split in blocks of 256.
+// Within a block, faces with the same coverage share one class: a 256 bit
+// mask of the codepoints and a bitmap of the faces. Font families mostly
+// share their coverage, so a lookup tests the few classes of one block
+// and walks the union of their face bitmaps in fallback order.
+//
+// Only the faces and their ranges are saved, the classes are rebuilt on
+// load.
+class FontCoverage
+{
+public:
+    FontCoverage();
+
+public:
+    // Reads the cmap, OS/2 and name tables of all files, spread over a pool
+    // of threads (0 uses one per hardware thread), and builds the index
+    void Build(std::vector<FontFile> const & files, unsigned int threads);
+
+    bool Save(std::wstring const & path) const;
+
+    bool Load(std::wstring const & path);
+
+    // Faces covering codepoint, best first. maxFaces == 0 returns all.
+    std::vector<uint32_t> Lookup(uint32_t codepoint, size_t maxFaces = 0) const;
+
+    bool Covers(uint32_t face, uint32_t codepoint) const;
+
+    uint32_t FaceCount() const;
+
+    FontCoverageFace const & Face(uint32_t face) const;
+
+private:
+    void Index();
+
+private:
+    std::vector<FontCoverageFace> m_faces;
+    std::vector<uint32_t> m_rangeOffsets; // FaceCount() + 1 entries
+    std::vector<CodepointRange> m_ranges;
+    std::vector<uint32_t> m_blockClasses; // first class of each block, plus the end
+    std::vector<uint64_t> m_classMasks;   // 4 words per class
+    std::vector<uint64_t> m_classFaces;   // m_nWords words per class
+    uint32_t m_nWords;
+};
+
+// Prints the faces covering each codepoint and how long the index took
+void PrintFontCoverage(std::vector<uint32_t> const & codepoints, unsigned int threads,
+                       std::wstring const & indexPath);
+
+#endif // FONTCOVERAGE_H
@@ -0,0 +1,14 @@
+// libFuzzer driver for the name table parsers, built in place of main.cpp
+// with qmake CONFIG+=fuzz and clang:
+//
+//     fontnamefuzz -max_len=65536 corpus/
+
+#include "fontbench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    return CheckFontNameTable(data, size);
+}
@@ -0,0 +1,468 @@
+#include "fontnameindex.h"
+#include "contenthash.h"
+#include "dumpoutput.h"
+#include "fonttext.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const uint32_t kTagName = 0x6e616d65; // 'name'
+
+const uint16_t FullNameId = 4;
+const uint16_t WwsFamilyId = 21;
+const uint16_t WwsStyleId = 22;
+
+// Files parsed by one task
+const size_t kFilesPerTask = 8;
+
+const uint32_t kIndexMagic = 0x31584e46; // "FNX1"
+const uint32_t kIndexVersion = 1;
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t charSize;
+    uint32_t faceCount;
+    uint32_t keyCount;
+    uint32_t matchCount;
+    uint32_t keyTextSize;
+    uint32_t charCount;
+};
+
+struct IndexFace
+{
+    uint32_t path;
+    uint32_t pathLength;
+    uint32_t faceIndex;
+    uint32_t names[4][2]; // offset and length, in the order of FontNames
+};
+
+bool IsFamilyName(uint16_t nameId)
+{
+    return nameId == FamilyId || nameId == PreferredFamilyId || nameId == WwsFamilyId || nameId == FullNameId;
+}
+
+bool IsStyleName(uint16_t nameId)
+{
+    return nameId == StyleId || nameId == PreferredStyleId || nameId == WwsStyleId;
+}
+
+// Simple case folding of the scripts font names are mostly written in:
+// ASCII, Latin-1, Greek, Cyrillic and fullwidth Latin. Done by hand so
+// keys don't depend on the locale.
+wchar_t FoldCase(wchar_t c)
+{
+    if (c < 0x80)
+        return c >= L'A' && c <= L'Z' ? wchar_t(c + 0x20) : c;
+    if ((c >= 0xc0 && c <= 0xde && c != 0xd7)
+        || (c >= 0x391 && c <= 0x3a9 && c != 0x3a2)
+        || (c >= 0x410 && c <= 0x42f)
+        || (c >= 0xff21 && c <= 0xff3a))
+        return wchar_t(c + 0x20);
+    if (c >= 0x400 && c <= 0x40f)
+        return wchar_t(c + 0x50);
+    return c;
+}
+
+std::string MakeKey(std::wstring name)
+{
+    for (size_t i = 0; i < name.size(); ++i)
+        name[i] = FoldCase(name[i]);
+    std::string key;
+    FontText::WideToUtf8(name, key);
+    return key;
+}
+
+struct ParsedName
+{
+    std::string key;
+    FontNameMatch match;
+};
+
+struct ParsedFile
+{
+    std::vector<FontFace> faces;
+    std::vector<std::vector<ParsedName> > names; // per face
+};
+
+void ParseFile(FontFile const & file, ParsedFile &parsed)
+{
+    MappedFile mapped;
+    if (!mapped.Open(file.path))
+        return;
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(mapped.Data());
+    uint64_t size = mapped.Size();
+    uint32_t count = FontFaceCount(data, size);
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *table = nullptr;
+        uint32_t length = 0;
+        FontNameTable nameTable;
+        if (!FindFontTable(data, size, i, kTagName, table, length) || !nameTable.Open(table, length))
+            continue;
+
+        FontFace face;
+        face.path = file.path;
+        face.faceIndex = i;
+        face.names = qt_getCanonicalFontNames(table, length);
+
+        std::vector<ParsedName> names;
+        std::wstring decoded;
+        for (uint16_t r = 0; r < nameTable.Count(); ++r) {
+            FontNameRecord record;
+            if (!nameTable.Record(r, record) || !(IsFamilyName(record.nameId) || IsStyleName(record.nameId)))
+                continue;
+            if (!DecodeFontName(record, decoded) || decoded.empty())
+                continue;
+            ParsedName name;
+            name.key = MakeKey(decoded);
+            name.match.face = 0;
+            name.match.nameId = record.nameId;
+            name.match.platformId = record.platformId;
+            name.match.languageId = record.languageId;
+            // The same name is usually there for several platforms
+            bool duplicate = false;
+            for (size_t n = 0; n < names.size() && !duplicate; ++n)
+                duplicate = names[n].match.nameId == record.nameId && names[n].key == name.key;
+            if (!duplicate)
+                names.push_back(name);
+        }
+        parsed.faces.push_back(face);
+        parsed.names.push_back(names);
+    }
+}
+
+struct KeyedMatch
+{
+    uint64_t hash;
+    std::string const * key;
+    FontNameMatch match;
+
+    bool operator<(KeyedMatch const & o) const
+    {
+        if (hash != o.hash)
+            return hash < o.hash;
+        int c = key->compare(*o.key);
+        if (c != 0)
+            return c < 0;
+        if (match.face != o.match.face)
+            return match.face < o.match.face;
+        return match.nameId < o.match.nameId;
+    }
+};
+
+bool MatchBeforeFace(FontNameMatch const & m, uint32_t face)
+{
+    return m.face < face;
+}
+
+} // namespace
+
+FontNameIndex::FontNameIndex()
+    : m_nBucketBits(0)
+{
+}
+
+void FontNameIndex::Build(std::vector<FontFile> const & files, unsigned int threads)
+{
+    std::vector<ParsedFile> parsed(files.size());
+    {
+        ThreadPool pool(threads);
+        for (size_t t = 0; t < files.size(); t += kFilesPerTask) {
+            FontFile const * first = &files[t];
+            ParsedFile * out = &parsed[t];
+            size_t count = std::min(kFilesPerTask, files.size() - t);
+            pool.Submit([first, out, count]() {
+                for (size_t i = 0; i < count; ++i)
+                    ParseFile(first[i], out[i]);
+            });
+        }
+        pool.Wait();
+    }
+
+    m_faces.clear();
+    std::vector<KeyedMatch> keyed;
+    for (size_t i = 0; i < parsed.size(); ++i) {
+        for (size_t f = 0; f < parsed[i].faces.size(); ++f) {
+            uint32_t face = uint32_t(m_faces.size());
+            m_faces.push_back(parsed[i].faces[f]);
+            std::vector<ParsedName> & names = parsed[i].names[f];
+            for (size_t n = 0; n < names.size(); ++n) {
+                KeyedMatch k;
+                k.hash = ContentHash::Hash64(names[n].key.data(), names[n].key.size());
+                k.key = &names[n].key;
+                k.match = names[n].match;
+                k.match.face = face;
+                keyed.push_back(k);
+            }
+        }
+    }
+    std::sort(keyed.begin(), keyed.end());
+
+    m_keys.clear();
+    m_matches.clear();
+    m_keyText.clear();
+    for (size_t i = 0; i < keyed.size(); ++i) {
+        if (i == 0 || keyed[i].hash != keyed[i - 1].hash || *keyed[i].key != *keyed[i - 1].key) {
+            Key key;
+            key.hash = keyed[i].hash;
+            key.text = uint32_t(m_keyText.size());
+            key.length = uint32_t(keyed[i].key->size());
+            key.firstMatch = uint32_t(m_matches.size());
+            key.matchCount = 0;
+            m_keyText += *keyed[i].key;
+            m_keys.push_back(key);
+        }
+        m_matches.push_back(keyed[i].match);
+        ++m_keys.back().matchCount;
+    }
+    IndexBuckets();
+}
+
+void FontNameIndex::IndexBuckets()
+{
+    // About one key per bucket
+    m_nBucketBits = 1;
+    while (m_nBucketBits < 32 && (size_t(1) << m_nBucketBits) < m_keys.size())
+        ++m_nBucketBits;
+    size_t buckets = size_t(1) << m_nBucketBits;
+    m_buckets.assign(buckets + 1, uint32_t(m_keys.size()));
+    size_t k = 0;
+    for (size_t b = 0; b < buckets; ++b) {
+        while (k < m_keys.size() && (m_keys[k].hash >> (64 - m_nBucketBits)) < b)
+            ++k;
+        m_buckets[b] = uint32_t(k);
+    }
+}
+
+FontNameIndex::Key const * FontNameIndex::FindKey(std::wstring const & name) const
+{
+    if (m_keys.empty())
+        return nullptr;
+    std::string key = MakeKey(name);
+    uint64_t hash = ContentHash::Hash64(key.data(), key.size());
+    size_t bucket = size_t(hash >> (64 - m_nBucketBits));
+    for (uint32_t k = m_buckets[bucket]; k < m_buckets[bucket + 1]; ++k) {
+        Key const & candidate = m_keys[k];
+        if (candidate.hash == hash && candidate.length == key.size()
+            && memcmp(m_keyText.data() + candidate.text, key.data(), key.size()) == 0)
+            return &candidate;
+    }
+    return nullptr;
+}
+
+std::vector<FontNameMatch> FontNameIndex::Find(std::wstring const & name) const
+{
+    Key const * key = FindKey(name);
+    if (key == nullptr)
+        return std::vector<FontNameMatch>();
+    return std::vector<FontNameMatch>(m_matches.begin() + key->firstMatch,
+                                      m_matches.begin() + key->firstMatch + key->matchCount);
+}
+
+int FontNameIndex::Resolve(std::wstring const & family, std::wstring const & style) const
+{
+    Key const * familyKey = FindKey(family);
+    Key const * styleKey = FindKey(style);
+    if (familyKey == nullptr || styleKey == nullptr)
+        return -1;
+
+    // Both lists are in face order, the style list is usually the longer
+    // one and is searched
+    std::vector<FontNameMatch>::const_iterator styles = m_matches.begin() + styleKey->firstMatch;
+    std::vector<FontNameMatch>::const_iterator stylesEnd = styles + styleKey->matchCount;
+    for (uint32_t i = 0; i < familyKey->matchCount; ++i) {
+        FontNameMatch const & match = m_matches[familyKey->firstMatch + i];
+        if (!IsFamilyName(match.nameId) || match.nameId == FullNameId)
+            continue;
+        std::vector<FontNameMatch>::const_iterator it = std::lower_bound(styles, stylesEnd, match.face,
+                                                                         MatchBeforeFace);
+        for (; it != stylesEnd && it->face == match.face; ++it) {
+            if (IsStyleName(it->nameId))
+                return int(match.face);
+        }
+    }
+    return -1;
+}
+
+uint32_t FontNameIndex::FaceCount() const
+{
+    return uint32_t(m_faces.size());
+}
+
+FontFace const & FontNameIndex::Face(uint32_t face) const
+{
+    return m_faces[face];
+}
+
+uint32_t FontNameIndex::KeyCount() const
+{
+    return uint32_t(m_keys.size());
+}
+
+bool FontNameIndex::Save(std::wstring const & path) const
+{
+    static_assert(sizeof(Key) == 24, "name index key must be 24 bytes");
+
+    std::wstring strings;
+    std::vector<IndexFace> records(m_faces.size());
+    for (size_t i = 0; i < m_faces.size(); ++i) {
+        FontFace const & face = m_faces[i];
+        IndexFace & record = records[i];
+        record.path = uint32_t(strings.size());
+        record.pathLength = uint32_t(face.path.size());
+        strings += face.path;
+        record.faceIndex = face.faceIndex;
+        std::wstring const * names[4] = { &face.names.name, &face.names.style, &face.names.preferredName,
+                                          &face.names.preferredStyle };
+        for (int n = 0; n < 4; ++n) {
+            record.names[n][0] = uint32_t(strings.size());
+            record.names[n][1] = uint32_t(names[n]->size());
+            strings += *names[n];
+        }
+    }
+
+    IndexHeader header;
+    header.magic = kIndexMagic;
+    header.version = kIndexVersion;
+    header.charSize = sizeof(wchar_t);
+    header.faceCount = uint32_t(records.size());
+    header.keyCount = uint32_t(m_keys.size());
+    header.matchCount = uint32_t(m_matches.size());
+    header.keyTextSize = uint32_t(m_keyText.size());
+    header.charCount = uint32_t(strings.size());
+
+    FileDumpOutput output;
+    if (!output.Open(path))
+        return false;
+    bool ok = output.Write(&header, sizeof(header));
+    if (ok && !records.empty())
+        ok = output.Write(&records[0], records.size() * sizeof(IndexFace));
+    if (ok && !m_keys.empty())
+        ok = output.Write(&m_keys[0], m_keys.size() * sizeof(Key));
+    if (ok && !m_matches.empty())
+        ok = output.Write(&m_matches[0], m_matches.size() * sizeof(FontNameMatch));
+    if (ok && !m_keyText.empty())
+        ok = output.Write(m_keyText.data(), m_keyText.size());
+    if (ok && !strings.empty())
+        ok = output.Write(strings.data(), strings.size() * sizeof(wchar_t));
+    return output.Finish() && ok;
+}
+
+bool FontNameIndex::Load(std::wstring const & path)
+{
+    MappedFile file;
+    if (!file.Open(path) || file.Size() < sizeof(IndexHeader))
+        return false;
+    IndexHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    if (header.magic != kIndexMagic || header.version != kIndexVersion || header.charSize != sizeof(wchar_t))
+        return false;
+    uint64_t keysOffset = sizeof(IndexHeader) + uint64_t(header.faceCount) * sizeof(IndexFace);
+    uint64_t matchesOffset = keysOffset + uint64_t(header.keyCount) * sizeof(Key);
+    uint64_t keyTextOffset = matchesOffset + uint64_t(header.matchCount) * sizeof(FontNameMatch);
+    uint64_t stringsOffset = keyTextOffset + header.keyTextSize;
+    if (stringsOffset + uint64_t(header.charCount) * sizeof(wchar_t) != file.Size())
+        return false;
+
+    std::vector<IndexFace> records(header.faceCount);
+    std::vector<Key> keys(header.keyCount);
+    std::vector<FontNameMatch> matches(header.matchCount);
+    std::string keyText(file.Data() + keyTextOffset, header.keyTextSize);
+    std::wstring strings(header.charCount, L'\0');
+    if (!records.empty())
+        memcpy(&records[0], file.Data() + sizeof(IndexHeader), records.size() * sizeof(IndexFace));
+    if (!keys.empty())
+        memcpy(&keys[0], file.Data() + keysOffset, keys.size() * sizeof(Key));
+    if (!matches.empty())
+        memcpy(&matches[0], file.Data() + matchesOffset, matches.size() * sizeof(FontNameMatch));
+    if (!strings.empty())
+        memcpy(&strings[0], file.Data() + stringsOffset, strings.size() * sizeof(wchar_t));
+
+    for (size_t k = 0; k < keys.size(); ++k) {
+        if (uint64_t(keys[k].text) + keys[k].length > keyText.size()
+            || uint64_t(keys[k].firstMatch) + keys[k].matchCount > matches.size()
+            || (k > 0 && keys[k].hash < keys[k - 1].hash))
+            return false;
+    }
+    for (size_t m = 0; m < matches.size(); ++m) {
+        if (matches[m].face >= records.size())
+            return false;
+    }
+
+    std::vector<FontFace> faces(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        IndexFace const & record = records[i];
+        FontFace & face = faces[i];
+        std::wstring * names[4] = { &face.names.name, &face.names.style, &face.names.preferredName,
+                                    &face.names.preferredStyle };
+        if (uint64_t(record.path) + record.pathLength > strings.size())
+            return false;
+        face.path = strings.substr(record.path, record.pathLength);
+        face.faceIndex = record.faceIndex;
+        for (int n = 0; n < 4; ++n) {
+            if (uint64_t(record.names[n][0]) + record.names[n][1] > strings.size())
+                return false;
+            *names[n] = strings.substr(record.names[n][0], record.names[n][1]);
+        }
+    }
+
+    m_faces.swap(faces);
+    m_keys.swap(keys);
+    m_matches.swap(matches);
+    m_keyText.swap(keyText);
+    IndexBuckets();
+    return true;
+}
+
+void PrintFontName(std::wstring const & name, std::wstring const & style, unsigned int threads,
+                   std::wstring const & indexPath)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    FontNameIndex index;
+    bool loaded = !indexPath.empty() && index.Load(indexPath);
+    if (!loaded) {
+        FontScanner scanner(threads);
+        scanner.AddDefaultDirectories();
+        index.Build(scanner.ListFiles(), threads);
+        if (!indexPath.empty() && !index.Save(indexPath))
+            wprintf(L"Couldn't write name index %ls\n", indexPath.c_str());
+    }
+    double buildMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    if (style.empty()) {
+        std::vector<FontNameMatch> matches = index.Find(name);
+        wprintf(L"%ls: %d names\n", name.c_str(), int(matches.size()));
+        for (size_t i = 0; i < matches.size(); ++i) {
+            FontFace const & face = index.Face(matches[i].face);
+            wprintf(L"  %ls, %ls (%ls #%u) name %u platform %u language 0x%04x\n", face.names.name.c_str(),
+                    face.names.style.c_str(), face.path.c_str(), face.faceIndex, matches[i].nameId,
+                    matches[i].platformId, matches[i].languageId);
+        }
+    } else {
+        int face = index.Resolve(name, style);
+        if (face < 0)
+            wprintf(L"%ls, %ls: not found\n", name.c_str(), style.c_str());
+        else
+            wprintf(L"%ls, %ls: %ls, %ls (%ls #%u)\n", name.c_str(), style.c_str(),
+                    index.Face(face).names.name.c_str(), index.Face(face).names.style.c_str(),
+                    index.Face(face).path.c_str(), index.Face(face).faceIndex);
+    }
+
+    const int kLookups = 100000;
+    Clock::time_point lookups = Clock::now();
+    for (int i = 0; i < kLookups; ++i)
+        index.Find(name);
+    double lookupNs = std::chrono::duration<double, std::nano>(Clock::now() - lookups).count() / kLookups;
+
+    wprintf(L"%ls %d faces with %d names in %.1f ms, lookup in %.0f ns\n", loaded ? L"Loaded" : L"Indexed",
+            int(index.FaceCount()), int(index.KeyCount()), buildMs, lookupNs);
+}
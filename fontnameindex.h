@@ -0,0 +1,85 @@
+#ifndef FONTNAMEINDEX_H
+#define FONTNAMEINDEX_H
+
+#include "fontscanner.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// A face known under a name
+struct FontNameMatch
+{
+    uint32_t face;
+    uint16_t nameId;     // FamilyId, StyleId, full name (4), ...
+    uint16_t platformId;
+    uint16_t languageId;
+};
+
+// Family, full and style names of installed faces in every language and
+// platform encoding, for resolving the names found in documents.
+//
+// Names are case folded and stored once as UTF-8 keys in a table sorted
+// by their 64 bit hash. A bucket array indexed by the top bits of the
+// hash points into the table, so a lookup hashes the name, reads one
+// bucket and compares the few keys in it. Every key has the list of its
+// faces, in face order.
+//
+// Names in encodings other than UTF-16 and Mac Roman (the legacy Windows
+// CJK code pages and the other Mac scripts) aren't indexed.
+class FontNameIndex
+{
+public:
+    FontNameIndex();
+
+public:
+    // Reads the name tables of all files, spread over a pool of threads (0
+    // uses one per hardware thread), and builds the index
+    void Build(std::vector<FontFile> const & files, unsigned int threads);
+
+    bool Save(std::wstring const & path) const;
+
+    bool Load(std::wstring const & path);
+
+    // Every face known under name, whatever the kind of name
+    std::vector<FontNameMatch> Find(std::wstring const & name) const;
+
+    // First face of a family with a style, both in any language. Returns
+    // -1 if there is none.
+    int Resolve(std::wstring const & family, std::wstring const & style) const;
+
+    uint32_t FaceCount() const;
+
+    // The face with its canonical names
+    FontFace const & Face(uint32_t face) const;
+
+    uint32_t KeyCount() const;
+
+private:
+    struct Key
+    {
+        uint64_t hash;
+        uint32_t text;       // offset in m_keyText
+        uint32_t length;
+        uint32_t firstMatch;
+        uint32_t matchCount;
+    };
+
+    Key const * FindKey(std::wstring const & name) const;
+
+    void IndexBuckets();
+
+private:
+    std::vector<FontFace> m_faces;
+    std::vector<Key> m_keys;              // sorted by hash
+    std::vector<FontNameMatch> m_matches; // per key, in face order
+    std::string m_keyText;
+    std::vector<uint32_t> m_buckets;      // first key of each bucket, plus the end
+    int m_nBucketBits;
+};
+
+// Prints the faces known under name, or the face of a family and style
+void PrintFontName(std::wstring const & name, std::wstring const & style, unsigned int threads,
+                   std::wstring const & indexPath);
+
+#endif // FONTNAMEINDEX_H
@@ -0,0 +1,152 @@
+#include "fontnames.h"
+#include "fonttext.h"
+
+namespace {
+
+const uint32_t NameRecordSize = 12;
+
+} // namespace
+
+FontNameTable::FontNameTable()
+    : m_table(nullptr)
+    , m_nBytes(0)
+    , m_nCount(0)
+    , m_nStringOffset(0)
+{
+}
+
+bool FontNameTable::Open(const unsigned char *table, uint32_t bytes)
+{
+    m_table = nullptr;
+    m_nCount = 0;
+    if (bytes < 6 || qt_getUShort(table) > 1)
+        return false;
+
+    uint16_t count = qt_getUShort(table + 2);
+    uint16_t stringOffset = qt_getUShort(table + 4);
+    if (stringOffset >= bytes || 6 + count * NameRecordSize > stringOffset)
+        return false;
+
+    m_table = table;
+    m_nBytes = bytes;
+    m_nCount = count;
+    m_nStringOffset = stringOffset;
+    return true;
+}
+
+uint16_t FontNameTable::Count() const
+{
+    return m_nCount;
+}
+
+bool FontNameTable::Record(uint16_t index, FontNameRecord &record) const
+{
+    if (index >= m_nCount)
+        return false;
+    const unsigned char *p = m_table + 6 + index * NameRecordSize;
+    record.platformId = qt_getUShort(p);
+    record.encodingId = qt_getUShort(p + 2);
+    record.languageId = qt_getUShort(p + 4);
+    record.nameId = qt_getUShort(p + 6);
+    record.length = qt_getUShort(p + 8);
+    uint32_t offset = m_nStringOffset + uint32_t(qt_getUShort(p + 10));
+    if (offset + record.length > m_nBytes)
+        return false;
+    record.string = m_table + offset;
+    return true;
+}
+
+bool DecodeFontName(FontNameRecord const & record, std::wstring &out)
+{
+    if (IsUtf16Name(record))
+        FontText::Utf16BeToWide(record.string, record.length, out);
+    else if (IsMacRomanName(record))
+        FontText::MacRomanToWide(record.string, record.length, out);
+    else
+        return false;
+    return true;
+}
+
+bool DecodeFontNameUtf8(FontNameRecord const & record, std::string &out)
+{
+    if (IsUtf16Name(record))
+        FontText::Utf16BeToUtf8(record.string, record.length, out);
+    else if (IsMacRomanName(record))
+        FontText::MacRomanToUtf8(record.string, record.length, out);
+    else
+        return false;
+    return true;
+}
+
+FontNames qt_getCanonicalFontNames(const unsigned char *table, uint32_t bytes)
+{
+    FontNames out;
+    const int MS_LangIdEnglish = 0x009;
+
+    FontNameTable nameTable;
+    if (!nameTable.Open(table, bytes))
+        return out;
+
+    enum PlatformIdType {
+        NotFound = 0,
+        Unicode = 1,
+        Apple = 2,
+        Microsoft = 3
+    };
+
+    PlatformIdType idStatus[4] = { NotFound, NotFound, NotFound, NotFound };
+    FontNameRecord records[4];
+
+    for (uint16_t i = 0; i < nameTable.Count(); ++i) {
+        // search for the correct name entries
+
+        FontNameRecord record;
+        if (!nameTable.Record(i, record))
+            continue;
+
+        int slot;
+        switch (record.nameId) {
+        case FamilyId:
+            slot = 0;
+            break;
+        case StyleId:
+            slot = 1;
+            break;
+        case PreferredFamilyId:
+            slot = 2;
+            break;
+        case PreferredStyleId:
+            slot = 3;
+            break;
+        default:
+            continue;
+        }
+        PlatformIdType *idType = &idStatus[slot];
+
+        if ((record.platformId == PlatformId_Microsoft
+            && (record.encodingId == 0 || record.encodingId == 1))
+            && ((record.languageId & 0x3ff) == MS_LangIdEnglish
+                || *idType < Microsoft)) {
+            records[slot] = record;
+            *idType = Microsoft;
+        }
+        // not sure if encoding id 4 for Unicode is utf16 or ucs4...
+        else if (record.platformId == PlatformId_Unicode && record.encodingId < 4 && *idType < Unicode) {
+            records[slot] = record;
+            *idType = Unicode;
+        }
+        else if (record.platformId == PlatformId_Apple && record.encodingId == 0 && record.languageId == 0
+                 && *idType < Apple) {
+            records[slot] = record;
+            *idType = Apple;
+        }
+    }
+
+    // Decoded straight into the result, no intermediate strings
+    std::wstring *strings[4] = { &out.name, &out.style, &out.preferredName, &out.preferredStyle };
+    for (int i = 0; i < 4; ++i) {
+        if (idStatus[i] != NotFound)
+            DecodeFontName(records[i], *strings[i]);
+    }
+    return out;
+}
@@ -0,0 +1,104 @@
+#ifndef FONTNAMES_H
+#define FONTNAMES_H
+
+// Parser for the OpenType 'name' table, shared by the GDI font enumeration
+// and the font file scanner.
+
+#include <string>
+#include <stdint.h>
+
+struct FontNames
+{
+    std::wstring name;   // e.g. "DejaVu Sans Condensed"
+    std::wstring style;  // e.g. "Italic"
+    std::wstring preferredName;  // e.g. "DejaVu Sans"
+    std::wstring preferredStyle; // e.g. "Condensed Italic"
+};
+
+inline uint16_t qt_getUShort(const unsigned char *p)
+{
+    uint16_t val;
+    val = *p++ << 8;
+    val |= *p;
+
+    return val;
+}
+
+inline uint32_t qt_getULong(const unsigned char *p)
+{
+    return (uint32_t(qt_getUShort(p)) << 16) | qt_getUShort(p + 2);
+}
+
+enum FieldTypeValue {
+    FamilyId = 1,
+    StyleId = 2,
+    PreferredFamilyId = 16,
+    PreferredStyleId = 17,
+};
+
+enum PlatformFieldValue {
+    PlatformId_Unicode = 0,
+    PlatformId_Apple = 1,
+    PlatformId_Microsoft = 3
+};
+
+// One record of a 'name' table, string points into the table
+struct FontNameRecord
+{
+    uint16_t platformId;
+    uint16_t encodingId;
+    uint16_t languageId;
+    uint16_t nameId;
+    const unsigned char *string;
+    uint16_t length; // in bytes
+};
+
+// View of a 'name' table in place, typically in a mapped font file. Records
+// are only decoded when asked for.
+class FontNameTable
+{
+public:
+    FontNameTable();
+
+public:
+    // Checks the header and that the records fit in the table
+    bool Open(const unsigned char *table, uint32_t bytes);
+
+    uint16_t Count() const;
+
+    // Returns false if the string of the record lies outside the table
+    bool Record(uint16_t index, FontNameRecord &record) const;
+
+private:
+    const unsigned char *m_table;
+    uint32_t m_nBytes;
+    uint16_t m_nCount;
+    uint16_t m_nStringOffset;
+};
+
+// Whether the string of a record is big endian UTF-16
+inline bool IsUtf16Name(FontNameRecord const & record)
+{
+    // Unicode encoding 4 and above are full repertoire UTF-16 as well,
+    // Microsoft 0 is symbol, 1 BMP and 10 full repertoire
+    return record.platformId == PlatformId_Unicode
+        || (record.platformId == PlatformId_Microsoft
+            && (record.encodingId == 0 || record.encodingId == 1 || record.encodingId == 10));
+}
+
+// Whether the string of a record is Mac Roman
+inline bool IsMacRomanName(FontNameRecord const & record)
+{
+    return record.platformId == PlatformId_Apple && record.encodingId == 0;
+}
+
+// Decode the string of a record, false for the legacy encodings that
+// aren't UTF-16 or Mac Roman
+bool DecodeFontName(FontNameRecord const & record, std::wstring &out);
+
+bool DecodeFontNameUtf8(FontNameRecord const & record, std::string &out);
+
+// Family and style names from a 'name' table, English names preferred
+FontNames qt_getCanonicalFontNames(const unsigned char *table, uint32_t bytes);
+
+#endif // FONTNAMES_H
@@ -0,0 +1,372 @@
+#include "fontscanner.h"
+#include "fontcache.h"
+#include "dumpoutput.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+namespace {
+
+const uint32_t kTagTtcf = 0x74746366; // 'ttcf'
+const uint32_t kTagName = 0x6e616d65; // 'name'
+
+// Files parsed by one task
+const size_t kFilesPerTask = 8;
+
+bool IsFontFile(std::wstring const & name)
+{
+    static const wchar_t * const extensions[] = { L".ttf", L".otf", L".ttc", L".otc" };
+    if (name.size() < 4)
+        return false;
+    std::wstring ext = name.substr(name.size() - 4);
+    for (size_t i = 0; i < ext.size(); ++i)
+        ext[i] = towlower(ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i) {
+        if (ext == extensions[i])
+            return true;
+    }
+    return false;
+}
+
+// Offset of the table directory of a face
+bool FaceOffset(const unsigned char *data, uint64_t size, uint32_t faceIndex, uint32_t &offset)
+{
+    if (size < 12)
+        return false;
+    if (qt_getULong(data) != kTagTtcf) {
+        offset = 0;
+        return faceIndex == 0;
+    }
+    uint32_t count = qt_getULong(data + 8);
+    if (faceIndex >= count || 12 + uint64_t(faceIndex + 1) * 4 > size)
+        return false;
+    offset = qt_getULong(data + 12 + faceIndex * 4);
+    return uint64_t(offset) + 12 <= size;
+}
+
+void ScanFile(std::wstring const & path, std::vector<FontFace> & faces)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return;
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(file.Data());
+    uint32_t count = FontFaceCount(data, file.Size());
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *table = nullptr;
+        uint32_t length = 0;
+        if (!FindFontTable(data, file.Size(), i, kTagName, table, length))
+            continue;
+        FontFace face;
+        face.path = path;
+        face.faceIndex = i;
+        face.names = qt_getCanonicalFontNames(table, length);
+        faces.push_back(face);
+    }
+}
+
+#ifdef _WIN32
+
+void ListDirectory(std::wstring const & directory, std::set<std::wstring> & visited, std::vector<FontFile> & files)
+{
+    std::wstring key = directory;
+    for (size_t i = 0; i < key.size(); ++i)
+        key[i] = towlower(key[i]);
+    if (!visited.insert(key).second)
+        return;
+
+    WIN32_FIND_DATAW data;
+    HANDLE hFind = FindFirstFileW((directory + L"\\*").c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        std::wstring name = data.cFileName;
+        if (name == L"." || name == L"..")
+            continue;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            ListDirectory(directory + L"\\" + name, visited, files);
+        else if (IsFontFile(name)) {
+            FontFile file;
+            file.path = directory + L"\\" + name;
+            file.size = (uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+            file.mtime = (uint64_t(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+            files.push_back(file);
+        }
+    } while (FindNextFileW(hFind, &data));
+    FindClose(hFind);
+}
+
+#else
+
+std::string HomeDirectory()
+{
+    const char *home = getenv("HOME");
+    return home ? home : "";
+}
+
+// Symlinked directories are common in font trees, each directory is only
+// listed once
+void ListDirectory(std::string const & directory, std::set<std::pair<dev_t, ino_t> > & visited,
+                   std::vector<FontFile> & files)
+{
+    struct stat st;
+    if (stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return;
+    if (!visited.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+        return;
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return;
+    while (dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = directory + "/" + name;
+        if (entry->d_type == DT_DIR) {
+            ListDirectory(path, visited, files);
+            continue;
+        }
+        // Size and modification time validate cached names
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            ListDirectory(path, visited, files);
+        } else {
+            FontFile file;
+            file.path = WidenPath(path);
+            if (!IsFontFile(file.path))
+                continue;
+            file.size = uint64_t(st.st_size);
+            file.mtime = uint64_t(st.st_mtim.tv_sec) * 1000000000 + uint64_t(st.st_mtim.tv_nsec);
+            files.push_back(file);
+        }
+    }
+    closedir(dir);
+}
+
+// <dir> entries of a fontconfig configuration file
+void ReadFontconfigDirectories(std::string const & path, std::vector<std::string> & directories)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+        return;
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        text.append(buf, n);
+    fclose(file);
+
+    size_t pos = 0;
+    while ((pos = text.find("<dir", pos)) != std::string::npos) {
+        size_t tagEnd = text.find('>', pos);
+        size_t close = text.find("</dir>", pos);
+        if (tagEnd == std::string::npos || close == std::string::npos || close < tagEnd)
+            break;
+        std::string attributes = text.substr(pos + 4, tagEnd - pos - 4);
+        std::string dir = text.substr(tagEnd + 1, close - tagEnd - 1);
+        pos = close + 6;
+        if (!attributes.empty() && attributes[0] != ' ')
+            continue; // <dirname> and friends
+        if (attributes.find("prefix=\"xdg\"") != std::string::npos) {
+            const char *xdg = getenv("XDG_DATA_HOME");
+            dir = (xdg && *xdg ? std::string(xdg) : HomeDirectory() + "/.local/share") + "/" + dir;
+        } else if (!dir.empty() && dir[0] == '~') {
+            dir = HomeDirectory() + dir.substr(1);
+        }
+        if (!dir.empty())
+            directories.push_back(dir);
+    }
+}
+
+#endif
+
+} // namespace
+
+uint32_t FontFaceCount(const unsigned char *data, uint64_t size)
+{
+    if (size < 12)
+        return 0;
+    uint32_t tag = qt_getULong(data);
+    if (tag == kTagTtcf) {
+        uint32_t count = qt_getULong(data + 8);
+        return 12 + uint64_t(count) * 4 <= size ? count : 0;
+    }
+    // TrueType, CFF and Apple TrueType outlines
+    if (tag == 0x00010000 || tag == 0x4f54544f || tag == 0x74727565)
+        return 1;
+    return 0;
+}
+
+bool FindFontTable(const unsigned char *data, uint64_t size, uint32_t faceIndex, uint32_t tag,
+                   const unsigned char *&table, uint32_t &length)
+{
+    uint32_t offset = 0;
+    if (!FaceOffset(data, size, faceIndex, offset))
+        return false;
+    uint16_t numTables = qt_getUShort(data + offset + 4);
+    if (uint64_t(offset) + 12 + uint64_t(numTables) * 16 > size)
+        return false;
+    const unsigned char *records = data + offset + 12;
+    for (uint16_t i = 0; i < numTables; ++i) {
+        if (qt_getULong(records + i * 16) != tag)
+            continue;
+        uint32_t tableOffset = qt_getULong(records + i * 16 + 8);
+        length = qt_getULong(records + i * 16 + 12);
+        if (uint64_t(tableOffset) + length > size)
+            return false;
+        table = data + tableOffset;
+        return true;
+    }
+    return false;
+}
+
+FontScanner::FontScanner(unsigned int threads)
+    : m_nThreads(threads)
+{
+}
+
+void FontScanner::AddDirectory(std::wstring const & directory)
+{
+    if (std::find(m_directories.begin(), m_directories.end(), directory) == m_directories.end())
+        m_directories.push_back(directory);
+}
+
+void FontScanner::AddDefaultDirectories()
+{
+#ifdef _WIN32
+    wchar_t windows[MAX_PATH];
+    UINT n = GetWindowsDirectoryW(windows, MAX_PATH);
+    if (n > 0 && n < MAX_PATH)
+        AddDirectory(std::wstring(windows) + L"\\Fonts");
+    // Fonts installed per user since Windows 10 1809
+    wchar_t local[MAX_PATH];
+    n = GetEnvironmentVariableW(L"LOCALAPPDATA", local, MAX_PATH);
+    if (n > 0 && n < MAX_PATH)
+        AddDirectory(std::wstring(local) + L"\\Microsoft\\Windows\\Fonts");
+#else
+    std::vector<std::string> directories;
+    ReadFontconfigDirectories("/etc/fonts/fonts.conf", directories);
+    if (directories.empty()) {
+        directories.push_back("/usr/share/fonts");
+        directories.push_back("/usr/local/share/fonts");
+        directories.push_back(HomeDirectory() + "/.local/share/fonts");
+        directories.push_back(HomeDirectory() + "/.fonts");
+    }
+    for (size_t i = 0; i < directories.size(); ++i)
+        AddDirectory(WidenPath(directories[i]));
+#endif
+}
+
+std::vector<std::wstring> const & FontScanner::Directories() const
+{
+    return m_directories;
+}
+
+std::vector<FontFile> FontScanner::ListFiles() const
+{
+    std::vector<FontFile> files;
+#ifdef _WIN32
+    std::set<std::wstring> visited;
+    for (size_t i = 0; i < m_directories.size(); ++i)
+        ListDirectory(m_directories[i], visited, files);
+#else
+    std::set<std::pair<dev_t, ino_t> > visited;
+    for (size_t i = 0; i < m_directories.size(); ++i)
+        ListDirectory(NarrowPath(m_directories[i]), visited, files);
+#endif
+    return files;
+}
+
+std::vector<FontFace> FontScanner::Scan(std::vector<FontFile> const & files, FontNameCache const * cache,
+                                        size_t * parsed) const
+{
+    // Cache lookups are cheap enough for this thread, the pool is only
+    // started when files have to be parsed
+    std::vector<std::vector<FontFace> > results(files.size());
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (cache == nullptr || !cache->Find(files[i], results[i]))
+            misses.push_back(i);
+    }
+    if (parsed)
+        *parsed = misses.size();
+
+    if (!misses.empty()) {
+        ThreadPool pool(m_nThreads);
+        for (size_t t = 0; t < misses.size(); t += kFilesPerTask) {
+            size_t const * first = &misses[t];
+            size_t count = std::min(kFilesPerTask, misses.size() - t);
+            std::vector<FontFile> const * all = &files;
+            std::vector<std::vector<FontFace> > * out = &results;
+            pool.Submit([first, count, all, out]() {
+                for (size_t i = 0; i < count; ++i)
+                    ScanFile((*all)[first[i]].path, (*out)[first[i]]);
+            });
+        }
+        pool.Wait();
+    }
+
+    std::vector<FontFace> faces;
+    for (size_t i = 0; i < results.size(); ++i)
+        faces.insert(faces.end(), results[i].begin(), results[i].end());
+    return faces;
+}
+
+std::vector<FontFace> FontScanner::Scan() const
+{
+    return Scan(ListFiles());
+}
+
+void PrintFontDatabase(unsigned int threads, bool useCache)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    FontScanner scanner(threads);
+    scanner.AddDefaultDirectories();
+    std::vector<FontFile> files = scanner.ListFiles();
+    Clock::time_point listed = Clock::now();
+
+    FontNameCache cache;
+    std::wstring cachePath = useCache ? FontNameCache::DefaultPath() : std::wstring();
+    if (!cachePath.empty())
+        cache.Load(cachePath);
+    size_t parsed = 0;
+    std::vector<FontFace> faces = scanner.Scan(files, &cache, &parsed);
+    Clock::time_point scanned = Clock::now();
+
+    // Rewritten when a file was added or changed, or one was removed
+    if (!cachePath.empty() && (parsed > 0 || cache.FileCount() != files.size())) {
+        if (!cache.Save(cachePath, files, faces))
+            wprintf(L"Couldn't write font cache %ls\n", cachePath.c_str());
+    }
+
+    for (size_t i = 0; i < faces.size(); ++i) {
+        FontNames const & names = faces[i].names;
+        if (names.preferredName.empty() || names.preferredName == names.name)
+            wprintf(L"Fout %ls, %ls\n", names.name.c_str(), names.style.c_str());
+        else
+            wprintf(L"Fout %ls, %ls (%ls %ls)\n", names.name.c_str(), names.style.c_str(),
+                    names.preferredName.c_str(), names.preferredStyle.c_str());
+    }
+    wprintf(L"Total %d font faces in %d files (%d parsed), listed in %.1f ms, read in %.1f ms\n",
+            int(faces.size()), int(files.size()), int(parsed),
+            std::chrono::duration<double, std::milli>(listed - start).count(),
+            std::chrono::duration<double, std::milli>(scanned - listed).count());
+}
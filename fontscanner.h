@@ -0,0 +1,77 @@
+#ifndef FONTSCANNER_H
+#define FONTSCANNER_H
+
+#include "fontnames.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class FontNameCache;
+
+// A font file as listed, size and modification time tell whether cached
+// names are still valid
+struct FontFile
+{
+    std::wstring path;
+    uint64_t size;
+    uint64_t mtime; // 100 ns units on Windows, ns on Linux
+};
+
+struct FontFace
+{
+    std::wstring path;
+    uint32_t faceIndex; // index in a font collection, 0 otherwise
+    FontNames names;
+};
+
+// Number of faces in a .ttf, .otf or .ttc file, 0 if it isn't one
+uint32_t FontFaceCount(const unsigned char *data, uint64_t size);
+
+// Finds a table of a face, returns false if the face doesn't have it or
+// it doesn't fit in the file
+bool FindFontTable(const unsigned char *data, uint64_t size, uint32_t faceIndex, uint32_t tag,
+                   const unsigned char *&table, uint32_t &length);
+
+// Lists installed font files and reads the names of every face straight
+// from the files.
+//
+// Files are mapped and their 'name' tables parsed in place with
+// qt_getCanonicalFontNames, spread over a pool of threads. Nothing goes
+// through GDI or fontconfig, so the scan is bound by how fast the files
+// can be read.
+class FontScanner
+{
+public:
+    // threads == 0 uses one thread per hardware thread
+    explicit FontScanner(unsigned int threads = 0);
+
+public:
+    void AddDirectory(std::wstring const & directory);
+
+    // The Windows font directories, or the directories listed in the
+    // fontconfig configuration
+    void AddDefaultDirectories();
+
+    std::vector<std::wstring> const & Directories() const;
+
+    // Font files in the directories and their subdirectories
+    std::vector<FontFile> ListFiles() const;
+
+    // Faces of all files, in file order. Files found unchanged in the cache
+    // aren't opened, parsed is set to the number of files that were.
+    std::vector<FontFace> Scan(std::vector<FontFile> const & files, FontNameCache const * cache = nullptr,
+                               size_t * parsed = nullptr) const;
+
+    std::vector<FontFace> Scan() const;
+
+private:
+    unsigned int m_nThreads;
+    std::vector<std::wstring> m_directories;
+};
+
+// Prints the names of all installed fonts and how long the scan took.
+// Names are taken from the font name cache unless useCache is false.
+void PrintFontDatabase(unsigned int threads, bool useCache);
+
+#endif // FONTSCANNER_H
@@ -0,0 +1,400 @@
+#include "fonttext.h"
+
+#include <wchar.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FONTTEXT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FONTTEXT_AVX2
+#else
+#define FONTTEXT_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+// Mac Roman 0x80 to 0xff, 0x00 to 0x7f are ASCII
+const uint16_t kMacRoman[128] = {
+    0x00c4, 0x00c5, 0x00c7, 0x00c9, 0x00d1, 0x00d6, 0x00dc, 0x00e1,
+    0x00e0, 0x00e2, 0x00e4, 0x00e3, 0x00e5, 0x00e7, 0x00e9, 0x00e8,
+    0x00ea, 0x00eb, 0x00ed, 0x00ec, 0x00ee, 0x00ef, 0x00f1, 0x00f3,
+    0x00f2, 0x00f4, 0x00f6, 0x00f5, 0x00fa, 0x00f9, 0x00fb, 0x00fc,
+    0x2020, 0x00b0, 0x00a2, 0x00a3, 0x00a7, 0x2022, 0x00b6, 0x00df,
+    0x00ae, 0x00a9, 0x2122, 0x00b4, 0x00a8, 0x2260, 0x00c6, 0x00d8,
+    0x221e, 0x00b1, 0x2264, 0x2265, 0x00a5, 0x00b5, 0x2202, 0x2211,
+    0x220f, 0x03c0, 0x222b, 0x00aa, 0x00ba, 0x03a9, 0x00e6, 0x00f8,
+    0x00bf, 0x00a1, 0x00ac, 0x221a, 0x0192, 0x2248, 0x2206, 0x00ab,
+    0x00bb, 0x2026, 0x00a0, 0x00c0, 0x00c3, 0x00d5, 0x0152, 0x0153,
+    0x2013, 0x2014, 0x201c, 0x201d, 0x2018, 0x2019, 0x00f7, 0x25ca,
+    0x00ff, 0x0178, 0x2044, 0x20ac, 0x2039, 0x203a, 0xfb01, 0xfb02,
+    0x2021, 0x00b7, 0x201a, 0x201e, 0x2030, 0x00c2, 0x00ca, 0x00c1,
+    0x00cb, 0x00c8, 0x00cd, 0x00ce, 0x00cf, 0x00cc, 0x00d3, 0x00d4,
+    0xf8ff, 0x00d2, 0x00da, 0x00db, 0x00d9, 0x0131, 0x02c6, 0x02dc,
+    0x00af, 0x02d8, 0x02d9, 0x02da, 0x00b8, 0x02dd, 0x02db, 0x02c7,
+};
+
+const uint32_t kReplacement = 0xfffd;
+
+inline uint16_t Unit(const unsigned char *p)
+{
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+// The high bits take part, a 32-bit wchar_t holds code points such as
+// U+1D800 whose low 16 bits look like a surrogate
+inline bool IsSurrogate(uint32_t c)
+{
+    return (c & 0xfffff800) == 0xd800;
+}
+
+inline bool IsHighSurrogate(uint32_t c)
+{
+    return (c & 0xfffffc00) == 0xd800;
+}
+
+inline bool IsLowSurrogate(uint32_t c)
+{
+    return (c & 0xfffffc00) == 0xdc00;
+}
+
+inline char * EncodeUtf8(uint32_t c, char *out)
+{
+    if (c < 0x80) {
+        *out++ = char(c);
+    } else if (c < 0x800) {
+        *out++ = char(0xc0 | (c >> 6));
+        *out++ = char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        *out++ = char(0xe0 | (c >> 12));
+        *out++ = char(0x80 | ((c >> 6) & 0x3f));
+        *out++ = char(0x80 | (c & 0x3f));
+    } else {
+        *out++ = char(0xf0 | (c >> 18));
+        *out++ = char(0x80 | ((c >> 12) & 0x3f));
+        *out++ = char(0x80 | ((c >> 6) & 0x3f));
+        *out++ = char(0x80 | (c & 0x3f));
+    }
+    return out;
+}
+
+// Kernels, each converts all units and returns whether it saw surrogates,
+// except Ascii which stops at the first unit that isn't ASCII and returns
+// the number of units converted
+struct Kernels
+{
+    const char * name;
+    bool (*swap)(const unsigned char *in, size_t units, uint16_t *out);
+    bool (*widen)(const unsigned char *in, size_t units, uint32_t *out);
+    size_t (*ascii)(const unsigned char *in, size_t units, char *out);
+};
+
+bool SwapScalar(const unsigned char *in, size_t units, uint16_t *out)
+{
+    bool surrogates = false;
+    for (size_t i = 0; i < units; ++i) {
+        out[i] = Unit(in + 2 * i);
+        surrogates |= IsSurrogate(out[i]);
+    }
+    return surrogates;
+}
+
+bool WidenScalar(const unsigned char *in, size_t units, uint32_t *out)
+{
+    bool surrogates = false;
+    for (size_t i = 0; i < units; ++i) {
+        out[i] = Unit(in + 2 * i);
+        surrogates |= IsSurrogate(out[i]);
+    }
+    return surrogates;
+}
+
+size_t AsciiScalar(const unsigned char *in, size_t units, char *out)
+{
+    size_t i = 0;
+    for (; i < units; ++i) {
+        if (in[2 * i] != 0 || in[2 * i + 1] >= 0x80)
+            break;
+        out[i] = char(in[2 * i + 1]);
+    }
+    return i;
+}
+
+#ifdef FONTTEXT_X86
+
+inline __m128i Swap128(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// 0xffff in the lanes holding surrogates
+inline __m128i Surrogates128(__m128i v)
+{
+    return _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(short(0xf800))), _mm_set1_epi16(short(0xd800)));
+}
+
+bool SwapSse2(const unsigned char *in, size_t units, uint16_t *out)
+{
+    __m128i found = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = Swap128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i)));
+        found = _mm_or_si128(found, Surrogates128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+    }
+    bool surrogates = _mm_movemask_epi8(found) != 0;
+    return SwapScalar(in + 2 * i, units - i, out + i) || surrogates;
+}
+
+bool WidenSse2(const unsigned char *in, size_t units, uint32_t *out)
+{
+    __m128i found = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = Swap128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i)));
+        found = _mm_or_si128(found, Surrogates128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 4), _mm_unpackhi_epi16(v, zero));
+    }
+    bool surrogates = _mm_movemask_epi8(found) != 0;
+    return WidenScalar(in + 2 * i, units - i, out + i) || surrogates;
+}
+
+size_t AsciiSse2(const unsigned char *in, size_t units, char *out)
+{
+    __m128i mask = _mm_set1_epi16(short(0xff80));
+    size_t i = 0;
+    for (; i + 16 <= units; i += 16) {
+        __m128i a = Swap128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i)));
+        __m128i b = Swap128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i + 16)));
+        __m128i high = _mm_and_si128(_mm_or_si128(a, b), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+            break;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(a, b));
+    }
+    return i + AsciiScalar(in + 2 * i, units - i, out + i);
+}
+
+FONTTEXT_AVX2 inline __m256i Swap256(__m256i v)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+FONTTEXT_AVX2 inline __m256i Surrogates256(__m256i v)
+{
+    return _mm256_cmpeq_epi16(_mm256_and_si256(v, _mm256_set1_epi16(short(0xf800))),
+                              _mm256_set1_epi16(short(0xd800)));
+}
+
+FONTTEXT_AVX2 bool SwapAvx2(const unsigned char *in, size_t units, uint16_t *out)
+{
+    __m256i found = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= units; i += 16) {
+        __m256i v = Swap256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i)));
+        found = _mm256_or_si256(found, Surrogates256(v));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), v);
+    }
+    bool surrogates = _mm256_movemask_epi8(found) != 0;
+    return SwapSse2(in + 2 * i, units - i, out + i) || surrogates;
+}
+
+FONTTEXT_AVX2 bool WidenAvx2(const unsigned char *in, size_t units, uint32_t *out)
+{
+    __m256i found = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= units; i += 16) {
+        __m256i v = Swap256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i)));
+        found = _mm256_or_si256(found, Surrogates256(v));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+    }
+    bool surrogates = _mm256_movemask_epi8(found) != 0;
+    return WidenSse2(in + 2 * i, units - i, out + i) || surrogates;
+}
+
+FONTTEXT_AVX2 size_t AsciiAvx2(const unsigned char *in, size_t units, char *out)
+{
+    __m256i mask = _mm256_set1_epi16(short(0xff80));
+    size_t i = 0;
+    for (; i + 32 <= units; i += 32) {
+        __m256i a = Swap256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i)));
+        __m256i b = Swap256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i + 32)));
+        __m256i high = _mm256_and_si256(_mm256_or_si256(a, b), mask);
+        if (unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi16(high, _mm256_setzero_si256()))) != 0xffffffffu)
+            break;
+        // packus works within 128 bit lanes, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), packed);
+    }
+    return i + AsciiSse2(in + 2 * i, units - i, out + i);
+}
+
+bool HasAvx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // The OS must save the AVX registers
+    bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // FONTTEXT_X86
+
+Kernels SelectKernels()
+{
+#ifdef FONTTEXT_X86
+    if (HasAvx2()) {
+        Kernels avx2 = { "avx2", SwapAvx2, WidenAvx2, AsciiAvx2 };
+        return avx2;
+    }
+    Kernels sse2 = { "sse2", SwapSse2, WidenSse2, AsciiSse2 };
+    return sse2;
+#else
+    Kernels scalar = { "scalar", SwapScalar, WidenScalar, AsciiScalar };
+    return scalar;
+#endif
+}
+
+Kernels const & ActiveKernels()
+{
+    static const Kernels kernels = SelectKernels();
+    return kernels;
+}
+
+} // namespace
+
+namespace FontText {
+
+bool SwapUtf16(const unsigned char *in, size_t units, uint16_t *out)
+{
+    return ActiveKernels().swap(in, units, out);
+}
+
+void Utf16BeToWide(const unsigned char *in, size_t bytes, std::wstring &out)
+{
+    size_t units = bytes / 2;
+    out.resize(units);
+    if (units == 0)
+        return;
+#if WCHAR_MAX > 0xffff
+    uint32_t *p = reinterpret_cast<uint32_t *>(&out[0]);
+    if (!ActiveKernels().widen(in, units, p))
+        return;
+    // Combine pairs in place, the string only gets shorter
+    size_t w = 0;
+    for (size_t r = 0; r < units; ++r) {
+        uint32_t c = p[r];
+        if (IsHighSurrogate(c) && r + 1 < units && IsLowSurrogate(p[r + 1])) {
+            p[w++] = 0x10000 + ((c - 0xd800) << 10) + (p[r + 1] - 0xdc00);
+            ++r;
+        } else {
+            p[w++] = IsSurrogate(c) ? kReplacement : c;
+        }
+    }
+    out.resize(w);
+#else
+    uint16_t *p = reinterpret_cast<uint16_t *>(&out[0]);
+    if (!ActiveKernels().swap(in, units, p))
+        return;
+    for (size_t i = 0; i < units; ++i) {
+        if (IsHighSurrogate(p[i]) && i + 1 < units && IsLowSurrogate(p[i + 1]))
+            ++i;
+        else if (IsSurrogate(p[i]))
+            p[i] = uint16_t(kReplacement);
+    }
+#endif
+}
+
+void Utf16BeToUtf8(const unsigned char *in, size_t bytes, std::string &out)
+{
+    size_t units = bytes / 2;
+    // At most 3 bytes per unit, pairs take 4 bytes for 2 units
+    out.resize(units * 3);
+    if (units == 0)
+        return;
+    Kernels const & kernels = ActiveKernels();
+    char *begin = &out[0];
+    char *o = begin;
+    size_t i = 0;
+    while (i < units) {
+        size_t n = kernels.ascii(in + 2 * i, units - i, o);
+        i += n;
+        o += n;
+        // Up to the next ASCII unit
+        while (i < units) {
+            uint32_t c = Unit(in + 2 * i);
+            if (c < 0x80)
+                break;
+            ++i;
+            if (IsHighSurrogate(c) && i < units && IsLowSurrogate(Unit(in + 2 * i))) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (Unit(in + 2 * i) - 0xdc00);
+                ++i;
+            } else if (IsSurrogate(c)) {
+                c = kReplacement;
+            }
+            o = EncodeUtf8(c, o);
+        }
+    }
+    out.resize(o - begin);
+}
+
+void MacRomanToWide(const unsigned char *in, size_t bytes, std::wstring &out)
+{
+    out.resize(bytes);
+    for (size_t i = 0; i < bytes; ++i)
+        out[i] = wchar_t(in[i] < 0x80 ? in[i] : kMacRoman[in[i] - 0x80]);
+}
+
+void MacRomanToUtf8(const unsigned char *in, size_t bytes, std::string &out)
+{
+    out.resize(bytes * 3);
+    if (bytes == 0)
+        return;
+    char *begin = &out[0];
+    char *o = begin;
+    for (size_t i = 0; i < bytes; ++i)
+        o = EncodeUtf8(in[i] < 0x80 ? in[i] : kMacRoman[in[i] - 0x80], o);
+    out.resize(o - begin);
+}
+
+void WideToUtf8(std::wstring const & in, std::string &out)
+{
+    out.resize(in.size() * 4);
+    if (in.empty())
+        return;
+    char *begin = &out[0];
+    char *o = begin;
+    for (size_t i = 0; i < in.size(); ++i) {
+        uint32_t c = uint32_t(in[i]);
+        if (IsHighSurrogate(c) && i + 1 < in.size() && IsLowSurrogate(uint32_t(in[i + 1]))) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (uint32_t(in[i + 1]) - 0xdc00);
+            ++i;
+        } else if (IsSurrogate(c) || c > 0x10ffff) {
+            c = kReplacement;
+        }
+        o = EncodeUtf8(c, o);
+    }
+    out.resize(o - begin);
+}
+
+const char * KernelName()
+{
+    return ActiveKernels().name;
+}
+
+} // namespace FontText
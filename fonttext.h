@@ -0,0 +1,40 @@
+#ifndef FONTTEXT_H
+#define FONTTEXT_H
+
+// Decoding of the strings stored in font tables: big endian UTF-16 and
+// Mac Roman.
+//
+// The UTF-16 conversions run on SSE2 or AVX2 kernels picked at run time,
+// with a scalar fallback on other CPUs. Unpaired surrogates decode to
+// U+FFFD, pairs are combined when the output isn't UTF-16.
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FontText {
+
+// Copies units big endian code units to out in host order, returns true if
+// there were surrogates among them
+bool SwapUtf16(const unsigned char *in, size_t units, uint16_t *out);
+
+// Replaces out with the decoded string, UTF-16 where wchar_t is 16 bits
+// and UTF-32 otherwise. An odd trailing byte is ignored.
+void Utf16BeToWide(const unsigned char *in, size_t bytes, std::wstring &out);
+
+void Utf16BeToUtf8(const unsigned char *in, size_t bytes, std::string &out);
+
+void MacRomanToWide(const unsigned char *in, size_t bytes, std::wstring &out);
+
+void MacRomanToUtf8(const unsigned char *in, size_t bytes, std::string &out);
+
+// Encodes a wide string, UTF-16 or UTF-32 depending on wchar_t, unpaired
+// surrogates become U+FFFD
+void WideToUtf8(std::wstring const & in, std::string &out);
+
+// Name of the kernels in use, "avx2", "sse2" or "scalar"
+const char * KernelName();
+
+} // namespace FontText
+
+#endif // FONTTEXT_H
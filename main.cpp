@@ -1,41 +1,526 @@
+#include "chunkstore.h"
+#include "dumpdiff.h"
+#include "dumpprofiler.h"
+#include "dumprecorder.h"
+#include "dumpreader.h"
+#include "dumpservice.h"
+#include "dumptrigger.h"
+#include "dumprebuild.h"
+#include "fontbench.h"
+#include "fontcoverage.h"
 #include "fontdump.h"
+#include "fontnameindex.h"
+#include "fontscanner.h"
 #include "minidumpper.h"
+#include "multidumpper.h"
+#include "processindex.h"
+#include "processwatcher.h"
+#include "progresssink.h"
+#include "stackprofile.h"
 
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
 
-int main()
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+// Sleeps for the given interval, returns non zero when woken up by a signal
+static unsigned int SleepEx(unsigned int milliseconds, bool)
+{
+    return sleep(milliseconds / 1000);
+}
+#endif
+
+// Parses a byte count with an optional K, M or G suffix
+static unsigned long long ParseSize(const wchar_t * text)
+{
+    wchar_t * end = nullptr;
+    unsigned long long size = wcstoull(text, &end, 10);
+    switch (*end) {
+    case L'G': case L'g': size <<= 10; // fall through
+    case L'M': case L'm': size <<= 10; // fall through
+    case L'K': case L'k': size <<= 10;
+    }
+    return size;
+}
+
+// Waits out the interval between two dumps of a target given by name and
+// moves the dumpper to the new instance as soon as the target restarts.
+// Returns false when a signal cut the wait short.
+static bool FollowTarget(ProcessWatcher & watcher, MiniDumpper & dumpper, unsigned int seconds)
 {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(seconds);
+    for (Clock::time_point now = Clock::now(); now < deadline; now = Clock::now()) {
+        bool bInterrupted = false;
+        bool bChanged = watcher.Wait(unsigned(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()),
+                                     bInterrupted);
+        if (bInterrupted)
+            return false;
+        int pid = watcher.Newest(0);
+        if (!bChanged || pid == dumpper.ProcessId())
+            continue;
+        if (pid == 0) {
+            wprintf(L"Process %d exited, waiting for it to come back\n", dumpper.ProcessId());
+        } else {
+            wprintf(L"Following the new process %d\n", pid);
+            dumpper.Attach(pid);
+        }
+    }
+    return true;
+}
+
+// Writes the spans recorded so far as a Chrome trace and prints a summary
+static void ReportProfile(DumpProfiler const & profiler, std::wstring const & tracePath)
+{
+    if (tracePath.empty())
+        return;
+    profiler.PrintSummary();
+    if (!profiler.WriteTrace(tracePath))
+        wprintf(L"Couldn't write %ls\n", tracePath.c_str());
+}
+
+int main(int nargs, char * args[])
+{
+#ifdef _WIN32
+    (void) nargs;
+    (void) args;
+
     // Get command line parameters.
     LPCWSTR szCommandLine = GetCommandLineW();
 
     // Split command line.
     int argc = 0;
     LPWSTR* argv = CommandLineToArgvW(szCommandLine, &argc);
+#else
+    setlocale(LC_ALL, "");
+
+    // Convert command line to wide strings.
+    int argc = nargs;
+    std::vector<std::wstring> wargs(argc);
+    std::vector<const wchar_t *> argv(argc);
+    for (int i = 0; i < argc; ++i) {
+        wargs[i].resize(mbstowcs(nullptr, args[i], 0) + 1);
+        wargs[i].resize(mbstowcs(&wargs[i][0], args[i], wargs[i].size()));
+        argv[i] = wargs[i].c_str();
+    }
+#endif
 
     // Check parameter count.
     if(argc < 2)
         return 1; // No arguments passed, exit.
 
+    // font [-j N] [-n] reads the font files, -n bypasses the name cache.
+    // font gdi enumerates through GDI.
     if (argv[1] == std::wstring(L"font")) {
-        FontDump font;
-        font.populateFontDatabase();
-        getchar();
+#ifdef _WIN32
+        if (argc > 2 && argv[2] == std::wstring(L"gdi")) {
+            FontDump font;
+            font.populateFontDatabase();
+            getchar();
+            return 0;
+        }
+#endif
+        // font covers <codepoint...> [-x index] lists the faces covering
+        // each codepoint, best fallback first
+        if (argc > 2 && argv[2] == std::wstring(L"covers")) {
+            std::vector<uint32_t> codepoints;
+            std::wstring indexPath;
+            int threads = 0;
+            for (int i = 3; i < argc; ++i) {
+                if (argv[i] == std::wstring(L"-j") && i + 1 < argc)
+                    threads = wcstol(argv[++i], nullptr, 10);
+                else if (argv[i] == std::wstring(L"-x") && i + 1 < argc)
+                    indexPath = argv[++i];
+                else
+                    codepoints.push_back(uint32_t(wcstoul(argv[i] + (wcsncmp(argv[i], L"U+", 2) == 0 ? 2 : 0),
+                                                          nullptr, 16)));
+            }
+            PrintFontCoverage(codepoints, threads, indexPath);
+            return 0;
+        }
+        // font bench [-m mutations] [files...] measures the name table
+        // parsers and checks them against mutated tables
+        if (argc > 2 && argv[2] == std::wstring(L"bench")) {
+            std::vector<std::wstring> files;
+            unsigned int mutations = 1000;
+            for (int i = 3; i < argc; ++i) {
+                if (argv[i] == std::wstring(L"-m") && i + 1 < argc)
+                    mutations = wcstoul(argv[++i], nullptr, 10);
+                else
+                    files.push_back(argv[i]);
+            }
+            BenchmarkFontNames(files, mutations);
+            return 0;
+        }
+        // font name <name> [style] [-x index] finds the faces known under a
+        // name in any language
+        if (argc > 3 && argv[2] == std::wstring(L"name")) {
+            std::vector<std::wstring> names;
+            std::wstring indexPath;
+            int threads = 0;
+            for (int i = 3; i < argc; ++i) {
+                if (argv[i] == std::wstring(L"-j") && i + 1 < argc)
+                    threads = wcstol(argv[++i], nullptr, 10);
+                else if (argv[i] == std::wstring(L"-x") && i + 1 < argc)
+                    indexPath = argv[++i];
+                else
+                    names.push_back(argv[i]);
+            }
+            if (names.empty())
+                return 1;
+            PrintFontName(names[0], names.size() > 1 ? names[1] : std::wstring(), threads, indexPath);
+            return 0;
+        }
+        int threads = 0;
+        bool useCache = true;
+        for (int i = 2; i < argc; ++i) {
+            if (argv[i] == std::wstring(L"-j") && i + 1 < argc)
+                threads = wcstol(argv[++i], nullptr, 10);
+            else if (argv[i] == std::wstring(L"-n"))
+                useCache = false;
+        }
+        PrintFontDatabase(threads, useCache);
+        return 0;
+    }
+
+    if (argv[1] == std::wstring(L"rebuild")) {
+        if (argc < 4)
+            return 1;
+        std::vector<std::wstring> inputs(&argv[3], &argv[0] + argc);
+        return RebuildDump(argv[2], inputs) ? 0 : 1;
+    }
+
+    if (argv[1] == std::wstring(L"findbench")) {
+        std::vector<int> counts;
+        for (int i = 2; i < argc; ++i)
+            counts.push_back(wcstol(argv[i], nullptr, 10));
+        if (counts.empty())
+            counts.push_back(0);
+        BenchmarkProcessIndex(counts);
         return 0;
     }
 
+    if (argv[1] == std::wstring(L"diff")) {
+        std::vector<std::wstring> paths;
+        int threads = 0;
+        for (int i = 2; i < argc; ++i) {
+            if (argv[i] == std::wstring(L"-j") && i + 1 < argc)
+                threads = wcstol(argv[++i], nullptr, 10);
+            else
+                paths.push_back(argv[i]);
+        }
+        return DiffDumps(paths, threads) ? 0 : 1;
+    }
+
+    if (argv[1] == std::wstring(L"inspect")) {
+        if (argc < 3)
+            return 1;
+        unsigned long long address = argc > 3 ? wcstoull(argv[3], nullptr, 16) : 0;
+        size_t size = argc > 3 ? (argc > 4 ? wcstoul(argv[4], nullptr, 10) : 256) : 0;
+        return InspectDump(argv[2], address, size) ? 0 : 1;
+    }
+
+    // store <repository> lists the dumps of a chunk store, restore
+    // <repository> <dump> <output> writes one out as an MDMP file
+    if (argv[1] == std::wstring(L"store")) {
+        if (argc < 3)
+            return 1;
+        return PrintChunkStore(argv[2]) ? 0 : 1;
+    }
+
+    if (argv[1] == std::wstring(L"restore")) {
+        if (argc < 5)
+            return 1;
+        return RestoreDump(argv[2], argv[3], argv[4]) ? 0 : 1;
+    }
+
+    if (argv[1] == std::wstring(L"decompress")) {
+        if (argc < 4)
+            return 1;
+        return DecompressDump(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // sample <target> [-f hz] [-d seconds] [-o file] profiles the stacks of
+    // the target until the time is up or Ctrl+C, folded for flame graphs
+    if (argv[1] == std::wstring(L"sample")) {
+        if (argc < 3)
+            return 1;
+        unsigned int hz = 100;
+        unsigned int seconds = 0;
+        std::wstring path = L"stacks.folded";
+        for (int i = 3; i < argc; ++i) {
+            if (argv[i] == std::wstring(L"-f") && i + 1 < argc)
+                hz = wcstoul(argv[++i], nullptr, 10);
+            else if (argv[i] == std::wstring(L"-d") && i + 1 < argc)
+                seconds = wcstoul(argv[++i], nullptr, 10);
+            else if (argv[i] == std::wstring(L"-o") && i + 1 < argc)
+                path = argv[++i];
+        }
+        MiniDumpper dumpper(argv[2]);
+        if (dumpper.ProcessId() == 0)
+            return 1;
+        return ProfileStacks(dumpper, hz, seconds, path) ? 0 : 1;
+    }
+
+    // multi <target,target,...> dumps all targets together, serve <socket>
+    // takes dump requests with the options applying to every dump
+    bool multi = argv[1] == std::wstring(L"multi");
+    bool serve = argv[1] == std::wstring(L"serve");
+    int first = multi || serve ? 3 : 2;
+    if ((multi || serve) && argc < 3)
+        return 1;
+
     int interval = 0;
+    bool incremental = false;
+    bool lowPause = false;
+    bool reread = false;
+    DumpCodec codec = NoCodec;
+    int level = 0;
+    int threads = 0;
+    unsigned int readThreads = 0;
+    std::wstring tracePath;
+    DumpLimits limits = {};
+    DumpPolicy policy;
+    std::vector<TriggerSpec> triggers;
+    unsigned int tick = 1000;
+    RecorderLimits recorderLimits = {};
+    std::wstring storePath;
+
+    for (int i = first; i < argc; ++i) {
+        if (argv[i] == std::wstring(L"-i")) {
+            incremental = true;
+        } else if (argv[i] == std::wstring(L"-l")) {
+            lowPause = true;
+        } else if (argv[i] == std::wstring(L"-r")) {
+            lowPause = true;
+            reread = true;
+        } else if (argv[i] == std::wstring(L"-z") && i + 1 < argc) {
+            if (!ParseDumpCodec(argv[++i], codec, level)) {
+                wprintf(L"Unsupported compression %ls\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i] == std::wstring(L"-j") && i + 1 < argc) {
+            threads = wcstol(argv[++i], nullptr, 10);
+        } else if (argv[i] == std::wstring(L"-c") && i + 1 < argc) {
+            // -c <threads> caps the threads reading target memory
+            readThreads = wcstoul(argv[++i], nullptr, 10);
+        } else if (argv[i] == std::wstring(L"-p") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (argv[i] == std::wstring(L"-t") && i + 1 < argc) {
+            // -t <ms> limits the time of each dump, -P <ms> how long the target stays stopped
+            limits.maxWallTime = wcstoll(argv[++i], nullptr, 10) * 1000;
+        } else if (argv[i] == std::wstring(L"-P") && i + 1 < argc) {
+            limits.maxPauseTime = wcstoll(argv[++i], nullptr, 10) * 1000;
+        } else if (argv[i] == std::wstring(L"-s") && i + 1 < argc) {
+            // -s <size>[K|M|G] limits the size of each dump before compression
+            limits.maxBytes = ParseSize(argv[++i]);
+        } else if (argv[i] == std::wstring(L"-m") && i + 1 < argc) {
+            // -m <rules> picks the memory to dump, rules separated by ';' or
+            // -m @<file> with one rule per line
+            std::wstring error;
+            std::wstring rules = argv[++i];
+            if (!(rules[0] == L'@' ? policy.Load(rules.substr(1), error) : policy.Parse(rules, error))) {
+                wprintf(L"%ls\n", error.c_str());
+                return 1;
+            }
+        } else if (argv[i] == std::wstring(L"-T") && i + 1 < argc) {
+            // -T <trigger> dumps when the trigger fires instead of every
+            // interval, -k <ms> sets how often the target is sampled
+            TriggerSpec spec;
+            if (!ParseTrigger(argv[++i], spec)) {
+                wprintf(L"Bad trigger %ls\n", argv[i]);
+                return 1;
+            }
+            triggers.push_back(spec);
+        } else if (argv[i] == std::wstring(L"-R") && i + 1 < argc) {
+            // -R <size>[,dumps=N][,for=seconds] keeps the dumps of every
+            // interval in memory and writes them out only when a trigger
+            // fires, the target exits or on SIGUSR1 (Ctrl+Break)
+            if (!ParseRecorderLimits(argv[++i], recorderLimits)) {
+                wprintf(L"Bad recorder limits %ls\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i] == std::wstring(L"-S") && i + 1 < argc) {
+            // -S <repository> stores dumps in a chunk store, each distinct
+            // chunk once across dumps and processes
+            storePath = argv[++i];
+        } else if (argv[i] == std::wstring(L"-k") && i + 1 < argc) {
+            tick = wcstoul(argv[++i], nullptr, 10);
+        } else if ((argv[i] == std::wstring(L"-g") || argv[i] == std::wstring(L"-G")) && i + 1 < argc) {
+            // -g <file> writes progress to a file, -G <file> as JSON lines, "-" is the console
+            ProgressFormat format = argv[i][1] == L'G' ? ProgressJson : ProgressText;
+            std::wstring path = argv[++i];
+            if (!ProgressSink::Instance().Open(path == L"-" ? std::wstring() : path, format)) {
+                wprintf(L"Couldn't open %ls\n", path.c_str());
+                return 1;
+            }
+        } else {
+            interval = wcstol(argv[i], nullptr, 10);
+        }
+    }
+
+    // -p <trace.json> profiles every dump, the trace keeps growing over
+    // the interval loop
+    DumpProfiler profiler(tracePath.empty() ? 0 : 1 << 18);
+
+    if (multi && !triggers.empty()) {
+        wprintf(L"Triggers watch a single process\n");
+        return 1;
+    }
+
+    bool record = recorderLimits.maxBytes != 0;
+    if (serve && (!triggers.empty() || record)) {
+        wprintf(L"The service dumps on request, without triggers or a recorder\n");
+        return 1;
+    }
+    if (record && (multi || interval == 0)) {
+        wprintf(L"The recorder takes a single process and an interval\n");
+        return 1;
+    }
 
-    if (argc > 2)
-        interval = wcstol(argv[2], nullptr, 10);
+    ChunkStore store;
+    if (!storePath.empty()) {
+        if (record) {
+            wprintf(L"The recorder writes files, it can't fill a chunk store\n");
+            return 1;
+        }
+        if (!store.Open(storePath, true)) {
+            wprintf(L"Couldn't open chunk store %ls\n", storePath.c_str());
+            return 1;
+        }
+        store.SetCompression(codec, level);
+    }
+
+    MiniDumpper::SetReadThreads(readThreads);
+
+    if (serve) {
+        // -j sets the number of workers
+        DumpService service(argv[2], threads, [&](MiniDumpper & dumpper) {
+            dumpper.SetIncremental(incremental);
+            dumpper.SetLowPause(lowPause, reread);
+            dumpper.SetCompression(codec, level);
+            dumpper.SetBudget(limits);
+            dumpper.SetPolicy(policy);
+            if (!storePath.empty())
+                dumpper.SetChunkStore(&store);
+            if (!tracePath.empty())
+                dumpper.SetProfiler(&profiler);
+        });
+        bool ok = service.Run();
+        ReportProfile(profiler, tracePath);
+        return ok ? 0 : 1;
+    }
+
+    if (multi) {
+        std::vector<std::wstring> targets;
+        std::wstring list = argv[2];
+        size_t pos = 0;
+        while (pos <= list.size()) {
+            size_t comma = list.find(L',', pos);
+            if (comma == std::wstring::npos)
+                comma = list.size();
+            if (comma > pos)
+                targets.push_back(list.substr(pos, comma - pos));
+            pos = comma + 1;
+        }
+
+        MultiDumpper dumpper(targets, threads);
+        dumpper.SetIncremental(incremental);
+        dumpper.SetLowPause(lowPause, reread);
+        dumpper.SetCompression(codec, level);
+        dumpper.SetBudget(limits);
+        dumpper.SetPolicy(policy);
+        if (!storePath.empty())
+            dumpper.SetChunkStore(&store);
+        if (!tracePath.empty())
+            dumpper.SetProfiler(&profiler);
+
+        dumpper.CreateMiniDumps();
+        ReportProfile(profiler, tracePath);
+
+        while (interval) {
+            if (SleepEx(interval * 1000, true) != 0)
+                break;
+            dumpper.CreateMiniDumps();
+            ReportProfile(profiler, tracePath);
+        }
+
+        return 0;
+    }
 
     MiniDumpper dumpper(argv[1]);
+    dumpper.SetIncremental(incremental);
+    dumpper.SetLowPause(lowPause, reread);
+    dumpper.SetCompression(codec, level);
+    dumpper.SetBudget(limits);
+    dumpper.SetPolicy(policy);
+    if (!storePath.empty())
+        dumpper.SetChunkStore(&store);
+    if (!tracePath.empty())
+        dumpper.SetProfiler(&profiler);
 
-    dumpper.CreateMiniDump();
+    DumpRecorder recorder(recorderLimits);
+    if (record) {
+        recorder.SetCompression(codec, level);
+        dumpper.SetRecorder(&recorder);
+    }
+
+    if (!triggers.empty() || record) {
+        // Escalating triggers start with a dump of the stacks alone, made
+        // like the full dumps but never as deltas of them
+        MiniDumpper light(dumpper.ProcessId());
+        DumpPolicy stacks;
+        std::wstring error;
+        stacks.Parse(L"include stack;exclude all", error);
+        light.SetPolicy(stacks);
+        light.SetLowPause(lowPause, reread);
+        light.SetCompression(codec, level);
+        light.SetBudget(limits);
+        if (!storePath.empty())
+            light.SetChunkStore(&store);
+        if (!tracePath.empty())
+            light.SetProfiler(&profiler);
+        TriggerEngine engine(dumpper, light, triggers);
+        if (record)
+            engine.SetRecorder(&recorder, interval);
+        engine.Run(tick);
+        ReportProfile(profiler, tracePath);
+        return 0;
+    }
+
+    // A target given by name is followed when it restarts, the dumps
+    // move to the new process without waiting for a failed dump
+    wchar_t * end = nullptr;
+    bool follow = interval && !(wcstol(argv[1], &end, 10) > 0 && *end == 0);
+    std::unique_ptr<ProcessWatcher> watcher;
+    if (follow) {
+        watcher.reset(new ProcessWatcher);
+        watcher->Watch(argv[1]);
+        if (watcher->Newest(0) && watcher->Newest(0) != dumpper.ProcessId())
+            dumpper.Attach(watcher->Newest(0));
+    }
+
+    if (!follow || dumpper.ProcessId())
+        dumpper.CreateMiniDump();
+    ReportProfile(profiler, tracePath);
 
     while (interval) {
-        if (SleepEx(interval * 1000, TRUE) != 0)
+        if (follow ? !FollowTarget(*watcher, dumpper, interval) : SleepEx(interval * 1000, true) != 0)
             break;
+        if (follow && watcher->Newest(0) == 0)
+            continue;
         dumpper.CreateMiniDump();
+        ReportProfile(profiler, tracePath);
     }
 
     return 0;
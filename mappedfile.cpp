@@ -0,0 +1,111 @@
+#include "mappedfile.h"
+#include "dumpoutput.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : m_data(nullptr)
+    , m_nSize(0)
+{
+#ifdef _WIN32
+    m_hFile = nullptr;
+    m_hMapping = nullptr;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(std::wstring const & path)
+{
+    Close();
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    m_hFile = hFile;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) {
+        Close();
+        return false;
+    }
+    m_hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_hMapping == nullptr) {
+        Close();
+        return false;
+    }
+    m_data = static_cast<char const *>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_data == nullptr) {
+        Close();
+        return false;
+    }
+    m_nSize = size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_hMapping)
+        CloseHandle(m_hMapping);
+    if (m_hFile)
+        CloseHandle(m_hFile);
+    m_data = nullptr;
+    m_hMapping = nullptr;
+    m_hFile = nullptr;
+    m_nSize = 0;
+}
+
+#else
+
+bool MappedFile::Open(std::wstring const & path)
+{
+    Close();
+    int fd = open(NarrowPath(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void * data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_data = static_cast<char const *>(data);
+    m_nSize = uint64_t(st.st_size);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data)
+        munmap(const_cast<char *>(m_data), size_t(m_nSize));
+    m_data = nullptr;
+    m_nSize = 0;
+}
+
+#endif
+
+char const * MappedFile::Data() const
+{
+    return m_data;
+}
+
+uint64_t MappedFile::Size() const
+{
+    return m_nSize;
+}
@@ -0,0 +1,38 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <stdint.h>
+
+// Read-only mapping of a whole file. Pages are only read when touched, so
+// opening a file costs the same whatever its size.
+class MappedFile
+{
+public:
+    MappedFile();
+
+    ~MappedFile();
+
+public:
+    bool Open(std::wstring const & path);
+
+    void Close();
+
+    char const * Data() const;
+
+    uint64_t Size() const;
+
+private:
+    MappedFile(MappedFile const &);
+    MappedFile & operator=(MappedFile const &);
+
+private:
+#ifdef _WIN32
+    void * m_hFile;
+    void * m_hMapping;
+#endif
+    char const * m_data;
+    uint64_t m_nSize;
+};
+
+#endif // MAPPEDFILE_H
@@ -0,0 +1,186 @@
+#include "memoryreader.h"
+
+#include <sys/uio.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace {
+
+unsigned int s_nThreads = 0;
+
+} // namespace
+
+size_t ReadProcessMemory(int pid, uint64_t address, void * buffer, size_t size)
+{
+    char * out = static_cast<char *>(buffer);
+    size_t done = 0;
+    size_t good = 0;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    while (done < size) {
+        iovec local = { out + done, size - done };
+        iovec remote = { reinterpret_cast<void *>(address + done), size - done };
+        ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (n > 0) {
+            done += n;
+            good += n;
+            continue;
+        }
+        // skip the failing page
+        size_t skip = pageSize - ((address + done) % pageSize);
+        if (skip > size - done)
+            skip = size - done;
+        memset(out + done, 0, skip);
+        done += skip;
+    }
+    return good;
+}
+
+MemoryReader::MemoryReader(int pid, std::vector<MDMemoryDescriptor64> const & ranges)
+    : m_pid(pid)
+    , m_nQueued(0)
+    , m_nCurrent(0)
+    , m_nOffset(0)
+    , m_nPending(0)
+    , m_bStop(false)
+{
+    Batch batch = { 0, 0, 0, std::vector<char>(), false };
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        uint64_t address = ranges[i].start_of_memory_range;
+        uint64_t left = ranges[i].data_size;
+        while (left) {
+            size_t n = size_t(std::min<uint64_t>(left, kBatchSize - batch.size));
+            Piece piece = { address, n };
+            m_pieces.push_back(piece);
+            ++batch.count;
+            batch.size += n;
+            address += n;
+            left -= n;
+            if (batch.size == kBatchSize || batch.count == IOV_MAX) {
+                m_batches.push_back(batch);
+                batch.first = m_pieces.size();
+                batch.count = 0;
+                batch.size = 0;
+            }
+        }
+    }
+    if (batch.count)
+        m_batches.push_back(batch);
+
+    m_nWindow = Pool().Size() * kBatchesPerThread;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Prefetch();
+}
+
+MemoryReader::~MemoryReader()
+{
+    // Batches still queued are dropped unread, the pool outlives us
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_bStop = true;
+    while (m_nPending)
+        m_ready.wait(lock);
+}
+
+void MemoryReader::SetThreads(unsigned int threads)
+{
+    s_nThreads = threads;
+}
+
+ThreadPool & MemoryReader::Pool()
+{
+    static ThreadPool pool(DefaultThreads());
+    return pool;
+}
+
+unsigned int MemoryReader::DefaultThreads()
+{
+    if (s_nThreads)
+        return s_nThreads;
+    unsigned int threads = std::thread::hardware_concurrency() / 2;
+    if (threads > kDefaultThreads)
+        threads = kDefaultThreads;
+    return threads ? threads : 1;
+}
+
+size_t MemoryReader::Next(char const *& data, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_nCurrent < m_batches.size() && m_nOffset == m_batches[m_nCurrent].size) {
+        // The caller is done with the batch, its buffer goes to the next one
+        m_free.push_back(std::vector<char>());
+        m_free.back().swap(m_batches[m_nCurrent].data);
+        ++m_nCurrent;
+        m_nOffset = 0;
+        Prefetch();
+    }
+    if (m_nCurrent >= m_batches.size())
+        return 0;
+    Batch & batch = m_batches[m_nCurrent];
+    while (!batch.ready)
+        m_ready.wait(lock);
+    size_t n = std::min(size, batch.size - m_nOffset);
+    data = &batch.data[m_nOffset];
+    m_nOffset += n;
+    return n;
+}
+
+void MemoryReader::Prefetch()
+{
+    while (m_nQueued < m_batches.size() && m_nQueued < m_nCurrent + m_nWindow) {
+        size_t batch = m_nQueued++;
+        if (!m_free.empty()) {
+            m_batches[batch].data.swap(m_free.back());
+            m_free.pop_back();
+        }
+        ++m_nPending;
+        Pool().Submit([this, batch]() { Read(batch); });
+    }
+}
+
+void MemoryReader::Read(size_t index)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_bStop) {
+            --m_nPending;
+            m_ready.notify_all();
+            return;
+        }
+    }
+    // Until it is ready the batch belongs to this task
+    Batch & batch = m_batches[index];
+    batch.data.resize(batch.size);
+    std::vector<iovec> remote(batch.count);
+    for (size_t i = 0; i < batch.count; ++i) {
+        remote[i].iov_base = reinterpret_cast<void *>(m_pieces[batch.first + i].address);
+        remote[i].iov_len = m_pieces[batch.first + i].size;
+    }
+    iovec local = { &batch.data[0], batch.size };
+    ssize_t n = process_vm_readv(m_pid, &local, 1, &remote[0], remote.size(), 0);
+    size_t done = n > 0 ? size_t(n) : 0;
+
+    // The read stops at the first page it can't read, the rest is read
+    // piece by piece, which zero fills what stays unreadable
+    if (done < batch.size) {
+        size_t offset = 0;
+        for (size_t i = 0; i < batch.count; ++i) {
+            Piece const & piece = m_pieces[batch.first + i];
+            if (offset + piece.size > done) {
+                size_t skip = done > offset ? done - offset : 0;
+                ReadProcessMemory(m_pid, piece.address + skip, &batch.data[offset + skip], piece.size - skip);
+            }
+            offset += piece.size;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    batch.ready = true;
+    --m_nPending;
+    m_ready.notify_all();
+}
@@ -0,0 +1,90 @@
+#ifndef MEMORYREADER_H
+#define MEMORYREADER_H
+
+#include "minidumpformat.h"
+#include "threadpool.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reads target memory with process_vm_readv, unreadable pages are zero
+// filled. Returns the bytes that could be read.
+size_t ReadProcessMemory(int pid, uint64_t address, void * buffer, size_t size);
+
+// Reads the memory ranges of a dump ahead of the writer. Linux only.
+//
+// The ranges are cut into batches of up to kBatchSize bytes, each read by
+// a single process_vm_readv with up to IOV_MAX ranges on the remote side,
+// so many small regions cost one syscall instead of one each. Batches are
+// read on a pool of threads shared by all readers of this process, a few
+// per thread ahead of the writer, and handed out in the order of the
+// ranges.
+class MemoryReader
+{
+public:
+    static const size_t kBatchSize = 4 * 1024 * 1024;
+
+    // Batches in flight per thread, bounds the memory held to
+    // threads * kBatchesPerThread * kBatchSize
+    static const unsigned int kBatchesPerThread = 2;
+
+    // Ranges have to be page aligned
+    MemoryReader(int pid, std::vector<MDMemoryDescriptor64> const & ranges);
+
+    ~MemoryReader();
+
+public:
+    // Threads of the shared pool, only before the first reader starts it.
+    // 0 uses half the hardware threads, at most kDefaultThreads.
+    static void SetThreads(unsigned int threads);
+
+    static const unsigned int kDefaultThreads = 4;
+
+    // The next bytes of the ranges, read back to back: up to size of them,
+    // fewer where a batch ends. data stays valid until the next call.
+    size_t Next(char const *& data, size_t size);
+
+private:
+    struct Batch
+    {
+        size_t first; // index of the first piece
+        size_t count;
+        size_t size;
+        std::vector<char> data;
+        bool ready;
+    };
+
+    struct Piece
+    {
+        uint64_t address;
+        size_t size;
+    };
+
+    void Read(size_t index);
+
+    // Queues the next batch while the window has room
+    void Prefetch();
+
+    static ThreadPool & Pool();
+
+    static unsigned int DefaultThreads();
+
+private:
+    int m_pid;
+    std::vector<Piece> m_pieces;
+    std::vector<Batch> m_batches;
+    size_t m_nWindow;
+    size_t m_nQueued;   // batches handed to the pool
+    size_t m_nCurrent;  // batch being consumed
+    size_t m_nOffset;   // within the current batch
+    std::vector<std::vector<char> > m_free; // buffers of consumed batches
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    size_t m_nPending;  // queued batches not done yet
+    bool m_bStop;
+};
+
+#endif // MEMORYREADER_H
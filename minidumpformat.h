@@ -0,0 +1,240 @@
+#ifndef MINIDUMPFORMAT_H
+#define MINIDUMPFORMAT_H
+
+// On-disk layout of MDMP files, mirroring the DbgHelp minidump structures.
+// The names follow breakpad so they don't clash with <DbgHelp.h>.
+
+#include <stdint.h>
+
+#pragma pack(push, 4)
+
+enum MDStreamType {
+    MD_UNUSED_STREAM = 0,
+    MD_THREAD_LIST_STREAM = 3,
+    MD_MODULE_LIST_STREAM = 4,
+    MD_MEMORY_LIST_STREAM = 5,
+    MD_SYSTEM_INFO_STREAM = 7,
+    MD_MEMORY_64_LIST_STREAM = 9,
+
+    // Linux specific streams, as written by breakpad
+    MD_LINUX_PROC_STATUS = 0x47670004,
+    MD_LINUX_CMD_LINE = 0x47670006,
+    MD_LINUX_MAPS = 0x47670009,
+
+    // Streams written by this tool
+    MD_DUMPPER_DELTA_INFO = 0x4d440001,
+    MD_DUMPPER_PAGE_FIXUPS = 0x4d440002,
+    MD_DUMPPER_OMITTED_MEMORY = 0x4d440003
+};
+
+const uint32_t MD_HEADER_SIGNATURE = 0x504d444d; // 'MDMP'
+const uint32_t MD_HEADER_VERSION = 0x0000a793;
+
+const uint16_t MD_CPU_ARCHITECTURE_X86 = 0;
+const uint16_t MD_CPU_ARCHITECTURE_AMD64 = 9;
+const uint16_t MD_CPU_ARCHITECTURE_ARM64 = 12;
+const uint32_t MD_OS_LINUX = 0x8201;
+
+struct MDLocationDescriptor {
+    uint32_t data_size;
+    uint32_t rva;
+};
+
+struct MDMemoryDescriptor {
+    uint64_t start_of_memory_range;
+    MDLocationDescriptor memory;
+};
+
+struct MDMemoryDescriptor64 {
+    uint64_t start_of_memory_range;
+    uint64_t data_size;
+};
+
+struct MDRawHeader {
+    uint32_t signature;
+    uint32_t version;
+    uint32_t stream_count;
+    uint32_t stream_directory_rva;
+    uint32_t checksum;
+    uint32_t time_date_stamp;
+    uint64_t flags;
+};
+
+struct MDRawDirectory {
+    uint32_t stream_type;
+    MDLocationDescriptor location;
+};
+
+struct MDRawThread {
+    uint32_t thread_id;
+    uint32_t suspend_count;
+    uint32_t priority_class;
+    uint32_t priority;
+    uint64_t teb;
+    MDMemoryDescriptor stack;
+    MDLocationDescriptor thread_context;
+};
+
+struct MDVSFixedFileInfo {
+    uint32_t signature;
+    uint32_t struct_version;
+    uint32_t file_version_hi;
+    uint32_t file_version_lo;
+    uint32_t product_version_hi;
+    uint32_t product_version_lo;
+    uint32_t file_flags_mask;
+    uint32_t file_flags;
+    uint32_t file_os;
+    uint32_t file_type;
+    uint32_t file_subtype;
+    uint32_t file_date_hi;
+    uint32_t file_date_lo;
+};
+
+struct MDRawModule {
+    uint64_t base_of_image;
+    uint32_t size_of_image;
+    uint32_t checksum;
+    uint32_t time_date_stamp;
+    uint32_t module_name_rva;
+    MDVSFixedFileInfo version_info;
+    MDLocationDescriptor cv_record;
+    MDLocationDescriptor misc_record;
+    uint64_t reserved0;
+    uint64_t reserved1;
+};
+
+struct MDRawSystemInfo {
+    uint16_t processor_architecture;
+    uint16_t processor_level;
+    uint16_t processor_revision;
+    uint8_t number_of_processors;
+    uint8_t product_type;
+    uint32_t major_version;
+    uint32_t minor_version;
+    uint32_t build_number;
+    uint32_t platform_id;
+    uint32_t csd_version_rva;
+    uint16_t suite_mask;
+    uint16_t reserved2;
+    uint32_t cpu[6];
+};
+
+struct MDUInt128 {
+    uint64_t low;
+    uint64_t high;
+};
+
+const uint32_t MD_CONTEXT_AMD64 = 0x00100000;
+const uint32_t MD_CONTEXT_AMD64_FULL = MD_CONTEXT_AMD64 | 0x0000000F;
+
+struct MDRawContextAMD64 {
+    uint64_t p1_home;
+    uint64_t p2_home;
+    uint64_t p3_home;
+    uint64_t p4_home;
+    uint64_t p5_home;
+    uint64_t p6_home;
+    uint32_t context_flags;
+    uint32_t mx_csr;
+    uint16_t cs;
+    uint16_t ds;
+    uint16_t es;
+    uint16_t fs;
+    uint16_t gs;
+    uint16_t ss;
+    uint32_t eflags;
+    uint64_t dr0;
+    uint64_t dr1;
+    uint64_t dr2;
+    uint64_t dr3;
+    uint64_t dr6;
+    uint64_t dr7;
+    uint64_t rax;
+    uint64_t rcx;
+    uint64_t rdx;
+    uint64_t rbx;
+    uint64_t rsp;
+    uint64_t rbp;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t r8;
+    uint64_t r9;
+    uint64_t r10;
+    uint64_t r11;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint64_t rip;
+    uint8_t flt_save[512]; // FXSAVE layout
+    MDUInt128 vector_register[26];
+    uint64_t vector_control;
+    uint64_t debug_control;
+    uint64_t last_branch_to_rip;
+    uint64_t last_branch_from_rip;
+    uint64_t last_exception_to_rip;
+    uint64_t last_exception_from_rip;
+};
+
+// Written to incremental dumps. A delta dump's memory lists only hold the
+// pages changed since the previous dump, the ranges here describe all the
+// memory a full dump taken at the same time would hold.
+struct MDRawDeltaInfo {
+    uint32_t sequence; // 0 for the base dump
+    uint32_t page_size;
+    uint32_t base_time_date_stamp;
+    uint32_t reserved;
+    uint64_t range_count;
+    // followed by range_count MDMemoryDescriptor64
+};
+
+// Written by low pause dumps, which copy memory while the target runs.
+// Same layout as the memory64 list: range count, file offset of the data,
+// then the ranges. Holds pages written to while the memory64 list data was
+// being copied, read again with the target stopped, they take precedence
+// over the same pages in the memory64 list.
+struct MDRawPageFixups {
+    uint64_t range_count;
+    uint64_t base_rva;
+    // followed by range_count MDMemoryDescriptor64
+};
+
+// Why memory was left out of a dump
+enum {
+    MD_OMITTED_WALL_TIME = 1,
+    MD_OMITTED_BYTES = 2,
+    MD_OMITTED_PAUSE_TIME = 4,
+    MD_OMITTED_RVA_LIMIT = 8 // the directory has to stay below 4 GB
+};
+
+// Written by dumps with a budget. Lists the memory a dump without budget
+// would have held but this one doesn't. The memory64 list only describes
+// what was copied.
+struct MDRawOmittedMemory {
+    uint32_t reasons; // MD_OMITTED_* flags
+    uint32_t reserved;
+    uint64_t range_count;
+    // followed by range_count MDMemoryDescriptor64
+};
+
+// MINIDUMP_STRING: byte length, then UTF-16 characters and a terminating zero
+struct MDString {
+    uint32_t length;
+    uint16_t buffer[1];
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(MDRawHeader) == 32, "MDRawHeader size");
+static_assert(sizeof(MDRawDirectory) == 12, "MDRawDirectory size");
+static_assert(sizeof(MDRawThread) == 48, "MDRawThread size");
+static_assert(sizeof(MDRawModule) == 108, "MDRawModule size");
+static_assert(sizeof(MDRawSystemInfo) == 56, "MDRawSystemInfo size");
+static_assert(sizeof(MDMemoryDescriptor) == 16, "MDMemoryDescriptor size");
+static_assert(sizeof(MDRawDeltaInfo) == 24, "MDRawDeltaInfo size");
+static_assert(sizeof(MDRawPageFixups) == 16, "MDRawPageFixups size");
+static_assert(sizeof(MDRawOmittedMemory) == 16, "MDRawOmittedMemory size");
+static_assert(sizeof(MDRawContextAMD64) == 1232, "MDRawContextAMD64 size");
+
+#endif // MINIDUMPFORMAT_H
@@ -1,19 +1,75 @@
 #include "minidumpper.h"
+#include "chunkstore.h"
+#include "dumprecorder.h"
+#include "processindex.h"
+#include "progresssink.h"
+#include "stackprofile.h"
 
 #include <Windows.h>
 #include <DbgHelp.h>
+#include <ProcessSnapshot.h>
+#include <Psapi.h>
 #include <TlHelp32.h>
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <assert.h>
+#include <string.h>
 
 MiniDumpper::MiniDumpper(int pid)
+    : m_bIncremental(false)
+    , m_nSequence(0)
+    , m_nBaseTimeStamp(0)
+    , m_nSoftDirty(-1)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_bLowPause(false)
+    , m_bReread(false)
+    , m_pRecorder(nullptr)
+    , m_pRecordOutput(nullptr)
+    , m_pStore(nullptr)
+    , m_pProfiler(nullptr)
+    , m_nItemStart(0)
+    , m_itemPhase(PhaseThread)
+    , m_nItemBytes(0)
+    , m_nPolicyRange(0)
+    , m_hDbgHelp(nullptr)
+    , m_pfnMiniDumpWriteDump(nullptr)
+    , m_hProcess(nullptr)
+    , m_hSampleProcess(nullptr)
+    , m_nSampleCount(0)
 {
+    memset(&m_stats, 0, sizeof(m_stats));
     m_dwProcessId = pid;
 }
 
 MiniDumpper::MiniDumpper(const std::wstring &name)
+    : m_bIncremental(false)
+    , m_nSequence(0)
+    , m_nBaseTimeStamp(0)
+    , m_nSoftDirty(-1)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_bLowPause(false)
+    , m_bReread(false)
+    , m_pRecorder(nullptr)
+    , m_pRecordOutput(nullptr)
+    , m_pStore(nullptr)
+    , m_pProfiler(nullptr)
+    , m_nItemStart(0)
+    , m_itemPhase(PhaseThread)
+    , m_nItemBytes(0)
+    , m_nPolicyRange(0)
+    , m_hDbgHelp(nullptr)
+    , m_pfnMiniDumpWriteDump(nullptr)
+    , m_hProcess(nullptr)
+    , m_hSampleProcess(nullptr)
+    , m_nSampleCount(0)
 {
+    memset(&m_stats, 0, sizeof(m_stats));
     int pid = wcstol(name.c_str(), nullptr, 10);
     if (pid == 0)
         pid = FindProcessId(name);
@@ -21,6 +77,97 @@ MiniDumpper::MiniDumpper(const std::wstring &name)
     m_dwProcessId = pid;
 }
 
+MiniDumpper::~MiniDumpper()
+{
+    if(m_hProcess)
+        CloseHandle(m_hProcess);
+    if(m_hDbgHelp)
+        FreeLibrary((HMODULE)m_hDbgHelp);
+    if(m_hSampleProcess)
+    {
+        SymCleanup(m_hSampleProcess);
+        CloseHandle(m_hSampleProcess);
+    }
+}
+
+// DbgHelp is single threaded, concurrent dumps have to take turns
+static std::mutex s_dbgHelpMutex;
+
+static std::once_flag s_privilegesOnce;
+
+static long long SteadyMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// MemoryCallback hands out at most this much at once, sizes are 32 bits
+static const unsigned long long kMaxPolicyRange = 1024 * 1024 * 1024;
+
+// Describes the committed regions of the target for the dump policy. Heaps
+// are known by the base of their first segment only, later segments count
+// as anonymous memory.
+static std::vector<DumpRegion> DescribeRegions(HANDLE hProcess, DWORD dwProcessId)
+{
+    std::vector<ULONG_PTR> heaps;
+    HANDLE hHeaps = CreateToolhelp32Snapshot(TH32CS_SNAPHEAPLIST, dwProcessId);
+    if(hHeaps != INVALID_HANDLE_VALUE)
+    {
+        HEAPLIST32 hl;
+        hl.dwSize = sizeof(hl);
+        for(BOOL bMore = Heap32ListFirst(hHeaps, &hl); bMore; bMore = Heap32ListNext(hHeaps, &hl))
+            heaps.push_back(hl.th32HeapID);
+        CloseHandle(hHeaps);
+    }
+    std::sort(heaps.begin(), heaps.end());
+
+    std::vector<DumpRegion> regions;
+    MEMORY_BASIC_INFORMATION mbi;
+    unsigned char * address = nullptr;
+    while(VirtualQueryEx(hProcess, address, &mbi, sizeof(mbi)) == sizeof(mbi))
+    {
+        address = static_cast<unsigned char *>(mbi.BaseAddress) + mbi.RegionSize;
+        if(mbi.State != MEM_COMMIT)
+            continue;
+        DWORD protect = mbi.Protect & 0xff;
+        DumpRegion r;
+        r.base = reinterpret_cast<ULONG_PTR>(mbi.BaseAddress);
+        r.size = mbi.RegionSize;
+        r.readable = !(mbi.Protect & PAGE_GUARD) && protect != PAGE_NOACCESS && protect != PAGE_EXECUTE;
+        r.writable = protect == PAGE_READWRITE || protect == PAGE_WRITECOPY
+                || protect == PAGE_EXECUTE_READWRITE || protect == PAGE_EXECUTE_WRITECOPY;
+        r.executable = protect == PAGE_EXECUTE || protect == PAGE_EXECUTE_READ
+                || protect == PAGE_EXECUTE_READWRITE || protect == PAGE_EXECUTE_WRITECOPY;
+        r.kinds = 0;
+        if(mbi.Type == MEM_PRIVATE)
+        {
+            r.kinds = RegionAnonymous;
+            if(std::binary_search(heaps.begin(), heaps.end(), reinterpret_cast<ULONG_PTR>(mbi.AllocationBase)))
+                r.kinds |= RegionHeap;
+        }
+        else
+        {
+            r.kinds = RegionFile | (mbi.Type == MEM_IMAGE ? RegionImage : RegionShared);
+            WCHAR path[MAX_PATH];
+            DWORD length = GetMappedFileNameW(hProcess, mbi.BaseAddress, path, MAX_PATH);
+            r.path.assign(path, length);
+            if(mbi.Type == MEM_IMAGE)
+                r.module = r.path;
+        }
+        regions.push_back(r);
+    }
+    return regions;
+}
+
+typedef BOOL (WINAPI *LPMINIDUMPWRITEDUMP)(
+    HANDLE hProcess,
+    DWORD ProcessId,
+    HANDLE hFile,
+    MINIDUMP_TYPE DumpType,
+    CONST PMINIDUMP_EXCEPTION_INFORMATION ExceptionParam,
+    CONST PMINIDUMP_USER_STREAM_INFORMATION UserEncoderParam,
+    CONST PMINIDUMP_CALLBACK_INFORMATION CallbackParam);
+
 // This callback function is called by MinidumpWriteDump
 static BOOL CALLBACK MiniDumpCallback(
     PVOID CallbackParam,
@@ -35,9 +182,16 @@ static BOOL CALLBACK MiniDumpCallback(
 bool MiniDumpper::CreateMiniDump()
 {
     BOOL bStatus = FALSE;
-    HMODULE hDbgHelp = nullptr;
     HANDLE hFile = nullptr;
+    HANDLE hProcess = nullptr;
+    HPSS hSnapshot = nullptr;
+    std::unique_ptr<RecordedDumpOutput> recordOutput;
     MINIDUMP_CALLBACK_INFORMATION mci;
+    long long wallStart = SteadyMicroseconds();
+    long long profileStart = ProfileStart();
+    long long phaseStart;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_budget.Start();
 
     SYSTEMTIME st;
     GetLocalTime(&st);
@@ -45,6 +199,7 @@ bool MiniDumpper::CreateMiniDump()
     std::wstring sMinidumpFile = TEXT("crashdump-000000-00-00-00-00-00.dmp");
     wsprintfW(&sMinidumpFile[0], TEXT("crashdump-%06d-%02d-%02d-%02d-%02d-%02d.dmp"),
             m_dwProcessId, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+    sMinidumpFile = UniqueDumpName(sMinidumpFile.c_str());
 
     std::wstring sErrorMsg;
 
@@ -52,58 +207,101 @@ bool MiniDumpper::CreateMiniDump()
     SetProgress(TEXT("Creating crash dump file..."), 0, false);
     SetProgress(TEXT("[creating_dump]"), 0, false);
 
-    // Load dbghelp.dll
-    const std::wstring sDebugHelpDLL_name = TEXT("dbghelp.dll");
-    hDbgHelp = LoadLibrary(sDebugHelpDLL_name.c_str());
+    // dbghelp.dll, the privileges and the target stay open between dumps
+    phaseStart = ProfileStart();
+    if(!m_hDbgHelp)
+        m_hDbgHelp = LoadLibrary(TEXT("dbghelp.dll"));
+    ProfileEnd(PhaseLoadDbgHelp, phaseStart);
 
-    if(hDbgHelp==nullptr)
+    if(m_hDbgHelp==nullptr)
     {
         sErrorMsg = TEXT("dbghelp.dll couldn't be loaded");
         SetProgress(TEXT("dbghelp.dll couldn't be loaded."), 0, false);
         goto cleanup;
     }
 
+    if(!m_pfnMiniDumpWriteDump)
+    {
+        // Set valid dbghelp API version
+        typedef LPAPI_VERSION (WINAPI* LPIMAGEHLPAPIVERSIONEX)(LPAPI_VERSION AppVersion);
+        LPIMAGEHLPAPIVERSIONEX lpImagehlpApiVersionEx =
+            (LPIMAGEHLPAPIVERSIONEX)GetProcAddress((HMODULE)m_hDbgHelp, "ImagehlpApiVersionEx");
+        assert(lpImagehlpApiVersionEx!=nullptr);
+        if(lpImagehlpApiVersionEx!=nullptr)
+        {
+            API_VERSION CompiledApiVer;
+            CompiledApiVer.MajorVersion = 6;
+            CompiledApiVer.MinorVersion = 1;
+            CompiledApiVer.Revision = 11;
+            CompiledApiVer.Reserved = 0;
+            LPAPI_VERSION pActualApiVer = lpImagehlpApiVersionEx(&CompiledApiVer);
+            pActualApiVer;
+            //ATLASSERT(CompiledApiVer.MajorVersion==pActualApiVer->MajorVersion);
+            //ATLASSERT(CompiledApiVer.MinorVersion==pActualApiVer->MinorVersion);
+            //ATLASSERT(CompiledApiVer.Revision==pActualApiVer->Revision);
+        }
+
+        // Get address of MiniDumpWirteDump function
+        m_pfnMiniDumpWriteDump = (void *)GetProcAddress((HMODULE)m_hDbgHelp, "MiniDumpWriteDump");
+        if(!m_pfnMiniDumpWriteDump)
+        {
+            SetProgress(TEXT("Bad MiniDumpWriteDump function."), 0, false);
+            sErrorMsg = TEXT("Bad MiniDumpWriteDump function");
+            goto cleanup;
+        }
+    }
+
     // Try to adjust process privilegies to be able to generate minidumps.
-    SetDumpPrivileges();
+    // The privileges belong to this process, checking them once is enough
+    phaseStart = ProfileStart();
+    std::call_once(s_privilegesOnce, [this] { SetDumpPrivileges(); });
+    ProfileEnd(PhasePrivileges, phaseStart);
 
-    // Create the minidump file
-    hFile = CreateFile(
-        sMinidumpFile.c_str(),
-        GENERIC_WRITE,
-        0,
-        nullptr,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        nullptr);
+    // Open client process
+    phaseStart = ProfileStart();
+    if(!m_hProcess)
+        m_hProcess = OpenProcess(
+            PROCESS_ALL_ACCESS,
+            FALSE,
+            m_dwProcessId);
+    ProfileEnd(PhaseOpenProcess, phaseStart);
+    hProcess = (HANDLE)m_hProcess;
+
+    if(hProcess==nullptr)
+    {
+        std::wstring sMsg = TEXT("Couldn't open process: ");
+        sMsg += FormatErrorMsg(GetLastError());
+        SetProgress(sMsg, 0, false);
+        sErrorMsg = sMsg;
+        goto cleanup;
+    }
+
+    // Create the minidump file, a recorded dump reaches the recorder
+    // through the I/O callbacks instead
+    phaseStart = ProfileStart();
+    if(m_pRecorder)
+        recordOutput.reset(m_pRecorder->Open(sMinidumpFile, true));
+    else
+        hFile = CreateFile(
+            sMinidumpFile.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+    ProfileEnd(PhaseCreateFile, phaseStart);
 
     // Check if file has been created
     if(hFile==INVALID_HANDLE_VALUE)
     {
+        hFile = nullptr;
         DWORD dwError = GetLastError();
         std::wstring sMsg = TEXT("Couldn't create minidump file: ");
         sMsg += FormatErrorMsg(dwError);
         SetProgress(sMsg, 0, false);
         sErrorMsg = sMsg;
-        return FALSE;
-    }
-
-    // Set valid dbghelp API version
-    typedef LPAPI_VERSION (WINAPI* LPIMAGEHLPAPIVERSIONEX)(LPAPI_VERSION AppVersion);
-    LPIMAGEHLPAPIVERSIONEX lpImagehlpApiVersionEx =
-        (LPIMAGEHLPAPIVERSIONEX)GetProcAddress(hDbgHelp, "ImagehlpApiVersionEx");
-    assert(lpImagehlpApiVersionEx!=nullptr);
-    if(lpImagehlpApiVersionEx!=nullptr)
-    {
-        API_VERSION CompiledApiVer;
-        CompiledApiVer.MajorVersion = 6;
-        CompiledApiVer.MinorVersion = 1;
-        CompiledApiVer.Revision = 11;
-        CompiledApiVer.Reserved = 0;
-        LPAPI_VERSION pActualApiVer = lpImagehlpApiVersionEx(&CompiledApiVer);
-        pActualApiVer;
-        //ATLASSERT(CompiledApiVer.MajorVersion==pActualApiVer->MajorVersion);
-        //ATLASSERT(CompiledApiVer.MinorVersion==pActualApiVer->MinorVersion);
-        //ATLASSERT(CompiledApiVer.Revision==pActualApiVer->Revision);
+        goto cleanup;
     }
 
     // Write minidump to the file
@@ -111,52 +309,144 @@ bool MiniDumpper::CreateMiniDump()
     mci.CallbackRoutine = MiniDumpCallback;
     mci.CallbackParam = this;
 
-    typedef BOOL (WINAPI *LPMINIDUMPWRITEDUMP)(
-        HANDLE hProcess,
-        DWORD ProcessId,
-        HANDLE hFile,
-        MINIDUMP_TYPE DumpType,
-        CONST PMINIDUMP_EXCEPTION_INFORMATION ExceptionParam,
-        CONST PMINIDUMP_USER_STREAM_INFORMATION UserEncoderParam,
-        CONST PMINIDUMP_CALLBACK_INFORMATION CallbackParam);
-
-    // Get address of MiniDumpWirteDump function
-    LPMINIDUMPWRITEDUMP pfnMiniDumpWriteDump =
-        (LPMINIDUMPWRITEDUMP)GetProcAddress(hDbgHelp, "MiniDumpWriteDump");
-    if(!pfnMiniDumpWriteDump)
+    // The policy adds memory through MemoryCallback, decided once the
+    // thread callbacks told where the stacks are
+    m_regions.clear();
+    m_policyRanges.clear();
+    m_registerValues.clear();
+    m_nPolicyRange = 0;
+    if(!m_policy.IsEmpty())
+        m_regions = DescribeRegions(hProcess, m_dwProcessId);
+
+    // In low pause mode the target is only suspended while its address
+    // space is cloned copy-on-write, the dump is written from the clone.
+    // This happens outside the DbgHelp lock, so concurrent dumps still
+    // capture at the same time.
+    if(m_bLowPause)
     {
-        SetProgress(TEXT("Bad MiniDumpWriteDump function."), 0, false);
-        sErrorMsg = TEXT("Bad MiniDumpWriteDump function");
-        return FALSE;
+        phaseStart = ProfileStart();
+        m_stats.captureTime = SteadyMicroseconds();
+        m_budget.PauseStarted();
+        DWORD dwPssError = PssCaptureSnapshot(
+            hProcess,
+            static_cast<PSS_CAPTURE_FLAGS>(PSS_CAPTURE_VA_CLONE | PSS_CAPTURE_HANDLES
+                                           | PSS_CAPTURE_THREADS | PSS_CAPTURE_THREAD_CONTEXT),
+            CONTEXT_ALL,
+            &hSnapshot);
+        m_budget.PauseEnded();
+        m_stats.pauseTime = SteadyMicroseconds() - m_stats.captureTime;
+        ProfileEnd(PhaseSnapshot, phaseStart);
+        if(dwPssError != ERROR_SUCCESS)
+        {
+            std::wstring sMsg = TEXT("Couldn't capture process snapshot: ");
+            sMsg += FormatErrorMsg(dwPssError);
+            SetProgress(sMsg, 0, false);
+            hSnapshot = nullptr;
+            goto cleanup;
+        }
     }
 
-    // Open client process
-    HANDLE hProcess = OpenProcess(
-        PROCESS_ALL_ACCESS,
-        FALSE,
-        m_dwProcessId);
-
-    // Now actually write the minidump
-    BOOL bWriteDump = pfnMiniDumpWriteDump(
-        hProcess,
-        m_dwProcessId,
-        hFile,
-        MiniDumpNormal,
-        nullptr,
-        nullptr,
-        nullptr);
+    // Now actually write the minidump, without a snapshot the target is
+    // suspended for the whole call
+    BOOL bWriteDump;
+    DWORD dwWriteError;
+    {
+        std::lock_guard<std::mutex> dbgHelpLock(s_dbgHelpMutex);
+        if(!hSnapshot)
+        {
+            m_stats.captureTime = SteadyMicroseconds();
+            m_budget.PauseStarted();
+        }
+        phaseStart = ProfileStart();
+        m_nItemStart = 0;
+        m_pRecordOutput = recordOutput.get();
+        bWriteDump = ((LPMINIDUMPWRITEDUMP)m_pfnMiniDumpWriteDump)(
+            hSnapshot ? reinterpret_cast<HANDLE>(hSnapshot) : hProcess,
+            m_dwProcessId,
+            hFile,
+            MiniDumpNormal,
+            nullptr,
+            nullptr,
+            hSnapshot || m_pProfiler || m_budget.IsLimited() || !m_policy.IsEmpty() || m_pRecordOutput ? &mci : nullptr);
+        dwWriteError = GetLastError();
+        m_pRecordOutput = nullptr;
+        ProfileItem(PhaseCount, nullptr, 0);
+        ProfileEnd(PhaseWrite, phaseStart);
+        m_budget.PauseEnded();
+        if(!hSnapshot)
+            m_stats.pauseTime = SteadyMicroseconds() - m_stats.captureTime;
+    }
+    WCHAR sPaused[64];
+    swprintf(sPaused, sizeof(sPaused) / sizeof(wchar_t), L"Paused target for %.2f ms", m_stats.pauseTime / 1000.0);
+    SetProgress(sPaused, 0, false);
 
     // Check result
     if(!bWriteDump)
     {
-        std::wstring sMsg = FormatErrorMsg(GetLastError());
+        std::wstring sMsg = FormatErrorMsg(dwWriteError);
         SetProgress(TEXT("Error writing dump."), 0, false);
         SetProgress(sMsg, 0, false);
         sErrorMsg = sMsg;
         goto cleanup;
     }
 
+    if(recordOutput)
+    {
+        m_stats.bytesWritten = recordOutput->Size();
+    }
+    else
+    {
+        LARGE_INTEGER size;
+        if(GetFileSizeEx(hFile, &size))
+            m_stats.bytesWritten = size.QuadPart;
+    }
+
+    // MiniDumpWriteDump seeks around in the file, so compression has to
+    // run over the finished dump. The recorder compresses when it writes
+    // its dumps out.
+    phaseStart = ProfileStart();
+    if(recordOutput)
+    {
+        recordOutput->Finish();
+    }
+    else if(m_pStore)
+    {
+        CloseHandle(hFile);
+        hFile = nullptr;
+        SetProgress(TEXT("Storing dump..."), 0, false);
+        if(!StoreDumpFile(*m_pStore, sMinidumpFile, sMinidumpFile))
+        {
+            SetProgress(TEXT("Error storing dump."), 0, false);
+            goto cleanup;
+        }
+        DeleteFile(sMinidumpFile.c_str());
+    }
+    else if(m_codec != NoCodec)
+    {
+        CloseHandle(hFile);
+        hFile = nullptr;
+        SetProgress(TEXT("Compressing dump..."), 0, false);
+        if(!CompressDump(sMinidumpFile, sMinidumpFile + DumpCodecExtension(m_codec), m_codec, m_nCodecLevel))
+        {
+            SetProgress(TEXT("Error compressing dump."), 0, false);
+            goto cleanup;
+        }
+        DeleteFile(sMinidumpFile.c_str());
+    }
+    else
+    {
+        // Closing writes back what the system still buffers
+        CloseHandle(hFile);
+        hFile = nullptr;
+    }
+    ProfileEnd(PhaseFlush, phaseStart);
+
+    m_stats.wallTime = SteadyMicroseconds() - wallStart;
+
     // Update progress
+    m_sLastDump = sMinidumpFile;
+    if(!m_pRecorder && !m_pStore)
+        m_sLastDump += DumpCodecExtension(m_codec);
     bStatus = TRUE;
     SetProgress(TEXT("Finished creating dump."), 100, false);
 
@@ -166,13 +456,213 @@ cleanup:
     if(hFile)
         CloseHandle(hFile);
 
-    // Unload dbghelp.dll
-    if(hDbgHelp)
-        FreeLibrary(hDbgHelp);
+    ProfileEnd(PhaseDump, profileStart, m_stats.bytesWritten, bStatus ? nullptr : "failed");
+
+    if(hSnapshot)
+        PssFreeSnapshot(GetCurrentProcess(), hSnapshot);
+
+    // Progress is written while the target runs, have it out before returning
+    ProgressSink::Instance().Flush();
 
     return bStatus;
 }
 
+bool MiniDumpper::SampleStacks(StackProfile & profile)
+{
+    const unsigned int kThreadListInterval = 16;
+    const size_t kMaxSampleFrames = 128;
+
+    if(m_hSampleProcess == nullptr)
+    {
+        m_hSampleProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ | SYNCHRONIZE,
+                                       FALSE, m_dwProcessId);
+        if(m_hSampleProcess == nullptr)
+        {
+            SetProgress(L"SampleStacks: OpenProcess failed: " + FormatErrorMsg(GetLastError()), 0);
+            return false;
+        }
+        // StackWalk64 needs the unwind data of the loaded modules
+        std::lock_guard<std::mutex> lock(s_dbgHelpMutex);
+        SymInitializeW(m_hSampleProcess, nullptr, TRUE);
+    }
+    if(WaitForSingleObject(m_hSampleProcess, 0) == WAIT_OBJECT_0)
+        return false;
+
+    // Threads come and go, listing them every sample would cost more than
+    // walking their stacks
+    if(m_nSampleCount++ % kThreadListInterval == 0)
+    {
+        m_sampleThreads.clear();
+        HANDLE hThreads = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if(hThreads != INVALID_HANDLE_VALUE)
+        {
+            THREADENTRY32 te;
+            te.dwSize = sizeof(te);
+            for(BOOL bMore = Thread32First(hThreads, &te); bMore; bMore = Thread32Next(hThreads, &te))
+            {
+                if(te.th32OwnerProcessID == DWORD(m_dwProcessId))
+                    m_sampleThreads.push_back(te.th32ThreadID);
+            }
+            CloseHandle(hThreads);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(s_dbgHelpMutex);
+    std::vector<uint64_t> frames;
+    for(size_t i = 0; i < m_sampleThreads.size(); ++i)
+    {
+        HANDLE hThread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION,
+                                    FALSE, m_sampleThreads[i]);
+        if(hThread == nullptr)
+            continue;
+        if(SuspendThread(hThread) == DWORD(-1))
+        {
+            CloseHandle(hThread);
+            continue;
+        }
+
+        frames.clear();
+        CONTEXT context;
+        memset(&context, 0, sizeof(context));
+        context.ContextFlags = CONTEXT_FULL;
+        if(GetThreadContext(hThread, &context))
+        {
+            STACKFRAME64 frame;
+            memset(&frame, 0, sizeof(frame));
+#if defined(_M_X64)
+            DWORD machine = IMAGE_FILE_MACHINE_AMD64;
+            frame.AddrPC.Offset = context.Rip;
+            frame.AddrFrame.Offset = context.Rbp;
+            frame.AddrStack.Offset = context.Rsp;
+#elif defined(_M_IX86)
+            DWORD machine = IMAGE_FILE_MACHINE_I386;
+            frame.AddrPC.Offset = context.Eip;
+            frame.AddrFrame.Offset = context.Ebp;
+            frame.AddrStack.Offset = context.Esp;
+#else
+            DWORD machine = IMAGE_FILE_MACHINE_ARM64;
+            frame.AddrPC.Offset = context.Pc;
+            frame.AddrFrame.Offset = context.Fp;
+            frame.AddrStack.Offset = context.Sp;
+#endif
+            frame.AddrPC.Mode = AddrModeFlat;
+            frame.AddrFrame.Mode = AddrModeFlat;
+            frame.AddrStack.Mode = AddrModeFlat;
+            while(frames.size() < kMaxSampleFrames
+                  && StackWalk64(machine, m_hSampleProcess, hThread, &frame, &context, nullptr,
+                                 SymFunctionTableAccess64, SymGetModuleBase64, nullptr)
+                  && frame.AddrPC.Offset != 0)
+                frames.push_back(frame.AddrPC.Offset);
+        }
+        ResumeThread(hThread);
+        CloseHandle(hThread);
+
+        if(!frames.empty())
+        {
+            wchar_t name[16];
+            swprintf(name, sizeof(name) / sizeof(wchar_t), L"0x%X", m_sampleThreads[i]);
+            profile.Add(name, frames.data(), frames.size());
+        }
+    }
+    return true;
+}
+
+int MiniDumpper::ProcessId() const
+{
+    return m_dwProcessId;
+}
+
+DumpStats const & MiniDumpper::LastDumpStats() const
+{
+    return m_stats;
+}
+
+std::wstring const & MiniDumpper::LastDumpName() const
+{
+    return m_sLastDump;
+}
+
+std::wstring MiniDumpper::UniqueDumpName(std::wstring const & sName) const
+{
+    std::wstring sExtension = !m_pRecorder && !m_pStore ? DumpCodecExtension(m_codec) : std::wstring();
+    std::wstring sStem = sName.substr(0, sName.size() - 4);
+    std::wstring sUnique = sName;
+    for(unsigned int n = 2; ; ++n)
+    {
+        std::wstring sPath = sUnique + sExtension;
+        if(sPath != m_sLastDump && GetFileAttributesW(sPath.c_str()) == INVALID_FILE_ATTRIBUTES)
+            return sUnique;
+        sUnique = sStem + L"-" + std::to_wstring(n) + L".dmp";
+    }
+}
+
+void MiniDumpper::SetCompression(DumpCodec codec, int level)
+{
+    m_codec = codec;
+    m_nCodecLevel = level;
+}
+
+void MiniDumpper::SetLowPause(bool bLowPause, bool bReread)
+{
+    m_bLowPause = bLowPause;
+    m_bReread = bReread;
+}
+
+void MiniDumpper::SetBudget(DumpLimits const & limits)
+{
+    m_budget.SetLimits(limits);
+}
+
+void MiniDumpper::SetPolicy(DumpPolicy const & policy)
+{
+    m_policy = policy;
+}
+
+void MiniDumpper::SetRecorder(DumpRecorder * recorder)
+{
+    m_pRecorder = recorder;
+}
+
+void MiniDumpper::SetChunkStore(ChunkStore * store)
+{
+    m_pStore = store;
+}
+
+void MiniDumpper::SetProfiler(DumpProfiler * profiler)
+{
+    m_pProfiler = profiler;
+}
+
+void MiniDumpper::Attach(int pid)
+{
+    if(m_hProcess)
+    {
+        CloseHandle(m_hProcess);
+        m_hProcess = nullptr;
+    }
+    if(m_hSampleProcess)
+    {
+        SymCleanup(m_hSampleProcess);
+        CloseHandle(m_hSampleProcess);
+        m_hSampleProcess = nullptr;
+    }
+    m_dwProcessId = pid;
+    m_nSequence = 0;
+    m_nBaseTimeStamp = 0;
+    m_sampleThreads.clear();
+    m_nSampleCount = 0;
+}
+
+void MiniDumpper::SetReadThreads(unsigned int threads)
+{
+    (void) threads;
+}
+
+void MiniDumpper::SetIncremental(bool bIncremental)
+{
+    m_bIncremental = bIncremental;
+}
+
 bool MiniDumpper::SetDumpPrivileges()
 {
     // This method is used to have the current process be able to call MiniDumpWriteDump
@@ -228,16 +718,87 @@ Cleanup:
     return fSuccess;
 }
 
-void MiniDumpper::SetProgress(std::wstring sStatusMsg, int percentCompleted, bool bRelative)
+void MiniDumpper::SetProgress(const wchar_t * sStatusMsg, int percentCompleted, bool bRelative,
+                              const wchar_t * sDetail)
 {
-    wprintf(TEXT("Progress %s %i\n"), sStatusMsg.c_str(), percentCompleted);
+    ProgressSink::Instance().Post(m_dwProcessId, sStatusMsg, percentCompleted, sDetail);
+}
+
+void MiniDumpper::SetProgress(std::wstring const & sStatusMsg, int percentCompleted, bool bRelative)
+{
+    SetProgress(sStatusMsg.c_str(), percentCompleted, bRelative);
 }
 
 bool MiniDumpper::IsCancelled()
 {
-    return false;
+    return m_budget.IsExhausted();
+}
+
+long long MiniDumpper::ProfileStart() const
+{
+    return m_pProfiler ? DumpProfiler::Now() : 0;
 }
 
+void MiniDumpper::ProfileEnd(DumpPhase phase, long long start, unsigned long long bytes, const char * name)
+{
+    if(m_pProfiler)
+        m_pProfiler->Record(phase, m_dwProcessId, start, DumpProfiler::Now(), bytes, name);
+}
+
+void MiniDumpper::ProfileItem(DumpPhase phase, const wchar_t * name, unsigned long long bytes)
+{
+    if(!m_pProfiler)
+        return;
+    long long now = DumpProfiler::Now();
+    if(m_nItemStart)
+        m_pProfiler->Record(m_itemPhase, m_dwProcessId, m_nItemStart, now, m_nItemBytes, m_sItemName.c_str());
+    m_nItemStart = 0;
+    if(phase == PhaseCount)
+        return;
+    m_nItemStart = now;
+    m_itemPhase = phase;
+    m_nItemBytes = bytes;
+    m_sItemName = name;
+}
+
+void MiniDumpper::BuildPolicyRanges()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    std::vector<std::pair<unsigned long long, unsigned long long> > ranges;
+    for(size_t i = 0; i < m_regions.size(); ++i)
+    {
+        if(m_regions[i].readable && m_policy.Decide(m_regions[i]) == PolicyInclude)
+            ranges.push_back(std::make_pair(m_regions[i].base, m_regions[i].base + m_regions[i].size));
+    }
+    for(size_t i = 0; i < m_registerValues.size() && m_policy.RegisterWindow(); ++i)
+    {
+        for(size_t j = 0; j < m_regions.size(); ++j)
+        {
+            DumpRegion const & r = m_regions[j];
+            if(m_registerValues[i] < r.base || m_registerValues[i] - r.base >= r.size || !r.readable)
+                continue;
+            uint64_t start = 0;
+            uint64_t size = 0;
+            m_policy.WindowAround(m_registerValues[i], r.base, r.base + r.size, si.dwPageSize, start, size);
+            if(size)
+                ranges.push_back(std::make_pair(start, start + size));
+            break;
+        }
+    }
+
+    // Merge what overlaps, then cut into pieces MemoryCallback can describe
+    std::sort(ranges.begin(), ranges.end());
+    for(size_t i = 0; i < ranges.size(); ++i)
+    {
+        unsigned long long start = ranges[i].first;
+        unsigned long long end = ranges[i].second;
+        while(i + 1 < ranges.size() && ranges[i + 1].first < end)
+            end = std::max(end, ranges[++i].second);
+        for(; start < end; start += kMaxPolicyRange)
+            m_policyRanges.push_back(std::make_pair(start, std::min(end - start, kMaxPolicyRange)));
+    }
+}
 
 // This method is called when MinidumpWriteDump notifies us about
 // currently performed action
@@ -248,33 +809,110 @@ int MiniDumpper::OnMinidumpProgress(void * const CallbackInput,
     {
     case CancelCallback:
         {
-            // This callback allows to cancel minidump generation
+            // This callback allows to cancel minidump generation, DbgHelp
+            // keeps asking as long as CheckCancel is set. A budget can only
+            // cancel here, DbgHelp has no way to leave memory out halfway.
+            PMINIDUMP_CALLBACK_OUTPUT pOutput = reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput);
+            pOutput->CheckCancel = TRUE;
             if(IsCancelled())
             {
-                reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->Cancel = TRUE;
-                SetProgress(TEXT("Dump generation cancelled by user"), 0, true);
+                pOutput->Cancel = TRUE;
+                SetProgress(TEXT("Dump generation cancelled, time budget used up"), 0, true);
             }
         }
         break;
 
+    case IoStartCallback:
+        {
+            // S_FALSE has DbgHelp hand every write to IoWriteAllCallback
+            if(m_pRecordOutput)
+                reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->Status = S_FALSE;
+        }
+        break;
+
+    case IoWriteAllCallback:
+        {
+            MINIDUMP_IO_CALLBACK const & io = reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Io;
+            bool ok = m_pRecordOutput && m_pRecordOutput->WriteAt(io.Offset, io.Buffer, io.BufferBytes);
+            reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->Status = ok ? S_OK : E_FAIL;
+        }
+        break;
+
+    case IoFinishCallback:
+        {
+            reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->Status = S_OK;
+        }
+        break;
+
+    case IsProcessSnapshotCallback:
+        {
+            // Only asked when dumping from a PssCaptureSnapshot handle
+            reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->Status = S_FALSE;
+        }
+        break;
+
     case ModuleCallback:
         {
             // We are currently dumping some module
-            std::wstring sMsg = TEXT("Dumping info for module");
-            sMsg += reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Module.FullPath;
-
-            // Update progress
-            SetProgress(sMsg, 0, true);
+            SetProgress(TEXT("Dumping info for module"), 0, true,
+                        reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Module.FullPath);
+            ProfileItem(PhaseModule, reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Module.FullPath, 0);
         }
         break;
     case ThreadCallback:
         {
             // We are currently dumping some thread
-            std::wstring sMsg = TEXT("Dumping info for thread ");
             WCHAR buf[16];
             wsprintfW(buf, TEXT("0x%X"), reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Thread.ThreadId);
-            sMsg += buf;
-            SetProgress(sMsg, 0, true);
+            SetProgress(TEXT("Dumping info for thread"), 0, true, buf);
+            MINIDUMP_THREAD_CALLBACK const & thread = reinterpret_cast<PMINIDUMP_CALLBACK_INPUT>(CallbackInput)->Thread;
+            ProfileItem(PhaseThread, buf, thread.StackEnd - thread.StackBase);
+
+            if(!m_policy.IsEmpty())
+            {
+                // Only the used part of the region is the thread's stack, the
+                // region itself is left to the other rules
+                for(size_t i = 0; i < m_regions.size(); ++i)
+                {
+                    DumpRegion r = m_regions[i];
+                    if(thread.StackBase < r.base || thread.StackBase - r.base >= r.size)
+                        continue;
+                    r.base = thread.StackBase;
+                    r.size = thread.StackEnd - thread.StackBase;
+                    r.kinds |= RegionStack;
+                    if(m_policy.Decide(r) == PolicyExclude)
+                        reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput)->ThreadWriteFlags &= ~ThreadWriteStack;
+                    break;
+                }
+                CONTEXT const & c = thread.Context;
+#if defined(_M_X64)
+                const DWORD64 regs[] = { c.Rax, c.Rbx, c.Rcx, c.Rdx, c.Rsi, c.Rdi, c.Rbp, c.Rsp,
+                                         c.R8, c.R9, c.R10, c.R11, c.R12, c.R13, c.R14, c.R15, c.Rip };
+                m_registerValues.insert(m_registerValues.end(), regs, regs + sizeof(regs) / sizeof(regs[0]));
+#elif defined(_M_IX86)
+                const DWORD regs[] = { c.Eax, c.Ebx, c.Ecx, c.Edx, c.Esi, c.Edi, c.Ebp, c.Esp, c.Eip };
+                m_registerValues.insert(m_registerValues.end(), regs, regs + sizeof(regs) / sizeof(regs[0]));
+#else
+                (void) c;
+#endif
+            }
+        }
+        break;
+
+    case MemoryCallback:
+        {
+            // Asked again until it returns FALSE, threads and modules have
+            // all been announced by now
+            if(m_policy.IsEmpty())
+                return FALSE;
+            if(m_nPolicyRange == 0 && m_policyRanges.empty())
+                BuildPolicyRanges();
+            if(m_nPolicyRange == m_policyRanges.size())
+                return FALSE;
+            PMINIDUMP_CALLBACK_OUTPUT pOutput = reinterpret_cast<PMINIDUMP_CALLBACK_OUTPUT>(CallbackOutput);
+            pOutput->MemoryBase = m_policyRanges[m_nPolicyRange].first;
+            pOutput->MemorySize = ULONG(m_policyRanges[m_nPolicyRange].second);
+            ++m_nPolicyRange;
         }
         break;
 
@@ -297,59 +935,11 @@ std::wstring MiniDumpper::FormatErrorMsg(DWORD dwErrorCode)
 int MiniDumpper::FindProcessId(std::wstring const & name)
 {
     int pid = 0;
-    HANDLE hProcSnapshot = ::CreateToolhelp32Snapshot( TH32CS_SNAPPROCESS, 0 );
-    if( INVALID_HANDLE_VALUE != hProcSnapshot )
-    {
-        FILETIME lpCreationTime;
-        FILETIME lpExitTime;
-        FILETIME lpKernelTime;
-        FILETIME lpUserTime;
-        FILETIME lpCreationTime2 = {0, 0};
-        PROCESSENTRY32 procEntry;
-        procEntry.dwSize = sizeof(PROCESSENTRY32);
-        if( ::Process32First( hProcSnapshot, &procEntry ) )
-        {
-            do
-            {
-                HANDLE hModSnapshot = ::CreateToolhelp32Snapshot( TH32CS_SNAPMODULE | TH32CS_SNAPMODULE32, procEntry.th32ProcessID );
-                if( INVALID_HANDLE_VALUE != hModSnapshot )
-                {
-                    MODULEENTRY32 modEntry;
-                    modEntry.dwSize = sizeof( MODULEENTRY32 );
-                    if( Module32First( hModSnapshot, &modEntry ) )
-                    {
-                        //wprintf(TEXT("Module %s\n"), modEntry.szModule);
-                        if( name == modEntry.szModule )
-                        {
-                            ::CloseHandle( hModSnapshot );
-                            wprintf(TEXT("Process %d\n"), procEntry.th32ProcessID);
-
-                            HANDLE hProc = OpenProcess(PROCESS_ALL_ACCESS,
-                                                       FALSE, procEntry.th32ProcessID);
-                            ::GetProcessTimes(hProc,
-                                              &lpCreationTime,
-                                              &lpExitTime,
-                                              &lpKernelTime,
-                                              &lpUserTime);
-                            ::CloseHandle(hProc);
-                            if (CompareFileTime(&lpCreationTime, &lpCreationTime2) > 0)
-                            {
-                                pid = procEntry.th32ProcessID;
-                                lpCreationTime2 = lpCreationTime;
-                            }
-                        }
-                    }
-                    ::CloseHandle( hModSnapshot );
-                }
-                else
-                {
-                    //auto msg = FormatErrorMsg(GetLastError());
-                    //wprintf(TEXT("Process %d %x\n"), procEntry.th32ProcessID, GetLastError());
-                }
-            }
-            while( ::Process32Next( hProcSnapshot, &procEntry ) );
-        }
-        ::CloseHandle( hProcSnapshot );
-    }
+    std::vector<ProcessInfo> matches = ProcessIndex::Instance().Find(name);
+    for (size_t i = 0; i < matches.size(); ++i)
+        wprintf(TEXT("Process %d\n"), matches[i].pid);
+    // Matches are sorted newest first
+    if (!matches.empty())
+        pid = matches[0].pid;
     return pid;
 }
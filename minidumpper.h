@@ -1,7 +1,30 @@
 #ifndef MINIDUMPPER_H
 #define MINIDUMPPER_H
 
+#include "dumpbudget.h"
+#include "dumpcompression.h"
+#include "dumppolicy.h"
+#include "dumpprofiler.h"
+
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ChunkStore;
+class DumpRecorder;
+class RecordedDumpOutput;
+class StackProfile;
+
+// Timings of a single CreateMiniDump call, in steady clock microseconds
+struct DumpStats
+{
+    long long captureTime; // when the target was stopped
+    long long pauseTime;   // how long the target stayed stopped, all phases
+    long long wallTime;    // the whole call
+    unsigned long long bytesWritten;
+    unsigned long long fixupBytes; // memory read again after a low pause copy
+};
 
 class MiniDumpper
 {
@@ -10,17 +33,96 @@ public:
 
     MiniDumpper(std::wstring const & name);
 
+    ~MiniDumpper();
+
 public:
     bool CreateMiniDump();
 
+    // Moves to another process, e.g. the new instance of a restarted
+    // target. Everything kept about the old one is dropped.
+    void Attach(int pid);
+
+    // Stops every thread of the target for a moment and adds its stack to
+    // profile. Stacks are walked along frame pointers on Linux and with
+    // StackWalk64 on Windows. Returns false once the target is gone.
+    bool SampleStacks(StackProfile & profile);
+
+    // After the first dump only pages changed since the previous dump are
+    // written. Linux only, the Windows backend always writes full dumps.
+    void SetIncremental(bool bIncremental);
+
+    // Compresses dumps into a seekable zstd or LZ4 container
+    void SetCompression(DumpCodec codec, int level);
+
+    // Stops the target only to capture threads, stacks and the memory map,
+    // the rest is copied while it runs. With bReread pages written to during
+    // the copy are read again in a second short stop. On Windows the target
+    // is captured with PssCaptureSnapshot, which makes re-reading needless.
+    void SetLowPause(bool bLowPause, bool bReread);
+
+    // Threads reading target memory, shared by all dumps of this process
+    // and started with the first one, so set before. 0 uses a few, at most
+    // half the hardware threads, to leave cores to a target that runs
+    // during the copy. Linux only, DbgHelp reads the memory itself on
+    // Windows.
+    static void SetReadThreads(unsigned int threads);
+
+    // Limits the time, size and pause of every dump. Bulk memory that
+    // doesn't fit is left out, on Windows a dump running out of time is
+    // cancelled.
+    void SetBudget(DumpLimits const & limits);
+
+    // Decides which memory goes into the dump. Without rules Linux dumps
+    // what the kernel's default coredump filter would, Windows writes a
+    // MiniDumpNormal dump.
+    void SetPolicy(DumpPolicy const & policy);
+
+    // Keeps dumps in the recorder instead of writing files, nullptr writes
+    // files again. The recorder asks for a base dump whenever it dropped
+    // the chain incremental dumps build on.
+    void SetRecorder(DumpRecorder * recorder);
+
+    // Stores dumps in a chunk store instead of writing files, nullptr
+    // writes files again. Compression is left to the store.
+    void SetChunkStore(ChunkStore * store);
+
+    // Records the phases of every dump, nullptr stops profiling. The
+    // profiler may be shared by several dumppers.
+    void SetProfiler(DumpProfiler * profiler);
+
+    int ProcessId() const;
+
+    DumpStats const & LastDumpStats() const;
+
+    // File, or recorder or store name, of the last dump written
+    std::wstring const & LastDumpName() const;
+
 private:
     bool SetDumpPrivileges();
 
-    // Sets the progress message and percent completed
-    void SetProgress(std::wstring sStatusMsg, int percentCompleted, bool bRelative=true);
+    // Sets the progress message and percent completed. Messages are queued
+    // on ProgressSink::Instance(), which never blocks the dump.
+    void SetProgress(const wchar_t * sStatusMsg, int percentCompleted, bool bRelative=true,
+                     const wchar_t * sDetail=nullptr);
+
+    void SetProgress(std::wstring const & sStatusMsg, int percentCompleted, bool bRelative=true);
 
     bool IsCancelled();
 
+    // Start of a profiled phase, 0 when not profiling
+    long long ProfileStart() const;
+
+    // Records the phase from start to now
+    void ProfileEnd(DumpPhase phase, long long start, unsigned long long bytes = 0,
+                    const char * name = nullptr);
+
+    // The dump callbacks only announce each thread and module, so an item
+    // lasts until the next one is announced. PhaseCount ends the last one.
+    void ProfileItem(DumpPhase phase, const wchar_t * name, unsigned long long bytes);
+
+    // Windows only, turns the policy into ranges for MemoryCallback
+    void BuildPolicyRanges();
+
 public:
     int OnMinidumpProgress(void * const CallbackInput,
         void * CallbackOutput);
@@ -28,11 +130,67 @@ public:
 private:
     static int FindProcessId(std::wstring const & name);
 
+    // sName, or with -2, -3... before .dmp while that names the previous
+    // dump or an existing file. Names have a resolution of a second.
+    std::wstring UniqueDumpName(std::wstring const & sName) const;
+
     // Formats the error message.
     static std::wstring FormatErrorMsg(unsigned long dwErrorCode);
 
 private:
     int m_dwProcessId;
+
+    // Incremental dump state
+    bool m_bIncremental;
+    int m_nSequence;
+    unsigned int m_nBaseTimeStamp;
+    int m_nSoftDirty; // -1 not probed yet, 0 use page hashes, 1 use soft-dirty bits
+    std::vector<std::pair<unsigned long long, unsigned long long> > m_lastLayout;
+    std::unordered_map<unsigned long long, unsigned long long> m_pageHashes;
+
+    DumpCodec m_codec;
+    int m_nCodecLevel;
+
+    bool m_bLowPause;
+    bool m_bReread;
+
+    DumpStats m_stats;
+    std::wstring m_sLastDump;
+    DumpBudget m_budget;
+    DumpPolicy m_policy;
+
+    DumpRecorder * m_pRecorder;
+    RecordedDumpOutput * m_pRecordOutput; // Windows only, while DbgHelp writes
+    ChunkStore * m_pStore;
+
+    DumpProfiler * m_pProfiler;
+    long long m_nItemStart;
+    DumpPhase m_itemPhase;
+    unsigned long long m_nItemBytes;
+    std::wstring m_sItemName;
+
+    // Windows only, memory the policy adds to a dump: the target's regions,
+    // register values seen in the thread callbacks and the (base, size)
+    // ranges handed out so far
+    std::vector<DumpRegion> m_regions;
+    std::vector<unsigned long long> m_registerValues;
+    std::vector<std::pair<unsigned long long, unsigned long long> > m_policyRanges;
+    size_t m_nPolicyRange;
+
+    // Windows only, set up by the first dump and kept for the next ones:
+    // dbghelp.dll, its MiniDumpWriteDump and the target opened with
+    // PROCESS_ALL_ACCESS
+    void * m_hDbgHelp;
+    void * m_pfnMiniDumpWriteDump;
+    void * m_hProcess;
+
+    // Stack sampling state. Windows keeps the process open with symbols
+    // loaded for StackWalk64 and lists the threads every few samples only,
+    // Linux caches thread names.
+    void * m_hSampleProcess;
+    std::vector<unsigned long> m_sampleThreads;
+    unsigned int m_nSampleCount;
+    std::unordered_map<int, std::wstring> m_threadNames;
 };
 
 #endif // MINIDUMPPER_H
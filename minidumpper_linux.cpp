@@ -0,0 +1,1718 @@
+#include "minidumpper.h"
+#include "chunkstore.h"
+#include "dumprecorder.h"
+#include "minidumpformat.h"
+#include "contenthash.h"
+#include "dumpcompression.h"
+#include "dumpoutput.h"
+#include "memoryreader.h"
+#include "processindex.h"
+#include "progresssink.h"
+#include "stackprofile.h"
+
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+MiniDumpper::MiniDumpper(int pid)
+    : m_bIncremental(false)
+    , m_nSequence(0)
+    , m_nBaseTimeStamp(0)
+    , m_nSoftDirty(-1)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_bLowPause(false)
+    , m_bReread(false)
+    , m_pRecorder(nullptr)
+    , m_pRecordOutput(nullptr)
+    , m_pStore(nullptr)
+    , m_pProfiler(nullptr)
+    , m_nItemStart(0)
+    , m_itemPhase(PhaseThread)
+    , m_nItemBytes(0)
+    , m_nPolicyRange(0)
+    , m_hDbgHelp(nullptr)
+    , m_pfnMiniDumpWriteDump(nullptr)
+    , m_hProcess(nullptr)
+    , m_hSampleProcess(nullptr)
+    , m_nSampleCount(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_dwProcessId = pid;
+}
+
+MiniDumpper::MiniDumpper(const std::wstring &name)
+    : m_bIncremental(false)
+    , m_nSequence(0)
+    , m_nBaseTimeStamp(0)
+    , m_nSoftDirty(-1)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_bLowPause(false)
+    , m_bReread(false)
+    , m_pRecorder(nullptr)
+    , m_pRecordOutput(nullptr)
+    , m_pStore(nullptr)
+    , m_pProfiler(nullptr)
+    , m_nItemStart(0)
+    , m_itemPhase(PhaseThread)
+    , m_nItemBytes(0)
+    , m_nPolicyRange(0)
+    , m_hDbgHelp(nullptr)
+    , m_pfnMiniDumpWriteDump(nullptr)
+    , m_hProcess(nullptr)
+    , m_hSampleProcess(nullptr)
+    , m_nSampleCount(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    int pid = wcstol(name.c_str(), nullptr, 10);
+    if (pid == 0)
+        pid = FindProcessId(name);
+    wprintf(L"MiniDumpper pid: %d\n", pid);
+    m_dwProcessId = pid;
+}
+
+MiniDumpper::~MiniDumpper()
+{
+}
+
+static std::once_flag s_privilegesOnce;
+
+namespace {
+
+struct MapRegion
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    unsigned long inode;
+    bool readable;
+    bool writable;
+    bool executable;
+    bool shared;
+    std::string path;
+};
+
+struct ThreadState
+{
+    int tid;
+    int pendingSignal;
+#if defined(__x86_64__)
+    user_regs_struct regs;
+    user_fpregs_struct fpregs;
+#endif
+    uint64_t stackPointer;
+    uint64_t stackStart;
+    uint64_t stackEnd;
+};
+
+// The x86-64 ABI lets leaf functions use 128 bytes below the stack pointer
+const uint64_t kRedZoneSize = 128;
+
+// Don't let a stray stack pointer pull a whole heap into the memory list
+const uint64_t kMaxStackSize = 8 * 1024 * 1024;
+
+const size_t kReadChunkSize = 8 * 1024 * 1024;
+
+// A stack sample reads this much above the stack pointer at once, frames
+// further up are read one by one
+const size_t kSampleWindowSize = 64 * 1024;
+
+const size_t kMaxSampleFrames = 128;
+
+// Pages changed during a low pause copy are read again with the target
+// stopped, a target rewriting more than this is left torn rather than
+// stopped for long.
+const uint64_t kMaxFixupSize = 64 * 1024 * 1024;
+const size_t kMaxFixupRanges = 32768;
+
+bool ReadTextFile(std::string const & path, std::string & text)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char buf[65536];
+    ssize_t n;
+    text.clear();
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        text.append(buf, n);
+    close(fd);
+    return n == 0;
+}
+
+bool ParseMaps(std::string const & text, std::vector<MapRegion> & regions)
+{
+    regions.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = text.size();
+        std::string line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        MapRegion r;
+        char perms[5] = {0};
+        unsigned int devMajor, devMinor;
+        int pathPos = 0;
+        unsigned long long start, end, offset;
+        if (sscanf(line.c_str(), "%llx-%llx %4s %llx %x:%x %lu %n",
+                   &start, &end, perms, &offset, &devMajor, &devMinor, &r.inode, &pathPos) < 7)
+            continue;
+        r.start = start;
+        r.end = end;
+        r.offset = offset;
+        r.readable = perms[0] == 'r';
+        r.writable = perms[1] == 'w';
+        r.executable = perms[2] == 'x';
+        r.shared = perms[3] == 's';
+        if (pathPos > 0 && size_t(pathPos) < line.size())
+            r.path = line.substr(pathPos);
+        regions.push_back(r);
+    }
+    return !regions.empty();
+}
+
+std::vector<int> ListThreads(int pid)
+{
+    std::vector<int> tids;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR * dir = opendir(path);
+    if (dir == nullptr)
+        return tids;
+    while (dirent * entry = readdir(dir)) {
+        int tid = atoi(entry->d_name);
+        if (tid > 0)
+            tids.push_back(tid);
+    }
+    closedir(dir);
+    return tids;
+}
+
+// Stops every thread of the target with PTRACE_SEIZE + PTRACE_INTERRUPT
+// and lets them go again when destroyed.
+class ThreadFreezer
+{
+public:
+    ThreadFreezer(int pid)
+        : m_pid(pid)
+    {
+    }
+
+    ~ThreadFreezer()
+    {
+        Thaw();
+    }
+
+    bool Freeze()
+    {
+        bool found = true;
+        // Rescan until no new threads show up, the target may still be
+        // spawning threads while we stop the others.
+        while (found) {
+            found = false;
+            std::vector<int> tids = ListThreads(m_pid);
+            for (size_t i = 0; i < tids.size(); ++i) {
+                if (IsFrozen(tids[i]))
+                    continue;
+                if (ptrace(PTRACE_SEIZE, tids[i], 0, 0) != 0)
+                    continue;
+                found = true;
+                ThreadState st;
+                memset(&st, 0, sizeof(st));
+                st.tid = tids[i];
+                if (ptrace(PTRACE_INTERRUPT, st.tid, 0, 0) != 0 || !WaitStop(st)) {
+                    ptrace(PTRACE_DETACH, st.tid, 0, 0);
+                    continue;
+                }
+                m_threads.push_back(st);
+            }
+        }
+        return !m_threads.empty();
+    }
+
+    void Thaw()
+    {
+        for (size_t i = 0; i < m_threads.size(); ++i)
+            ptrace(PTRACE_DETACH, m_threads[i].tid, 0, m_threads[i].pendingSignal);
+        m_threads.clear();
+    }
+
+    std::vector<ThreadState> & Threads()
+    {
+        return m_threads;
+    }
+
+private:
+    bool IsFrozen(int tid) const
+    {
+        for (size_t i = 0; i < m_threads.size(); ++i) {
+            if (m_threads[i].tid == tid)
+                return true;
+        }
+        return false;
+    }
+
+    static bool WaitStop(ThreadState & st)
+    {
+        int status = 0;
+        if (waitpid(st.tid, &status, __WALL) != st.tid || !WIFSTOPPED(status))
+            return false;
+        // A signal may have arrived before our interrupt, it has to be
+        // delivered again when we detach.
+        int sig = WSTOPSIG(status);
+        if (sig != SIGTRAP && (status >> 16) != PTRACE_EVENT_STOP)
+            st.pendingSignal = sig;
+        return true;
+    }
+
+private:
+    int m_pid;
+    std::vector<ThreadState> m_threads;
+};
+
+bool ReadRegisters(ThreadState & st)
+{
+#if defined(__x86_64__)
+    if (ptrace(PTRACE_GETREGS, st.tid, 0, &st.regs) != 0)
+        return false;
+    ptrace(PTRACE_GETFPREGS, st.tid, 0, &st.fpregs);
+    st.stackPointer = st.regs.rsp;
+    return true;
+#else
+    return false;
+#endif
+}
+
+const MapRegion * FindRegion(std::vector<MapRegion> const & regions, uint64_t address)
+{
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (address >= regions[i].start && address < regions[i].end)
+            return &regions[i];
+    }
+    return nullptr;
+}
+
+bool IsSpecialRegion(MapRegion const & r)
+{
+    return r.path == "[vvar]" || r.path == "[vsyscall]" || r.path == "[vvar_vclock]";
+}
+
+// Same idea as the kernel's default coredump_filter: anonymous and
+// written-to memory goes into the dump, read-only file mappings can be
+// recovered from the files on disk.
+bool IsDumpedRegion(MapRegion const & r)
+{
+    if (!r.readable || IsSpecialRegion(r))
+        return false;
+    if (r.inode == 0 || r.path.empty() || r.path[0] == '[')
+        return true;
+    return r.writable;
+}
+
+// MINIDUMP_STRING wants UTF-16. Malformed sequences decode to U+FFFD per
+// byte, code points above the BMP become surrogate pairs.
+void Utf8ToUtf16(std::string const & in, std::vector<uint16_t> & out)
+{
+    out.reserve(in.size());
+    for (size_t i = 0; i < in.size(); ) {
+        unsigned char lead = static_cast<unsigned char>(in[i]);
+        size_t length = lead < 0x80 ? 1 : lead < 0xc2 ? 0 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : lead < 0xf5 ? 4 : 0;
+        uint32_t c = length == 1 ? lead : length == 2 ? lead & 0x1f : length == 3 ? lead & 0x0f : lead & 0x07;
+        for (size_t j = 1; j < length; ++j) {
+            unsigned char next = i + j < in.size() ? static_cast<unsigned char>(in[i + j]) : 0;
+            if ((next & 0xc0) != 0x80) {
+                length = 0;
+                break;
+            }
+            c = (c << 6) | (next & 0x3f);
+        }
+        // Overlong forms, surrogates and code points past U+10FFFF
+        if ((length == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000)))
+                || (length == 4 && (c < 0x10000 || c > 0x10ffff)))
+            length = 0;
+        if (length == 0) {
+            out.push_back(0xfffd);
+            ++i;
+            continue;
+        }
+        if (c >= 0x10000) {
+            out.push_back(uint16_t(0xd800 + ((c - 0x10000) >> 10)));
+            out.push_back(uint16_t(0xdc00 + ((c - 0x10000) & 0x3ff)));
+        } else {
+            out.push_back(uint16_t(c));
+        }
+        i += length;
+    }
+}
+
+// Whether regions[i] starts a module: a file mapped from offset 0 with
+// code in some mapping of it. Data files mapped whole, like locale
+// archives or gconv-modules.cache, have none.
+std::vector<bool> FindModules(std::vector<MapRegion> const & regions)
+{
+    std::vector<std::pair<unsigned long, std::string> > code;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (regions[i].executable && regions[i].inode != 0)
+            code.push_back(std::make_pair(regions[i].inode, regions[i].path));
+    }
+    std::sort(code.begin(), code.end());
+    std::vector<bool> modules(regions.size(), false);
+    for (size_t i = 0; i < regions.size(); ++i) {
+        MapRegion const & r = regions[i];
+        modules[i] = r.offset == 0 && r.inode != 0 && !r.path.empty() && r.path[0] == '/'
+                && std::binary_search(code.begin(), code.end(), std::make_pair(r.inode, r.path));
+    }
+    return modules;
+}
+
+// Describes the regions for the dump policy. A module is what the module
+// list holds, see FindModules, its uninitialized data is the anonymous
+// mapping right behind its last mapping.
+std::vector<DumpRegion> DescribeRegions(std::vector<MapRegion> const & regions)
+{
+    std::vector<DumpRegion> described(regions.size());
+    std::vector<bool> starts = FindModules(regions);
+    std::vector<std::string> modules;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (starts[i])
+            modules.push_back(regions[i].path);
+    }
+    std::sort(modules.begin(), modules.end());
+
+    for (size_t i = 0; i < regions.size(); ++i) {
+        MapRegion const & r = regions[i];
+        DumpRegion & d = described[i];
+        d.base = r.start;
+        d.size = r.end - r.start;
+        d.readable = r.readable;
+        d.writable = r.writable;
+        d.executable = r.executable;
+        d.kinds = r.shared ? RegionShared : 0;
+        if (r.inode == 0 || r.path.empty() || r.path[0] == '[') {
+            d.kinds |= RegionAnonymous;
+            if (r.path == "[heap]")
+                d.kinds |= RegionHeap;
+            if (i > 0 && r.path.empty() && regions[i - 1].end == r.start)
+                d.module = described[i - 1].module;
+        } else {
+            d.kinds |= RegionFile;
+            d.path = WidenPath(r.path);
+            if (std::binary_search(modules.begin(), modules.end(), r.path)) {
+                d.kinds |= RegionImage;
+                d.module = d.path;
+            }
+        }
+    }
+    return described;
+}
+
+// Register values a policy may include memory around
+std::vector<uint64_t> RegisterValues(ThreadState const & t)
+{
+    std::vector<uint64_t> values;
+#if defined(__x86_64__)
+    const unsigned long long regs[] = {
+        t.regs.rax, t.regs.rbx, t.regs.rcx, t.regs.rdx, t.regs.rsi, t.regs.rdi, t.regs.rbp, t.regs.rsp,
+        t.regs.r8, t.regs.r9, t.regs.r10, t.regs.r11, t.regs.r12, t.regs.r13, t.regs.r14, t.regs.r15,
+        t.regs.rip,
+    };
+    values.assign(regs, regs + sizeof(regs) / sizeof(regs[0]));
+#else
+    (void) t;
+#endif
+    return values;
+}
+
+// Grows a flat byte buffer while handing out file offsets (RVAs), so the
+// whole metadata part of the dump can be built before anything is written.
+class DumpBlob
+{
+public:
+    uint32_t Reserve(size_t size)
+    {
+        uint32_t rva = uint32_t(m_data.size());
+        m_data.resize(m_data.size() + ((size + 3) & ~size_t(3)));
+        return rva;
+    }
+
+    uint32_t Append(void const * data, size_t size)
+    {
+        uint32_t rva = Reserve(size);
+        memcpy(&m_data[rva], data, size);
+        return rva;
+    }
+
+    // str is UTF-8, as paths and uname fields are on Linux
+    uint32_t AppendString(std::string const & str)
+    {
+        std::vector<uint16_t> utf16;
+        Utf8ToUtf16(str, utf16);
+        uint32_t length = uint32_t(utf16.size() * 2);
+        uint32_t rva = Reserve(sizeof(length) + length + 2);
+        memcpy(&m_data[rva], &length, sizeof(length));
+        if (length)
+            memcpy(&m_data[rva + sizeof(length)], &utf16[0], length);
+        return rva;
+    }
+
+    template <typename T>
+    T * At(uint32_t rva)
+    {
+        return reinterpret_cast<T *>(&m_data[rva]);
+    }
+
+    size_t Size() const
+    {
+        return m_data.size();
+    }
+
+    char const * Data() const
+    {
+        return m_data.data();
+    }
+
+private:
+    std::vector<char> m_data;
+};
+
+uint32_t AppendBuildId(DumpBlob & blob, int pid, uint64_t base, uint32_t & size)
+{
+    Elf64_Ehdr ehdr;
+    if (ReadProcessMemory(pid, base, &ehdr, sizeof(ehdr)) != sizeof(ehdr)
+            || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0
+            || ehdr.e_ident[EI_CLASS] != ELFCLASS64
+            || ehdr.e_phnum == 0 || ehdr.e_phnum > 256)
+        return 0;
+    std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+    size_t phdrSize = phdrs.size() * sizeof(Elf64_Phdr);
+    if (ReadProcessMemory(pid, base + ehdr.e_phoff, &phdrs[0], phdrSize) != phdrSize)
+        return 0;
+    uint64_t loadBias = base;
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_LOAD) {
+            loadBias = base - (phdrs[i].p_vaddr & ~uint64_t(phdrs[i].p_align - 1));
+            break;
+        }
+    }
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_memsz > 65536)
+            continue;
+        std::vector<char> notes(phdrs[i].p_memsz);
+        if (notes.empty() || ReadProcessMemory(pid, loadBias + phdrs[i].p_vaddr, &notes[0], notes.size()) != notes.size())
+            continue;
+        size_t pos = 0;
+        while (pos + sizeof(Elf64_Nhdr) <= notes.size()) {
+            Elf64_Nhdr const * note = reinterpret_cast<Elf64_Nhdr const *>(&notes[pos]);
+            size_t nameSize = (note->n_namesz + 3) & ~3u;
+            size_t descSize = (note->n_descsz + 3) & ~3u;
+            size_t desc = pos + sizeof(Elf64_Nhdr) + nameSize;
+            if (desc + note->n_descsz > notes.size())
+                break;
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                    && memcmp(&notes[pos + sizeof(Elf64_Nhdr)], "GNU", 4) == 0) {
+                // breakpad's CodeView record for ELF: 'BpEL' followed by the build id
+                const uint32_t signature = 0x4c457042;
+                size = sizeof(signature) + note->n_descsz;
+                uint32_t rva = blob.Reserve(size);
+                memcpy(blob.At<char>(rva), &signature, sizeof(signature));
+                memcpy(blob.At<char>(rva) + sizeof(signature), &notes[desc], note->n_descsz);
+                return rva;
+            }
+            pos = desc + descSize;
+        }
+    }
+    return 0;
+}
+
+bool StartsBefore(MDMemoryDescriptor64 const & a, MDMemoryDescriptor64 const & b)
+{
+    return a.start_of_memory_range < b.start_of_memory_range;
+}
+
+// Keeps the first size bytes of ranges, in whole pages, and moves the rest
+// to omitted. Returns true if anything was moved.
+bool TrimRanges(std::vector<MDMemoryDescriptor64> & ranges, uint64_t size, long pageSize,
+                std::vector<MDMemoryDescriptor64> & omitted)
+{
+    size = size / pageSize * pageSize;
+    size_t i = 0;
+    for (; i < ranges.size() && ranges[i].data_size <= size; ++i)
+        size -= ranges[i].data_size;
+    if (i == ranges.size())
+        return false;
+    std::vector<MDMemoryDescriptor64> rest(ranges.begin() + i, ranges.end());
+    ranges.resize(i);
+    if (size) {
+        MDMemoryDescriptor64 d = { rest[0].start_of_memory_range, size };
+        ranges.push_back(d);
+        rest[0].start_of_memory_range += size;
+        rest[0].data_size -= size;
+    }
+    omitted.insert(omitted.end(), rest.begin(), rest.end());
+    return true;
+}
+
+// Size of what follows the memory data of dumps that keep their directory
+// there: the directory, the fixup list, the omitted memory and the list of
+// the memory copied
+uint64_t TailSize(uint32_t streams, bool bFixups, size_t fixupRanges,
+                  bool bBudget, size_t omittedRanges, size_t memoryRanges)
+{
+    uint64_t size = sizeof(MDRawDirectory) * uint64_t(streams);
+    if (bFixups)
+        size += sizeof(MDRawPageFixups) + fixupRanges * sizeof(MDMemoryDescriptor64);
+    if (bBudget)
+        size += sizeof(MDRawOmittedMemory) + omittedRanges * sizeof(MDMemoryDescriptor64)
+                + sizeof(uint64_t) * 2 + memoryRanges * sizeof(MDMemoryDescriptor64);
+    return size;
+}
+
+// Pagemap entry bits, see Documentation/admin-guide/mm/pagemap.rst
+const uint64_t kPagemapSoftDirty = 1ULL << 55;
+const uint64_t kPagemapSwapped = 1ULL << 62;
+const uint64_t kPagemapPresent = 1ULL << 63;
+
+typedef std::vector<std::pair<unsigned long long, unsigned long long> > Layout;
+
+// Appends [address, address + size) to the list, merging with the last run
+void AppendRun(std::vector<MDMemoryDescriptor64> & runs, uint64_t address, uint64_t size)
+{
+    if (!runs.empty() && runs.back().start_of_memory_range + runs.back().data_size == address) {
+        runs.back().data_size += size;
+        return;
+    }
+    MDMemoryDescriptor64 d = { address, size };
+    runs.push_back(d);
+}
+
+bool IsInLayout(Layout const & layout, uint64_t address)
+{
+    Layout::const_iterator it = std::upper_bound(layout.begin(), layout.end(),
+            std::make_pair(static_cast<unsigned long long>(address), ~0ULL));
+    if (it == layout.begin())
+        return false;
+    --it;
+    return address < it->first + it->second;
+}
+
+// Calls visit(address, entry) for every page of the ranges
+template <typename Visitor>
+bool VisitPagemap(int pid, std::vector<MDMemoryDescriptor64> const & ranges, long pageSize, Visitor visit)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    std::vector<uint64_t> entries(65536);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        uint64_t page = ranges[i].start_of_memory_range / pageSize;
+        uint64_t pages = ranges[i].data_size / pageSize;
+        while (pages) {
+            size_t count = pages < entries.size() ? size_t(pages) : entries.size();
+            ssize_t n = pread(fd, &entries[0], count * sizeof(uint64_t), page * sizeof(uint64_t));
+            if (n <= 0) {
+                close(fd);
+                return false;
+            }
+            count = n / sizeof(uint64_t);
+            for (size_t j = 0; j < count; ++j)
+                visit((page + j) * pageSize, entries[j]);
+            page += count;
+            pages -= count;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+bool ClearSoftDirty(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, "4", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+// Whether the kernel keeps soft-dirty bits, tried on a page of our own: the
+// bit has to go away with a clear and come back with a write. The target's
+// pages say nothing, an idle target shows none right after a clear.
+bool KernelHasSoftDirty(long pageSize)
+{
+    void * page = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        return false;
+    volatile char * byte = static_cast<char *>(page);
+    std::vector<MDMemoryDescriptor64> range(1);
+    range[0].start_of_memory_range = reinterpret_cast<uint64_t>(page);
+    range[0].data_size = pageSize;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    bool ok = false;
+    *byte = 1;
+    if (ClearSoftDirty(getpid())
+            && VisitPagemap(getpid(), range, pageSize, [&before](uint64_t, uint64_t entry) { before = entry; })) {
+        *byte = 2;
+        ok = VisitPagemap(getpid(), range, pageSize, [&after](uint64_t, uint64_t entry) { after = entry; })
+                && (before & kPagemapSoftDirty) == 0 && (after & kPagemapSoftDirty) != 0;
+    }
+    munmap(page, pageSize);
+    return ok;
+}
+
+// Soft-dirty tracking needs CONFIG_MEM_SOFT_DIRTY, read access to the
+// target's pagemap and write access to its clear_refs
+bool ProbeSoftDirty(int pid, long pageSize)
+{
+    static int s_nKernel = -1;
+    static std::once_flag s_kernelOnce;
+    std::call_once(s_kernelOnce, [pageSize] { s_nKernel = KernelHasSoftDirty(pageSize) ? 1 : 0; });
+    if (!s_nKernel)
+        return false;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+    if (access(path, W_OK) != 0)
+        return false;
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    return access(path, R_OK) == 0;
+}
+
+// Pages written since the last clear, plus every page that wasn't mapped
+// at the previous dump.
+bool CollectSoftDirtyPages(int pid, std::vector<MDMemoryDescriptor64> const & layout,
+                           Layout const & lastLayout, long pageSize,
+                           std::vector<MDMemoryDescriptor64> & dirty)
+{
+    return VisitPagemap(pid, layout, pageSize, [&](uint64_t address, uint64_t entry) {
+        bool present = (entry & (kPagemapPresent | kPagemapSwapped)) != 0;
+        if ((present && (entry & kPagemapSoftDirty) != 0) || !IsInLayout(lastLayout, address))
+            AppendRun(dirty, address, pageSize);
+    });
+}
+
+// Pages of ranges written to since the soft-dirty bits were cleared
+bool CollectWrittenPages(int pid, std::vector<MDMemoryDescriptor64> const & ranges, long pageSize,
+                         std::vector<MDMemoryDescriptor64> & written)
+{
+    return VisitPagemap(pid, ranges, pageSize, [&](uint64_t address, uint64_t entry) {
+        if ((entry & kPagemapPresent) != 0 && (entry & kPagemapSoftDirty) != 0)
+            AppendRun(written, address, pageSize);
+    });
+}
+
+// Fallback without soft-dirty bits: hash every page and compare with the
+// hashes of the previous dump.
+void CollectChangedPages(int pid, std::vector<MDMemoryDescriptor64> const & layout, long pageSize,
+                         std::unordered_map<unsigned long long, unsigned long long> & hashes,
+                         std::vector<MDMemoryDescriptor64> & dirty)
+{
+    std::unordered_map<unsigned long long, unsigned long long> current;
+    current.reserve(hashes.size());
+    std::vector<char> buffer(kReadChunkSize);
+    for (size_t i = 0; i < layout.size(); ++i) {
+        uint64_t address = layout[i].start_of_memory_range;
+        uint64_t left = layout[i].data_size;
+        while (left) {
+            size_t size = left < buffer.size() ? size_t(left) : buffer.size();
+            ReadProcessMemory(pid, address, &buffer[0], size);
+            for (size_t off = 0; off < size; off += pageSize) {
+                uint64_t hash = ContentHash::Hash64(&buffer[off], pageSize);
+                std::unordered_map<unsigned long long, unsigned long long>::const_iterator it = hashes.find(address + off);
+                if (it == hashes.end() || it->second != hash)
+                    AppendRun(dirty, address + off, pageSize);
+                current[address + off] = hash;
+            }
+            address += size;
+            left -= size;
+        }
+    }
+    hashes.swap(current);
+}
+
+} // namespace
+
+bool MiniDumpper::CreateMiniDump()
+{
+    // The recorder may have dropped the dumps the next delta builds on
+    if (m_pRecorder && m_pRecorder->NeedsBase())
+        m_nSequence = 0;
+
+    bool bStatus = false;
+    std::unique_ptr<DumpOutput> output;
+    std::vector<MapRegion> regions;
+    std::string mapsText;
+    std::string cmdline;
+    std::vector<std::pair<uint64_t, uint64_t> > stackRanges;
+    std::vector<MDMemoryDescriptor64> layout;
+    std::vector<MDMemoryDescriptor64> bulk;
+    uint64_t bulkSize = 0;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    bool bDelta = m_bIncremental && m_nSequence > 0;
+    bool bHashWhileWriting = false;
+    bool bReread = m_bLowPause && m_bReread;
+    bool bCollectChanged = false;
+    std::unordered_map<unsigned long long, unsigned long long> copyHashes;
+    std::vector<MDMemoryDescriptor64> fixups;
+    std::vector<char> fixupData;
+    bool bBudget = m_budget.IsLimited();
+    std::vector<MDMemoryDescriptor64> omitted;
+    uint32_t memoryStream = 0;
+    bool bPolicy = !m_policy.IsEmpty();
+    std::vector<DumpRegion> described;
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point pauseStart;
+    std::chrono::steady_clock::time_point pauseEnd;
+    long long profileStart = ProfileStart();
+    long long phaseStart;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_budget.Start();
+
+    time_t now = time(nullptr);
+    tm st;
+    localtime_r(&now, &st);
+
+    wchar_t sName[80];
+    if (bDelta)
+        swprintf(sName, sizeof(sName) / sizeof(wchar_t), L"crashdump-%06d-%02d-%02d-%02d-%02d-%02d-delta%04d.dmp",
+                 m_dwProcessId, st.tm_mon + 1, st.tm_mday, st.tm_hour, st.tm_min, st.tm_sec, m_nSequence);
+    else
+        swprintf(sName, sizeof(sName) / sizeof(wchar_t), L"crashdump-%06d-%02d-%02d-%02d-%02d-%02d.dmp",
+                 m_dwProcessId, st.tm_mon + 1, st.tm_mday, st.tm_hour, st.tm_min, st.tm_sec);
+    std::wstring sMinidumpFile = UniqueDumpName(sName);
+
+    // Update progress
+    SetProgress(L"Creating crash dump file...", 0, false);
+    SetProgress(L"[creating_dump]", 0, false);
+
+    // The privileges belong to this process, checking them once is enough
+    phaseStart = ProfileStart();
+    std::call_once(s_privilegesOnce, [this] { SetDumpPrivileges(); });
+    ProfileEnd(PhasePrivileges, phaseStart);
+
+    char procPath[64];
+    snprintf(procPath, sizeof(procPath), "/proc/%d/cmdline", m_dwProcessId);
+    ReadTextFile(procPath, cmdline);
+
+    phaseStart = ProfileStart();
+    if (m_pRecorder)
+        output.reset(m_pRecorder->Open(sMinidumpFile, !bDelta));
+    else if (m_pStore)
+        output.reset(new ChunkStoreDumpOutput(*m_pStore, sMinidumpFile));
+    else
+        output.reset(OpenDumpOutput(sMinidumpFile + DumpCodecExtension(m_codec), m_codec, m_nCodecLevel));
+    ProfileEnd(PhaseCreateFile, phaseStart);
+    if (!output) {
+        std::wstring sMsg = L"Couldn't create minidump file: ";
+        sMsg += FormatErrorMsg(errno);
+        SetProgress(sMsg, 0, false);
+        return false;
+    }
+
+    {
+        ThreadFreezer freezer(m_dwProcessId);
+        pauseStart = std::chrono::steady_clock::now();
+        phaseStart = ProfileStart();
+        if (!freezer.Freeze()) {
+            std::wstring sMsg = L"Couldn't attach to process: ";
+            sMsg += FormatErrorMsg(errno);
+            SetProgress(sMsg, 0, false);
+            goto cleanup;
+        }
+        m_budget.PauseStarted();
+        ProfileEnd(PhaseOpenProcess, phaseStart);
+
+        // The map is read after stopping the threads so it can't change under us
+        phaseStart = ProfileStart();
+        snprintf(procPath, sizeof(procPath), "/proc/%d/maps", m_dwProcessId);
+        if (!ReadTextFile(procPath, mapsText) || !ParseMaps(mapsText, regions)) {
+            SetProgress(L"Couldn't read process memory map.", 0, false);
+            goto cleanup;
+        }
+
+        std::vector<ThreadState> & threads = freezer.Threads();
+        for (size_t i = 0; i < threads.size(); ++i) {
+            if (!ReadRegisters(threads[i]))
+                threads[i].stackPointer = 0;
+        }
+        if (bPolicy)
+            described = DescribeRegions(regions);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            ThreadState & t = threads[i];
+            const MapRegion * stack = t.stackPointer ? FindRegion(regions, t.stackPointer) : nullptr;
+            if (stack == nullptr)
+                continue;
+            uint64_t stackStart = (t.stackPointer - kRedZoneSize) & ~uint64_t(pageSize - 1);
+            if (stackStart < stack->start)
+                stackStart = stack->start;
+            uint64_t stackEnd = stack->end;
+            if (stackEnd - stackStart > kMaxStackSize)
+                stackEnd = stackStart + kMaxStackSize;
+            if (bPolicy) {
+                // Only the part of the region in use is the thread's stack,
+                // the rest of the mapping is left to the bulk rules
+                DumpRegion d = described[stack - &regions[0]];
+                d.base = stackStart;
+                d.size = stackEnd - stackStart;
+                d.kinds |= RegionStack;
+                if (m_policy.Decide(d) == PolicyExclude)
+                    continue;
+            }
+            t.stackStart = stackStart;
+            t.stackEnd = stackEnd;
+            stackRanges.push_back(std::make_pair(t.stackStart, t.stackEnd));
+        }
+        std::sort(stackRanges.begin(), stackRanges.end());
+        ProfileEnd(PhaseSnapshot, phaseStart, mapsText.size());
+
+        DumpBlob blob;
+        const int streamCount = 8;
+        uint32_t headerRva = blob.Reserve(sizeof(MDRawHeader));
+        uint32_t dirRva = blob.Reserve(sizeof(MDRawDirectory) * streamCount);
+        int stream = 0;
+
+        // System info
+        {
+            utsname un;
+            uname(&un);
+            std::string csd = std::string(un.sysname) + " " + un.release + " " + un.version + " " + un.machine;
+            uint32_t csdRva = blob.AppendString(csd);
+            uint32_t rva = blob.Reserve(sizeof(MDRawSystemInfo));
+            MDRawSystemInfo * si = blob.At<MDRawSystemInfo>(rva);
+#if defined(__x86_64__)
+            si->processor_architecture = MD_CPU_ARCHITECTURE_AMD64;
+#elif defined(__aarch64__)
+            si->processor_architecture = MD_CPU_ARCHITECTURE_ARM64;
+#endif
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            si->number_of_processors = uint8_t(cpus > 255 ? 255 : cpus);
+            unsigned major = 0, minor = 0, build = 0;
+            sscanf(un.release, "%u.%u.%u", &major, &minor, &build);
+            si->major_version = major;
+            si->minor_version = minor;
+            si->build_number = build;
+            si->platform_id = MD_OS_LINUX;
+            si->csd_version_rva = csdRva;
+            MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_SYSTEM_INFO_STREAM;
+            dir->location.data_size = sizeof(MDRawSystemInfo);
+            dir->location.rva = rva;
+        }
+
+        // Thread list and stack memory
+        {
+            uint32_t count = uint32_t(threads.size());
+            uint32_t listRva = blob.Reserve(sizeof(count) + count * sizeof(MDRawThread));
+            *blob.At<uint32_t>(listRva) = count;
+            std::vector<MDMemoryDescriptor> stacks;
+            for (uint32_t i = 0; i < count; ++i) {
+                ThreadState & t = threads[i];
+                phaseStart = ProfileStart();
+                MDRawThread raw;
+                memset(&raw, 0, sizeof(raw));
+                raw.thread_id = t.tid;
+#if defined(__x86_64__)
+                MDRawContextAMD64 ctx;
+                memset(&ctx, 0, sizeof(ctx));
+                ctx.context_flags = MD_CONTEXT_AMD64_FULL;
+                ctx.cs = uint16_t(t.regs.cs);
+                ctx.ds = uint16_t(t.regs.ds);
+                ctx.es = uint16_t(t.regs.es);
+                ctx.fs = uint16_t(t.regs.fs);
+                ctx.gs = uint16_t(t.regs.gs);
+                ctx.ss = uint16_t(t.regs.ss);
+                ctx.eflags = uint32_t(t.regs.eflags);
+                ctx.rax = t.regs.rax;
+                ctx.rcx = t.regs.rcx;
+                ctx.rdx = t.regs.rdx;
+                ctx.rbx = t.regs.rbx;
+                ctx.rsp = t.regs.rsp;
+                ctx.rbp = t.regs.rbp;
+                ctx.rsi = t.regs.rsi;
+                ctx.rdi = t.regs.rdi;
+                ctx.r8 = t.regs.r8;
+                ctx.r9 = t.regs.r9;
+                ctx.r10 = t.regs.r10;
+                ctx.r11 = t.regs.r11;
+                ctx.r12 = t.regs.r12;
+                ctx.r13 = t.regs.r13;
+                ctx.r14 = t.regs.r14;
+                ctx.r15 = t.regs.r15;
+                ctx.rip = t.regs.rip;
+                ctx.mx_csr = t.fpregs.mxcsr;
+                memcpy(ctx.flt_save, &t.fpregs, sizeof(ctx.flt_save));
+                raw.thread_context.data_size = sizeof(ctx);
+                raw.thread_context.rva = blob.Append(&ctx, sizeof(ctx));
+                raw.teb = t.regs.fs_base;
+#endif
+                if (t.stackEnd > t.stackStart) {
+                    size_t size = size_t(t.stackEnd - t.stackStart);
+                    uint32_t rva = blob.Reserve(size);
+                    ReadProcessMemory(m_dwProcessId, t.stackStart, blob.At<char>(rva), size);
+                    raw.stack.start_of_memory_range = t.stackStart;
+                    raw.stack.memory.data_size = uint32_t(size);
+                    raw.stack.memory.rva = rva;
+                    stacks.push_back(raw.stack);
+                }
+                memcpy(blob.At<MDRawThread>(listRva + sizeof(count)) + i, &raw, sizeof(raw));
+                if (m_pProfiler) {
+                    char name[16];
+                    snprintf(name, sizeof(name), "%d", t.tid);
+                    ProfileEnd(PhaseThread, phaseStart, raw.stack.memory.data_size, name);
+                }
+            }
+            MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_THREAD_LIST_STREAM;
+            dir->location.data_size = sizeof(count) + count * sizeof(MDRawThread);
+            dir->location.rva = listRva;
+
+            count = uint32_t(stacks.size());
+            uint32_t memRva = blob.Reserve(sizeof(count) + count * sizeof(MDMemoryDescriptor));
+            *blob.At<uint32_t>(memRva) = count;
+            if (count)
+                memcpy(blob.At<char>(memRva + sizeof(count)), &stacks[0], count * sizeof(MDMemoryDescriptor));
+            dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_MEMORY_LIST_STREAM;
+            dir->location.data_size = sizeof(count) + count * sizeof(MDMemoryDescriptor);
+            dir->location.rva = memRva;
+        }
+
+        // Module list, one module per file mapped from offset 0 with code
+        {
+            std::vector<MDRawModule> modules;
+            std::vector<bool> starts = FindModules(regions);
+            for (size_t i = 0; i < regions.size(); ++i) {
+                MapRegion const & r = regions[i];
+                if (!starts[i])
+                    continue;
+                uint64_t end = r.end;
+                for (size_t j = i + 1; j < regions.size(); ++j) {
+                    if (regions[j].inode != r.inode || regions[j].path != r.path)
+                        break;
+                    end = regions[j].end;
+                }
+                phaseStart = ProfileStart();
+                MDRawModule m;
+                memset(&m, 0, sizeof(m));
+                m.base_of_image = r.start;
+                m.size_of_image = uint32_t(end - r.start);
+                m.module_name_rva = blob.AppendString(r.path);
+                m.cv_record.rva = AppendBuildId(blob, m_dwProcessId, r.start, m.cv_record.data_size);
+                modules.push_back(m);
+                ProfileEnd(PhaseModule, phaseStart, 0, r.path.c_str());
+            }
+            uint32_t count = uint32_t(modules.size());
+            uint32_t rva = blob.Reserve(sizeof(count) + count * sizeof(MDRawModule));
+            *blob.At<uint32_t>(rva) = count;
+            if (count)
+                memcpy(blob.At<char>(rva + sizeof(count)), &modules[0], count * sizeof(MDRawModule));
+            MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_MODULE_LIST_STREAM;
+            dir->location.data_size = sizeof(count) + count * sizeof(MDRawModule);
+            dir->location.rva = rva;
+        }
+
+        // Raw text streams
+        {
+            const struct { uint32_t type; std::string * text; } texts[] = {
+                { MD_LINUX_MAPS, &mapsText },
+                { MD_LINUX_CMD_LINE, &cmdline },
+            };
+            for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i) {
+                MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+                dir->stream_type = texts[i].type;
+                dir->location.data_size = uint32_t(texts[i].text->size());
+                dir->location.rva = blob.Append(texts[i].text->data(), texts[i].text->size());
+            }
+        }
+
+        // Bulk memory, stacks are already in the memory list. Regions no
+        // policy rule decides on are dumped by default.
+        std::vector<MDMemoryDescriptor64> wanted;
+        for (size_t i = 0; i < regions.size(); ++i) {
+            PolicyDecision decision = bPolicy ? m_policy.Decide(described[i]) : PolicyNoMatch;
+            if (decision == PolicyNoMatch ? !IsDumpedRegion(regions[i])
+                                          : decision == PolicyExclude || !regions[i].readable || IsSpecialRegion(regions[i]))
+                continue;
+            MDMemoryDescriptor64 d = { regions[i].start, regions[i].end - regions[i].start };
+            wanted.push_back(d);
+        }
+        if (m_policy.RegisterWindow()) {
+            for (size_t i = 0; i < threads.size(); ++i) {
+                std::vector<uint64_t> values = threads[i].stackPointer ? RegisterValues(threads[i])
+                                                                       : std::vector<uint64_t>();
+                for (size_t j = 0; j < values.size(); ++j) {
+                    const MapRegion * r = FindRegion(regions, values[j]);
+                    if (r == nullptr || !r->readable || IsSpecialRegion(*r))
+                        continue;
+                    MDMemoryDescriptor64 d;
+                    m_policy.WindowAround(values[j], r->start, r->end, pageSize,
+                                          d.start_of_memory_range, d.data_size);
+                    if (d.data_size)
+                        wanted.push_back(d);
+                }
+            }
+            // Windows overlap each other and the regions dumped whole
+            std::sort(wanted.begin(), wanted.end(), StartsBefore);
+            size_t merged = 0;
+            for (size_t i = 1; i < wanted.size(); ++i) {
+                MDMemoryDescriptor64 & last = wanted[merged];
+                uint64_t lastEnd = last.start_of_memory_range + last.data_size;
+                if (wanted[i].start_of_memory_range < lastEnd) {
+                    uint64_t end = wanted[i].start_of_memory_range + wanted[i].data_size;
+                    if (end > lastEnd)
+                        last.data_size = end - last.start_of_memory_range;
+                } else {
+                    wanted[++merged] = wanted[i];
+                }
+            }
+            if (!wanted.empty())
+                wanted.resize(merged + 1);
+        }
+        for (size_t i = 0; i < wanted.size(); ++i) {
+            uint64_t start = wanted[i].start_of_memory_range;
+            uint64_t end = start + wanted[i].data_size;
+            for (size_t j = 0; j < stackRanges.size(); ++j) {
+                if (stackRanges[j].second <= start || stackRanges[j].first >= end)
+                    continue;
+                if (stackRanges[j].first > start) {
+                    MDMemoryDescriptor64 d = { start, stackRanges[j].first - start };
+                    layout.push_back(d);
+                }
+                if (stackRanges[j].second > start)
+                    start = stackRanges[j].second;
+            }
+            if (end > start) {
+                MDMemoryDescriptor64 d = { start, end - start };
+                layout.push_back(d);
+            }
+        }
+
+        phaseStart = ProfileStart();
+        if ((m_bIncremental || bReread) && m_nSoftDirty < 0) {
+            m_nSoftDirty = ProbeSoftDirty(m_dwProcessId, pageSize) ? 1 : 0;
+            SetProgress(m_nSoftDirty ? L"Tracking changed pages with soft-dirty bits"
+                                     : L"Tracking changed pages with page hashes", 0, false);
+        }
+        if (!bDelta) {
+            bulk = layout;
+            if (m_bIncremental) {
+                bHashWhileWriting = m_nSoftDirty == 0;
+                m_pageHashes.clear();
+            }
+        } else if (m_nSoftDirty == 0 || !CollectSoftDirtyPages(m_dwProcessId, layout, m_lastLayout, pageSize, bulk)) {
+            bulk.clear();
+            bCollectChanged = true;
+        }
+        if (m_bIncremental || bReread)
+            ProfileEnd(PhaseChangedPages, phaseStart);
+
+        // Phase one ends here in low pause mode, everything but the bulk
+        // memory has been read. Soft-dirty bits are cleared first so writes
+        // made during the copy can be found afterwards.
+        if (m_bLowPause) {
+            if ((m_bIncremental || bReread) && m_nSoftDirty == 1 && !ClearSoftDirty(m_dwProcessId)) {
+                SetProgress(L"Couldn't clear soft-dirty bits, falling back to page hashes.", 0, false);
+                m_nSoftDirty = 0;
+                if (m_bIncremental)
+                    m_nSequence = -1;
+            }
+            freezer.Thaw();
+            m_budget.PauseEnded();
+            pauseEnd = std::chrono::steady_clock::now();
+            m_stats.pauseTime = std::chrono::duration_cast<std::chrono::microseconds>(pauseEnd - pauseStart).count();
+        }
+
+        if (bCollectChanged) {
+            phaseStart = ProfileStart();
+            CollectChangedPages(m_dwProcessId, layout, pageSize, m_pageHashes, bulk);
+            ProfileEnd(PhaseChangedPages, phaseStart);
+        }
+
+        if (m_bIncremental) {
+            uint32_t size = uint32_t(sizeof(MDRawDeltaInfo) + layout.size() * sizeof(MDMemoryDescriptor64));
+            uint32_t rva = blob.Reserve(size);
+            MDRawDeltaInfo * info = blob.At<MDRawDeltaInfo>(rva);
+            info->sequence = m_nSequence;
+            info->page_size = uint32_t(pageSize);
+            info->base_time_date_stamp = bDelta ? m_nBaseTimeStamp : uint32_t(now);
+            info->range_count = layout.size();
+            if (!layout.empty())
+                memcpy(info + 1, &layout[0], layout.size() * sizeof(MDMemoryDescriptor64));
+            MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_DUMPPER_DELTA_INFO;
+            dir->location.data_size = size;
+            dir->location.rva = rva;
+        }
+        // A budget leaves out what doesn't fit before anything is written.
+        // Limited dumps keep their directory behind the memory data, where
+        // memory left out during the copy can still be listed, so they have
+        // to stay below 4 GB as well.
+        if (bBudget) {
+            uint64_t fixed = blob.Size() + sizeof(uint64_t) * 2 + bulk.size() * sizeof(MDMemoryDescriptor64)
+                    + TailSize(stream + (bReread ? 3 : 2), bReread, kMaxFixupRanges,
+                               true, bulk.size() + 1, bulk.size());
+            uint64_t maxBytes = m_budget.Limits().maxBytes;
+            if (maxBytes && TrimRanges(bulk, maxBytes > fixed ? maxBytes - fixed : 0, pageSize, omitted))
+                m_budget.AddReasons(MD_OMITTED_BYTES);
+            if (TrimRanges(bulk, 0xffffffffULL - fixed, pageSize, omitted))
+                m_budget.AddReasons(MD_OMITTED_RVA_LIMIT);
+        }
+
+        memoryStream = stream;
+        {
+            uint64_t count = bulk.size();
+            uint32_t rva = blob.Reserve(sizeof(uint64_t) * 2 + count * sizeof(MDMemoryDescriptor64));
+            MDRawDirectory * dir = blob.At<MDRawDirectory>(dirRva) + stream++;
+            dir->stream_type = MD_MEMORY_64_LIST_STREAM;
+            dir->location.data_size = uint32_t(sizeof(uint64_t) * 2 + count * sizeof(MDMemoryDescriptor64));
+            dir->location.rva = rva;
+            uint64_t * list = blob.At<uint64_t>(rva);
+            list[0] = count;
+            list[1] = blob.Size();
+            if (count)
+                memcpy(&list[2], &bulk[0], count * sizeof(MDMemoryDescriptor64));
+            for (size_t i = 0; i < bulk.size(); ++i)
+                bulkSize += bulk[i].data_size;
+        }
+
+        MDRawHeader * header = blob.At<MDRawHeader>(headerRva);
+        header->signature = MD_HEADER_SIGNATURE;
+        header->version = MD_HEADER_VERSION;
+        header->stream_count = stream;
+        header->stream_directory_rva = dirRva;
+        header->time_date_stamp = uint32_t(now);
+
+        // Fixups are only known after the copy, so the directory moves
+        // behind the memory data where it can list them. RVAs are 32 bits,
+        // which limits this to dumps below 4 GB.
+        uint64_t memoryRva = blob.Size();
+        uint64_t tailRva = memoryRva + bulkSize;
+        if (bReread && !bBudget && tailRva + TailSize(stream + 1, true, kMaxFixupRanges, false, 0, 0) > 0xffffffffULL) {
+            SetProgress(L"Dump too large to re-read changed pages.", 0, false);
+            bReread = false;
+        }
+        if (bReread || bBudget) {
+            header->stream_count = stream + (bReread ? 1 : 0) + (bBudget ? 1 : 0);
+            header->stream_directory_rva = uint32_t(tailRva);
+        }
+        bHashWhileWriting = bHashWhileWriting || (bReread && m_nSoftDirty == 0);
+
+        phaseStart = ProfileStart();
+        if (!output->Write(blob.Data(), blob.Size())) {
+            std::wstring sMsg = FormatErrorMsg(errno);
+            SetProgress(L"Error writing dump.", 0, false);
+            SetProgress(sMsg, 0, false);
+            goto cleanup;
+        }
+        ProfileEnd(PhaseWrite, phaseStart, blob.Size());
+
+        // Memory is read ahead on the reader's threads while it is written
+        MemoryReader reader(m_dwProcessId, bulk);
+        uint64_t written = 0;
+        size_t copied = bulk.size(); // ranges copied before a budget ran low
+        for (size_t i = 0; i < bulk.size() && copied == bulk.size(); ++i) {
+            uint64_t address = bulk[i].start_of_memory_range;
+            uint64_t left = bulk[i].data_size;
+            phaseStart = ProfileStart();
+            while (left) {
+                size_t size = left < kReadChunkSize ? size_t(left) : kReadChunkSize;
+                if (bBudget) {
+                    size_t allowed = size_t(m_budget.BulkAllowance(memoryRva + written, size, pageSize));
+                    if (allowed < size) {
+                        copied = i;
+                        size = allowed;
+                    }
+                }
+                char const * data = nullptr;
+                if (size)
+                    size = reader.Next(data, size);
+                if (bHashWhileWriting) {
+                    for (size_t off = 0; off < size; off += pageSize) {
+                        uint64_t hash = ContentHash::Hash64(&data[off], pageSize);
+                        if (m_bIncremental && !bDelta)
+                            m_pageHashes[address + off] = hash;
+                        if (bReread)
+                            copyHashes[address + off] = hash;
+                    }
+                }
+                if (size && !output->Write(data, size)) {
+                    std::wstring sMsg = FormatErrorMsg(errno);
+                    SetProgress(L"Error writing dump.", 0, false);
+                    SetProgress(sMsg, 0, false);
+                    goto cleanup;
+                }
+                address += size;
+                left -= size;
+                written += size;
+                if (copied != bulk.size())
+                    break;
+            }
+            if (m_pProfiler) {
+                char name[24];
+                snprintf(name, sizeof(name), "%llx", static_cast<unsigned long long>(bulk[i].start_of_memory_range));
+                ProfileEnd(PhaseMemory, phaseStart, bulk[i].data_size - left, name);
+            }
+            // A budget running low ends the loop above, the dump still gets
+            // its directory
+            if (copied == bulk.size() && IsCancelled()) {
+                SetProgress(L"Dump generation cancelled, time budget used up", 0, true);
+                goto cleanup;
+            }
+            SetProgress(L"Dumping memory", int(written * 100 / bulkSize), true);
+        }
+
+        // The rest of the memory is left out, its space stays empty so
+        // the directory lands where the header expects it
+        if (copied != bulk.size()) {
+            uint64_t partial = written;
+            for (size_t i = 0; i < copied; ++i)
+                partial -= bulk[i].data_size;
+            std::vector<MDMemoryDescriptor64> rest(bulk.begin() + copied, bulk.end());
+            TrimRanges(rest, partial, pageSize, omitted);
+            bulk.resize(copied);
+            if (partial)
+                bulk.push_back(rest[0]);
+            if (!output->Skip(bulkSize - written)) {
+                std::wstring sMsg = FormatErrorMsg(errno);
+                SetProgress(L"Error writing dump.", 0, false);
+                SetProgress(sMsg, 0, false);
+                goto cleanup;
+            }
+        }
+        if (!omitted.empty()) {
+            uint64_t omittedSize = 0;
+            for (size_t i = 0; i < omitted.size(); ++i)
+                omittedSize += omitted[i].data_size;
+            wchar_t sMsg[96];
+            swprintf(sMsg, sizeof(sMsg) / sizeof(wchar_t), L"Dump budget ran low, left out %llu bytes of memory.",
+                     static_cast<unsigned long long>(omittedSize));
+            SetProgress(sMsg, 0, false);
+            // Later deltas would be missing the memory left out here
+            if (m_bIncremental)
+                m_nSequence = -1;
+        }
+
+        if (!m_bLowPause) {
+            // Start tracking writes for the next delta while the target is still stopped
+            if (m_bIncremental && m_nSoftDirty == 1 && !ClearSoftDirty(m_dwProcessId)) {
+                SetProgress(L"Couldn't clear soft-dirty bits, next dump will be a full dump.", 0, false);
+                m_nSoftDirty = 0;
+                m_nSequence = -1;
+            }
+
+            freezer.Thaw();
+            m_budget.PauseEnded();
+            pauseEnd = std::chrono::steady_clock::now();
+            m_stats.pauseTime = std::chrono::duration_cast<std::chrono::microseconds>(pauseEnd - pauseStart).count();
+        }
+        m_stats.captureTime = std::chrono::duration_cast<std::chrono::microseconds>(pauseStart.time_since_epoch()).count();
+
+        if (bReread) {
+            phaseStart = ProfileStart();
+
+            // Without soft-dirty bits the pages changed since they were
+            // copied are found while the target runs, which narrows the
+            // window to the rehash but can miss pages written during it.
+            if (m_nSoftDirty == 0)
+                CollectChangedPages(m_dwProcessId, bulk, pageSize, copyHashes, fixups);
+
+            std::chrono::steady_clock::time_point fixupStart = std::chrono::steady_clock::now();
+            if (!m_budget.AllowsPause()) {
+                SetProgress(L"Dump budget ran low, leaving changed pages as copied.", 0, false);
+                fixups.clear();
+            } else if (freezer.Freeze()) {
+                m_budget.PauseStarted();
+                if (m_nSoftDirty == 1)
+                    CollectWrittenPages(m_dwProcessId, bulk, pageSize, fixups);
+                uint64_t fixupSize = 0;
+                for (size_t i = 0; i < fixups.size(); ++i)
+                    fixupSize += fixups[i].data_size;
+                if (fixupSize > kMaxFixupSize || fixups.size() > kMaxFixupRanges) {
+                    SetProgress(L"Too many pages changed during the copy, leaving them as copied.", 0, false);
+                    fixups.clear();
+                    fixupSize = 0;
+                }
+                fixupData.resize(size_t(fixupSize));
+                size_t pos = 0;
+                for (size_t i = 0; i < fixups.size(); ++i) {
+                    ReadProcessMemory(m_dwProcessId, fixups[i].start_of_memory_range, &fixupData[pos], size_t(fixups[i].data_size));
+                    pos += size_t(fixups[i].data_size);
+                }
+                freezer.Thaw();
+                m_budget.PauseEnded();
+            } else {
+                SetProgress(L"Couldn't stop the target again to re-read changed pages.", 0, false);
+                fixups.clear();
+            }
+            m_stats.pauseTime += std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - fixupStart).count();
+            m_stats.fixupBytes = fixupData.size();
+            ProfileEnd(PhaseFixups, phaseStart, fixupData.size());
+        }
+
+        if (bReread || bBudget) {
+            // Directory, fixup list, omitted memory, the memory list of
+            // what was copied and fixup data follow the memory data
+            uint32_t count = stream + (bReread ? 1 : 0) + (bBudget ? 1 : 0);
+            std::sort(omitted.begin(), omitted.end(), StartsBefore);
+            std::vector<char> tail(size_t(TailSize(count, bReread, fixups.size(), bBudget, omitted.size(), bulk.size())));
+            MDRawDirectory * dir = reinterpret_cast<MDRawDirectory *>(&tail[0]);
+            memcpy(dir, blob.At<MDRawDirectory>(dirRva), sizeof(MDRawDirectory) * stream);
+            size_t pos = sizeof(MDRawDirectory) * count;
+            uint32_t next = stream;
+            if (bReread) {
+                uint32_t size = uint32_t(sizeof(MDRawPageFixups) + fixups.size() * sizeof(MDMemoryDescriptor64));
+                dir[next].stream_type = MD_DUMPPER_PAGE_FIXUPS;
+                dir[next].location.data_size = size;
+                dir[next].location.rva = uint32_t(tailRva + pos);
+                MDRawPageFixups * list = reinterpret_cast<MDRawPageFixups *>(&tail[pos]);
+                list->range_count = fixups.size();
+                list->base_rva = tailRva + tail.size();
+                if (!fixups.empty())
+                    memcpy(list + 1, &fixups[0], fixups.size() * sizeof(MDMemoryDescriptor64));
+                pos += size;
+                ++next;
+            }
+            if (bBudget) {
+                uint32_t size = uint32_t(sizeof(MDRawOmittedMemory) + omitted.size() * sizeof(MDMemoryDescriptor64));
+                dir[next].stream_type = MD_DUMPPER_OMITTED_MEMORY;
+                dir[next].location.data_size = size;
+                dir[next].location.rva = uint32_t(tailRva + pos);
+                MDRawOmittedMemory * info = reinterpret_cast<MDRawOmittedMemory *>(&tail[pos]);
+                info->reasons = omitted.empty() ? 0 : m_budget.Reasons();
+                info->range_count = omitted.size();
+                if (!omitted.empty())
+                    memcpy(info + 1, &omitted[0], omitted.size() * sizeof(MDMemoryDescriptor64));
+                pos += size;
+                ++next;
+
+                size = uint32_t(sizeof(uint64_t) * 2 + bulk.size() * sizeof(MDMemoryDescriptor64));
+                dir[memoryStream].location.data_size = size;
+                dir[memoryStream].location.rva = uint32_t(tailRva + pos);
+                uint64_t * list = reinterpret_cast<uint64_t *>(&tail[pos]);
+                list[0] = bulk.size();
+                list[1] = memoryRva;
+                if (!bulk.empty())
+                    memcpy(&list[2], &bulk[0], bulk.size() * sizeof(MDMemoryDescriptor64));
+            }
+            if (!output->Write(&tail[0], tail.size())
+                    || (!fixupData.empty() && !output->Write(&fixupData[0], fixupData.size()))) {
+                std::wstring sMsg = FormatErrorMsg(errno);
+                SetProgress(L"Error writing dump.", 0, false);
+                SetProgress(sMsg, 0, false);
+                goto cleanup;
+            }
+        }
+
+        // Through the sink, so it comes after the progress posted before it
+        wchar_t sPaused[96];
+        if (bReread)
+            swprintf(sPaused, sizeof(sPaused) / sizeof(wchar_t), L"Paused target for %.2f ms, re-read %llu bytes",
+                     m_stats.pauseTime / 1000.0, m_stats.fixupBytes);
+        else if (m_bLowPause)
+            swprintf(sPaused, sizeof(sPaused) / sizeof(wchar_t), L"Paused target for %.2f ms", m_stats.pauseTime / 1000.0);
+        else
+            swprintf(sPaused, sizeof(sPaused) / sizeof(wchar_t), L"Paused target for %lld ms", m_stats.pauseTime / 1000);
+        SetProgress(sPaused, 0, false);
+    }
+
+    phaseStart = ProfileStart();
+    if (!output->Finish()) {
+        std::wstring sMsg = FormatErrorMsg(errno);
+        SetProgress(L"Error writing dump.", 0, false);
+        SetProgress(sMsg, 0, false);
+        goto cleanup;
+    }
+    ProfileEnd(PhaseFlush, phaseStart);
+    m_stats.bytesWritten = output->Size();
+    m_stats.wallTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - wallStart).count();
+
+    if (m_bIncremental) {
+        if (!bDelta)
+            m_nBaseTimeStamp = uint32_t(now);
+        unsigned long long layoutSize = 0;
+        m_lastLayout.clear();
+        for (size_t i = 0; i < layout.size(); ++i) {
+            m_lastLayout.push_back(std::make_pair(layout[i].start_of_memory_range, layout[i].data_size));
+            layoutSize += layout[i].data_size;
+        }
+        ++m_nSequence;
+        // Through the sink like the rest of the progress, the dump may go
+        // to the recorder rather than to a file
+        wchar_t sChanged[96];
+        swprintf(sChanged, sizeof(sChanged) / sizeof(wchar_t), L"Dumped %llu of %llu bytes of memory",
+                 static_cast<unsigned long long>(bulkSize), layoutSize);
+        SetProgress(sChanged, 0, false);
+    }
+
+    // Update progress
+    m_sLastDump = sMinidumpFile;
+    if (!m_pRecorder && !m_pStore)
+        m_sLastDump += DumpCodecExtension(m_codec);
+    bStatus = true;
+    SetProgress(L"Finished creating dump.", 100, false);
+
+cleanup:
+
+    // Close file
+    output.reset();
+
+    ProfileEnd(PhaseDump, profileStart, m_stats.bytesWritten, bStatus ? nullptr : "failed");
+
+    // A failed dump breaks the delta chain, start over with a base dump
+    if (!bStatus)
+        m_nSequence = 0;
+
+    // Progress is written while the target runs, have it out before returning
+    ProgressSink::Instance().Flush();
+
+    return bStatus;
+}
+
+bool MiniDumpper::SampleStacks(StackProfile & profile)
+{
+    ThreadFreezer freezer(m_dwProcessId);
+    if (!freezer.Freeze())
+        return false;
+
+    std::vector<ThreadState> & threads = freezer.Threads();
+    std::vector<std::vector<uint64_t> > stacks(threads.size());
+    std::vector<char> window(kSampleWindowSize);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        if (!ReadRegisters(threads[i]))
+            continue;
+#if defined(__x86_64__)
+        std::vector<uint64_t> & frames = stacks[i];
+        uint64_t sp = threads[i].regs.rsp;
+        uint64_t fp = threads[i].regs.rbp;
+        frames.push_back(threads[i].regs.rip);
+
+        // One read for the frames near the top of the stack, it stops short
+        // at the first unreadable page
+        iovec local = { window.data(), window.size() };
+        iovec remote = { reinterpret_cast<void *>(sp), window.size() };
+        ssize_t n = process_vm_readv(m_dwProcessId, &local, 1, &remote, 1, 0);
+        uint64_t windowEnd = sp + (n > 0 ? uint64_t(n) : 0);
+
+        // Each frame holds the caller's frame pointer and above it the
+        // return address. Code built without frame pointers ends the walk
+        // early or leaves out callers, it can't make it loop.
+        while (frames.size() < kMaxSampleFrames && fp != 0 && (fp & 7) == 0) {
+            uint64_t link[2];
+            if (fp >= sp && fp + sizeof(link) <= windowEnd) {
+                memcpy(link, window.data() + (fp - sp), sizeof(link));
+            } else {
+                iovec linkLocal = { link, sizeof(link) };
+                iovec linkRemote = { reinterpret_cast<void *>(fp), sizeof(link) };
+                if (process_vm_readv(m_dwProcessId, &linkLocal, 1, &linkRemote, 1, 0) != ssize_t(sizeof(link)))
+                    break;
+            }
+            if (link[1] == 0)
+                break;
+            frames.push_back(link[1]);
+            if (link[0] <= fp)
+                break;
+            fp = link[0];
+        }
+#endif
+    }
+    // Names are looked up with the target running again
+    std::vector<int> tids;
+    for (size_t i = 0; i < threads.size(); ++i)
+        tids.push_back(threads[i].tid);
+    freezer.Thaw();
+
+    for (size_t i = 0; i < tids.size(); ++i) {
+        if (stacks[i].empty())
+            continue;
+        std::unordered_map<int, std::wstring>::iterator name = m_threadNames.find(tids[i]);
+        if (name == m_threadNames.end()) {
+            std::string comm;
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", m_dwProcessId, tids[i]);
+            if (!ReadTextFile(path, comm))
+                continue;
+            while (!comm.empty() && (comm.back() == '\n' || comm.back() == ' '))
+                comm.pop_back();
+            name = m_threadNames.insert(std::make_pair(tids[i], WidenPath(comm))).first;
+        }
+        profile.Add(name->second, stacks[i].data(), stacks[i].size());
+    }
+    return true;
+}
+
+int MiniDumpper::ProcessId() const
+{
+    return m_dwProcessId;
+}
+
+DumpStats const & MiniDumpper::LastDumpStats() const
+{
+    return m_stats;
+}
+
+std::wstring const & MiniDumpper::LastDumpName() const
+{
+    return m_sLastDump;
+}
+
+std::wstring MiniDumpper::UniqueDumpName(std::wstring const & sName) const
+{
+    std::wstring sExtension = !m_pRecorder && !m_pStore ? DumpCodecExtension(m_codec) : std::wstring();
+    std::wstring sStem = sName.substr(0, sName.size() - 4);
+    std::wstring sUnique = sName;
+    for (unsigned int n = 2; ; ++n) {
+        std::wstring sPath = sUnique + sExtension;
+        FILE * file = sPath == m_sLastDump ? nullptr : OpenDumpFile(sPath, L"rb");
+        if (file)
+            fclose(file);
+        else if (sPath != m_sLastDump)
+            return sUnique;
+        sUnique = sStem + L"-" + std::to_wstring(n) + L".dmp";
+    }
+}
+
+void MiniDumpper::SetCompression(DumpCodec codec, int level)
+{
+    m_codec = codec;
+    m_nCodecLevel = level;
+}
+
+void MiniDumpper::SetLowPause(bool bLowPause, bool bReread)
+{
+    m_bLowPause = bLowPause;
+    m_bReread = bReread;
+}
+
+void MiniDumpper::SetBudget(DumpLimits const & limits)
+{
+    m_budget.SetLimits(limits);
+}
+
+void MiniDumpper::SetPolicy(DumpPolicy const & policy)
+{
+    m_policy = policy;
+}
+
+void MiniDumpper::SetRecorder(DumpRecorder * recorder)
+{
+    m_pRecorder = recorder;
+}
+
+void MiniDumpper::SetChunkStore(ChunkStore * store)
+{
+    m_pStore = store;
+}
+
+void MiniDumpper::SetProfiler(DumpProfiler * profiler)
+{
+    m_pProfiler = profiler;
+}
+
+void MiniDumpper::Attach(int pid)
+{
+    // Incremental dumps of the new process start over with a base dump
+    m_dwProcessId = pid;
+    m_nSequence = 0;
+    m_nBaseTimeStamp = 0;
+    m_nSoftDirty = -1;
+    m_lastLayout.clear();
+    m_pageHashes.clear();
+    m_threadNames.clear();
+}
+
+void MiniDumpper::SetReadThreads(unsigned int threads)
+{
+    MemoryReader::SetThreads(threads);
+}
+
+void MiniDumpper::SetIncremental(bool bIncremental)
+{
+    m_bIncremental = bIncremental;
+    m_nSequence = 0;
+}
+
+bool MiniDumpper::SetDumpPrivileges()
+{
+    // Yama may restrict ptrace to descendants, tell the user why attaching fails
+    std::string scope;
+    if (ReadTextFile("/proc/sys/kernel/yama/ptrace_scope", scope) && atoi(scope.c_str()) > 0 && geteuid() != 0) {
+        SetProgress(L"SetDumpPrivileges: ptrace_scope is restricted, run as root or with CAP_SYS_PTRACE", 0);
+        return false;
+    }
+    return true;
+}
+
+void MiniDumpper::SetProgress(const wchar_t * sStatusMsg, int percentCompleted, bool bRelative,
+                              const wchar_t * sDetail)
+{
+    ProgressSink::Instance().Post(m_dwProcessId, sStatusMsg, percentCompleted, sDetail);
+}
+
+void MiniDumpper::SetProgress(std::wstring const & sStatusMsg, int percentCompleted, bool bRelative)
+{
+    SetProgress(sStatusMsg.c_str(), percentCompleted, bRelative);
+}
+
+bool MiniDumpper::IsCancelled()
+{
+    return m_budget.IsExhausted();
+}
+
+long long MiniDumpper::ProfileStart() const
+{
+    return m_pProfiler ? DumpProfiler::Now() : 0;
+}
+
+void MiniDumpper::ProfileEnd(DumpPhase phase, long long start, unsigned long long bytes, const char * name)
+{
+    if (m_pProfiler)
+        m_pProfiler->Record(phase, m_dwProcessId, start, DumpProfiler::Now(), bytes, name);
+}
+
+std::wstring MiniDumpper::FormatErrorMsg(unsigned long dwErrorCode)
+{
+    const char * msg = strerror(int(dwErrorCode));
+    std::wstring str(msg, msg + strlen(msg));
+    return str;
+}
+
+int MiniDumpper::FindProcessId(std::wstring const & name)
+{
+    int pid = 0;
+    std::vector<ProcessInfo> matches = ProcessIndex::Instance().Find(name);
+    for (size_t i = 0; i < matches.size(); ++i)
+        wprintf(L"Process %d\n", matches[i].pid);
+    // Matches are sorted newest first
+    if (!matches.empty())
+        pid = matches[0].pid;
+    return pid;
+}
@@ -0,0 +1,179 @@
+#include "multidumpper.h"
+#include "processindex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+long long SteadyMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+MultiDumpper::MultiDumpper(std::vector<std::wstring> const & targets, unsigned int threads)
+    : m_targets(targets)
+    , m_nThreads(threads)
+    , m_bIncremental(false)
+    , m_codec(NoCodec)
+    , m_nCodecLevel(0)
+    , m_bLowPause(false)
+    , m_bReread(false)
+    , m_pProfiler(nullptr)
+    , m_pStore(nullptr)
+{
+    memset(&m_limits, 0, sizeof(m_limits));
+
+    std::unique_ptr<ProcessWatcher> watcher;
+    m_watches.resize(m_targets.size(), 0);
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        wchar_t * end = nullptr;
+        long pid = wcstol(m_targets[i].c_str(), &end, 10);
+        if (pid > 0 && *end == 0)
+            continue;
+        if (!watcher)
+            watcher.reset(new ProcessWatcher);
+        if (!watcher->IsEventDriven())
+            return;
+        m_watches[i] = watcher->Watch(m_targets[i]);
+    }
+    m_pWatcher.swap(watcher);
+}
+
+void MultiDumpper::SetIncremental(bool bIncremental)
+{
+    m_bIncremental = bIncremental;
+}
+
+void MultiDumpper::SetCompression(DumpCodec codec, int level)
+{
+    m_codec = codec;
+    m_nCodecLevel = level;
+}
+
+void MultiDumpper::SetLowPause(bool bLowPause, bool bReread)
+{
+    m_bLowPause = bLowPause;
+    m_bReread = bReread;
+}
+
+void MultiDumpper::SetProfiler(DumpProfiler * profiler)
+{
+    m_pProfiler = profiler;
+}
+
+void MultiDumpper::SetBudget(DumpLimits const & limits)
+{
+    m_limits = limits;
+}
+
+void MultiDumpper::SetPolicy(DumpPolicy const & policy)
+{
+    m_policy = policy;
+}
+
+void MultiDumpper::SetChunkStore(ChunkStore * store)
+{
+    m_pStore = store;
+}
+
+std::vector<int> MultiDumpper::ResolveTargets()
+{
+    // Takes in the starts and exits since the last round
+    bool bInterrupted = false;
+    if (m_pWatcher)
+        m_pWatcher->Wait(0, bInterrupted);
+
+    std::vector<int> pids;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        wchar_t * end = nullptr;
+        long pid = wcstol(m_targets[i].c_str(), &end, 10);
+        if (pid > 0 && *end == 0) {
+            pids.push_back(int(pid));
+            continue;
+        }
+        std::vector<ProcessInfo> matches = m_pWatcher ? m_pWatcher->Processes(m_watches[i])
+                                                      : ProcessIndex::Instance().Find(m_targets[i]);
+        if (matches.empty())
+            wprintf(L"No process named %ls\n", m_targets[i].c_str());
+        for (size_t j = 0; j < matches.size(); ++j)
+            pids.push_back(matches[j].pid);
+    }
+    std::sort(pids.begin(), pids.end());
+    pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+    return pids;
+}
+
+bool MultiDumpper::CreateMiniDumps()
+{
+    long long start = SteadyMicroseconds();
+    std::vector<int> pids = ResolveTargets();
+    if (pids.empty())
+        return false;
+
+    // Forget processes that went away, their incremental state is useless
+    std::map<int, std::unique_ptr<MiniDumpper> > dumppers;
+    std::vector<MiniDumpper *> targets;
+    for (size_t i = 0; i < pids.size(); ++i) {
+        std::map<int, std::unique_ptr<MiniDumpper> >::iterator it = m_dumppers.find(pids[i]);
+        std::unique_ptr<MiniDumpper> dumpper;
+        if (it != m_dumppers.end()) {
+            // Set up already, setting it up again would restart its chain
+            dumpper.swap(it->second);
+        } else {
+            dumpper.reset(new MiniDumpper(pids[i]));
+            dumpper->SetIncremental(m_bIncremental);
+            dumpper->SetCompression(m_codec, m_nCodecLevel);
+            dumpper->SetLowPause(m_bLowPause, m_bReread);
+            dumpper->SetProfiler(m_pProfiler);
+            dumpper->SetBudget(m_limits);
+            dumpper->SetPolicy(m_policy);
+            dumpper->SetChunkStore(m_pStore);
+        }
+        targets.push_back(dumpper.get());
+        dumppers[pids[i]].swap(dumpper);
+    }
+    m_dumppers.swap(dumppers);
+
+    // All targets are stopped as close together as the pool allows, which
+    // keeps the snapshots of cooperating processes consistent.
+    std::vector<char> results(targets.size(), 0);
+    {
+        ThreadPool pool(m_nThreads ? std::min<unsigned int>(m_nThreads, unsigned(targets.size()))
+                                   : unsigned(targets.size()));
+        for (size_t i = 0; i < targets.size(); ++i) {
+            MiniDumpper * dumpper = targets[i];
+            char * result = &results[i];
+            pool.Submit([dumpper, result]() { *result = dumpper->CreateMiniDump(); });
+        }
+        pool.Wait();
+    }
+
+    bool ok = true;
+    long long firstCapture = 0;
+    long long lastCapture = 0;
+    wprintf(L"%8ls %6ls %10ls %10ls %14ls\n", L"pid", L"status", L"pause ms", L"wall ms", L"bytes");
+    for (size_t i = 0; i < targets.size(); ++i) {
+        DumpStats const & stats = targets[i]->LastDumpStats();
+        wprintf(L"%8d %6ls %10.2f %10.1f %14llu\n", targets[i]->ProcessId(),
+                results[i] ? L"ok" : L"failed", stats.pauseTime / 1000.0,
+                stats.wallTime / 1000.0, stats.bytesWritten);
+        if (!results[i]) {
+            ok = false;
+            continue;
+        }
+        if (firstCapture == 0 || stats.captureTime < firstCapture)
+            firstCapture = stats.captureTime;
+        lastCapture = std::max(lastCapture, stats.captureTime);
+    }
+    wprintf(L"Dumped %d processes in %.1f ms, capture skew %.1f ms\n", int(targets.size()),
+            (SteadyMicroseconds() - start) / 1000.0, (lastCapture - firstCapture) / 1000.0);
+    return ok;
+}
@@ -0,0 +1,67 @@
+#ifndef MULTIDUMPPER_H
+#define MULTIDUMPPER_H
+
+#include "minidumpper.h"
+#include "processwatcher.h"
+#include "threadpool.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Dumps several processes at once.
+//
+// Targets are pids or image names. Names are resolved again on every call,
+// so processes that restart or get spawned between two dumps are picked up.
+// Where the kernel reports process events the names are followed by a
+// ProcessWatcher, which saves scanning the process list every round.
+// Each process keeps its own MiniDumpper, which keeps incremental dumps
+// working across calls.
+class MultiDumpper
+{
+public:
+    // threads == 0 dumps all processes at once
+    MultiDumpper(std::vector<std::wstring> const & targets, unsigned int threads = 0);
+
+public:
+    // Dumps every matching process, returns false if any dump failed
+    bool CreateMiniDumps();
+
+    void SetIncremental(bool bIncremental);
+
+    void SetCompression(DumpCodec codec, int level);
+
+    void SetLowPause(bool bLowPause, bool bReread);
+
+    void SetProfiler(DumpProfiler * profiler);
+
+    // Limits every dump of the round on its own
+    void SetBudget(DumpLimits const & limits);
+
+    void SetPolicy(DumpPolicy const & policy);
+
+    // All targets share the store, identical workers share their chunks
+    void SetChunkStore(ChunkStore * store);
+
+private:
+    std::vector<int> ResolveTargets();
+
+private:
+    std::vector<std::wstring> m_targets;
+    unsigned int m_nThreads;
+    bool m_bIncremental;
+    DumpCodec m_codec;
+    int m_nCodecLevel;
+    bool m_bLowPause;
+    bool m_bReread;
+    DumpProfiler * m_pProfiler;
+    DumpLimits m_limits;
+    DumpPolicy m_policy;
+    ChunkStore * m_pStore;
+    std::map<int, std::unique_ptr<MiniDumpper> > m_dumppers;
+    std::unique_ptr<ProcessWatcher> m_pWatcher; // nullptr without events
+    std::vector<size_t> m_watches;              // by target, for names
+};
+
+#endif // MULTIDUMPPER_H
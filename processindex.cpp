@@ -0,0 +1,311 @@
+#include "processindex.h"
+#include "dumpoutput.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <TlHelp32.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+// Every so many refreshes all processes are read again, this discovers
+// processes that got a pid the last scan had seen. Find checks what it
+// returns on its own.
+const unsigned int kFullRescanInterval = 16;
+
+bool NewerFirst(ProcessInfo const & a, ProcessInfo const & b)
+{
+    return a.startTime > b.startTime;
+}
+
+#ifndef _WIN32
+// The kernel truncates comm to 15 characters
+const size_t kCommLength = 15;
+
+std::vector<int> ListProcesses()
+{
+    std::vector<int> pids;
+    DIR * dir = opendir("/proc");
+    if (dir == nullptr)
+        return pids;
+    while (dirent * entry = readdir(dir)) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+            continue;
+        pids.push_back(atoi(entry->d_name));
+    }
+    closedir(dir);
+    return pids;
+}
+
+// Full image name for processes whose comm got truncated
+std::wstring ReadImageName(int pid)
+{
+    char path[64];
+    char exe[4096];
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    ssize_t n = readlink(path, exe, sizeof(exe) - 1);
+    if (n <= 0) {
+        // Not allowed to follow exe of other users' processes, try argv[0]
+        snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return std::wstring();
+        n = read(fd, exe, sizeof(exe) - 1);
+        close(fd);
+        if (n <= 0)
+            return std::wstring();
+    }
+    exe[n] = 0;
+    const char * base = strrchr(exe, '/');
+    return WidenPath(base ? base + 1 : exe);
+}
+
+// Name and start time from /proc/<pid>/stat
+bool ReadProcess(int pid, ProcessInfo & info)
+{
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    stat[n] = 0;
+
+    // pid (comm) state ppid ..., comm may contain spaces and parentheses
+    char * lparen = strchr(stat, '(');
+    char * rparen = strrchr(stat, ')');
+    if (lparen == nullptr || rparen == nullptr || rparen < lparen)
+        return false;
+    *rparen = 0;
+    info.pid = pid;
+    info.name = WidenPath(lparen + 1);
+    info.startTime = 0;
+    // start time is field 22, the 20th after comm
+    sscanf(rparen + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+           &info.startTime);
+    return true;
+}
+#endif
+
+} // namespace
+
+ProcessIndex::ProcessIndex(unsigned int threads)
+    : m_nThreads(threads ? threads : std::thread::hardware_concurrency())
+    , m_nRefreshes(0)
+{
+    if (m_nThreads == 0)
+        m_nThreads = 1;
+}
+
+ProcessIndex & ProcessIndex::Instance()
+{
+    static ProcessIndex index;
+    return index;
+}
+
+std::vector<ProcessInfo> ProcessIndex::Find(std::wstring const & name, bool bRefresh)
+{
+    if (bRefresh)
+        Refresh();
+
+    // A cached pid may belong to another process by now, every match is
+    // checked against the process running under it before it is returned
+    std::vector<ProcessInfo> matches;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::unordered_map<int, ProcessInfo>::iterator it = m_processes.begin(); it != m_processes.end();) {
+        ProcessInfo & info = it->second;
+        if (!NameMatches(info, name)) {
+            ++it;
+            continue;
+        }
+#ifdef _WIN32
+        // Only matches are opened, the name is as fresh as the snapshot
+        HANDLE hProc = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, info.pid);
+        if (hProc) {
+            FILETIME creation, exit, kernel, user;
+            if (GetProcessTimes(hProc, &creation, &exit, &kernel, &user))
+                info.startTime = (ULONGLONG(creation.dwHighDateTime) << 32) | creation.dwLowDateTime;
+            CloseHandle(hProc);
+        } else if (GetLastError() == ERROR_INVALID_PARAMETER) {
+            it = m_processes.erase(it);
+            continue;
+        }
+#else
+        // Another start time is another process, another comm an exec
+        ProcessInfo current;
+        if (!ReadProcess(info.pid, current)) {
+            it = m_processes.erase(it);
+            continue;
+        }
+        if (current.startTime != info.startTime || info.name.compare(0, kCommLength, current.name) != 0) {
+            info = current;
+            if (!NameMatches(info, name)) {
+                ++it;
+                continue;
+            }
+        }
+#endif
+        matches.push_back(info);
+        ++it;
+    }
+    std::sort(matches.begin(), matches.end(), NewerFirst);
+    return matches;
+}
+
+bool ProcessIndex::NameMatches(ProcessInfo & info, std::wstring const & name)
+{
+#ifdef _WIN32
+    return _wcsicmp(info.name.c_str(), name.c_str()) == 0;
+#else
+    if (info.name == name)
+        return true;
+    if (info.name.size() != kCommLength || name.compare(0, kCommLength, info.name) != 0)
+        return false;
+    info.name = ReadImageName(info.pid);
+    return info.name == name;
+#endif
+}
+
+#ifndef _WIN32
+bool ProcessIndex::ReadProcessInfo(int pid, ProcessInfo & info)
+{
+    return ReadProcess(pid, info);
+}
+#endif
+
+#ifdef _WIN32
+
+size_t ProcessIndex::Refresh()
+{
+    HANDLE hProcSnapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (INVALID_HANDLE_VALUE == hProcSnapshot)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool full = ++m_nRefreshes % kFullRescanInterval == 0;
+    std::unordered_map<int, ProcessInfo> processes;
+    PROCESSENTRY32 procEntry;
+    procEntry.dwSize = sizeof(PROCESSENTRY32);
+    if (::Process32First(hProcSnapshot, &procEntry)) {
+        do {
+            int pid = procEntry.th32ProcessID;
+            std::unordered_map<int, ProcessInfo>::iterator it = m_processes.find(pid);
+            if (!full && it != m_processes.end() && it->second.name == procEntry.szExeFile) {
+                processes[pid] = it->second;
+            } else {
+                ProcessInfo & info = processes[pid];
+                info.pid = pid;
+                info.startTime = 0;
+                info.name = procEntry.szExeFile;
+            }
+        } while (::Process32Next(hProcSnapshot, &procEntry));
+    }
+    ::CloseHandle(hProcSnapshot);
+    m_processes.swap(processes);
+    return m_processes.size();
+}
+
+#else
+
+size_t ProcessIndex::Refresh()
+{
+    std::vector<int> pids = ListProcesses();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool full = ++m_nRefreshes % kFullRescanInterval == 0;
+    std::unordered_map<int, ProcessInfo> processes;
+    std::vector<int> fresh;
+    for (size_t i = 0; i < pids.size(); ++i) {
+        std::unordered_map<int, ProcessInfo>::iterator it = m_processes.find(pids[i]);
+        if (!full && it != m_processes.end())
+            processes[pids[i]] = it->second;
+        else
+            fresh.push_back(pids[i]);
+    }
+
+    // Read the new processes in parallel, a cold scan of a host with
+    // thousands of processes is dominated by the per-file syscalls.
+    std::vector<ProcessInfo> infos(fresh.size());
+    std::vector<char> found(fresh.size(), 0);
+    size_t threads = std::min<size_t>(m_nThreads, (fresh.size() + 255) / 256);
+    if (threads <= 1) {
+        for (size_t i = 0; i < fresh.size(); ++i)
+            found[i] = ReadProcess(fresh[i], infos[i]);
+    } else {
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.push_back(std::thread([&fresh, &infos, &found, t, threads]() {
+                for (size_t i = t; i < fresh.size(); i += threads)
+                    found[i] = ReadProcess(fresh[i], infos[i]);
+            }));
+        }
+        for (size_t t = 0; t < threads; ++t)
+            workers[t].join();
+    }
+    for (size_t i = 0; i < fresh.size(); ++i) {
+        if (found[i])
+            processes[fresh[i]] = infos[i];
+    }
+    m_processes.swap(processes);
+    return m_processes.size();
+}
+#endif
+
+void BenchmarkProcessIndex(std::vector<int> const & counts)
+{
+    typedef std::chrono::steady_clock Clock;
+#ifndef _WIN32
+    std::vector<pid_t> children;
+#endif
+    wprintf(L"%10ls %12ls %12ls\n", L"processes", L"cold ms", L"warm ms");
+    for (size_t c = 0; c < counts.size(); ++c) {
+#ifndef _WIN32
+        // Spawn idle processes until the host runs the requested number
+        for (int n = int(ListProcesses().size()); n < counts[c]; ++n) {
+            pid_t child = fork();
+            if (child == 0) {
+                pause();
+                _exit(0);
+            }
+            if (child < 0)
+                break;
+            children.push_back(child);
+        }
+#endif
+        ProcessIndex index;
+        Clock::time_point start = Clock::now();
+        index.Find(L"no-such-process");
+        Clock::time_point cold = Clock::now();
+        const int warmRuns = 10;
+        for (int i = 0; i < warmRuns; ++i)
+            index.Find(L"no-such-process");
+        Clock::time_point warm = Clock::now();
+        wprintf(L"%10d %12.3f %12.3f\n", int(index.Refresh()),
+                std::chrono::duration<double, std::milli>(cold - start).count(),
+                std::chrono::duration<double, std::milli>(warm - cold).count() / warmRuns);
+    }
+#ifndef _WIN32
+    for (size_t i = 0; i < children.size(); ++i)
+        kill(children[i], SIGKILL);
+    for (size_t i = 0; i < children.size(); ++i)
+        waitpid(children[i], nullptr, 0);
+#endif
+}
@@ -0,0 +1,64 @@
+#ifndef PROCESSINDEX_H
+#define PROCESSINDEX_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ProcessInfo
+{
+    int pid;
+    unsigned long long startTime; // clock ticks since boot on Linux, FILETIME on Windows
+    std::wstring name;
+};
+
+// Finds processes by image name without opening every process.
+//
+// On Linux the name comes from /proc/<pid>/stat, which also holds the start
+// time, so one small read per process is enough. New pids are read in
+// parallel. On Windows szExeFile from a single process snapshot is used
+// and only matches are opened for their start time.
+//
+// Results are cached between calls, only processes that appeared since the
+// last scan are read again. Matches are checked against the running
+// process before they are returned, so a reused pid is never reported
+// under the name of the process that had it before.
+class ProcessIndex
+{
+public:
+    explicit ProcessIndex(unsigned int threads = 0);
+
+public:
+    // All processes named name, newest first. Without bRefresh only the
+    // processes of the last scan are searched.
+    std::vector<ProcessInfo> Find(std::wstring const & name, bool bRefresh = true);
+
+    // Rescans the process list, returns the number of processes
+    size_t Refresh();
+
+    // Index shared by everything in this process
+    static ProcessIndex & Instance();
+
+    // Whether info is the process named name. On Linux a truncated comm
+    // is replaced by the full image name when it could match.
+    static bool NameMatches(ProcessInfo & info, std::wstring const & name);
+
+#ifndef _WIN32
+    // Reads a single process, e.g. one a process event announced. False
+    // once it is gone.
+    static bool ReadProcessInfo(int pid, ProcessInfo & info);
+#endif
+
+private:
+    unsigned int m_nThreads;
+    unsigned int m_nRefreshes;
+    std::mutex m_mutex;
+    std::unordered_map<int, ProcessInfo> m_processes;
+};
+
+// Prints lookup latency against the number of running processes, spawning
+// extra idle processes on Linux to reach each count.
+void BenchmarkProcessIndex(std::vector<int> const & counts);
+
+#endif // PROCESSINDEX_H
@@ -0,0 +1,426 @@
+#include "processwatcher.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+// How often names without a process are looked for when the kernel
+// doesn't report starts
+const long long kRescanMilliseconds = 500;
+
+long long SteadyMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool NewerFirst(ProcessInfo const & a, ProcessInfo const & b)
+{
+    return a.startTime > b.startTime;
+}
+
+} // namespace
+
+ProcessWatcher::ProcessWatcher()
+    : m_nNextRescan(0)
+{
+#ifndef _WIN32
+    m_netlink = -1;
+    if (!Subscribe() && m_netlink >= 0) {
+        close(m_netlink);
+        m_netlink = -1;
+    }
+#endif
+}
+
+ProcessWatcher::~ProcessWatcher()
+{
+#ifdef _WIN32
+    for (std::map<int, void *>::iterator it = m_handles.begin(); it != m_handles.end(); ++it)
+        CloseHandle(it->second);
+#else
+    for (std::map<int, int>::iterator it = m_pidfds.begin(); it != m_pidfds.end(); ++it)
+        close(it->second);
+    if (m_netlink >= 0)
+        close(m_netlink);
+#endif
+}
+
+size_t ProcessWatcher::Watch(std::wstring const & name)
+{
+    Target target;
+    target.name = name;
+    target.processes = ProcessIndex::Instance().Find(name);
+    m_targets.push_back(target);
+    SyncHandles();
+    m_nNextRescan = NeedsRescan() ? SteadyMilliseconds() + kRescanMilliseconds : 0;
+    return m_targets.size() - 1;
+}
+
+std::vector<ProcessInfo> const & ProcessWatcher::Processes(size_t watch) const
+{
+    return m_targets[watch].processes;
+}
+
+int ProcessWatcher::Newest(size_t watch) const
+{
+    return m_targets[watch].processes.empty() ? 0 : m_targets[watch].processes[0].pid;
+}
+
+bool ProcessWatcher::IsEventDriven() const
+{
+#ifdef _WIN32
+    return false;
+#else
+    return m_netlink >= 0;
+#endif
+}
+
+bool ProcessWatcher::Wait(unsigned int milliseconds, bool & bInterrupted)
+{
+    bInterrupted = false;
+    bool bChanged = false;
+    long long deadline = SteadyMilliseconds() + milliseconds;
+    for (;;) {
+        long long now = SteadyMilliseconds();
+        if (m_nNextRescan && now >= m_nNextRescan) {
+            bChanged = Rescan() || bChanged;
+            m_nNextRescan = NeedsRescan() ? now + kRescanMilliseconds : 0;
+        }
+        long long timeout = std::max(0LL, deadline - now);
+        if (m_nNextRescan)
+            timeout = std::min(timeout, std::max(0LL, m_nNextRescan - now));
+
+        int exited = 0;
+#ifdef _WIN32
+        // Processes beyond what one wait takes are found by the scans
+        std::vector<HANDLE> handles;
+        std::vector<int> pids;
+        for (std::map<int, void *>::iterator it = m_handles.begin();
+             it != m_handles.end() && handles.size() < MAXIMUM_WAIT_OBJECTS; ++it) {
+            pids.push_back(it->first);
+            handles.push_back(it->second);
+        }
+        DWORD result = handles.empty()
+                ? SleepEx(DWORD(timeout), TRUE)
+                : WaitForMultipleObjectsEx(DWORD(handles.size()), handles.data(), FALSE, DWORD(timeout), TRUE);
+        if (result == WAIT_IO_COMPLETION) {
+            bInterrupted = true;
+            return bChanged;
+        }
+        if (!handles.empty() && result < WAIT_OBJECT_0 + handles.size())
+            exited = pids[result - WAIT_OBJECT_0];
+#else
+        std::vector<pollfd> fds;
+        std::vector<int> pids;
+        if (m_netlink >= 0) {
+            pollfd p = { m_netlink, POLLIN, 0 };
+            fds.push_back(p);
+            pids.push_back(0);
+        }
+        for (std::map<int, int>::iterator it = m_pidfds.begin(); it != m_pidfds.end(); ++it) {
+            pollfd p = { it->second, POLLIN, 0 };
+            fds.push_back(p);
+            pids.push_back(it->first);
+        }
+        int result = poll(fds.data(), fds.size(), int(timeout));
+        if (result < 0 && errno == EINTR) {
+            bInterrupted = true;
+            return bChanged;
+        }
+        for (size_t i = 0; i < fds.size() && result > 0; ++i) {
+            if (!fds[i].revents)
+                continue;
+            if (pids[i] != 0) {
+                exited = pids[i];
+            } else if (!ReadEvents(bChanged)) {
+                // The socket overflowed, only a scan tells what was missed
+                wprintf(L"Process events were lost, rescanning\n");
+                m_nNextRescan = now;
+            }
+        }
+#endif
+        if (exited) {
+            bChanged = Remove(exited) || bChanged;
+            // A replacement may already be running
+            if (!IsEventDriven())
+                m_nNextRescan = now;
+        }
+        if (bChanged || SteadyMilliseconds() >= deadline)
+            return bChanged;
+    }
+}
+
+bool ProcessWatcher::Rescan()
+{
+    ProcessIndex & index = ProcessIndex::Instance();
+    index.Refresh();
+    bool bChanged = false;
+    std::map<int, unsigned long long> exited;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        std::vector<ProcessInfo> processes = index.Find(m_targets[i].name, false);
+        // A process that exited is listed until its parent reaps it
+        for (size_t j = 0; j < processes.size(); ) {
+            std::map<int, unsigned long long>::iterator it = m_exited.find(processes[j].pid);
+            if (it != m_exited.end() && it->second == processes[j].startTime) {
+                exited.insert(*it);
+                processes.erase(processes.begin() + j);
+            } else {
+                ++j;
+            }
+        }
+        bool bSame = processes.size() == m_targets[i].processes.size();
+        for (size_t j = 0; bSame && j < processes.size(); ++j)
+            bSame = processes[j].pid == m_targets[i].processes[j].pid;
+        if (!bSame) {
+            m_targets[i].processes.swap(processes);
+            bChanged = true;
+        }
+    }
+    m_exited.swap(exited);
+    SyncHandles();
+    return bChanged;
+}
+
+bool ProcessWatcher::Remove(int pid)
+{
+    bool bChanged = false;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        std::vector<ProcessInfo> & processes = m_targets[i].processes;
+        for (size_t j = 0; j < processes.size(); ++j) {
+            if (processes[j].pid == pid) {
+                m_exited[pid] = processes[j].startTime;
+                processes.erase(processes.begin() + j);
+                bChanged = true;
+                break;
+            }
+        }
+    }
+    SyncHandles();
+    return bChanged;
+}
+
+bool ProcessWatcher::IsWatched(int pid) const
+{
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        for (size_t j = 0; j < m_targets[i].processes.size(); ++j) {
+            if (m_targets[i].processes[j].pid == pid)
+                return true;
+        }
+    }
+    return false;
+}
+
+void ProcessWatcher::SyncHandles()
+{
+#ifndef _WIN32
+    // The connector reports exits by itself
+    if (m_netlink >= 0)
+        return;
+#endif
+    std::set<int> pids;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        for (size_t j = 0; j < m_targets[i].processes.size(); ++j)
+            pids.insert(m_targets[i].processes[j].pid);
+    }
+#ifdef _WIN32
+    for (std::map<int, void *>::iterator it = m_handles.begin(); it != m_handles.end(); ) {
+        if (pids.count(it->first)) {
+            ++it;
+            continue;
+        }
+        CloseHandle(it->second);
+        it = m_handles.erase(it);
+    }
+    for (std::set<int>::iterator it = pids.begin(); it != pids.end(); ++it) {
+        if (m_handles.count(*it))
+            continue;
+        if (HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, *it))
+            m_handles[*it] = hProcess;
+    }
+#else
+    for (std::map<int, int>::iterator it = m_pidfds.begin(); it != m_pidfds.end(); ) {
+        if (pids.count(it->first)) {
+            ++it;
+            continue;
+        }
+        close(it->second);
+        it = m_pidfds.erase(it);
+    }
+#ifdef SYS_pidfd_open
+    for (std::set<int>::iterator it = pids.begin(); it != pids.end(); ++it) {
+        if (m_pidfds.count(*it))
+            continue;
+        int pidfd = int(syscall(SYS_pidfd_open, *it, 0));
+        if (pidfd >= 0)
+            m_pidfds[*it] = pidfd;
+    }
+#endif
+#endif
+}
+
+bool ProcessWatcher::NeedsRescan() const
+{
+    if (IsEventDriven())
+        return false;
+    size_t processes = 0;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        if (m_targets[i].processes.empty())
+            return true;
+        processes += m_targets[i].processes.size();
+    }
+#ifdef _WIN32
+    return m_handles.size() < processes || m_handles.size() > MAXIMUM_WAIT_OBJECTS;
+#else
+    return m_pidfds.size() < processes;
+#endif
+}
+
+#ifndef _WIN32
+
+bool ProcessWatcher::Subscribe()
+{
+    m_netlink = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+    if (m_netlink < 0)
+        return false;
+    sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    if (bind(m_netlink, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        return false;
+    // Busy hosts exec a lot, room for bursts keeps the scans rare
+    int bufferSize = 1 << 20;
+    setsockopt(m_netlink, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    char request[NLMSG_SPACE(sizeof(cn_msg) + sizeof(proc_cn_mcast_op))];
+    memset(request, 0, sizeof(request));
+    nlmsghdr * header = reinterpret_cast<nlmsghdr *>(request);
+    header->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+    header->nlmsg_type = NLMSG_DONE;
+    header->nlmsg_pid = getpid();
+    cn_msg * message = static_cast<cn_msg *>(NLMSG_DATA(header));
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(proc_cn_mcast_op);
+    proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+    memcpy(message->data, &op, sizeof(op));
+    if (send(m_netlink, request, header->nlmsg_len, 0) < 0)
+        return false;
+
+    // Outside the initial namespaces the kernel accepts the subscription
+    // and sends nothing, so make sure an exit gets reported
+    pid_t child = fork();
+    if (child == 0)
+        _exit(0);
+    if (child < 0)
+        return false;
+    waitpid(child, nullptr, 0);
+    long long deadline = SteadyMilliseconds() + 250;
+    for (long long now = SteadyMilliseconds(); now < deadline; now = SteadyMilliseconds()) {
+        pollfd p = { m_netlink, POLLIN, 0 };
+        if (poll(&p, 1, int(deadline - now)) <= 0)
+            continue;
+        bool bChanged = false;
+        int awaited = child;
+        ReadEvents(bChanged, &awaited);
+        if (awaited == 0)
+            return true;
+    }
+    return false;
+}
+
+bool ProcessWatcher::Consider(int pid)
+{
+    ProcessInfo info;
+    if (!ProcessIndex::ReadProcessInfo(pid, info))
+        return Remove(pid);
+    bool bChanged = false;
+    for (size_t i = 0; i < m_targets.size(); ++i) {
+        std::vector<ProcessInfo> & processes = m_targets[i].processes;
+        std::vector<ProcessInfo>::iterator it = processes.begin();
+        while (it != processes.end() && it->pid != pid)
+            ++it;
+        bool bMatches = ProcessIndex::NameMatches(info, m_targets[i].name);
+        if (bMatches && it == processes.end()) {
+            processes.insert(std::upper_bound(processes.begin(), processes.end(), info, NewerFirst), info);
+            bChanged = true;
+        } else if (!bMatches && it != processes.end()) {
+            // Replaced itself with another program
+            processes.erase(it);
+            bChanged = true;
+        }
+    }
+    return bChanged;
+}
+
+bool ProcessWatcher::ReadEvents(bool & bChanged, int * awaited)
+{
+    char buffer[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        sockaddr_nl sender;
+        socklen_t senderSize = sizeof(sender);
+        ssize_t n = recvfrom(m_netlink, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&sender), &senderSize);
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR;
+        // Only the kernel speaks for the connector
+        if (sender.nl_pid != 0)
+            continue;
+        for (nlmsghdr * header = reinterpret_cast<nlmsghdr *>(buffer); NLMSG_OK(header, n);
+             header = NLMSG_NEXT(header, n)) {
+            if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR)
+                continue;
+            cn_msg * message = static_cast<cn_msg *>(NLMSG_DATA(header));
+            if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC)
+                continue;
+            proc_event * event = reinterpret_cast<proc_event *>(message->data);
+            switch (event->what) {
+            case proc_event::PROC_EVENT_FORK:
+                // A new process starts under the name of its parent
+                if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid
+                        && IsWatched(event->event_data.fork.parent_tgid))
+                    bChanged = Consider(event->event_data.fork.child_tgid) || bChanged;
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+                bChanged = Consider(event->event_data.exec.process_tgid) || bChanged;
+                break;
+            case proc_event::PROC_EVENT_COMM:
+                if (event->event_data.comm.process_pid == event->event_data.comm.process_tgid)
+                    bChanged = Consider(event->event_data.comm.process_tgid) || bChanged;
+                break;
+            case proc_event::PROC_EVENT_EXIT:
+                // Threads exit too, only the group leader ends the process
+                if (event->event_data.exit.process_pid != event->event_data.exit.process_tgid)
+                    break;
+                if (awaited && event->event_data.exit.process_tgid == *awaited)
+                    *awaited = 0;
+                bChanged = Remove(event->event_data.exit.process_tgid) || bChanged;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef PROCESSWATCHER_H
+#define PROCESSWATCHER_H
+
+#include "processindex.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Follows processes by name while they exit and start again.
+//
+// On Linux the kernel's process connector reports every exec, fork and
+// exit over netlink, so a watcher only wakes up when a process starts or
+// goes away and costs nothing in between, however many names it watches.
+// Some kernels report only to privileged processes outside containers.
+// Without the events, and on Windows, exits are waited for on a pidfd or
+// process handle, and the process list is scanned again only while a
+// watched name has no process.
+//
+// Not thread safe.
+class ProcessWatcher
+{
+public:
+    ProcessWatcher();
+
+    ~ProcessWatcher();
+
+public:
+    // Starts watching name, returns the index of the watch
+    size_t Watch(std::wstring const & name);
+
+    // The processes of a watch, newest first
+    std::vector<ProcessInfo> const & Processes(size_t watch) const;
+
+    // The newest process of a watch, 0 while none runs
+    int Newest(size_t watch) const;
+
+    // Waits up to milliseconds for a watched process to start or exit,
+    // returns true as soon as one did. bInterrupted is set when a signal
+    // cut the wait short. 0 only takes in what happened so far.
+    bool Wait(unsigned int milliseconds, bool & bInterrupted);
+
+    // Whether starts are reported by the kernel instead of found by scans
+    bool IsEventDriven() const;
+
+private:
+    struct Target
+    {
+        std::wstring name;
+        std::vector<ProcessInfo> processes; // newest first
+    };
+
+    // Looks for the watched names in a fresh process list
+    bool Rescan();
+
+    // Drops a process that exited
+    bool Remove(int pid);
+
+    bool IsWatched(int pid) const;
+
+    // Opens exit handles for new processes and closes those of old ones
+    void SyncHandles();
+
+    // Without events a scan is due while a name has no process or a
+    // process can't be waited for
+    bool NeedsRescan() const;
+
+#ifndef _WIN32
+    bool Subscribe();
+
+    // Handles the queued process events, false when events were lost.
+    // awaited is cleared once its exit was reported.
+    bool ReadEvents(bool & bChanged, int * awaited = nullptr);
+
+    // Adds or drops pid wherever its name now says it belongs
+    bool Consider(int pid);
+#endif
+
+private:
+    std::vector<Target> m_targets;
+#ifdef _WIN32
+    std::map<int, void *> m_handles;
+#else
+    int m_netlink;              // -1 without the process connector
+    std::map<int, int> m_pidfds; // without the connector only
+#endif
+    long long m_nNextRescan;    // steady clock milliseconds, 0 for none
+    std::map<int, unsigned long long> m_exited; // start times, scans may still list them
+};
+
+#endif // PROCESSWATCHER_H
@@ -0,0 +1,209 @@
+#include "progresssink.h"
+#include "dumpoutput.h"
+#include "fonttext.h"
+
+#include <chrono>
+#include <stdint.h>
+#include <wchar.h>
+
+namespace {
+
+// How long the drain thread sleeps when the ring is empty. Posting never
+// wakes it, that would cost a system call on the dump path.
+const std::chrono::milliseconds kDrainInterval(2);
+
+void AppendText(wchar_t * out, size_t size, size_t & pos, const wchar_t * text)
+{
+    while (*text && pos + 1 < size)
+        out[pos++] = *text++;
+}
+
+void AppendJsonString(std::wstring & line, const wchar_t * text)
+{
+    line += L'"';
+    for (; *text; ++text) {
+        if (*text == L'"' || *text == L'\\') {
+            line += L'\\';
+            line += *text;
+        } else if (static_cast<unsigned long>(*text) < 0x20) {
+            wchar_t escape[8];
+            swprintf(escape, sizeof(escape) / sizeof(wchar_t), L"\\u%04x", unsigned(*text));
+            line += escape;
+        } else {
+            line += *text;
+        }
+    }
+    line += L'"';
+}
+
+} // namespace
+
+ProgressSink::ProgressSink(size_t capacity)
+    : m_nMask(0)
+    , m_nEnqueuePos(0)
+    , m_nDequeuePos(0)
+    , m_nDropped(0)
+    , m_nReported(0)
+    , m_file(nullptr)
+    , m_format(ProgressText)
+    , m_bStop(false)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    m_slots = std::vector<Slot>(size);
+    for (size_t i = 0; i < size; ++i)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    m_nMask = size - 1;
+    m_thread = std::thread(&ProgressSink::Run, this);
+}
+
+ProgressSink::~ProgressSink()
+{
+    m_bStop = true;
+    m_wake.notify_one();
+    m_thread.join();
+    if (m_file)
+        fclose(m_file);
+}
+
+ProgressSink & ProgressSink::Instance()
+{
+    static ProgressSink sink;
+    return sink;
+}
+
+bool ProgressSink::Open(std::wstring const & path, ProgressFormat format)
+{
+    FILE * file = nullptr;
+    if (!path.empty()) {
+        file = OpenDumpFile(path, L"wb");
+        if (file == nullptr)
+            return false;
+    }
+    Flush();
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    if (m_file)
+        fclose(m_file);
+    m_file = file;
+    m_format = format;
+    return true;
+}
+
+bool ProgressSink::Post(int pid, const wchar_t * message, int percent, const wchar_t * detail)
+{
+    size_t pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+    Slot * slot;
+    for (;;) {
+        slot = &m_slots[pos & m_nMask];
+        intptr_t diff = intptr_t(slot->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+        if (diff == 0) {
+            if (m_nEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Still holds a message the drain thread hasn't written
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    Event & event = slot->event;
+    event.time = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    event.pid = pid;
+    event.percent = percent;
+    size_t length = 0;
+    const size_t size = sizeof(event.text) / sizeof(event.text[0]);
+    AppendText(event.text, size, length, message);
+    if (detail) {
+        AppendText(event.text, size, length, L" ");
+        AppendText(event.text, size, length, detail);
+    }
+    event.text[length] = 0;
+
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void ProgressSink::Flush()
+{
+    size_t target = m_nEnqueuePos.load(std::memory_order_acquire);
+    while (m_nDequeuePos.load(std::memory_order_acquire) < target) {
+        m_wake.notify_one();
+        std::this_thread::yield();
+    }
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    fflush(m_file ? m_file : stdout);
+}
+
+unsigned long long ProgressSink::Dropped() const
+{
+    return m_nDropped.load(std::memory_order_relaxed);
+}
+
+void ProgressSink::Run()
+{
+    for (;;) {
+        bool bStop = m_bStop;
+        bool bWrote = false;
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            for (;;) {
+                size_t pos = m_nDequeuePos.load(std::memory_order_relaxed);
+                Slot & slot = m_slots[pos & m_nMask];
+                if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+                    break;
+                Write(slot.event);
+                slot.sequence.store(pos + m_nMask + 1, std::memory_order_release);
+                m_nDequeuePos.store(pos + 1, std::memory_order_release);
+                bWrote = true;
+            }
+            if (bWrote)
+                fflush(m_file ? m_file : stdout);
+        }
+        if (bStop)
+            break;
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_wake.wait_for(lock, kDrainInterval);
+    }
+}
+
+void ProgressSink::Write(Event const & event)
+{
+    std::wstring line;
+    unsigned long long dropped = Dropped();
+    if (dropped != m_nReported) {
+        wchar_t text[64];
+        if (m_format == ProgressJson)
+            swprintf(text, sizeof(text) / sizeof(wchar_t), L"{\"dropped\":%llu}\n", dropped - m_nReported);
+        else
+            swprintf(text, sizeof(text) / sizeof(wchar_t), L"Dropped %llu progress messages\n", dropped - m_nReported);
+        line = text;
+        m_nReported = dropped;
+    }
+
+    if (m_format == ProgressJson) {
+        wchar_t fields[96];
+        swprintf(fields, sizeof(fields) / sizeof(wchar_t), L"{\"time_us\":%lld,\"pid\":%d,\"percent\":%d,\"message\":",
+                 event.time, event.pid, event.percent);
+        line += fields;
+        AppendJsonString(line, event.text);
+        line += L"}\n";
+    } else {
+        line += L"Progress ";
+        line += event.text;
+        wchar_t percent[16];
+        swprintf(percent, sizeof(percent) / sizeof(wchar_t), L" %i\n", event.percent);
+        line += percent;
+    }
+
+    if (m_file) {
+        std::string utf8;
+        FontText::WideToUtf8(line, utf8);
+        fwrite(utf8.data(), 1, utf8.size(), m_file);
+    } else {
+        fputws(line.c_str(), stdout);
+    }
+}
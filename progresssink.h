@@ -0,0 +1,87 @@
+#ifndef PROGRESSSINK_H
+#define PROGRESSSINK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+
+enum ProgressFormat
+{
+    ProgressText, // "Progress <message> <percent>" lines
+    ProgressJson  // one JSON object per line
+};
+
+// Takes progress messages off the dump path.
+//
+// Posting copies the message into a slot of a fixed ring, claimed with a
+// compare-and-swap, and returns: no allocation, lock or I/O. A background
+// thread drains the ring to the console or a file. When the ring is full
+// messages are dropped and counted, the count is reported with the next
+// message that makes it through.
+class ProgressSink
+{
+public:
+    // capacity is rounded up to a power of two
+    explicit ProgressSink(size_t capacity = 1024);
+
+    ~ProgressSink();
+
+public:
+    // Writes to path from now on, or to the console when path is empty
+    bool Open(std::wstring const & path, ProgressFormat format);
+
+    // Queues "<message> <detail> <percent>" for pid, messages longer than a
+    // slot are cut. Returns false if the message was dropped.
+    bool Post(int pid, const wchar_t * message, int percent, const wchar_t * detail = nullptr);
+
+    // Blocks until everything posted so far has been written
+    void Flush();
+
+    unsigned long long Dropped() const;
+
+    // Sink shared by everything in this process, writes text to the console
+    static ProgressSink & Instance();
+
+private:
+    struct Event
+    {
+        long long time; // microseconds since the epoch
+        int pid;
+        int percent;
+        wchar_t text[240];
+    };
+
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        Event event;
+    };
+
+    void Run();
+
+    void Write(Event const & event);
+
+private:
+    std::vector<Slot> m_slots;
+    size_t m_nMask;
+    std::atomic<size_t> m_nEnqueuePos;
+    std::atomic<size_t> m_nDequeuePos;
+    std::atomic<unsigned long long> m_nDropped;
+    unsigned long long m_nReported;
+
+    std::mutex m_outputMutex; // held by the drain thread while writing
+    FILE * m_file;
+    ProgressFormat m_format;
+
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_bStop;
+    std::thread m_thread;
+};
+
+#endif // PROGRESSSINK_H
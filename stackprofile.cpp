@@ -0,0 +1,388 @@
+#include "stackprofile.h"
+#include "contenthash.h"
+#include "dumpoutput.h"
+#include "fonttext.h"
+#include "minidumpper.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <DbgHelp.h>
+#else
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+const size_t npos = size_t(-1);
+
+// Set by Ctrl+C while profiling without a time limit
+volatile sig_atomic_t s_bStopProfiling = 0;
+
+#ifdef _WIN32
+
+BOOL WINAPI StopProfiling(DWORD)
+{
+    s_bStopProfiling = 1;
+    return TRUE;
+}
+
+#else
+
+void StopProfiling(int)
+{
+    s_bStopProfiling = 1;
+}
+
+bool ReadAt(int fd, uint64_t offset, void * data, size_t size)
+{
+    return pread(fd, data, size, off_t(offset)) == ssize_t(size);
+}
+
+#endif
+
+} // namespace
+
+#ifdef _WIN32
+
+FrameSymbolizer::FrameSymbolizer(int pid)
+    : m_pid(pid)
+    , m_bLoaded(false)
+{
+    m_hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid);
+    if (m_hProcess)
+        m_bLoaded = SymInitializeW(m_hProcess, nullptr, TRUE) != FALSE;
+}
+
+FrameSymbolizer::~FrameSymbolizer()
+{
+    if (m_bLoaded)
+        SymCleanup(m_hProcess);
+    if (m_hProcess)
+        CloseHandle(m_hProcess);
+}
+
+std::wstring FrameSymbolizer::Describe(uint64_t address)
+{
+    std::unordered_map<uint64_t, std::wstring>::const_iterator it = m_names.find(address);
+    if (it != m_names.end())
+        return it->second;
+
+    wchar_t text[64];
+    swprintf(text, sizeof(text) / sizeof(wchar_t), L"0x%llx", static_cast<unsigned long long>(address));
+    std::wstring name = text;
+    if (m_bLoaded) {
+        union {
+            SYMBOL_INFOW info;
+            char buffer[sizeof(SYMBOL_INFOW) + 256 * sizeof(wchar_t)];
+        } symbol;
+        memset(&symbol, 0, sizeof(symbol));
+        symbol.info.SizeOfStruct = sizeof(SYMBOL_INFOW);
+        symbol.info.MaxNameLen = 256;
+        DWORD64 displacement = 0;
+        IMAGEHLP_MODULEW64 module;
+        memset(&module, 0, sizeof(module));
+        module.SizeOfStruct = sizeof(module);
+        if (SymFromAddrW(m_hProcess, address, &displacement, &symbol.info)) {
+            name = symbol.info.Name;
+        } else if (SymGetModuleInfoW64(m_hProcess, address, &module)) {
+            swprintf(text, sizeof(text) / sizeof(wchar_t), L"+0x%llx",
+                     static_cast<unsigned long long>(address - module.BaseOfImage));
+            name = std::wstring(module.ModuleName) + text;
+        }
+    }
+    m_names[address] = name;
+    return name;
+}
+
+#else
+
+FrameSymbolizer::FrameSymbolizer(int pid)
+    : m_pid(pid)
+    , m_hProcess(nullptr)
+    , m_bLoaded(false)
+{
+}
+
+FrameSymbolizer::~FrameSymbolizer()
+{
+}
+
+void FrameSymbolizer::LoadModules()
+{
+    m_bLoaded = true;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", m_pid);
+    FILE * maps = fopen(path, "r");
+    if (maps == nullptr)
+        return;
+    char line[4096];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long long start, end, offset;
+        char perms[5] = {0};
+        int pathPos = 0;
+        if (sscanf(line, "%llx-%llx %4s %llx %*x:%*x %*u %n", &start, &end, perms, &offset, &pathPos) < 4
+                || perms[2] != 'x' || pathPos == 0 || line[pathPos] != '/')
+            continue;
+        std::string file(line + pathPos);
+        file.erase(file.find_last_not_of("\n") + 1);
+
+        Module module;
+        module.start = start;
+        module.end = end;
+        module.bias = start - offset;
+        module.name = WidenPath(file.substr(file.rfind('/') + 1));
+
+        // The symbols and the load segment of the mapping come from the file
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        Elf64_Ehdr eh;
+        if (fd >= 0 && ReadAt(fd, 0, &eh, sizeof(eh)) && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0
+                && eh.e_ident[EI_CLASS] == ELFCLASS64) {
+            for (int i = 0; i < eh.e_phnum; ++i) {
+                Elf64_Phdr ph;
+                if (!ReadAt(fd, eh.e_phoff + uint64_t(i) * eh.e_phentsize, &ph, sizeof(ph)))
+                    break;
+                if (ph.p_type == PT_LOAD && offset >= ph.p_offset && offset < ph.p_offset + ph.p_filesz) {
+                    module.bias = start - offset + ph.p_offset - ph.p_vaddr;
+                    break;
+                }
+            }
+            std::vector<Elf64_Shdr> sections(eh.e_shnum);
+            for (int i = 0; i < eh.e_shnum; ++i) {
+                if (!ReadAt(fd, eh.e_shoff + uint64_t(i) * eh.e_shentsize, &sections[i], sizeof(Elf64_Shdr))) {
+                    sections.clear();
+                    break;
+                }
+            }
+            // .symtab when the file isn't stripped, .dynsym otherwise
+            for (int pass = 0; pass < 2 && module.symbols.empty(); ++pass) {
+                for (size_t i = 0; i < sections.size(); ++i) {
+                    Elf64_Shdr const & sh = sections[i];
+                    if (sh.sh_type != (pass == 0 ? SHT_SYMTAB : SHT_DYNSYM) || sh.sh_link >= sections.size()
+                            || sh.sh_entsize != sizeof(Elf64_Sym))
+                        continue;
+                    std::vector<Elf64_Sym> syms(sh.sh_size / sizeof(Elf64_Sym));
+                    std::vector<char> strings(sections[sh.sh_link].sh_size + 1);
+                    if (syms.empty() || !ReadAt(fd, sh.sh_offset, &syms[0], syms.size() * sizeof(Elf64_Sym))
+                            || !ReadAt(fd, sections[sh.sh_link].sh_offset, &strings[0], strings.size() - 1))
+                        continue;
+                    for (size_t j = 0; j < syms.size(); ++j) {
+                        if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || syms[j].st_value == 0
+                                || syms[j].st_name >= strings.size() - 1)
+                            continue;
+                        Symbol symbol = { syms[j].st_value, syms[j].st_size, &strings[syms[j].st_name] };
+                        module.symbols.push_back(symbol);
+                    }
+                }
+            }
+            std::sort(module.symbols.begin(), module.symbols.end(),
+                      [](Symbol const & a, Symbol const & b) { return a.address < b.address; });
+        }
+        if (fd >= 0)
+            close(fd);
+        m_modules.push_back(module);
+    }
+    fclose(maps);
+    std::sort(m_modules.begin(), m_modules.end(),
+              [](Module const & a, Module const & b) { return a.start < b.start; });
+}
+
+std::wstring FrameSymbolizer::Describe(uint64_t address)
+{
+    std::unordered_map<uint64_t, std::wstring>::const_iterator it = m_names.find(address);
+    if (it != m_names.end())
+        return it->second;
+    if (!m_bLoaded)
+        LoadModules();
+
+    wchar_t text[64];
+    swprintf(text, sizeof(text) / sizeof(wchar_t), L"0x%llx", static_cast<unsigned long long>(address));
+    std::wstring name = text;
+    size_t m = 0;
+    while (m < m_modules.size() && m_modules[m].end <= address)
+        ++m;
+    if (m < m_modules.size() && m_modules[m].start <= address) {
+        Module const & module = m_modules[m];
+        uint64_t vaddr = address - module.bias;
+        Symbol key = { vaddr, 0, std::string() };
+        std::vector<Symbol>::const_iterator s = std::upper_bound(module.symbols.begin(), module.symbols.end(), key,
+                [](Symbol const & a, Symbol const & b) { return a.address < b.address; });
+        if (s != module.symbols.begin() && (--s, vaddr < s->address + std::max<uint64_t>(s->size, 1))) {
+            int status = -1;
+            char * demangled = abi::__cxa_demangle(s->name.c_str(), nullptr, nullptr, &status);
+            name = WidenPath(status == 0 ? demangled : s->name);
+            free(demangled);
+        } else {
+            swprintf(text, sizeof(text) / sizeof(wchar_t), L"+0x%llx", static_cast<unsigned long long>(vaddr));
+            name = module.name + text;
+        }
+    }
+    m_names[address] = name;
+    return name;
+}
+
+#endif
+
+StackProfile::StackProfile()
+    : m_nSamples(0)
+{
+}
+
+void StackProfile::Add(std::wstring const & thread, uint64_t const * frames, size_t depth)
+{
+    ++m_nSamples;
+    std::unordered_map<std::wstring, uint32_t>::const_iterator t = m_threadIndex.find(thread);
+    uint32_t threadIndex;
+    if (t == m_threadIndex.end()) {
+        threadIndex = uint32_t(m_threads.size());
+        m_threads.push_back(thread);
+        m_threadIndex[thread] = threadIndex;
+    } else {
+        threadIndex = t->second;
+    }
+
+    uint64_t hash = ContentHash::Hash64(frames, depth * sizeof(uint64_t), threadIndex);
+    std::unordered_map<uint64_t, size_t>::iterator bucket = m_buckets.find(hash);
+    if (bucket != m_buckets.end()) {
+        for (size_t i = bucket->second; i != npos; i = m_entries[i].next) {
+            Entry & e = m_entries[i];
+            if (e.hash == hash && e.thread == threadIndex && e.depth == depth
+                    && (depth == 0 || memcmp(&m_frames[e.offset], frames, depth * sizeof(uint64_t)) == 0)) {
+                ++e.count;
+                return;
+            }
+        }
+    }
+
+    Entry e;
+    e.offset = m_frames.size();
+    e.depth = uint32_t(depth);
+    e.thread = threadIndex;
+    e.hash = hash;
+    e.count = 1;
+    e.next = bucket != m_buckets.end() ? bucket->second : npos;
+    m_frames.insert(m_frames.end(), frames, frames + depth);
+    m_buckets[hash] = m_entries.size();
+    m_entries.push_back(e);
+}
+
+unsigned long long StackProfile::Samples() const
+{
+    return m_nSamples;
+}
+
+size_t StackProfile::Stacks() const
+{
+    return m_entries.size();
+}
+
+bool StackProfile::WriteFolded(std::wstring const & path, FrameSymbolizer & symbolizer) const
+{
+    FILE * file = OpenDumpFile(path, L"wb");
+    if (file == nullptr)
+        return false;
+    // Stacks differing only in addresses within the same functions fold
+    // into one line
+    std::vector<std::wstring> lines;
+    std::unordered_map<std::wstring, unsigned long long> counts;
+    std::wstring line;
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        Entry const & e = m_entries[i];
+        line = m_threads[e.thread];
+        for (size_t j = e.depth; j-- > 0; ) {
+            // Return addresses point behind the call, look up the call itself
+            uint64_t address = m_frames[e.offset + j];
+            std::wstring name = symbolizer.Describe(j > 0 ? address - 1 : address);
+            std::replace(name.begin(), name.end(), L';', L':');
+            std::replace(name.begin(), name.end(), L' ', L'_');
+            line += L';';
+            line += name;
+        }
+        std::pair<std::unordered_map<std::wstring, unsigned long long>::iterator, bool> added =
+                counts.insert(std::make_pair(line, 0ULL));
+        if (added.second)
+            lines.push_back(line);
+        added.first->second += e.count;
+    }
+
+    bool ok = true;
+    std::string utf8;
+    for (size_t i = 0; i < lines.size() && ok; ++i) {
+        wchar_t count[32];
+        swprintf(count, sizeof(count) / sizeof(wchar_t), L" %llu\n", counts[lines[i]]);
+        FontText::WideToUtf8(lines[i] + count, utf8);
+        ok = fwrite(utf8.data(), 1, utf8.size(), file) == utf8.size();
+    }
+    return fclose(file) == 0 && ok;
+}
+
+bool ProfileStacks(MiniDumpper & dumpper, unsigned int hz, unsigned int seconds, std::wstring const & path,
+                   bool bStopOnSignal)
+{
+    typedef std::chrono::steady_clock Clock;
+    StackProfile profile;
+#ifdef _WIN32
+    if (bStopOnSignal) {
+        s_bStopProfiling = 0;
+        SetConsoleCtrlHandler(StopProfiling, TRUE);
+    }
+#else
+    struct sigaction action, oldInt, oldTerm;
+    if (bStopOnSignal) {
+        s_bStopProfiling = 0;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = StopProfiling;
+        sigaction(SIGINT, &action, &oldInt);
+        sigaction(SIGTERM, &action, &oldTerm);
+    }
+#endif
+
+    Clock::duration interval = std::chrono::microseconds(1000000 / (hz ? hz : 1));
+    Clock::time_point start = Clock::now();
+    Clock::time_point next = start;
+    Clock::duration sampling(0);
+    unsigned long long ticks = 0;
+    while (!(bStopOnSignal && s_bStopProfiling) && (seconds == 0 || Clock::now() - start < std::chrono::seconds(seconds))) {
+        Clock::time_point before = Clock::now();
+        if (!dumpper.SampleStacks(profile))
+            break;
+        sampling += Clock::now() - before;
+        ++ticks;
+        // Samples late by more than an interval are skipped, not made up
+        next += interval;
+        if (next < Clock::now())
+            next = Clock::now();
+        std::this_thread::sleep_until(next);
+    }
+
+    if (bStopOnSignal) {
+#ifdef _WIN32
+        SetConsoleCtrlHandler(StopProfiling, FALSE);
+#else
+        sigaction(SIGINT, &oldInt, nullptr);
+        sigaction(SIGTERM, &oldTerm, nullptr);
+#endif
+    }
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    wprintf(L"%llu samples of %d in %.1f s, %llu stacks, %d distinct, %.1f us per sample\n",
+            ticks, dumpper.ProcessId(), elapsed, profile.Samples(), int(profile.Stacks()),
+            ticks ? std::chrono::duration<double, std::micro>(sampling).count() / ticks : 0.0);
+    FrameSymbolizer symbolizer(dumpper.ProcessId());
+    if (!profile.WriteFolded(path, symbolizer)) {
+        wprintf(L"Couldn't write %ls\n", path.c_str());
+        return false;
+    }
+    return true;
+}
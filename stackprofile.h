@@ -0,0 +1,102 @@
+#ifndef STACKPROFILE_H
+#define STACKPROFILE_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class MiniDumpper;
+
+// Turns code addresses of the target into names
+class FrameSymbolizer
+{
+public:
+    explicit FrameSymbolizer(int pid);
+
+    ~FrameSymbolizer();
+
+public:
+    // Name of the function holding address, "module+0x1234" without
+    // symbols or the plain address outside of any module. Results are
+    // cached.
+    std::wstring Describe(uint64_t address);
+
+private:
+    struct Symbol
+    {
+        uint64_t address; // ELF virtual address
+        uint64_t size;
+        std::string name;
+    };
+
+    // An executable mapping, address - bias is the ELF virtual address
+    struct Module
+    {
+        uint64_t start;
+        uint64_t end;
+        uint64_t bias;
+        std::wstring name;
+        std::vector<Symbol> symbols; // sorted by address
+    };
+
+    // Linux only, reads the executable mappings and their symbols
+    void LoadModules();
+
+private:
+    int m_pid;
+    void * m_hProcess;             // Windows only, symbols come from DbgHelp
+    std::vector<Module> m_modules; // Linux only, sorted by start
+    bool m_bLoaded;
+    std::unordered_map<uint64_t, std::wstring> m_names;
+};
+
+// Counts identical stacks.
+//
+// A stack is the thread it was seen on and its return addresses, innermost
+// first. Frames of all stacks are kept in one array and found again through
+// a hash table, so a stack seen before costs a hash and a compare.
+class StackProfile
+{
+public:
+    StackProfile();
+
+public:
+    void Add(std::wstring const & thread, uint64_t const * frames, size_t depth);
+
+    unsigned long long Samples() const;
+
+    size_t Stacks() const;
+
+    // One line per stack, outermost frame first: "thread;a;b;c count",
+    // the format flamegraph.pl and speedscope read
+    bool WriteFolded(std::wstring const & path, FrameSymbolizer & symbolizer) const;
+
+private:
+    struct Entry
+    {
+        size_t offset; // in m_frames
+        uint32_t depth;
+        uint32_t thread;
+        uint64_t hash;
+        unsigned long long count;
+        size_t next;   // next entry with the same bucket, or npos
+    };
+
+private:
+    std::vector<std::wstring> m_threads;
+    std::unordered_map<std::wstring, uint32_t> m_threadIndex;
+    std::vector<uint64_t> m_frames;
+    std::vector<Entry> m_entries;
+    std::unordered_map<uint64_t, size_t> m_buckets; // hash to first entry
+    unsigned long long m_nSamples;
+};
+
+// Samples the stacks of the target at hz for seconds, 0 until a signal
+// arrives, and writes them folded to path. Without bStopOnSignal the
+// signal handlers are left alone, for callers that have their own.
+bool ProfileStacks(MiniDumpper & dumpper, unsigned int hz, unsigned int seconds, std::wstring const & path,
+                   bool bStopOnSignal = true);
+
+#endif // STACKPROFILE_H
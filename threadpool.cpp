@@ -0,0 +1,65 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned int threads)
+    : m_nBusy(0)
+    , m_bStop(false)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    for (unsigned int i = 0; i < threads; ++i)
+        m_threads.push_back(std::thread(&ThreadPool::Run, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_taskReady.notify_all();
+    for (size_t i = 0; i < m_threads.size(); ++i)
+        m_threads[i].join();
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_taskReady.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_tasks.empty() || m_nBusy)
+        m_idle.wait(lock);
+}
+
+unsigned int ThreadPool::Size() const
+{
+    return static_cast<unsigned int>(m_threads.size());
+}
+
+void ThreadPool::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        while (m_tasks.empty() && !m_bStop)
+            m_taskReady.wait(lock);
+        if (m_tasks.empty())
+            return;
+        std::function<void()> task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        ++m_nBusy;
+        lock.unlock();
+        task();
+        lock.lock();
+        --m_nBusy;
+        if (m_tasks.empty() && m_nBusy == 0)
+            m_idle.notify_all();
+    }
+}
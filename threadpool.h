@@ -0,0 +1,41 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads running queued tasks in FIFO order.
+class ThreadPool
+{
+public:
+    // threads == 0 uses one thread per hardware thread
+    explicit ThreadPool(unsigned int threads = 0);
+
+    ~ThreadPool();
+
+public:
+    void Submit(std::function<void()> task);
+
+    // Blocks until the queue is empty and no task is running
+    void Wait();
+
+    unsigned int Size() const;
+
+private:
+    void Run();
+
+private:
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()> > m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_taskReady;
+    std::condition_variable m_idle;
+    unsigned int m_nBusy;
+    bool m_bStop;
+};
+
+#endif // THREADPOOL_H